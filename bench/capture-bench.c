@@ -0,0 +1,645 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Drives the buffer pool, damage handling and neatvnc feeding the same way
+ * as the screencopy capture path does, but with frames coming from a
+ * synthetic source or a recorded frame trace instead of a compositor. The time
+ * spent producing the frames is left out of all results.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <libdrm/drm_fourcc.h>
+#include <wayland-client.h>
+#include <pixman.h>
+#include <neatvnc.h>
+#include <aml.h>
+
+#include "buffer.h"
+#include "damage-util.h"
+#include "damage-refinery.h"
+#include "transform-util.h"
+#include "histogram.h"
+#include "frame-trace.h"
+#include "time-util.h"
+
+#define SCROLL_STEP 16
+#define SPARSE_N_RECTS 16
+#define SPARSE_RECT_WIDTH 32
+#define SPARSE_RECT_HEIGHT 16
+
+enum pattern {
+	PATTERN_STATIC = 0,
+	PATTERN_SCROLL,
+	PATTERN_VIDEO,
+	PATTERN_SPARSE,
+};
+
+static const char* pattern_names[] = {
+	[PATTERN_STATIC] = "static",
+	[PATTERN_SCROLL] = "scroll",
+	[PATTERN_VIDEO] = "video",
+	[PATTERN_SPARSE] = "sparse",
+};
+
+struct bench {
+	int width, height;
+	enum pattern pattern;
+	int n_frames;
+	double rate;
+	enum wl_output_transform transform;
+	bool y_inverted;
+	bool use_refinery;
+	int tile_size;
+
+	/* Frames are taken from here instead of the pattern, if set */
+	const char* trace_path;
+	struct frame_trace trace;
+	uint64_t trace_index;
+
+	/* What the compositor would be showing */
+	uint32_t* screen;
+	uint32_t rng;
+
+	struct wv_buffer_pool* pool;
+	struct damage_refinery refinery;
+	struct nvnc* nvnc;
+	struct nvnc_display* display;
+
+	struct histogram latency;
+	uint64_t cpu_time;
+	int n_allocations;
+	int n_stalls;
+	uint64_t n_rects;
+};
+
+static uint64_t get_cpu_time_us(void)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return timespec_to_us(&ts);
+}
+
+static uint32_t bench_random(struct bench* self)
+{
+	// xorshift32
+	self->rng ^= self->rng << 13;
+	self->rng ^= self->rng >> 17;
+	self->rng ^= self->rng << 5;
+	return self->rng;
+}
+
+static void bench_fill_rect(struct bench* self, struct pixman_region16* damage,
+		int x, int y, int width, int height, bool is_noise)
+{
+	uint32_t colour = bench_random(self);
+
+	for (int j = y; j < y + height; ++j)
+		for (int i = x; i < x + width; ++i)
+			self->screen[j * self->width + i] =
+				is_noise ? bench_random(self) : colour;
+
+	pixman_region_union_rect(damage, damage, x, y, width, height);
+}
+
+static void bench_scroll(struct bench* self, struct pixman_region16* damage)
+{
+	size_t row_size = self->width * sizeof(*self->screen);
+
+	memmove(self->screen, self->screen + SCROLL_STEP * self->width,
+			(self->height - SCROLL_STEP) * row_size);
+
+	bench_fill_rect(self, damage, 0, self->height - SCROLL_STEP,
+			self->width, SCROLL_STEP, false);
+	pixman_region_union_rect(damage, damage, 0, 0, self->width,
+			self->height);
+}
+
+static void bench_update_screen(struct bench* self,
+		struct pixman_region16* damage)
+{
+	switch (self->pattern) {
+	case PATTERN_STATIC:
+		break;
+	case PATTERN_SCROLL:
+		bench_scroll(self, damage);
+		break;
+	case PATTERN_VIDEO:
+		bench_fill_rect(self, damage, self->width / 3,
+				self->height / 3, self->width / 3,
+				self->height / 3, true);
+		break;
+	case PATTERN_SPARSE:
+		for (int i = 0; i < SPARSE_N_RECTS; ++i) {
+			int x = bench_random(self) %
+				(self->width - SPARSE_RECT_WIDTH);
+			int y = bench_random(self) %
+				(self->height - SPARSE_RECT_HEIGHT);
+			bench_fill_rect(self, damage, x, y, SPARSE_RECT_WIDTH,
+					SPARSE_RECT_HEIGHT, false);
+		}
+		break;
+	}
+}
+
+/* Recorded frames are in the memory layout of the buffer that they were
+ * captured into, and so is their damage.
+ */
+static int bench_replay_frame(struct bench* self,
+		struct pixman_region16* damage)
+{
+	const struct frame_trace_frame* frame =
+		frame_trace_get(&self->trace, self->trace_index);
+	if (!frame) {
+		fprintf(stderr, "Frame %"PRIu64" of the trace is damaged\n",
+				self->trace_index);
+		return -1;
+	}
+
+	if ((int)frame->width != self->width ||
+	    (int)frame->height != self->height ||
+	    frame->pixel_size != sizeof(*self->screen)) {
+		fprintf(stderr, "Geometry changes at frame %"PRIu64" of the trace\n",
+				self->trace_index);
+		return -1;
+	}
+
+	self->trace_index++;
+	self->transform = frame->transform;
+	self->y_inverted = frame->flags & FRAME_TRACE_Y_INVERTED;
+
+	const struct frame_trace_rect* rects = frame_trace_frame_rects(frame);
+	const uint8_t* pixels = frame_trace_frame_pixels(frame);
+
+	for (uint32_t i = 0; i < frame->n_rects; ++i) {
+		const struct frame_trace_rect* rect = &rects[i];
+		size_t row_size = (rect->x2 - rect->x1) * sizeof(*self->screen);
+
+		for (int y = rect->y1; y < rect->y2; ++y) {
+			memcpy(self->screen + y * self->width + rect->x1,
+					pixels, row_size);
+			pixels += row_size;
+		}
+
+		pixman_region_union_rect(damage, damage, rect->x1, rect->y1,
+				rect->x2 - rect->x1, rect->y2 - rect->y1);
+	}
+
+	return 0;
+}
+
+/* This is what the compositor does when it copies a frame */
+static void bench_copy_frame(struct bench* self, struct wv_buffer* buffer,
+		struct pixman_region16* damage)
+{
+	size_t row_size = self->width * sizeof(*self->screen);
+	bool is_flipped = self->y_inverted && !self->trace_path;
+
+	for (int y = 0; y < self->height; ++y) {
+		int src_y = is_flipped ? self->height - y - 1 : y;
+		memcpy((char*)buffer->pixels + y * buffer->stride,
+				self->screen + src_y * self->width, row_size);
+	}
+
+	buffer->y_inverted = self->y_inverted;
+
+	if (is_flipped)
+		wv_region_transform(&buffer->damage, damage,
+				WL_OUTPUT_TRANSFORM_FLIPPED_180,
+				buffer->width, buffer->height);
+	else
+		pixman_region_copy(&buffer->damage, damage);
+}
+
+static void bench_refine_damage(struct bench* self, struct wv_buffer* buffer)
+{
+	struct pixman_region16 refined;
+	pixman_region_init(&refined);
+	damage_refinery_refine(&self->refinery, &refined, &buffer->damage,
+			buffer);
+	pixman_region_copy(&buffer->damage, &refined);
+	pixman_region_fini(&refined);
+}
+
+/* Mirrors wayvnc_process_frame() */
+static void bench_process_frame(struct bench* self, struct wv_buffer* buffer)
+{
+	struct pixman_region16 damage;
+	pixman_region_init(&damage);
+
+	enum wl_output_transform buffer_transform = self->transform;
+
+	if (buffer->y_inverted) {
+		buffer_transform = wv_output_transform_compose(self->transform,
+				WL_OUTPUT_TRANSFORM_FLIPPED_180);
+
+		wv_region_transform(&damage, &buffer->damage,
+				WL_OUTPUT_TRANSFORM_FLIPPED_180,
+				buffer->width, buffer->height);
+	} else {
+		pixman_region_copy(&damage, &buffer->damage);
+	}
+
+	if (self->tile_size > 0) {
+		damage_coalesce(&damage, &damage, self->tile_size, 25, 32);
+		pixman_region_intersect_rect(&damage, &damage, 0, 0,
+				buffer->width, buffer->height);
+	}
+
+	self->n_rects += pixman_region_n_rects(&damage);
+
+	nvnc_fb_set_transform(buffer->nvnc_fb,
+			(enum nvnc_transform)buffer_transform);
+	wv_buffer_hold(buffer);
+	nvnc_display_feed_buffer(self->display, buffer->nvnc_fb, &damage);
+
+	pixman_region_fini(&damage);
+}
+
+static struct wv_buffer* bench_acquire(struct bench* self)
+{
+	for (;;) {
+		int n_buffers = self->pool->n_buffers;
+		struct wv_buffer* buffer = wv_buffer_pool_acquire(self->pool);
+		if (self->pool->n_buffers > n_buffers)
+			self->n_allocations++;
+
+		if (buffer || !wv_buffer_pool_is_exhausted(self->pool))
+			return buffer;
+
+		// Let neatvnc release something
+		self->n_stalls++;
+		aml_poll(aml_get_default(), 1);
+		aml_dispatch(aml_get_default());
+	}
+}
+
+static int bench_run_frame(struct bench* self)
+{
+	struct pixman_region16 damage;
+	pixman_region_init(&damage);
+
+	if (!self->trace_path) {
+		bench_update_screen(self, &damage);
+	} else if (bench_replay_frame(self, &damage) < 0) {
+		pixman_region_fini(&damage);
+		return -1;
+	}
+
+	uint64_t start_time = gettime_us();
+	uint64_t start_cpu_time = get_cpu_time_us();
+
+	struct wv_buffer* buffer = bench_acquire(self);
+	if (!buffer) {
+		fprintf(stderr, "Failed to acquire a buffer\n");
+		pixman_region_fini(&damage);
+		return -1;
+	}
+
+	uint64_t copy_time = gettime_us();
+	uint64_t copy_cpu_time = get_cpu_time_us();
+	bench_copy_frame(self, buffer, &damage);
+	copy_time = gettime_us() - copy_time;
+	copy_cpu_time = get_cpu_time_us() - copy_cpu_time;
+
+	pixman_region_fini(&damage);
+
+	if (self->use_refinery)
+		bench_refine_damage(self, buffer);
+
+	bench_process_frame(self, buffer);
+
+	histogram_add(&self->latency,
+			gettime_us() - start_time - copy_time);
+	self->cpu_time += get_cpu_time_us() - start_cpu_time - copy_cpu_time;
+
+	return 0;
+}
+
+static void bench_wait(struct bench* self, uint64_t deadline)
+{
+	for (;;) {
+		uint64_t now = gettime_us();
+		int timeout = now < deadline ? (deadline - now + 999) / 1000 : 0;
+
+		aml_poll(aml_get_default(), timeout);
+		aml_dispatch(aml_get_default());
+
+		if (timeout == 0)
+			break;
+	}
+}
+
+static int bench_run(struct bench* self)
+{
+	uint64_t period = self->rate > 0.0 ? 1.0e6 / self->rate : 0;
+	uint64_t start_time = gettime_us();
+	uint64_t deadline = start_time;
+
+	for (int i = 0; i < self->n_frames; ++i) {
+		if (bench_run_frame(self) < 0)
+			return -1;
+
+		deadline += period;
+		bench_wait(self, deadline);
+	}
+
+	double duration = (gettime_us() - start_time) * 1.0e-6;
+
+	struct rusage usage = { 0 };
+	getrusage(RUSAGE_SELF, &usage);
+
+	if (self->trace_path)
+		printf("Trace: %s, %dx%d%s\n", self->trace_path, self->width,
+				self->height,
+				self->use_refinery ? ", damage refinery" : "");
+	else
+		printf("Pattern: %s, %dx%d, transform %d%s%s\n",
+				pattern_names[self->pattern], self->width,
+				self->height, self->transform,
+				self->y_inverted ? ", y-inverted" : "",
+				self->use_refinery ? ", damage refinery" : "");
+	printf("Frames: %d in %.2f s, %.1f frames/s\n", self->n_frames,
+			duration, self->n_frames / duration);
+	printf("CPU time per frame: %.3f ms\n",
+			1.0e-3 * self->cpu_time / self->n_frames);
+	printf("Latency: p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+			1.0e-3 * histogram_percentile(&self->latency, 0.50),
+			1.0e-3 * histogram_percentile(&self->latency, 0.95),
+			1.0e-3 * histogram_percentile(&self->latency, 0.99),
+			1.0e-3 * self->latency.max);
+	printf("Damage rects per frame: %.1f\n",
+			(double)self->n_rects / self->n_frames);
+	printf("Buffer allocations: %d, stalls: %d\n", self->n_allocations,
+			self->n_stalls);
+	printf("Peak RSS: %ld KiB\n", usage.ru_maxrss);
+
+	return 0;
+}
+
+/* Replaying starts at a keyframe, so that the screen is complete */
+static int bench_seek(struct bench* self, double start, bool has_n_frames,
+		uint32_t* format)
+{
+	if (self->trace.n_frames == 0) {
+		fprintf(stderr, "The trace is empty\n");
+		return -1;
+	}
+
+	const struct frame_trace_frame* first =
+		frame_trace_get(&self->trace, 0);
+	uint64_t time = (first ? first->time : 0) + start * 1.0e6;
+	self->trace_index = frame_trace_find_keyframe(&self->trace, time);
+
+	const struct frame_trace_frame* frame =
+		frame_trace_get(&self->trace, self->trace_index);
+	if (!frame || !(frame->flags & FRAME_TRACE_KEYFRAME)) {
+		fprintf(stderr, "No keyframe found in the trace\n");
+		return -1;
+	}
+
+	if (frame->pixel_size != sizeof(*self->screen)) {
+		fprintf(stderr, "Only 32 bit pixel formats can be replayed\n");
+		return -1;
+	}
+
+	self->width = frame->width;
+	self->height = frame->height;
+	*format = frame->format;
+
+	uint64_t n_remaining = self->trace.n_frames - self->trace_index;
+	if (!has_n_frames || (uint64_t)self->n_frames > n_remaining)
+		self->n_frames = n_remaining;
+
+	return 0;
+}
+
+static int parse_pattern(const char* name)
+{
+	for (size_t i = 0; i < sizeof(pattern_names) / sizeof(*pattern_names);
+			++i)
+		if (strcmp(name, pattern_names[i]) == 0)
+			return i;
+
+	return -1;
+}
+
+static int usage(FILE* stream, int rc)
+{
+	static const char* text =
+"Usage: capture-bench [options]\n"
+"\n"
+"    -s,--size=<width>x<height>    Frame size (default 1920x1080).\n"
+"    -p,--pattern=<name>           static, scroll, video or sparse.\n"
+"    -n,--frames=<n>               Number of frames (default 300).\n"
+"    -f,--rate=<fps>               Frame rate; 0 is unlimited (default).\n"
+"    -d,--depth=<n>                Buffer pool depth (default 0).\n"
+"    -t,--transform=<0-7>          Output transform.\n"
+"    -y,--y-inverted               Deliver frames upside down.\n"
+"    -R,--refine                   Enable content-based damage refinery.\n"
+"    -c,--tile-size=<px>           Coalesce damage into tiles.\n"
+"    -S,--slab                     Allocate buffers from a slab.\n"
+"    -P,--populate                 Prefault buffers.\n"
+"    -r,--replay=<path>            Replay frames recorded by wayvnc.\n"
+"    -T,--start=<seconds>          Start replaying this far into the\n"
+"                                  trace, at the keyframe before it.\n"
+"    -h,--help                     Get help (this text).\n"
+"\n";
+
+	fprintf(stream, "%s", text);
+	return rc;
+}
+
+int main(int argc, char* argv[])
+{
+	struct bench self = {
+		.width = 1920,
+		.height = 1080,
+		.pattern = PATTERN_SPARSE,
+		.n_frames = 300,
+		.rng = 0x2545f491,
+	};
+
+	int depth = 0;
+	int pattern;
+	enum wv_buffer_alloc_flags alloc_flags = 0;
+	uint32_t format = DRM_FORMAT_XRGB8888;
+	bool has_n_frames = false;
+	double start = 0.0;
+
+	static const char* shortopts = "s:p:n:f:d:t:yRc:SPr:T:h";
+	static const struct option longopts[] = {
+		{ "size", required_argument, NULL, 's' },
+		{ "pattern", required_argument, NULL, 'p' },
+		{ "frames", required_argument, NULL, 'n' },
+		{ "rate", required_argument, NULL, 'f' },
+		{ "depth", required_argument, NULL, 'd' },
+		{ "transform", required_argument, NULL, 't' },
+		{ "y-inverted", no_argument, NULL, 'y' },
+		{ "refine", no_argument, NULL, 'R' },
+		{ "tile-size", required_argument, NULL, 'c' },
+		{ "slab", no_argument, NULL, 'S' },
+		{ "populate", no_argument, NULL, 'P' },
+		{ "replay", required_argument, NULL, 'r' },
+		{ "start", required_argument, NULL, 'T' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while (1) {
+		int c = getopt_long(argc, argv, shortopts, longopts, NULL);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 's':
+			if (sscanf(optarg, "%dx%d", &self.width,
+						&self.height) != 2)
+				return usage(stderr, 1);
+			break;
+		case 'p':
+			pattern = parse_pattern(optarg);
+			if (pattern < 0)
+				return usage(stderr, 1);
+			self.pattern = pattern;
+			break;
+		case 'n':
+			self.n_frames = atoi(optarg);
+			has_n_frames = true;
+			break;
+		case 'f':
+			self.rate = atof(optarg);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 't':
+			self.transform = atoi(optarg) & 7;
+			break;
+		case 'y':
+			self.y_inverted = true;
+			break;
+		case 'R':
+			self.use_refinery = true;
+			break;
+		case 'c':
+			self.tile_size = atoi(optarg);
+			break;
+		case 'S':
+			alloc_flags |= WV_BUFFER_ALLOC_SLAB;
+			break;
+		case 'P':
+			alloc_flags |= WV_BUFFER_ALLOC_POPULATE;
+			break;
+		case 'r':
+			self.trace_path = optarg;
+			break;
+		case 'T':
+			start = atof(optarg);
+			break;
+		case 'h':
+			return usage(stdout, 0);
+		default:
+			return usage(stderr, 1);
+		}
+	}
+
+	int rc = 1;
+
+	if (self.trace_path) {
+		if (frame_trace_open(&self.trace, self.trace_path) < 0)
+			return 1;
+
+		if (bench_seek(&self, start, has_n_frames, &format) < 0)
+			goto trace_failure;
+	} else if (self.width < SPARSE_RECT_WIDTH * 2 ||
+	           self.height < SCROLL_STEP * 2) {
+		return usage(stderr, 1);
+	}
+
+	if (self.n_frames <= 0) {
+		rc = usage(stderr, 1);
+		goto trace_failure;
+	}
+
+	struct aml* aml = aml_new();
+	if (!aml)
+		goto trace_failure;
+
+	aml_set_default(aml);
+
+	self.screen = calloc(self.width * self.height, sizeof(*self.screen));
+	if (!self.screen)
+		goto screen_failure;
+
+	if (damage_refinery_init(&self.refinery, self.width, self.height) < 0)
+		goto refinery_failure;
+
+	self.pool = wv_buffer_pool_create(WV_BUFFER_SHM, self.width,
+			self.height, self.width * 4, format);
+	if (!self.pool)
+		goto pool_failure;
+
+	wv_buffer_pool_set_depth(self.pool, depth);
+	wv_buffer_pool_set_alloc_flags(self.pool, alloc_flags);
+
+	char socket_path[] = "/tmp/wayvnc-bench-XXXXXX";
+	if (!mkdtemp(socket_path))
+		goto socket_failure;
+
+	char socket_name[sizeof(socket_path) + 8];
+	snprintf(socket_name, sizeof(socket_name), "%s/socket", socket_path);
+
+	self.nvnc = nvnc_open_unix(socket_name);
+	if (!self.nvnc)
+		goto nvnc_failure;
+
+	self.display = nvnc_display_new(0, 0);
+	if (!self.display)
+		goto display_failure;
+
+	nvnc_add_display(self.nvnc, self.display);
+
+	rc = bench_run(&self) < 0;
+
+	nvnc_display_unref(self.display);
+display_failure:
+	nvnc_close(self.nvnc);
+	unlink(socket_name);
+nvnc_failure:
+	rmdir(socket_path);
+socket_failure:
+	wv_buffer_pool_destroy(self.pool);
+pool_failure:
+	damage_refinery_destroy(&self.refinery);
+refinery_failure:
+	free(self.screen);
+screen_failure:
+	aml_unref(aml);
+trace_failure:
+	if (self.trace_path)
+		frame_trace_close(&self.trace);
+	return rc;
+}
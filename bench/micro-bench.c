@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Times the small utility functions that run once or more per frame or per
+ * input event. Each result is the mean wall-clock time of one call.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <libdrm/drm_fourcc.h>
+#include <wayland-client.h>
+#include <pixman.h>
+#include <xkbcommon/xkbcommon.h>
+
+#include "transform-util.h"
+#include "intset.h"
+#include "keyboard.h"
+#include "smooth.h"
+#include "pixels.h"
+#include "time-util.h"
+
+#define DEFAULT_ITERATIONS 1000000
+#define N_DAMAGE_RECTS 16
+#define N_KEYS 256
+
+static volatile uint64_t sink;
+
+static const uint32_t formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_XBGR8888,
+	DRM_FORMAT_ABGR8888,
+	DRM_FORMAT_RGBX8888,
+	DRM_FORMAT_BGRX8888,
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_NV12,
+};
+
+#define N_FORMATS (sizeof(formats) / sizeof(*formats))
+
+static void report(const char* name, uint64_t start_time, int n)
+{
+	double ns = (gettime_us() - start_time) * 1.0e3 / n;
+	printf("%-32s %10.1f ns/op\n", name, ns);
+}
+
+static void bench_region_transform(int n)
+{
+	struct pixman_region16 src, dst;
+	pixman_region_init(&src);
+	pixman_region_init(&dst);
+
+	for (int i = 0; i < N_DAMAGE_RECTS; ++i)
+		pixman_region_union_rect(&src, &src, (i * 97) % 1800,
+				(i * 61) % 1000, 64, 32);
+
+	for (int tr = 0; tr < 8; ++tr) {
+		char name[64];
+		snprintf(name, sizeof(name), "wv_region_transform/%d", tr);
+
+		uint64_t start_time = gettime_us();
+		for (int i = 0; i < n; ++i) {
+			wv_region_transform(&dst, &src, tr, 1920, 1080);
+			sink += pixman_region_n_rects(&dst);
+		}
+		report(name, start_time, n);
+	}
+
+	pixman_region_fini(&dst);
+	pixman_region_fini(&src);
+}
+
+static void bench_pixman_transform(int n)
+{
+	pixman_transform_t transform;
+
+	for (int tr = 0; tr < 8; ++tr) {
+		char name[64];
+		snprintf(name, sizeof(name), "wv_pixman_transform/%d", tr);
+
+		uint64_t start_time = gettime_us();
+		for (int i = 0; i < n; ++i) {
+			wv_pixman_transform_from_wl_output_transform(&transform,
+					tr, 1920, 1080);
+			sink += transform.matrix[0][2];
+		}
+		report(name, start_time, n);
+	}
+}
+
+static void bench_intset(int n)
+{
+	struct intset set;
+	if (intset_init(&set, 0) < 0)
+		return;
+
+	/* About as many keys as a user can hold down */
+	for (int i = 0; i < 6; ++i)
+		intset_set(&set, i * 37 % N_KEYS);
+
+	uint64_t start_time = gettime_us();
+	for (int i = 0; i < n; ++i)
+		sink += intset_is_set(&set, i % N_KEYS);
+	report("intset_is_set", start_time, n);
+
+	start_time = gettime_us();
+	for (int i = 0; i < n; ++i) {
+		intset_set(&set, 200 + (i & 15));
+		intset_clear(&set, 200 + (i & 15));
+	}
+	report("intset_set+clear", start_time, n);
+
+	intset_destroy(&set);
+}
+
+static void bench_keyboard(int n)
+{
+	struct xkb_rule_names rule_names = {
+		.rules = "evdev",
+		.model = "pc105",
+		.layout = "us",
+	};
+
+	struct keyboard keyboard = { 0 };
+	if (keyboard_init(&keyboard, &rule_names) < 0) {
+		printf("%-32s %13s\n", "keyboard_find_symbol", "skipped");
+		return;
+	}
+
+	size_t len = keyboard.lookup_table_length;
+
+	uint64_t start_time = gettime_us();
+	for (int i = 0; i < n; ++i) {
+		xkb_keysym_t symbol =
+			keyboard.lookup_table[(i * 7919) % len].symbol;
+		sink += (uintptr_t)keyboard_find_symbol(&keyboard, symbol);
+	}
+	report("keyboard_find_symbol", start_time, n);
+
+	keyboard_destroy(&keyboard);
+}
+
+static void bench_smooth(int n)
+{
+	struct smooth smoother = {
+		.time_constant = 1.0,
+		.last_time = gettime_us(),
+	};
+
+	uint64_t start_time = gettime_us();
+	for (int i = 0; i < n; ++i)
+		sink += smooth(&smoother, i & 255);
+	report("smooth", start_time, n);
+}
+
+static void bench_pixels(int n)
+{
+	uint64_t start_time = gettime_us();
+	for (int i = 0; i < n; ++i)
+		sink += fourcc_to_wl_shm(formats[i % N_FORMATS]);
+	report("fourcc_to_wl_shm", start_time, n);
+
+	pixman_format_code_t fmt;
+
+	start_time = gettime_us();
+	for (int i = 0; i < n; ++i)
+		sink += fourcc_to_pixman_fmt(&fmt, formats[i % N_FORMATS]);
+	report("fourcc_to_pixman_fmt", start_time, n);
+}
+
+static int usage(FILE* stream, int rc)
+{
+	static const char* text =
+"Usage: micro-bench [options]\n"
+"\n"
+"    -n,--iterations=<n>           Calls per function (default 1000000).\n"
+"    -h,--help                     Get help (this text).\n"
+"\n";
+
+	fprintf(stream, "%s", text);
+	return rc;
+}
+
+int main(int argc, char* argv[])
+{
+	int n = DEFAULT_ITERATIONS;
+
+	static const char* shortopts = "n:h";
+	static const struct option longopts[] = {
+		{ "iterations", required_argument, NULL, 'n' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while (1) {
+		int c = getopt_long(argc, argv, shortopts, longopts, NULL);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'h':
+			return usage(stdout, 0);
+		default:
+			return usage(stderr, 1);
+		}
+	}
+
+	if (n <= 0)
+		return usage(stderr, 1);
+
+	bench_region_transform(n / 10);
+	bench_pixman_transform(n);
+	bench_intset(n);
+	bench_keyboard(n);
+	bench_smooth(n);
+	bench_pixels(n);
+
+	return 0;
+}
@@ -27,6 +27,20 @@
 struct wl_buffer;
 struct gbm_bo;
 struct nvnc_fb;
+struct zwlr_export_dmabuf_frame_v1;
+struct wv_buffer_pool_job;
+struct shm_slab;
+struct histogram;
+struct aml;
+struct aml_timer;
+
+/* Unless a depth has been set, this many buffers are allocated up front */
+#define WV_BUFFER_POOL_PREWARM_DEPTH 2
+
+/* The display always holds on to the last frame, so this many buffers may be
+ * allocated regardless of the memory limit.
+ */
+#define WV_BUFFER_POOL_MIN_DEPTH 2
 
 enum wv_buffer_type {
 	WV_BUFFER_UNSPEC = 0,
@@ -36,6 +50,19 @@ enum wv_buffer_type {
 #endif
 };
 
+enum wv_buffer_alloc_flags {
+	/* Fault in all pages when the buffer is allocated */
+	WV_BUFFER_ALLOC_POPULATE = 1 << 0,
+	/* Back shared memory buffers with huge pages, if available */
+	WV_BUFFER_ALLOC_HUGEPAGES = 1 << 1,
+	/* Carve shared memory buffers out of a single region */
+	WV_BUFFER_ALLOC_SLAB = 1 << 2,
+	/* Keep the file descriptors of shared memory buffers that are not in
+	 * a slab, so that they can be passed on
+	 */
+	WV_BUFFER_ALLOC_KEEP_FD = 1 << 3,
+};
+
 struct wv_buffer {
 	enum wv_buffer_type type;
 	TAILQ_ENTRY(wv_buffer) link;
@@ -51,17 +78,99 @@ struct wv_buffer {
 
 	struct pixman_region16 damage;
 
+	/* The pool geometry that this buffer was allocated for */
+	unsigned int generation;
+
+	/* If set, the time from feeding the buffer to neatvnc until it is
+	 * released is recorded here.
+	 */
+	struct histogram* hold_histogram;
+	uint64_t feed_time;
+
+	// When the buffer was last returned to the pool
+	uint64_t release_time;
+
+	/* Everything that uses the buffer after it has been captured, including
+	 * neatvnc, holds on to it. Once the last one lets go, the release
+	 * function hands it back to its owner, e.g. the pool.
+	 */
+	int n_holds;
+	void (*release_fn)(struct nvnc_fb*, void* context);
+	void* release_context;
+
 	/* The following is only applicable to DMABUF */
 	struct gbm_bo* bo;
+
+	/* The shared memory of buffers that are not in a slab, if it was
+	 * allocated with WV_BUFFER_ALLOC_KEEP_FD. -1 otherwise.
+	 */
+	int shm_fd;
+
+	/* Only set for shared memory buffers that live in a slab */
+	struct shm_slab* slab;
+	int slab_slot;
+
+	/* Only set for buffers that were imported via export-dmabuf */
+	struct zwlr_export_dmabuf_frame_v1* export_frame;
 };
 
 TAILQ_HEAD(wv_buffer_queue, wv_buffer);
+LIST_HEAD(wv_buffer_pool_job_list, wv_buffer_pool_job);
 
 struct wv_buffer_pool {
 	struct wv_buffer_queue queue;
 	enum wv_buffer_type type;
 	int width, height, stride;
 	uint32_t format;
+
+	/* Maximum number of live buffers, including those that are held by
+	 * neatvnc. 0 means unlimited.
+	 */
+	int depth;
+	int n_buffers;
+	int n_free;
+
+	/* Memory taken by all of the buffers in n_buffers, and the limit for
+	 * it. Buffers are not allocated beyond the limit. Instead, the
+	 * capture waits until one is released. 0 means unlimited.
+	 */
+	size_t n_bytes;
+	size_t max_bytes;
+
+	/* Free buffers that go unused for this long are destroyed. They are
+	 * reused most recently released first, so that the extra buffers
+	 * that a slow client made us allocate age out. 0 means never.
+	 */
+	uint32_t idle_timeout; // ms
+	struct aml_timer* trim_timer;
+	bool is_trim_scheduled;
+
+	/* Bumped whenever the geometry changes. Buffers from earlier
+	 * generations are still held by neatvnc and get destroyed once they
+	 * are released. They are included in n_buffers, but they do not count
+	 * against the depth, so that the new geometry can be captured right
+	 * away.
+	 */
+	unsigned int generation;
+	int n_stale;
+
+	enum wv_buffer_alloc_flags alloc_flags;
+
+	/* Buffers that are being allocated in the background. They are
+	 * included in n_buffers.
+	 */
+	struct wv_buffer_pool_job_list jobs;
+	int n_pending;
+
+	struct shm_slab* slab;
+
+	/* Background allocations finish on this loop, or on the default one
+	 * if it's not set.
+	 */
+	struct aml* aml;
+
+	void* userdata;
+	void (*on_release)(struct wv_buffer_pool*);
 };
 
 enum wv_buffer_type wv_buffer_get_available_types(void);
@@ -70,6 +179,26 @@ struct wv_buffer* wv_buffer_create(enum wv_buffer_type, int width, int height,
 		int stride, uint32_t fourcc);
 void wv_buffer_destroy(struct wv_buffer* self);
 
+#ifdef ENABLE_SCREENCOPY_DMABUF
+struct wv_buffer* wv_buffer_import_dmabuf(int width, int height,
+		uint32_t fourcc, uint64_t modifier, int n_planes, const int* fds,
+		const uint32_t* offsets, const uint32_t* strides);
+#endif
+
+void wv_buffer_set_release_fn(struct wv_buffer* self,
+		void (*fn)(struct nvnc_fb*, void* context), void* context);
+
+/* neatvnc's hold is taken before the buffer is fed to it and released by the
+ * release function of the nvnc_fb. A buffer is never fed again while neatvnc
+ * still holds it, because it only comes back from capturing after that.
+ */
+void wv_buffer_hold(struct wv_buffer* self);
+void wv_buffer_release(struct wv_buffer* self);
+
+/* These record how long neatvnc holds on to the buffer */
+void wv_buffer_begin_hold(struct wv_buffer* self, struct histogram* histogram);
+void wv_buffer_end_hold(struct wv_buffer* self);
+
 void wv_buffer_damage_rect(struct wv_buffer* self, int x, int y, int width,
 		int height);
 void wv_buffer_damage_whole(struct wv_buffer* self);
@@ -80,6 +209,16 @@ struct wv_buffer_pool* wv_buffer_pool_create(enum wv_buffer_type, int width,
 void wv_buffer_pool_destroy(struct wv_buffer_pool* pool);
 void wv_buffer_pool_resize(struct wv_buffer_pool* pool, enum wv_buffer_type,
 		int width, int height, int stride, uint32_t format);
+void wv_buffer_pool_set_depth(struct wv_buffer_pool* pool, int depth);
+void wv_buffer_pool_set_max_bytes(struct wv_buffer_pool* pool,
+		size_t max_bytes);
+void wv_buffer_pool_set_idle_timeout(struct wv_buffer_pool* pool,
+		uint32_t timeout_ms);
+void wv_buffer_pool_set_alloc_flags(struct wv_buffer_pool* pool,
+		enum wv_buffer_alloc_flags flags);
+void wv_buffer_pool_prewarm(struct wv_buffer_pool* pool);
+bool wv_buffer_pool_is_exhausted(const struct wv_buffer_pool* pool);
+int wv_buffer_pool_get_n_held(const struct wv_buffer_pool* pool);
 struct wv_buffer* wv_buffer_pool_acquire(struct wv_buffer_pool* pool);
 void wv_buffer_pool_release(struct wv_buffer_pool* pool,
 		struct wv_buffer* buffer);
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "screencopy.h"
+#include "buffer.h"
+#include "spsc-ring.h"
+#include "thread-sched.h"
+
+struct wl_display;
+struct wl_event_queue;
+struct aml;
+struct aml_handler;
+struct wv_buffer;
+
+enum capture_command {
+	CAPTURE_START = 0,
+	CAPTURE_START_IMMEDIATE,
+	CAPTURE_STOP,
+	CAPTURE_RECONFIGURE,
+	CAPTURE_PREWARM,
+};
+
+struct capture_message {
+	enum capture_command command;
+	/* Only set for CAPTURE_RECONFIGURE */
+	struct screencopy_config config;
+};
+
+struct capture_frame {
+	enum screencopy_status status;
+	/* Only set if the status is SCREENCOPY_DONE */
+	struct wv_buffer* buffer;
+	uint64_t time;
+	/* The latencies of this capture, as in struct screencopy */
+	uint64_t wait_us;
+	uint64_t capture_us;
+	uint64_t present_us;
+};
+
+/* Runs a screencopy state machine on its own thread, with its own Wayland
+ * event queue and its own event loop. The main loop controls it through
+ * commands and receives finished frames, and it hands the buffers back when
+ * neatvnc releases them. All of these travel through single-producer,
+ * single-consumer rings.
+ *
+ * The screencopy counters and histograms belong to the capture thread. The
+ * main thread keeps its own from what arrives through the frame ring.
+ */
+struct capture_thread {
+	struct screencopy* screencopy;
+	struct wl_display* display;
+	struct wl_event_queue* queue;
+	struct zwlr_screencopy_manager_v1* manager;
+
+	struct aml* aml;
+	pthread_t thread;
+	bool is_running;
+	atomic_bool do_exit;
+
+	/* Only accessed by the capture thread. is_reading is set while it
+	 * has prepared to read Wayland events.
+	 */
+	bool is_reading;
+	bool is_active;
+
+	int wake_fds[2];
+	int notify_fds[2];
+	struct aml_handler* notify_handler;
+
+	struct spsc_ring commands;
+	struct spsc_ring releases;
+	struct spsc_ring frames;
+
+	/* Buffers that neatvnc has released, but may still hold a reference
+	 * to until the current callback returns. Only accessed by the main
+	 * thread.
+	 */
+	struct wv_buffer_queue released;
+
+	/* Applied by the thread itself when it starts, if set */
+	const struct thread_sched* sched;
+
+	/* Counted by the main thread as the frames arrive */
+	uint64_t n_frames_captured;
+	uint64_t n_frames_failed;
+
+	void* userdata;
+	void (*on_frame)(struct capture_thread*, const struct capture_frame*);
+};
+
+/* Must be called before screencopy_init() */
+int capture_thread_init(struct capture_thread* self,
+		struct screencopy* screencopy, struct wl_display* display);
+int capture_thread_start(struct capture_thread* self);
+
+/* Stops the thread and returns all buffers to the pool. The screencopy may
+ * then be destroyed, followed by capture_thread_destroy().
+ */
+void capture_thread_stop(struct capture_thread* self);
+void capture_thread_destroy(struct capture_thread* self);
+
+void capture_thread_send(struct capture_thread* self,
+		enum capture_command command);
+
+/* The new configuration is applied on the capture thread, before the capture
+ * is reconfigured.
+ */
+void capture_thread_reconfigure(struct capture_thread* self,
+		const struct screencopy_config* config);
+
+/* Hands released buffers back to the capture thread. Call this once per main
+ * loop iteration.
+ */
+void capture_thread_flush(struct capture_thread* self);
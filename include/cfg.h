@@ -28,11 +28,41 @@
 	X(string, address) \
 	X(uint, port) \
 	X(bool, enable_pam) \
+	X(uint, pam_max_attempts) \
+	X(uint, pam_timeout) \
 	X(string, xkb_rules) \
 	X(string, xkb_model) \
 	X(string, xkb_layout) \
 	X(string, xkb_variant) \
 	X(string, xkb_options) \
+	X(uint, pool_depth) \
+	X(uint, pool_max_memory) \
+	X(uint, pool_idle_timeout) \
+	X(uint, min_fps) \
+	X(uint, fps_rise_time) \
+	X(uint, fps_fall_time) \
+	X(bool, enable_damage_refinery) \
+	X(bool, enable_export_dmabuf) \
+	X(uint, damage_tile_size) \
+	X(uint, damage_max_waste) \
+	X(uint, damage_max_rects) \
+	X(bool, prefault_buffers) \
+	X(bool, hugepage_buffers) \
+	X(bool, slab_buffers) \
+	X(string, metrics_socket) \
+	X(uint, clipboard_max_size) \
+	X(bool, capture_thread) \
+	X(bool, prerotate_buffers) \
+	X(string, capture_format) \
+	X(bool, cursor_channel) \
+	X(string, capture_region) \
+	X(string, control_socket) \
+	X(string, frame_tap_socket) \
+	X(uint, worker_threads) \
+	X(string, cpu_affinity) \
+	X(string, worker_cpu_affinity) \
+	X(string, capture_cpu_affinity) \
+	X(string, capture_priority) \
 
 struct cfg {
 #define string char*
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdio.h>
+
+struct ctl_server;
+
+/* Called for each command line with the line split on whitespace. The reply
+ * is written to out and must end with a line saying "ok" or "error: ...".
+ */
+typedef void (*ctl_command_fn)(FILE* out, int argc, char* argv[],
+		void* userdata);
+
+/* Accepts line based commands on a UNIX domain socket at path, e.g.:
+ * echo "max-fps 60" | socat - UNIX-CONNECT:<path>
+ */
+struct ctl_server* ctl_server_new(const char* path, ctl_command_fn fn,
+		void* userdata);
+void ctl_server_destroy(struct ctl_server* self);
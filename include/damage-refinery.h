@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define DAMAGE_REFINERY_TILE_SIZE 64
+
+struct pixman_region16;
+struct wv_buffer;
+
+struct damage_refinery {
+	uint64_t* hashes;
+	uint32_t width;
+	uint32_t height;
+};
+
+int damage_refinery_init(struct damage_refinery* self, uint32_t width,
+		uint32_t height);
+void damage_refinery_destroy(struct damage_refinery* self);
+
+/* Narrows the hinted damage down to the tiles whose content changed since they
+ * were last hashed. The hash is plain C, laid out so that the compiler can
+ * vectorise it; there is no hand-written SIMD. Tiles outside the hint are
+ * neither hashed nor reported.
+ */
+void damage_refinery_refine(struct damage_refinery* self,
+		struct pixman_region16* refined, struct pixman_region16* hint,
+		const struct wv_buffer* buffer);
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+
+struct pixman_region16;
+
+uint32_t calculate_region_area(struct pixman_region16* region);
+
+/* Snaps the damage to a grid of tile_size and merges rects as long as the
+ * area that is needlessly covered stays within max_waste percent of the
+ * merged rect. Finally, the least wasteful merges are made until there are
+ * no more than max_rects left, unless max_rects is 0.
+ */
+int damage_coalesce(struct pixman_region16* dst, struct pixman_region16* src,
+		int tile_size, int max_waste, int max_rects);
@@ -16,10 +16,17 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <neatvnc.h>
 
 #include "wlr-data-control-unstable-v1.h"
 
+#define DEFAULT_CLIPBOARD_MAX_SIZE (16 * 1024 * 1024)
+
+struct aml_handler;
+struct clipboard_data;
+
 struct data_control {
 	struct wl_display* wl_display;
 	struct nvnc* server;
@@ -29,8 +36,24 @@ struct data_control {
 	struct zwlr_data_control_source_v1* primary_selection;
 	struct zwlr_data_control_offer_v1* offer;
 	const char* mime_type;
-	char* cb_data;
-	size_t cb_len;
+	struct clipboard_data* cb_data;
+	int n_sends_pending;
+
+	/* Selections larger than this are not passed on to clients */
+	size_t max_size;
+	struct aml_handler* receive_handler;
+
+	/* Identifies the selection that was last passed on in either
+	 * direction, so that it isn't echoed back.
+	 */
+	bool has_last_hash;
+	uint64_t last_hash;
+	size_t last_len;
+
+	/* Clipboard data passed from the compositor to clients and back */
+	uint64_t n_bytes_received;
+	uint64_t n_bytes_sent;
+	uint64_t n_duplicates;
 };
 
 void data_control_init(struct data_control* self, struct wl_display* wl_display, struct nvnc* server, struct wl_seat* seat);
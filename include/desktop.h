@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-client.h>
+#include <pixman.h>
+
+#include "screencopy.h"
+
+#define DESKTOP_N_BUFFERS 3
+
+struct output;
+struct nvnc_fb;
+struct desktop;
+
+struct desktop_buffer {
+	struct desktop* desktop;
+	struct nvnc_fb* fb;
+
+	/* Damage that has accumulated since this buffer was last painted */
+	struct pixman_region16 damage;
+
+	bool is_held;
+};
+
+struct desktop_output {
+	struct wl_list link;
+	struct desktop* desktop;
+	struct output* output;
+
+	struct screencopy screencopy;
+
+	/* The last frame that was captured from this output. It is kept
+	 * around so that older desktop buffers can be repaired from it.
+	 */
+	struct wv_buffer* frame;
+
+	/* Placement of the output within the desktop. The frames are scaled
+	 * up by scale to match the densest output.
+	 */
+	int x, y;
+	uint32_t width, height;
+	double scale;
+};
+
+struct desktop {
+	struct wl_list outputs;
+
+	/* What the screencopy of each output starts out as */
+	struct screencopy template;
+
+	uint32_t width, height;
+	uint32_t format;
+
+	struct desktop_buffer buffers[DESKTOP_N_BUFFERS];
+
+	/* Damage that has not yet been sent to the display */
+	struct pixman_region16 damage;
+	bool is_paint_pending;
+	bool is_running;
+
+	void* userdata;
+	void (*on_frame)(struct desktop*, struct nvnc_fb*,
+			struct pixman_region16* damage);
+	void (*on_fatal)(struct desktop*);
+	/* Called for outputs that are added later on, before they are
+	 * started
+	 */
+	void (*on_output_added)(struct desktop*, struct desktop_output*);
+};
+
+struct desktop* desktop_new(struct wl_list* outputs,
+		const struct screencopy* template);
+void desktop_destroy(struct desktop* self);
+
+int desktop_start(struct desktop* self);
+void desktop_stop(struct desktop* self);
+
+int desktop_add_output(struct desktop* self, struct output* output);
+void desktop_remove_output(struct desktop* self, struct output* output);
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct zwlr_export_dmabuf_manager_v1;
+struct zwlr_export_dmabuf_frame_v1;
+struct wl_output;
+struct wv_buffer;
+
+#define EXPORT_DMABUF_MAX_PLANES 4
+
+/* Zero-copy capture backend: The compositor's own DMA-BUFs are imported as
+ * GBM buffer objects and handed to neatvnc directly. The compositor does not
+ * report damage for these frames, so every frame is damaged as a whole.
+ */
+struct export_dmabuf {
+	struct zwlr_export_dmabuf_manager_v1* manager;
+	struct zwlr_export_dmabuf_frame_v1* frame;
+
+	uint32_t width, height;
+	uint32_t format;
+	uint64_t modifier;
+	bool y_inverted;
+
+	uint32_t n_planes;
+	int fds[EXPORT_DMABUF_MAX_PLANES];
+	uint32_t offsets[EXPORT_DMABUF_MAX_PLANES];
+	uint32_t strides[EXPORT_DMABUF_MAX_PLANES];
+
+	// When the last frame was presented, in microseconds
+	uint64_t present_time;
+
+	void* userdata;
+	void (*on_ready)(struct export_dmabuf*, struct wv_buffer*);
+	void (*on_failed)(struct export_dmabuf*, bool is_fatal);
+
+	/* Called instead of on_failed if a frame could not be imported. The
+	 * others are unlikely to fare any better.
+	 */
+	void (*on_import_failed)(struct export_dmabuf*);
+};
+
+int export_dmabuf_capture(struct export_dmabuf* self,
+		struct wl_output* output, bool overlay_cursor);
+void export_dmabuf_stop(struct export_dmabuf* self);
+void export_dmabuf_release(struct wv_buffer* buffer);
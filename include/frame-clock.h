@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Keeps track of when the output presents its frames, so that captures can be
+ * requested at a steady phase relative to the refresh cycle.
+ *
+ * The compositor fulfils a copy on the next frame that it presents. A copy
+ * that is requested just before a presentation may or may not make it in
+ * time, so the age of captured frames varies by up to a whole refresh
+ * interval. Requesting it just after a presentation takes that guess out.
+ *
+ * All times are in microseconds on CLOCK_MONOTONIC.
+ */
+struct frame_clock {
+	/* The refresh interval of the output, or 0 if it is not known */
+	uint64_t interval;
+
+	/* The presentation time of the last frame that was captured */
+	uint64_t last_present;
+
+	/* The presentation time that the next frame is due for, if captures
+	 * ran exactly at the requested rate. Rounding each frame to the
+	 * nearest refresh is evened out over time, so that rates which are
+	 * not a fraction of the refresh rate are met on average.
+	 */
+	uint64_t due;
+};
+
+/* Returns false if the time stamp is not plausible on our clock, in which case
+ * the clock is reset.
+ */
+bool frame_clock_present(struct frame_clock* self, uint64_t present,
+		uint64_t now);
+void frame_clock_reset(struct frame_clock* self);
+
+static inline bool frame_clock_is_locked(const struct frame_clock* self)
+{
+	return self->interval && self->last_present;
+}
+
+/* Returns the time at which the next copy should be requested, for frames that
+ * are period apart. The clock must be locked.
+ */
+uint64_t frame_clock_schedule(struct frame_clock* self, uint64_t period);
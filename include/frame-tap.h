@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <wayland-client.h>
+
+struct wv_buffer;
+struct frame_tap;
+
+/* Shares the captured frames with other processes on the same host, so that
+ * they need not capture the output themselves.
+ *
+ * Frames are sent over a SOCK_SEQPACKET UNIX domain socket, one message per
+ * frame, with the file descriptor of the buffer's memory attached. Shared
+ * memory is passed on read-only, so it must be mapped with PROT_READ. The
+ * buffer is not reused until the client sends back a release message for it,
+ * so a client should copy what it needs and release the frame quickly. A client
+ * that holds on to FRAME_TAP_MAX_HELD frames, or whose socket is full, skips
+ * frames until it catches up.
+ *
+ * The damage of each frame is relative to the previous frame that the client
+ * received. All coordinates are in buffer memory, i.e. before the transform
+ * and the y-inversion are applied. Everything is in host byte order.
+ */
+
+#define FRAME_TAP_MAX_HELD 2
+#define FRAME_TAP_MAX_RECTS 64
+
+enum frame_tap_msg_type {
+	FRAME_TAP_MSG_FRAME = 1,
+	FRAME_TAP_MSG_RELEASE = 2,
+};
+
+enum frame_tap_buffer_type {
+	// Shared memory, to be mapped with mmap()
+	FRAME_TAP_BUFFER_SHM = 1,
+	FRAME_TAP_BUFFER_DMABUF = 2,
+};
+
+enum frame_tap_flags {
+	FRAME_TAP_Y_INVERTED = 1 << 0,
+};
+
+// Same layout as struct pixman_box16
+struct frame_tap_rect {
+	int16_t x1, y1, x2, y2;
+};
+
+/* Sent to the client, followed by n_rects rectangles. If the damage has more
+ * rectangles than FRAME_TAP_MAX_RECTS, its extents are sent instead.
+ */
+struct frame_tap_frame_msg {
+	uint32_t type;
+	uint32_t id;
+	uint32_t buffer_type;
+	uint32_t flags;
+	uint32_t width, height, stride;
+	uint32_t format; // DRM fourcc
+	uint32_t transform; // enum wl_output_transform
+	uint32_t n_rects;
+	// The frame starts at this offset into the file
+	uint64_t offset;
+	// The number of bytes that may be mapped, from the start of the file
+	uint64_t size;
+	// Only set for DMA-BUFs
+	uint64_t modifier;
+	// Capture time in microseconds on CLOCK_MONOTONIC
+	uint64_t time;
+};
+
+// Sent by the client when it is done with a frame
+struct frame_tap_release_msg {
+	uint32_t type;
+	uint32_t id;
+};
+
+struct frame_tap* frame_tap_new(const char* path);
+void frame_tap_destroy(struct frame_tap* self);
+
+/* Hands the buffer to every client that is ready for it. The buffer is held
+ * until all of them have released it.
+ */
+void frame_tap_publish(struct frame_tap* self, struct wv_buffer* buffer,
+		enum wl_output_transform transform, uint64_t time);
+
+int frame_tap_get_n_clients(const struct frame_tap* self);
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* On-disk format for recorded frames, as written by the recorder. Everything
+ * is in host byte order and all structures are 8 byte aligned, so a trace can
+ * be mapped and used in place.
+ *
+ * The file starts with a header, followed by one record per frame. Each record
+ * holds the damage of the frame, as it was reported for the buffer, followed by
+ * the pixels of each damaged rectangle, row by row. A keyframe covers the whole
+ * buffer. Keyframes are written at the start, whenever the geometry or the
+ * format changes and after frames had to be dropped, so that the content can
+ * be rebuilt from the keyframe at or before any frame.
+ *
+ * An index of all the frames and a footer follow the last record. If the
+ * recording was cut short, the index is missing and the records are scanned
+ * instead.
+ */
+
+#define FRAME_TRACE_MAGIC "WVTRACE"
+#define FRAME_TRACE_INDEX_MAGIC "WVINDEX"
+#define FRAME_TRACE_VERSION 1
+#define FRAME_TRACE_FRAME_MAGIC 0x52465657 // "WVFR"
+
+enum frame_trace_flags {
+	FRAME_TRACE_KEYFRAME = 1 << 0,
+	FRAME_TRACE_Y_INVERTED = 1 << 1,
+};
+
+struct frame_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+};
+
+struct frame_trace_frame {
+	uint32_t magic;
+	uint32_t flags;
+	// The size of the whole record, including padding
+	uint64_t size;
+	// Capture time in microseconds on CLOCK_MONOTONIC
+	uint64_t time;
+	uint32_t width, height;
+	uint32_t format; // DRM fourcc
+	uint32_t transform; // enum wl_output_transform
+	uint32_t n_rects;
+	uint32_t pixel_size;
+	uint32_t damage_area;
+	uint32_t reserved;
+};
+
+// Same layout as struct pixman_box16
+struct frame_trace_rect {
+	int16_t x1, y1, x2, y2;
+};
+
+struct frame_trace_index_entry {
+	uint64_t offset;
+	uint64_t time;
+	uint32_t flags;
+	uint32_t damage_area;
+};
+
+struct frame_trace_footer {
+	uint64_t index_offset;
+	uint64_t n_frames;
+	char magic[8];
+};
+
+static inline size_t frame_trace_align(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+static inline const struct frame_trace_rect* frame_trace_frame_rects(
+		const struct frame_trace_frame* frame)
+{
+	return (const struct frame_trace_rect*)(frame + 1);
+}
+
+static inline const uint8_t* frame_trace_frame_pixels(
+		const struct frame_trace_frame* frame)
+{
+	return (const uint8_t*)(frame_trace_frame_rects(frame) +
+			frame->n_rects);
+}
+
+/* A trace that has been mapped for reading */
+struct frame_trace {
+	const uint8_t* data;
+	size_t size;
+
+	const struct frame_trace_index_entry* index;
+	uint64_t n_frames;
+
+	// Only set if the index had to be rebuilt
+	struct frame_trace_index_entry* scanned_index;
+};
+
+int frame_trace_open(struct frame_trace* self, const char* path);
+void frame_trace_close(struct frame_trace* self);
+
+/* Returns NULL if the record is damaged */
+const struct frame_trace_frame* frame_trace_get(const struct frame_trace* self,
+		uint64_t i);
+
+/* Returns the keyframe at or before the first frame that was captured at or
+ * after the given time.
+ */
+uint64_t frame_trace_find_keyframe(const struct frame_trace* self,
+		uint64_t time);
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A rectangle in X11 geometry notation: <width>x<height>[{+-}<x>{+-}<y>].
+ * Negative offsets are measured from the right and bottom edges, so the
+ * rectangle stays anchored to them when the outer area changes size.
+ */
+struct geometry {
+	uint32_t width, height;
+	int32_t x, y;
+	bool x_from_end, y_from_end;
+};
+
+bool geometry_parse(struct geometry* dst, const char* str);
+
+/* Places the rectangle within an area of the given size and clips it */
+void geometry_resolve(const struct geometry* self, uint32_t outer_width,
+		uint32_t outer_height, int32_t* x, int32_t* y, uint32_t* width,
+		uint32_t* height);
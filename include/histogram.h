@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+
+/* Fixed-bucket histogram for latencies in microseconds. Values below 8 get a
+ * bucket each. Above that, every power of two is split into 8 buckets, so the
+ * reported percentiles are within 12.5 % of the real value. Values beyond the
+ * last bucket are counted in it.
+ */
+#define HISTOGRAM_SUB_BUCKETS 8
+#define HISTOGRAM_MAX_EXPONENT 33
+#define HISTOGRAM_N_BUCKETS \
+	(HISTOGRAM_SUB_BUCKETS * (HISTOGRAM_MAX_EXPONENT - 1))
+
+struct histogram {
+	uint32_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint32_t buckets[HISTOGRAM_N_BUCKETS];
+};
+
+static inline int histogram__bucket(uint64_t value)
+{
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return value;
+
+	int exponent = 63 - __builtin_clzll(value);
+	if (exponent > HISTOGRAM_MAX_EXPONENT)
+		return HISTOGRAM_N_BUCKETS - 1;
+
+	int sub = (value >> (exponent - 3)) & (HISTOGRAM_SUB_BUCKETS - 1);
+	return HISTOGRAM_SUB_BUCKETS * (exponent - 2) + sub;
+}
+
+static inline void histogram_add(struct histogram* self, uint64_t value)
+{
+	self->buckets[histogram__bucket(value)]++;
+	self->count++;
+	self->sum += value;
+	if (value > self->max)
+		self->max = value;
+}
+
+void histogram_reset(struct histogram* self);
+
+/* Stores the values that were added to a since it was equal to b. The maximum
+ * is taken from a.
+ */
+void histogram_diff(struct histogram* dst, const struct histogram* a,
+		const struct histogram* b);
+
+/* Returns the number of values that fall into buckets that lie entirely at
+ * or below the given value.
+ */
+uint32_t histogram_count_le(const struct histogram* self, uint64_t value);
+
+/* Returns the upper bound of the bucket that contains the given fraction of
+ * values, which is between 0 and 1.
+ */
+uint64_t histogram_percentile(const struct histogram* self, double fraction);
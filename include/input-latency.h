@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pixman.h>
+
+struct histogram;
+
+#define INPUT_LATENCY_MAX_EVENTS 64
+
+/* Pointer events count as shown once the damage of a frame overlaps this area
+ * around their position, which is roughly where a cursor or whatever is under
+ * it would be redrawn.
+ */
+#define INPUT_LATENCY_POINTER_AREA 32
+
+/* Events that have not shown up in a frame by then are given up on */
+#define INPUT_LATENCY_TIMEOUT 1000000 // µs
+
+struct input_latency_event {
+	uint64_t time;
+	bool has_position;
+	int32_t x, y;
+};
+
+/* Correlates input events with the first captured frame that shows their
+ * effect, to measure the latency from input to capture and from input to the
+ * frame being fed to the encoder.
+ *
+ * Pointer events have a position in buffer coordinates and are matched
+ * against the damage around it. Key events have no position, so any damage
+ * counts. A frame resolves every event up to the latest one that it matches,
+ * since it was copied after all of them.
+ *
+ * All times are in microseconds on CLOCK_MONOTONIC.
+ */
+struct input_latency {
+	struct histogram* capture_histogram;
+	struct histogram* feed_histogram;
+
+	// Events that have not been matched to a frame, oldest first
+	struct input_latency_event pending[INPUT_LATENCY_MAX_EVENTS];
+	int n_pending;
+
+	// Events that were captured, but not fed to the encoder yet
+	uint64_t captured[INPUT_LATENCY_MAX_EVENTS];
+	int n_captured;
+
+	uint64_t n_expired;
+};
+
+void input_latency_add(struct input_latency* self, uint64_t time,
+		bool has_position, int32_t x, int32_t y);
+
+/* The damage must be in buffer coordinates, the same as the positions */
+void input_latency_capture(struct input_latency* self,
+		struct pixman_region16* damage, uint64_t capture_time);
+
+void input_latency_feed(struct input_latency* self, uint64_t feed_time);
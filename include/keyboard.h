@@ -19,11 +19,20 @@
 #include <stdlib.h>
 #include <xkbcommon/xkbcommon.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-#include "intset.h"
+/* Key codes at or above this are ignored. This covers all evdev codes, which
+ * xkb offsets by 8.
+ */
+#define KEYBOARD_MAX_KEYCODE 1024
 
 struct zwp_virtual_keyboard_v1;
-struct table_entry;
+
+struct table_entry {
+	xkb_keysym_t symbol;
+	xkb_keycode_t code;
+	int level;
+};
 
 struct keyboard {
 	struct zwp_virtual_keyboard_v1* virtual_keyboard;
@@ -36,7 +45,14 @@ struct keyboard {
 	size_t lookup_table_length;
 	struct table_entry* lookup_table;
 
-	struct intset key_state;
+	/* Open addressing hash table from symbol to the first entry for that
+	 * symbol in lookup_table. Slots hold the entry index plus one, so that
+	 * zero means empty.
+	 */
+	uint32_t* symbol_index;
+	uint32_t symbol_index_mask;
+
+	uint64_t key_state[KEYBOARD_MAX_KEYCODE / 64];
 };
 
 int keyboard_init(struct keyboard* self, const struct xkb_rule_names* rule_names);
@@ -44,3 +60,12 @@ void keyboard_destroy(struct keyboard* self);
 void keyboard_feed(struct keyboard* self, xkb_keysym_t symbol, bool is_pressed);
 void keyboard_feed_code(struct keyboard* self, xkb_keycode_t code,
 		bool is_pressed);
+
+/* Returns the entry with the lowest level that produces the symbol */
+struct table_entry* keyboard_find_symbol(const struct keyboard* self,
+		xkb_keysym_t symbol);
+
+bool keyboard_is_pressed(const struct keyboard* self, xkb_keycode_t code);
+
+/* Releases every key that is held down, e.g. before switching keymaps */
+void keyboard_release_all(struct keyboard* self);
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct histogram;
+struct metrics_server;
+
+/* Called for each scrape. The metrics are written to out in the Prometheus
+ * text exposition format, using the helpers below.
+ */
+typedef void (*metrics_collect_fn)(FILE* out, void* userdata);
+
+/* Serves the metrics over HTTP on a UNIX domain socket at path, e.g.:
+ * curl --unix-socket <path> http://localhost/metrics
+ */
+struct metrics_server* metrics_server_new(const char* path,
+		metrics_collect_fn collect, void* userdata);
+void metrics_server_destroy(struct metrics_server* self);
+
+void metrics_write_header(FILE* out, const char* name, const char* type,
+		const char* help);
+void metrics_write_value(FILE* out, const char* name, const char* labels,
+		double value);
+
+/* The histogram is expected to hold microseconds. It is exported in seconds,
+ * with a fixed set of buckets.
+ */
+void metrics_write_histogram(FILE* out, const char* name, const char* help,
+		const struct histogram* histogram);
@@ -32,9 +32,18 @@ struct output {
 	uint32_t width;
 	uint32_t height;
 
+	// In mHz, or 0 if unknown
+	uint32_t refresh;
+
 	uint32_t x;
 	uint32_t y;
 
+	/* The size in the compositor's logical coordinate space, after
+	 * transformation and scaling. 0 if xdg-output hasn't reported it.
+	 */
+	uint32_t logical_width;
+	uint32_t logical_height;
+
 	enum wl_output_transform transform;
 
 	char make[256];
@@ -63,6 +72,9 @@ struct output* output_first(struct wl_list* list);
 uint32_t output_get_transformed_width(const struct output* self);
 uint32_t output_get_transformed_height(const struct output* self);
 
+// Returns the refresh interval in microseconds, or 0 if it is not known
+uint64_t output_get_refresh_interval(const struct output* self);
+
 void output_transform_coord(const struct output* self,
                             uint32_t src_x, uint32_t src_y,
                             uint32_t* dst_x, uint32_t* dst_y);
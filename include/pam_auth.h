@@ -17,5 +17,17 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+
+/* The PAM conversation runs on a thread of its own, so that a module that
+ * blocks does not take the calling thread with it for longer than timeout_ms.
+ * Attempts that run out of time are denied, but they keep running until PAM
+ * returns and count against max_attempts until then. Beyond max_attempts,
+ * attempts are denied right away.
+ *
+ * Passing 0 lifts the respective limit. The config can't ask for that, because
+ * 0 there selects the default, as it does for other keys.
+ */
+void pam_auth_set_limits(unsigned int max_attempts, uint32_t timeout_ms);
 
 bool pam_auth(const char* username, const char* password);
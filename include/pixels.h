@@ -24,3 +24,9 @@
 enum wl_shm_format fourcc_to_wl_shm(uint32_t in);
 bool fourcc_to_pixman_fmt(pixman_format_code_t* dst, uint32_t src);
 uint32_t fourcc_from_wl_shm(enum wl_shm_format in);
+
+/* Returns the number of bytes per pixel or 0 if the format is unknown */
+int fourcc_get_pixel_size(uint32_t fourcc);
+
+/* Parses format names such as "xrgb8888" or "rgb565" */
+bool fourcc_from_string(uint32_t* dst, const char* str);
@@ -17,6 +17,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <neatvnc.h>
 #include "wlr-virtual-pointer-unstable-v1.h"
 
@@ -31,7 +32,19 @@ struct pointer {
 	uint32_t current_x;
 	uint32_t current_y;
 
+	bool has_pending_motion;
+	uint32_t pending_x;
+	uint32_t pending_y;
+	uint32_t pending_time;
+
+	uint64_t n_frames;
+
+	/* The pointer is mapped onto the whole desktop if there is no
+	 * output. Its extent is then given by width and height.
+	 */
 	const struct output* output;
+	uint32_t width;
+	uint32_t height;
 };
 
 int pointer_init(struct pointer* self);
@@ -39,3 +52,11 @@ void pointer_destroy(struct pointer* self);
 
 void pointer_set(struct pointer* self, uint32_t x, uint32_t y,
 		 enum nvnc_button_mask button_mask);
+
+/* Sends motion that has been held back by pointer_set() */
+void pointer_flush(struct pointer* self);
+
+/* Sends pending motion and releases all buttons. This is meant for when the
+ * virtual pointer is about to be replaced.
+ */
+void pointer_release_all(struct pointer* self);
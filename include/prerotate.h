@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-client.h>
+#include <pixman.h>
+
+#define PREROTATE_N_BUFFERS 3
+
+struct nvnc_fb;
+struct wv_buffer;
+struct prerotate;
+
+struct prerotate_buffer {
+	struct prerotate* parent;
+	struct nvnc_fb* fb;
+
+	/* Damage that has accumulated since this buffer was last painted */
+	struct pixman_region16 damage;
+
+	bool is_held;
+};
+
+/* Copies transformed or scaled frames into upright buffers so that the
+ * encoders never have to deal with rotated, flipped or oversized
+ * framebuffers.
+ */
+struct prerotate {
+	struct prerotate_buffer buffers[PREROTATE_N_BUFFERS];
+
+	/* Downscaling factor in the range (0, 1]. 0 means 1. */
+	double scale;
+
+	/* Geometry of the source frames that the buffers were made for */
+	int src_width, src_height;
+	uint32_t format;
+	enum wl_output_transform transform;
+
+	uint32_t width, height;
+
+	pixman_fixed_t* filter_params;
+	int n_filter_params;
+
+	/* A frame that is waiting for one of the buffers to be released */
+	struct wv_buffer* frame;
+
+	/* Damage that has not yet been handed to on_frame */
+	struct pixman_region16 damage;
+
+	uint64_t n_frames;
+	uint64_t n_deferred;
+
+	void* userdata;
+	void (*on_frame)(struct prerotate*, struct nvnc_fb*,
+			struct pixman_region16* damage);
+};
+
+void prerotate_init(struct prerotate* self);
+void prerotate_destroy(struct prerotate* self);
+
+bool prerotate_is_enabled(const struct prerotate* self,
+		enum wl_output_transform transform);
+bool prerotate_is_supported(const struct wv_buffer* frame);
+
+/* Paints the damaged parts of the frame into an upright buffer and hands
+ * that to on_frame. The damage is given in buffer coordinates.
+ *
+ * The frame is released as soon as it has been copied. If every buffer is
+ * still held, the frame is kept until one of them is released.
+ */
+void prerotate_feed(struct prerotate* self, struct wv_buffer* frame,
+		enum wl_output_transform transform,
+		struct pixman_region16* damage);
+
+/* Maps a point in the upright buffer back to the unscaled output */
+void prerotate_unscale_coord(const struct prerotate* self, uint32_t x,
+		uint32_t y, uint32_t* dst_x, uint32_t* dst_y);
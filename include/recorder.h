@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <wayland-client.h>
+
+struct wv_buffer;
+struct recorder;
+
+/* Records captured frames to a file in the frame trace format, see
+ * frame-trace.h. Only the damaged parts of each frame are copied on the
+ * calling thread. The file is written by a thread of its own. If it falls
+ * behind by too much, frames are dropped and the next one is recorded as a
+ * keyframe.
+ */
+struct recorder* recorder_new(const char* path);
+
+/* Writes out all pending frames and the index before closing the file */
+void recorder_destroy(struct recorder* self);
+
+/* The buffer must be accessible from the CPU */
+void recorder_add_frame(struct recorder* self, const struct wv_buffer* buffer,
+		enum wl_output_transform transform, uint64_t time);
+
+uint64_t recorder_get_n_frames(const struct recorder* self);
+uint64_t recorder_get_n_dropped(const struct recorder* self);
@@ -21,14 +21,19 @@
 #include "wlr-screencopy-unstable-v1.h"
 #include "smooth.h"
 #include "buffer.h"
+#include "export-dmabuf.h"
+#include "damage-refinery.h"
+#include "frame-clock.h"
 
 struct zwlr_screencopy_manager_v1;
 struct zwlr_screencopy_frame_v1;
 struct wl_output;
 struct wl_buffer;
 struct wl_shm;
+struct aml;
 struct aml_timer;
 struct renderer;
+struct histogram;
 
 enum screencopy_status {
 	SCREENCOPY_STOPPED = 0,
@@ -38,6 +43,18 @@ enum screencopy_status {
 	SCREENCOPY_DONE,
 };
 
+/* The settings that follow the output around while capturing. They are
+ * applied with screencopy_configure() on the thread that runs the screencopy.
+ */
+struct screencopy_config {
+	bool use_region;
+	int32_t region_x, region_y;
+	int32_t region_width, region_height;
+
+	// The refresh interval of the output, or 0 if it is not known
+	uint64_t frame_interval;
+};
+
 struct screencopy {
 	enum screencopy_status status;
 
@@ -48,33 +65,122 @@ struct screencopy {
 	struct zwlr_screencopy_manager_v1* manager;
 	struct zwlr_screencopy_frame_v1* frame;
 
+	/* Used instead of screencopy if the compositor supports it and the
+	 * frames can be imported.
+	 */
+	struct export_dmabuf export_dmabuf;
+	bool use_export_dmabuf;
+
+	/* export-dmabuf saves a copy, but its frames are always damaged as a
+	 * whole, so it is only used if this is set before screencopy_init().
+	 */
+	bool enable_export_dmabuf;
+
 	void* userdata;
 	void (*on_done)(struct screencopy*);
 
+	/* The event loop that timers and background allocations run on. The
+	 * default loop is used if this isn't set.
+	 */
+	struct aml* aml;
+
 	uint64_t last_time;
 	uint64_t start_time;
+	uint64_t wait_start_time;
 	struct aml_timer* timer;
 
 	struct smooth delay_smoother;
 	double delay;
+
+	/* Captures are aligned with the output's refresh cycle, if its
+	 * interval is set here and the compositor's time stamps are on our
+	 * clock.
+	 */
+	struct frame_clock frame_clock;
 	bool is_immediate_copy;
+	bool is_prewarming;
+	bool is_frame_negotiated;
+	bool is_copy_pending;
+	bool is_waiting_for_buffer;
+
+	/* Number of upcoming frames that are damaged as a whole, regardless
+	 * of what the compositor reports.
+	 */
+	int n_damage_whole;
 	bool overlay_cursor;
 	struct wl_output* wl_output;
 
+	/* If set, only this part of the output is captured. It is given in
+	 * the output's logical coordinates.
+	 */
+	bool use_region;
+	int32_t region_x, region_y;
+	int32_t region_width, region_height;
+
+	/* Set if the frames need to be accessible from the CPU */
+	bool force_shm;
+
+	/* The format to pick when the compositor offers more than one. If it
+	 * is 0, a format that neatvnc handles natively is picked.
+	 */
+	uint32_t preferred_fourcc;
+
 	uint32_t wl_shm_width, wl_shm_height, wl_shm_stride;
 	enum wl_shm_format wl_shm_format;
+	int wl_shm_rank;
 
 	bool have_linux_dmabuf;
 	uint32_t dmabuf_width, dmabuf_height;
 	uint32_t fourcc;
+	int dmabuf_rank;
 
 	double rate_limit;
+
+	/* Adaptive rate control: the capture rate goes down to min_rate
+	 * when there is little damage. It is disabled if min_rate is 0.
+	 */
+	double min_rate;
+	double rate_rise_time;
+	double rate_fall_time;
+	struct smooth damage_smoother;
+	double damage;
+
+	/* Time spent between starting a capture and requesting the copy, and
+	 * from there until the frame is ready. These are only collected if
+	 * set.
+	 */
+	struct histogram* wait_histogram;
+	struct histogram* capture_histogram;
+
+	/* Time from requesting the copy until the frame was presented */
+	struct histogram* present_histogram;
+
+	/* The same latencies for the last capture, in microseconds. The
+	 * presentation latency is 0 if it isn't known.
+	 */
+	uint64_t wait_us;
+	uint64_t capture_us;
+	uint64_t present_us;
+
+	uint64_t n_frames_captured;
+	uint64_t n_frames_failed;
+
+	/* Drops reported damage from tiles whose content did not change */
+	bool enable_damage_refinery;
+	struct damage_refinery damage_refinery;
 };
 
 void screencopy_init(struct screencopy* self);
 void screencopy_destroy(struct screencopy* self);
 
+int screencopy_prewarm(struct screencopy* self);
 int screencopy_start(struct screencopy* self);
 int screencopy_start_immediate(struct screencopy* self);
 
+void screencopy_configure(struct screencopy* self,
+		const struct screencopy_config* config);
+void screencopy_reconfigure(struct screencopy* self);
+
+double screencopy_get_rate(struct screencopy* self);
+
 void screencopy_stop(struct screencopy* self);
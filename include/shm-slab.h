@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHM_SLAB_MAX_SLOTS 64
+
+struct wl_shm_pool;
+
+/* A single shared memory region, from which equally sized buffers are carved
+ * out. The address space for all slots is reserved up front, so the mapping
+ * never moves when the region grows. The memory of a slot is given back
+ * when the slot is freed.
+ */
+struct shm_slab {
+	int ref;
+
+	int fd;
+	struct wl_shm_pool* wl_pool;
+
+	void* reservation;
+	size_t reservation_size;
+
+	uint8_t* base;
+	size_t slot_size;
+	int n_slots;
+	/* wl_shm takes sizes and offsets as int32, which limits the number of
+	 * slots for large buffers.
+	 */
+	int max_slots;
+	uint64_t used;
+
+	bool is_populated;
+};
+
+struct shm_slab* shm_slab_new(size_t size, bool use_hugepages,
+		bool is_populated);
+void shm_slab_ref(struct shm_slab* self);
+void shm_slab_unref(struct shm_slab* self);
+
+/* Returns the slot index or -1 if the slab is full */
+int shm_slab_alloc(struct shm_slab* self);
+void shm_slab_free(struct shm_slab* self, int slot);
+
+static inline void* shm_slab_get_addr(const struct shm_slab* self, int slot)
+{
+	return self->base + slot * self->slot_size;
+}
+
+static inline int32_t shm_slab_get_offset(const struct shm_slab* self,
+		int slot)
+{
+	return slot * self->slot_size;
+}
@@ -18,4 +18,15 @@
 
 #include <unistd.h>
 
+#define SHM_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
 int shm_alloc_fd(size_t size);
+int shm_truncate(int fd, size_t size);
+
+/* The size must be a multiple of SHM_HUGEPAGE_SIZE */
+int shm_alloc_hugetlb_fd(size_t size);
+
+/* Opens the same memory again, but read-only, so that the holder of the new
+ * descriptor can neither write to it nor truncate it.
+ */
+int shm_reopen_readonly(int fd);
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Lock-free ring buffer for passing fixed-size elements from exactly one
+ * producer thread to exactly one consumer thread. The capacity is rounded up
+ * to a power of two.
+ */
+struct spsc_ring {
+	size_t elem_size;
+	size_t mask;
+	char* data;
+
+	/* Written only by the consumer and the producer, respectively. They
+	 * are kept on separate cache lines so that the two threads don't keep
+	 * invalidating each other's copies.
+	 */
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) atomic_size_t tail;
+};
+
+int spsc_ring_init(struct spsc_ring* self, size_t elem_size, size_t capacity);
+void spsc_ring_destroy(struct spsc_ring* self);
+
+/* Returns false if the ring is full */
+bool spsc_ring_push(struct spsc_ring* self, const void* elem);
+
+/* Returns false if the ring is empty */
+bool spsc_ring_pop(struct spsc_ring* self, void* elem);
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <sched.h>
+
+/* CPU affinity and scheduling priority for one of our threads. Nothing is
+ * changed for the parts that aren't set.
+ */
+struct thread_sched {
+	bool has_cpus;
+	cpu_set_t cpus;
+
+	bool has_priority;
+	int policy;
+	int priority; // Only used with SCHED_FIFO
+	int nice; // Only used with SCHED_OTHER
+};
+
+/* Takes a list of CPUs and CPU ranges, e.g. "0-3,6" */
+bool thread_sched_parse_cpus(struct thread_sched* self, const char* str);
+
+/* Takes either a nice value, e.g. "-5", or "fifo", optionally followed by a
+ * real-time priority, e.g. "fifo:10".
+ */
+bool thread_sched_parse_priority(struct thread_sched* self, const char* str);
+
+/* Applies the settings to the calling thread */
+int thread_sched_apply(const struct thread_sched* self);
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <unistd.h>
+
+/* More than this is not buffered for a client that doesn't keep up */
+#define UNIX_SOCKET_MAX_QUEUED (4 * 1024 * 1024)
+
+/* Data that a non-blocking socket hasn't taken yet */
+struct unix_socket_out {
+	char* data;
+	size_t len;
+	size_t pos;
+};
+
+/* Creates a non-blocking listening socket of the given type at path. The
+ * socket is only accessible to the owner from the moment it is bound. A stale
+ * socket at the path is replaced, but anything else there is left alone.
+ */
+int unix_socket_listen(const char* path, int type);
+
+/* Sends as much as the socket takes and keeps the rest. Returns -1 on error,
+ * 0 if everything was sent and 1 if some of it has to wait until the socket
+ * becomes writable, at which point unix_socket_out_flush() continues.
+ */
+int unix_socket_out_send(struct unix_socket_out* self, int fd,
+		const void* data, size_t len);
+int unix_socket_out_flush(struct unix_socket_out* self, int fd);
+void unix_socket_out_destroy(struct unix_socket_out* self);
+
+static inline bool unix_socket_out_is_empty(const struct unix_socket_out* self)
+{
+	return self->pos == self->len;
+}
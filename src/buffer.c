@@ -24,12 +24,18 @@
 #include <wayland-client.h>
 #include <pixman.h>
 #include <neatvnc.h>
+#include <aml.h>
 
 #include "linux-dmabuf-unstable-v1.h"
 #include "shm.h"
+#include "shm-slab.h"
 #include "sys/queue.h"
 #include "buffer.h"
 #include "pixels.h"
+#include "logging.h"
+#include "histogram.h"
+#include "time-util.h"
+#include "usdt.h"
 #include "config.h"
 
 #ifdef ENABLE_SCREENCOPY_DMABUF
@@ -40,6 +46,14 @@ extern struct wl_shm* wl_shm;
 extern struct zwp_linux_dmabuf_v1* zwp_linux_dmabuf;
 extern struct gbm_device* gbm_device;
 
+struct wv_buffer_pool_job {
+	LIST_ENTRY(wv_buffer_pool_job) link;
+	struct wv_buffer_pool* pool;
+	struct wv_buffer* buffer;
+	enum wv_buffer_alloc_flags flags;
+	int fd;
+};
+
 enum wv_buffer_type wv_buffer_get_available_types(void)
 {
 	enum wv_buffer_type type = 0;
@@ -55,12 +69,9 @@ enum wv_buffer_type wv_buffer_get_available_types(void)
 	return type;
 }
 
-struct wv_buffer* wv_buffer_create_shm(int width,
-		int height, int stride, uint32_t fourcc)
+static struct wv_buffer* wv_buffer__new_shm(int width, int height, int stride,
+		uint32_t fourcc)
 {
-	assert(wl_shm);
-	enum wl_shm_format wl_fmt = fourcc_to_wl_shm(fourcc);
-
 	struct wv_buffer* self = calloc(1, sizeof(*self));
 	if (!self)
 		return NULL;
@@ -70,49 +81,171 @@ struct wv_buffer* wv_buffer_create_shm(int width,
 	self->height = height;
 	self->stride = stride;
 	self->format = fourcc;
-
 	self->size = height * stride;
+	self->shm_fd = -1;
+
+	return self;
+}
+
+static int wv_buffer__map_shm_fd(struct wv_buffer* self, int fd,
+		size_t size, enum wv_buffer_alloc_flags flags)
+{
+	int mmap_flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if (flags & WV_BUFFER_ALLOC_POPULATE)
+		mmap_flags |= MAP_POPULATE;
+#endif
+
+	void* pixels = mmap(NULL, size, PROT_READ | PROT_WRITE, mmap_flags,
+			fd, 0);
+	if (pixels == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	self->pixels = pixels;
+	self->size = size;
+	return fd;
+}
+
+/* This does not touch any Wayland objects, so it may run on a worker thread.
+ * Returns the file descriptor of the shared memory.
+ */
+static int wv_buffer__map_shm(struct wv_buffer* self,
+		enum wv_buffer_alloc_flags flags)
+{
+	/* Huge pages may be unavailable even if the file can be created, which
+	 * only shows once it is mapped.
+	 */
+	if (flags & WV_BUFFER_ALLOC_HUGEPAGES) {
+		size_t size = (self->size + SHM_HUGEPAGE_SIZE - 1) &
+			~((size_t)SHM_HUGEPAGE_SIZE - 1);
+
+		int fd = shm_alloc_hugetlb_fd(size);
+		if (fd >= 0)
+			fd = wv_buffer__map_shm_fd(self, fd, size, flags);
+		if (fd >= 0)
+			return fd;
+	}
+
 	int fd = shm_alloc_fd(self->size);
 	if (fd < 0)
-		goto failure;
+		return -1;
 
-	self->pixels = mmap(NULL, self->size, PROT_READ | PROT_WRITE,
-			MAP_SHARED, fd, 0);
-	if (!self->pixels)
-		goto mmap_failure;
+	return wv_buffer__map_shm_fd(self, fd, self->size, flags);
+}
 
-	struct wl_shm_pool* pool = wl_shm_create_pool(wl_shm, fd, self->size);
-	if (!pool)
-		goto pool_failure;
+/* neatvnc's hold on the buffer is one hold among others. The release function
+ * of the owner is only called once they are all gone.
+ */
+static void wv_buffer__on_fb_release(struct nvnc_fb* fb, void* context)
+{
+	wv_buffer_release(nvnc_get_userdata(fb));
+}
 
-	self->wl_buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
-			stride, wl_fmt);
-	wl_shm_pool_destroy(pool);
+static void wv_buffer__init_fb(struct wv_buffer* self)
+{
+	nvnc_set_userdata(self->nvnc_fb, self, NULL);
+	nvnc_fb_set_release_fn(self->nvnc_fb, wv_buffer__on_fb_release, NULL);
+}
+
+static int wv_buffer__attach_shm_pool(struct wv_buffer* self,
+		struct wl_shm_pool* pool, int32_t offset)
+{
+	enum wl_shm_format wl_fmt = fourcc_to_wl_shm(self->format);
+
+	self->wl_buffer = wl_shm_pool_create_buffer(pool, offset, self->width,
+			self->height, self->stride, wl_fmt);
 	if (!self->wl_buffer)
-		goto shm_failure;
+		return -1;
 
-	// TODO: Get the pixel size from the format instead of assuming it's 4.
-	self->nvnc_fb = nvnc_fb_from_buffer(self->pixels, width, height, fourcc,
-			stride / 4);
+	/* Formats that pixman doesn't know about are all 32 bits wide */
+	int pixel_size = fourcc_get_pixel_size(self->format);
+	if (pixel_size == 0)
+		pixel_size = 4;
+
+	self->nvnc_fb = nvnc_fb_from_buffer(self->pixels, self->width,
+			self->height, self->format, self->stride / pixel_size);
 	if (!self->nvnc_fb) {
-		goto nvnc_fb_failure;
+		wl_buffer_destroy(self->wl_buffer);
+		return -1;
 	}
 
-	nvnc_set_userdata(self->nvnc_fb, self, NULL);
+	wv_buffer__init_fb(self);
 
 	pixman_region_init(&self->damage);
 
-	close(fd);
+	return 0;
+}
+
+static int wv_buffer__attach_shm(struct wv_buffer* self, int fd)
+{
+	assert(wl_shm);
+
+	struct wl_shm_pool* pool = wl_shm_create_pool(wl_shm, fd, self->size);
+	if (!pool)
+		return -1;
+
+	int rc = wv_buffer__attach_shm_pool(self, pool, 0);
+	wl_shm_pool_destroy(pool);
+	return rc;
+}
+
+static struct wv_buffer* wv_buffer_create_shm(int width, int height,
+		int stride, uint32_t fourcc, enum wv_buffer_alloc_flags flags)
+{
+	struct wv_buffer* self = wv_buffer__new_shm(width, height, stride,
+			fourcc);
+	if (!self)
+		return NULL;
+
+	int fd = wv_buffer__map_shm(self, flags);
+	if (fd < 0)
+		goto map_failure;
+
+	if (wv_buffer__attach_shm(self, fd) < 0)
+		goto attach_failure;
+
+	if (flags & WV_BUFFER_ALLOC_KEEP_FD)
+		self->shm_fd = fd;
+	else
+		close(fd);
 	return self;
 
-nvnc_fb_failure:
-	wl_buffer_destroy(self->wl_buffer);
-shm_failure:
-pool_failure:
-mmap_failure:
+attach_failure:
+	munmap(self->pixels, self->size);
 	close(fd);
-failure:
+map_failure:
+	free(self);
+	return NULL;
+}
+
+static struct wv_buffer* wv_buffer_create_shm_from_slab(struct shm_slab* slab,
+		int width, int height, int stride, uint32_t fourcc)
+{
+	int slot = shm_slab_alloc(slab);
+	if (slot < 0)
+		return NULL;
+
+	struct wv_buffer* self = wv_buffer__new_shm(width, height, stride,
+			fourcc);
+	if (!self)
+		goto failure;
+
+	self->slab = slab;
+	self->slab_slot = slot;
+	self->pixels = shm_slab_get_addr(slab, slot);
+
+	if (wv_buffer__attach_shm_pool(self, slab->wl_pool,
+				shm_slab_get_offset(slab, slot)) < 0)
+		goto attach_failure;
+
+	return self;
+
+attach_failure:
 	free(self);
+failure:
+	shm_slab_free(slab, slot);
 	return NULL;
 }
 
@@ -145,6 +278,9 @@ static struct wv_buffer* wv_buffer_create_dmabuf(int width, int height,
 	uint32_t offset = gbm_bo_get_offset(self->bo, 0);
 	uint32_t stride = gbm_bo_get_stride(self->bo);
 	uint64_t mod = gbm_bo_get_modifier(self->bo);
+
+	// Only used for keeping track of memory
+	self->size = (size_t)stride * height;
 	int fd = gbm_bo_get_fd(self->bo);
 	if (fd < 0)
 		goto fd_failure;
@@ -164,7 +300,9 @@ static struct wv_buffer* wv_buffer_create_dmabuf(int width, int height,
 		goto nvnc_fb_failure;
 	}
 
-	nvnc_set_userdata(self->nvnc_fb, self, NULL);
+	wv_buffer__init_fb(self);
+
+	pixman_region_init(&self->damage);
 
 	return self;
 
@@ -179,14 +317,70 @@ bo_failure:
 	free(self);
 	return NULL;
 }
+
+struct wv_buffer* wv_buffer_import_dmabuf(int width, int height,
+		uint32_t fourcc, uint64_t modifier, int n_planes, const int* fds,
+		const uint32_t* offsets, const uint32_t* strides)
+{
+	assert(gbm_device);
+
+	if (n_planes < 1 || n_planes > 4)
+		return NULL;
+
+	struct wv_buffer* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->type = WV_BUFFER_DMABUF;
+	self->width = width;
+	self->height = height;
+	self->format = fourcc;
+
+	struct gbm_import_fd_modifier_data data = {
+		.width = width,
+		.height = height,
+		.format = fourcc,
+		.num_fds = n_planes,
+		.modifier = modifier,
+	};
+
+	for (int i = 0; i < n_planes; ++i) {
+		data.fds[i] = fds[i];
+		data.offsets[i] = offsets[i];
+		data.strides[i] = strides[i];
+	}
+
+	self->bo = gbm_bo_import(gbm_device, GBM_BO_IMPORT_FD_MODIFIER, &data,
+			GBM_BO_USE_RENDERING);
+	if (!self->bo)
+		goto bo_failure;
+
+	self->nvnc_fb = nvnc_fb_from_gbm_bo(self->bo);
+	if (!self->nvnc_fb)
+		goto nvnc_fb_failure;
+
+	wv_buffer__init_fb(self);
+
+	pixman_region_init(&self->damage);
+
+	return self;
+
+nvnc_fb_failure:
+	gbm_bo_destroy(self->bo);
+bo_failure:
+	free(self);
+	return NULL;
+}
 #endif
 
-struct wv_buffer* wv_buffer_create(enum wv_buffer_type type, int width,
-		int height, int stride, uint32_t fourcc)
+static struct wv_buffer* wv_buffer__create(enum wv_buffer_type type,
+		int width, int height, int stride, uint32_t fourcc,
+		enum wv_buffer_alloc_flags flags)
 {
 	switch (type) {
 	case WV_BUFFER_SHM:
-		return wv_buffer_create_shm(width, height, stride, fourcc);
+		return wv_buffer_create_shm(width, height, stride, fourcc,
+				flags);
 #ifdef ENABLE_SCREENCOPY_DMABUF
 	case WV_BUFFER_DMABUF:
 		return wv_buffer_create_dmabuf(width, height, fourcc);
@@ -198,11 +392,22 @@ struct wv_buffer* wv_buffer_create(enum wv_buffer_type type, int width,
 	return NULL;
 }
 
+struct wv_buffer* wv_buffer_create(enum wv_buffer_type type, int width,
+		int height, int stride, uint32_t fourcc)
+{
+	return wv_buffer__create(type, width, height, stride, fourcc, 0);
+}
+
 static void wv_buffer_destroy_shm(struct wv_buffer* self)
 {
 	nvnc_fb_unref(self->nvnc_fb);
 	wl_buffer_destroy(self->wl_buffer);
-	munmap(self->pixels, self->size);
+	if (self->slab)
+		shm_slab_free(self->slab, self->slab_slot);
+	else
+		munmap(self->pixels, self->size);
+	if (self->shm_fd >= 0)
+		close(self->shm_fd);
 	free(self);
 }
 
@@ -210,7 +415,8 @@ static void wv_buffer_destroy_shm(struct wv_buffer* self)
 static void wv_buffer_destroy_dmabuf(struct wv_buffer* self)
 {
 	nvnc_fb_unref(self->nvnc_fb);
-	wl_buffer_destroy(self->wl_buffer);
+	if (self->wl_buffer)
+		wl_buffer_destroy(self->wl_buffer);
 	gbm_bo_destroy(self->bo);
 	free(self);
 }
@@ -235,6 +441,41 @@ void wv_buffer_destroy(struct wv_buffer* self)
 	abort();
 }
 
+void wv_buffer_set_release_fn(struct wv_buffer* self,
+		void (*fn)(struct nvnc_fb*, void* context), void* context)
+{
+	self->release_fn = fn;
+	self->release_context = context;
+}
+
+void wv_buffer_hold(struct wv_buffer* self)
+{
+	self->n_holds++;
+}
+
+void wv_buffer_release(struct wv_buffer* self)
+{
+	assert(self->n_holds > 0);
+
+	if (--self->n_holds == 0 && self->release_fn)
+		self->release_fn(self->nvnc_fb, self->release_context);
+}
+
+void wv_buffer_begin_hold(struct wv_buffer* self, struct histogram* histogram)
+{
+	self->hold_histogram = histogram;
+	self->feed_time = histogram ? gettime_us() : 0;
+}
+
+void wv_buffer_end_hold(struct wv_buffer* self)
+{
+	if (!self->hold_histogram)
+		return;
+
+	histogram_add(self->hold_histogram, gettime_us() - self->feed_time);
+	self->hold_histogram = NULL;
+}
+
 void wv_buffer_damage_rect(struct wv_buffer* self, int x, int y, int width,
 		int height)
 {
@@ -252,6 +493,37 @@ void wv_buffer_damage_clear(struct wv_buffer* self)
 	pixman_region_clear(&self->damage);
 }
 
+static struct aml* wv_buffer_pool__aml(const struct wv_buffer_pool* pool)
+{
+	return pool->aml ? pool->aml : aml_get_default();
+}
+
+static size_t wv_buffer_pool__buffer_size(const struct wv_buffer_pool* pool)
+{
+	if (pool->stride)
+		return (size_t)pool->stride * pool->height;
+
+	// The stride of a DMA-BUF is only known once it has been allocated
+	int pixel_size = fourcc_get_pixel_size(pool->format);
+	return (size_t)pool->width * pool->height *
+		(pixel_size > 0 ? pixel_size : 4);
+}
+
+static bool wv_buffer_pool__is_full(const struct wv_buffer_pool* pool)
+{
+	int n_live = pool->n_buffers - pool->n_stale;
+
+	if (pool->depth > 0 && n_live >= pool->depth)
+		return true;
+
+	/* Stale buffers count against the memory limit, because they take up
+	 * memory all the same.
+	 */
+	return pool->max_bytes > 0 && n_live >= WV_BUFFER_POOL_MIN_DEPTH &&
+		pool->n_bytes + wv_buffer_pool__buffer_size(pool) >
+			pool->max_bytes;
+}
+
 struct wv_buffer_pool* wv_buffer_pool_create(enum wv_buffer_type type,
 		int width, int height, int stride, uint32_t format)
 {
@@ -260,6 +532,7 @@ struct wv_buffer_pool* wv_buffer_pool_create(enum wv_buffer_type type,
 		return NULL;
 
 	TAILQ_INIT(&self->queue);
+	LIST_INIT(&self->jobs);
 	self->type = type;
 	self->width = width;
 	self->height = height;
@@ -269,18 +542,100 @@ struct wv_buffer_pool* wv_buffer_pool_create(enum wv_buffer_type type,
 	return self;
 }
 
+static void wv_buffer_pool__destroy_buffer(struct wv_buffer_pool* pool,
+		struct wv_buffer* buffer)
+{
+	DTRACE_PROBE2(wayvnc, buffer_pool_destroy, pool, buffer);
+
+	assert(pool->n_buffers > 0);
+	pool->n_buffers--;
+	pool->n_bytes -= buffer->size;
+
+	if (buffer->generation != pool->generation) {
+		assert(pool->n_stale > 0);
+		pool->n_stale--;
+	}
+
+	wv_buffer_destroy(buffer);
+}
+
+/* Buffers that prewarming would allocate again are kept. Freeing a slab slot
+ * gives its memory back, so slab buffers are trimmed like any other.
+ */
+static struct wv_buffer* wv_buffer_pool__find_trimmable(
+		struct wv_buffer_pool* pool)
+{
+	int n_keep = pool->depth > 0 ? pool->depth :
+		WV_BUFFER_POOL_PREWARM_DEPTH;
+	if (pool->n_buffers - pool->n_stale <= n_keep)
+		return NULL;
+
+	// The least recently used buffer is at the end of the queue
+	return TAILQ_LAST(&pool->queue, wv_buffer_queue);
+}
+
+static void wv_buffer_pool__schedule_trim(struct wv_buffer_pool* pool)
+{
+	if (!pool->trim_timer || pool->is_trim_scheduled)
+		return;
+
+	struct wv_buffer* buffer = wv_buffer_pool__find_trimmable(pool);
+	if (!buffer)
+		return;
+
+	uint64_t idle_time = (gettime_us() - buffer->release_time) / 1000;
+	uint32_t time_left = idle_time < pool->idle_timeout ?
+		pool->idle_timeout - idle_time : 0;
+
+	aml_set_duration(pool->trim_timer, time_left + 1);
+	if (aml_start(wv_buffer_pool__aml(pool), pool->trim_timer) == 0)
+		pool->is_trim_scheduled = true;
+}
+
+static void wv_buffer_pool__trim(struct wv_buffer_pool* pool)
+{
+	uint64_t now = gettime_us();
+	uint64_t timeout = (uint64_t)pool->idle_timeout * 1000;
+
+	struct wv_buffer* buffer;
+	while ((buffer = wv_buffer_pool__find_trimmable(pool)) &&
+			now - buffer->release_time >= timeout) {
+		TAILQ_REMOVE(&pool->queue, buffer, link);
+		pool->n_free--;
+		wv_buffer_pool__destroy_buffer(pool, buffer);
+	}
+
+	wv_buffer_pool__schedule_trim(pool);
+}
+
 static void wv_buffer_pool_clear(struct wv_buffer_pool* pool)
 {
 	while (!TAILQ_EMPTY(&pool->queue)) {
 		struct wv_buffer* buffer = TAILQ_FIRST(&pool->queue);
 		TAILQ_REMOVE(&pool->queue, buffer, link);
-		wv_buffer_destroy(buffer);
+		pool->n_free--;
+		wv_buffer_pool__destroy_buffer(pool, buffer);
 	}
 }
 
 void wv_buffer_pool_destroy(struct wv_buffer_pool* pool)
 {
+	if (pool->trim_timer) {
+		aml_stop(wv_buffer_pool__aml(pool), pool->trim_timer);
+		aml_unref(pool->trim_timer);
+	}
+
+	/* Jobs that are still running clean up after themselves */
+	while (!LIST_EMPTY(&pool->jobs)) {
+		struct wv_buffer_pool_job* job = LIST_FIRST(&pool->jobs);
+		LIST_REMOVE(job, link);
+		job->pool = NULL;
+	}
+
 	wv_buffer_pool_clear(pool);
+
+	if (pool->slab)
+		shm_slab_unref(pool->slab);
 	free(pool);
 }
 
@@ -291,6 +646,17 @@ void wv_buffer_pool_resize(struct wv_buffer_pool* pool,
 	if (pool->type != type || pool->width != width || pool->height != height
 	    || pool->stride != stride || pool->format != format) {
 		wv_buffer_pool_clear(pool);
+
+		/* Buffers that are still held keep the old slab alive */
+		if (pool->slab)
+			shm_slab_unref(pool->slab);
+		pool->slab = NULL;
+
+		/* Everything that is left is either held by neatvnc or still
+		 * being allocated, and none of it fits any more.
+		 */
+		pool->generation++;
+		pool->n_stale = pool->n_buffers;
 	}
 
 	pool->type = type;
@@ -303,7 +669,8 @@ void wv_buffer_pool_resize(struct wv_buffer_pool* pool,
 static bool wv_buffer_pool_match_buffer(struct wv_buffer_pool* pool,
 		struct wv_buffer* buffer)
 {
-	if (pool->type != buffer->type)
+	if (pool->type != buffer->type ||
+	    pool->generation != buffer->generation)
 		return false;
 
 	switch (pool->type) {
@@ -333,35 +700,272 @@ void wv_buffer_pool__on_release(struct nvnc_fb* fb, void* context)
 	struct wv_buffer* buffer = nvnc_get_userdata(fb);
 	struct wv_buffer_pool* pool = context;
 
+	wv_buffer_end_hold(buffer);
+	wv_buffer_pool_release(pool, buffer);
+}
+
+void wv_buffer_pool_set_depth(struct wv_buffer_pool* pool, int depth)
+{
+	pool->depth = depth;
+}
+
+void wv_buffer_pool_set_max_bytes(struct wv_buffer_pool* pool,
+		size_t max_bytes)
+{
+	pool->max_bytes = max_bytes;
+}
+
+static void wv_buffer_pool__on_trim(void* handle)
+{
+	struct wv_buffer_pool* pool = aml_get_userdata(handle);
+
+	pool->is_trim_scheduled = false;
+	wv_buffer_pool__trim(pool);
+}
+
+void wv_buffer_pool_set_idle_timeout(struct wv_buffer_pool* pool,
+		uint32_t timeout_ms)
+{
+	pool->idle_timeout = timeout_ms;
+
+	if (!timeout_ms || pool->trim_timer)
+		return;
+
+	pool->trim_timer = aml_timer_new(0, wv_buffer_pool__on_trim, pool,
+			NULL);
+	if (!pool->trim_timer)
+		log_warning("Failed to create timer for trimming buffers\n");
+}
+
+void wv_buffer_pool_set_alloc_flags(struct wv_buffer_pool* pool,
+		enum wv_buffer_alloc_flags flags)
+{
+	pool->alloc_flags = flags;
+}
+
+static struct wv_buffer* wv_buffer_pool__create_slab_buffer(
+		struct wv_buffer_pool* pool)
+{
+	if (!pool->slab)
+		pool->slab = shm_slab_new(pool->height * pool->stride,
+				pool->alloc_flags & WV_BUFFER_ALLOC_HUGEPAGES,
+				pool->alloc_flags & WV_BUFFER_ALLOC_POPULATE);
+	if (!pool->slab)
+		return NULL;
+
+	return wv_buffer_create_shm_from_slab(pool->slab, pool->width,
+			pool->height, pool->stride, pool->format);
+}
+
+static struct wv_buffer* wv_buffer_pool__create_buffer(
+		struct wv_buffer_pool* pool)
+{
+	struct wv_buffer* buffer = NULL;
+
+	/* Buffers that don't fit into the slab get their own memory */
+	if (pool->type == WV_BUFFER_SHM &&
+	    (pool->alloc_flags & WV_BUFFER_ALLOC_SLAB))
+		buffer = wv_buffer_pool__create_slab_buffer(pool);
+
+	if (!buffer)
+		buffer = wv_buffer__create(pool->type, pool->width,
+				pool->height, pool->stride, pool->format,
+				pool->alloc_flags);
+	if (!buffer)
+		return NULL;
+
+	DTRACE_PROBE2(wayvnc, buffer_pool_create, pool, buffer);
+
+	buffer->generation = pool->generation;
+	pool->n_buffers++;
+	pool->n_bytes += buffer->size;
+	wv_buffer_set_release_fn(buffer, wv_buffer_pool__on_release, pool);
+
+	return buffer;
+}
+
+static void wv_buffer_pool__job_work(void* handle)
+{
+	struct wv_buffer_pool_job* job = aml_get_userdata(handle);
+
+	job->fd = wv_buffer__map_shm(job->buffer, job->flags);
+}
+
+static void wv_buffer_pool__job_done(void* handle)
+{
+	struct wv_buffer_pool_job* job = aml_get_userdata(handle);
+	struct wv_buffer_pool* pool = job->pool;
+
+	if (!pool)
+		return;
+
+	LIST_REMOVE(job, link);
+	pool->n_pending--;
+
+	if (job->fd < 0 || wv_buffer__attach_shm(job->buffer, job->fd) < 0) {
+		log_error("Failed to allocate buffer in the background\n");
+		pool->n_buffers--;
+		pool->n_bytes -= job->buffer->size;
+		if (job->buffer->generation != pool->generation)
+			pool->n_stale--;
+		return;
+	}
+
+	if (job->flags & WV_BUFFER_ALLOC_KEEP_FD)
+		job->buffer->shm_fd = job->fd;
+	else
+		close(job->fd);
+	job->fd = -1;
+
+	struct wv_buffer* buffer = job->buffer;
+	job->buffer = NULL;
+
+	wv_buffer_set_release_fn(buffer, wv_buffer_pool__on_release, pool);
+
+	/* This also takes care of buffers that no longer fit the pool */
 	wv_buffer_pool_release(pool, buffer);
 }
 
+static void wv_buffer_pool__job_free(void* userdata)
+{
+	struct wv_buffer_pool_job* job = userdata;
+
+	if (job->buffer) {
+		if (job->buffer->pixels)
+			munmap(job->buffer->pixels, job->buffer->size);
+		free(job->buffer);
+	}
+
+	if (job->fd >= 0)
+		close(job->fd);
+
+	free(job);
+}
+
+static int wv_buffer_pool__start_job(struct wv_buffer_pool* pool)
+{
+	struct aml* aml = wv_buffer_pool__aml(pool);
+
+	if (aml_require_workers(aml, 1) < 0)
+		return -1;
+
+	struct wv_buffer_pool_job* job = calloc(1, sizeof(*job));
+	if (!job)
+		return -1;
+
+	job->pool = pool;
+	job->fd = -1;
+	job->flags = pool->alloc_flags;
+	job->buffer = wv_buffer__new_shm(pool->width, pool->height,
+			pool->stride, pool->format);
+	if (!job->buffer)
+		goto buffer_failure;
+
+	job->buffer->generation = pool->generation;
+
+	struct aml_work* work = aml_work_new(wv_buffer_pool__job_work,
+			wv_buffer_pool__job_done, job, wv_buffer_pool__job_free);
+	if (!work)
+		goto work_failure;
+
+	int rc = aml_start(aml, work);
+	aml_unref(work);
+	if (rc < 0)
+		return -1;
+
+	LIST_INSERT_HEAD(&pool->jobs, job, link);
+	pool->n_buffers++;
+	pool->n_bytes += job->buffer->size;
+	pool->n_pending++;
+	return 0;
+
+work_failure:
+	free(job->buffer);
+buffer_failure:
+	free(job);
+	return -1;
+}
+
+void wv_buffer_pool_prewarm(struct wv_buffer_pool* pool)
+{
+	/* Creating dmabufs involves the GBM device, which must stay on the
+	 * main thread, so those are still allocated on demand.
+	 */
+	if (pool->type != WV_BUFFER_SHM)
+		return;
+
+	int target = pool->depth > 0 ? pool->depth :
+		WV_BUFFER_POOL_PREWARM_DEPTH;
+
+	while (pool->n_buffers - pool->n_stale < target &&
+			!wv_buffer_pool__is_full(pool)) {
+		/* Carving buffers out of a slab is cheap, apart from growing it
+		 * every now and then, so that is done right away.
+		 */
+		if (pool->alloc_flags & WV_BUFFER_ALLOC_SLAB) {
+			struct wv_buffer* buffer =
+				wv_buffer_pool__create_buffer(pool);
+			if (!buffer)
+				break;
+
+			buffer->release_time = gettime_us();
+			TAILQ_INSERT_TAIL(&pool->queue, buffer, link);
+			pool->n_free++;
+			continue;
+		}
+
+		if (wv_buffer_pool__start_job(pool) < 0)
+			break;
+	}
+}
+
+bool wv_buffer_pool_is_exhausted(const struct wv_buffer_pool* pool)
+{
+	return TAILQ_EMPTY(&pool->queue) && wv_buffer_pool__is_full(pool);
+}
+
+int wv_buffer_pool_get_n_held(const struct wv_buffer_pool* pool)
+{
+	return pool->n_buffers - pool->n_free - pool->n_pending;
+}
+
 struct wv_buffer* wv_buffer_pool_acquire(struct wv_buffer_pool* pool)
 {
 	struct wv_buffer* buffer = TAILQ_FIRST(&pool->queue);
 	if (buffer) {
 		assert(wv_buffer_pool_match_buffer(pool, buffer));
 		TAILQ_REMOVE(&pool->queue, buffer, link);
+		pool->n_free--;
+		DTRACE_PROBE2(wayvnc, buffer_pool_acquire, pool, buffer);
 		return buffer;
 	}
 
-	buffer = wv_buffer_create(pool->type, pool->width, pool->height,
-			pool->stride, pool->format);
-	if (buffer)
-		nvnc_fb_set_release_fn(buffer->nvnc_fb,
-				wv_buffer_pool__on_release, pool);
+	if (wv_buffer_pool_is_exhausted(pool))
+		return NULL;
 
+	buffer = wv_buffer_pool__create_buffer(pool);
+	DTRACE_PROBE2(wayvnc, buffer_pool_acquire, pool, buffer);
 	return buffer;
 }
 
 void wv_buffer_pool_release(struct wv_buffer_pool* pool,
 		struct wv_buffer* buffer)
 {
+	DTRACE_PROBE2(wayvnc, buffer_pool_release, pool, buffer);
+
 	wv_buffer_damage_clear(buffer);
 
+	bool was_exhausted = wv_buffer_pool_is_exhausted(pool);
+
 	if (wv_buffer_pool_match_buffer(pool, buffer)) {
-		TAILQ_INSERT_TAIL(&pool->queue, buffer, link);
+		buffer->release_time = gettime_us();
+		TAILQ_INSERT_HEAD(&pool->queue, buffer, link);
+		pool->n_free++;
+		wv_buffer_pool__schedule_trim(pool);
 	} else {
-		wv_buffer_destroy(buffer);
+		wv_buffer_pool__destroy_buffer(pool, buffer);
 	}
+
+	if (was_exhausted && pool->on_release)
+		pool->on_release(pool);
 }
@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <wayland-client.h>
+#include <neatvnc.h>
+#include <aml.h>
+
+#include "capture-thread.h"
+#include "screencopy.h"
+#include "buffer.h"
+#include "spsc-ring.h"
+#include "logging.h"
+
+#define N_COMMANDS 64
+#define N_FRAMES 16
+#define N_RELEASES 256
+
+static int make_pipe(int fds[2])
+{
+	if (pipe(fds) < 0)
+		return -1;
+
+	/* The reader drains the pipe and the writer doesn't care if it is
+	 * full, because the reader is going to wake up either way.
+	 */
+	for (int i = 0; i < 2; ++i) {
+		int flags = fcntl(fds[i], F_GETFL);
+		fcntl(fds[i], F_SETFL, flags | O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	return 0;
+}
+
+static void poke(int fd)
+{
+	char c = 0;
+	ssize_t rc __attribute__((unused)) = write(fd, &c, 1);
+}
+
+static void drain(int fd)
+{
+	char buf[64];
+	while (read(fd, buf, sizeof(buf)) > 0);
+}
+
+static void capture_thread__push(struct capture_thread* self,
+		const struct capture_frame* frame)
+{
+	if (!spsc_ring_push(&self->frames, frame)) {
+		log_error("Capture frame queue overflow\n");
+		if (frame->buffer)
+			wv_buffer_pool_release(self->screencopy->pool,
+					frame->buffer);
+		return;
+	}
+
+	poke(self->notify_fds[1]);
+}
+
+static void capture_thread__push_fatal(struct capture_thread* self)
+{
+	struct capture_frame frame = {
+		.status = SCREENCOPY_FATAL,
+	};
+	capture_thread__push(self, &frame);
+}
+
+/* Runs on the capture thread */
+static void capture_thread__on_done(struct screencopy* sc)
+{
+	struct capture_thread* self = sc->userdata;
+	struct wv_buffer* buffer = NULL;
+
+	switch (sc->status) {
+	case SCREENCOPY_STOPPED:
+	case SCREENCOPY_IN_PROGRESS:
+		return;
+	case SCREENCOPY_DONE:
+		buffer = sc->back;
+		sc->back = NULL;
+		break;
+	case SCREENCOPY_FAILED:
+	case SCREENCOPY_FATAL:
+		break;
+	}
+
+	struct capture_frame frame = {
+		.status = sc->status,
+		.buffer = buffer,
+		.time = sc->last_time,
+		.wait_us = sc->wait_us,
+		.capture_us = sc->capture_us,
+		.present_us = sc->present_us,
+	};
+	capture_thread__push(self, &frame);
+}
+
+static void capture_thread__start_capture(struct capture_thread* self,
+		bool is_immediate)
+{
+	struct screencopy* sc = self->screencopy;
+
+	self->is_active = true;
+
+	/* The capture may have been restarted by a reconfiguration already */
+	if (sc->status == SCREENCOPY_IN_PROGRESS)
+		return;
+
+	int rc = is_immediate ? screencopy_start_immediate(sc) :
+		screencopy_start(sc);
+	if (rc < 0)
+		capture_thread__push_fatal(self);
+}
+
+static void capture_thread__run_command(struct capture_thread* self,
+		const struct capture_message* msg)
+{
+	struct screencopy* sc = self->screencopy;
+
+	switch (msg->command) {
+	case CAPTURE_START:
+		capture_thread__start_capture(self, false);
+		break;
+	case CAPTURE_START_IMMEDIATE:
+		capture_thread__start_capture(self, true);
+		break;
+	case CAPTURE_STOP:
+		self->is_active = false;
+		screencopy_stop(sc);
+		break;
+	case CAPTURE_RECONFIGURE:
+		screencopy_configure(sc, &msg->config);
+		screencopy_reconfigure(sc);
+		if (self->is_active)
+			capture_thread__start_capture(self, false);
+		break;
+	case CAPTURE_PREWARM:
+		screencopy_prewarm(sc);
+		break;
+	}
+}
+
+static void capture_thread__on_wake(void* handler)
+{
+	struct capture_thread* self = aml_get_userdata(handler);
+
+	drain(self->wake_fds[0]);
+
+	/* Returning buffers first lets a pending copy go ahead right away */
+	struct wv_buffer* buffer;
+	while (spsc_ring_pop(&self->releases, &buffer))
+		wv_buffer_pool_release(self->screencopy->pool, buffer);
+
+	struct capture_message msg;
+	while (spsc_ring_pop(&self->commands, &msg))
+		capture_thread__run_command(self, &msg);
+}
+
+static void capture_thread__on_wayland_event(void* handler)
+{
+	struct capture_thread* self = aml_get_userdata(handler);
+
+	if (!self->is_reading)
+		return;
+
+	self->is_reading = false;
+
+	if (wl_display_read_events(self->display) < 0 && errno != EAGAIN) {
+		log_error("Failed to read wayland events on capture thread: %m\n");
+		capture_thread__push_fatal(self);
+		atomic_store(&self->do_exit, true);
+		return;
+	}
+
+	/* Events for the main thread's queue may have been read as well */
+	poke(self->notify_fds[1]);
+}
+
+static void* capture_thread__run(void* userdata)
+{
+	struct capture_thread* self = userdata;
+
+	if (self->sched)
+		thread_sched_apply(self->sched);
+
+	while (!atomic_load(&self->do_exit)) {
+		while (wl_display_prepare_read_queue(self->display,
+					self->queue) != 0)
+			wl_display_dispatch_queue_pending(self->display,
+					self->queue);
+
+		self->is_reading = true;
+		wl_display_flush(self->display);
+
+		aml_poll(self->aml, -1);
+		aml_dispatch(self->aml);
+
+		if (self->is_reading) {
+			wl_display_cancel_read(self->display);
+			self->is_reading = false;
+		}
+
+		wl_display_dispatch_queue_pending(self->display, self->queue);
+	}
+
+	return NULL;
+}
+
+/* Runs on the main thread, where neatvnc lets go of its buffers */
+static void capture_thread__on_fb_release(struct nvnc_fb* fb, void* context)
+{
+	struct capture_thread* self = context;
+	struct wv_buffer* buffer = nvnc_get_userdata(fb);
+
+	wv_buffer_end_hold(buffer);
+
+	/* The buffer is not in the pool, so its link is free to use */
+	TAILQ_INSERT_TAIL(&self->released, buffer, link);
+}
+
+void capture_thread_flush(struct capture_thread* self)
+{
+	if (TAILQ_EMPTY(&self->released))
+		return;
+
+	while (!TAILQ_EMPTY(&self->released)) {
+		struct wv_buffer* buffer = TAILQ_FIRST(&self->released);
+		if (!spsc_ring_push(&self->releases, &buffer))
+			break;
+
+		TAILQ_REMOVE(&self->released, buffer, link);
+	}
+
+	poke(self->wake_fds[1]);
+}
+
+static void capture_thread__on_notify(void* handler)
+{
+	struct capture_thread* self = aml_get_userdata(handler);
+
+	drain(self->notify_fds[0]);
+
+	wl_display_dispatch_pending(self->display);
+
+	struct capture_frame frame;
+	while (spsc_ring_pop(&self->frames, &frame)) {
+		if (frame.status == SCREENCOPY_DONE)
+			self->n_frames_captured++;
+		else if (frame.status == SCREENCOPY_FAILED)
+			self->n_frames_failed++;
+
+		if (frame.buffer)
+			wv_buffer_set_release_fn(frame.buffer,
+					capture_thread__on_fb_release, self);
+
+		self->on_frame(self, &frame);
+	}
+}
+
+int capture_thread_init(struct capture_thread* self,
+		struct screencopy* screencopy, struct wl_display* display)
+{
+	self->screencopy = screencopy;
+	self->display = display;
+	atomic_init(&self->do_exit, false);
+	TAILQ_INIT(&self->released);
+
+	if (spsc_ring_init(&self->commands, sizeof(struct capture_message),
+				N_COMMANDS) < 0)
+		goto commands_failure;
+
+	if (spsc_ring_init(&self->releases, sizeof(struct wv_buffer*),
+				N_RELEASES) < 0)
+		goto releases_failure;
+
+	if (spsc_ring_init(&self->frames, sizeof(struct capture_frame),
+				N_FRAMES) < 0)
+		goto frames_failure;
+
+	if (make_pipe(self->wake_fds) < 0)
+		goto wake_failure;
+
+	if (make_pipe(self->notify_fds) < 0)
+		goto notify_failure;
+
+	self->aml = aml_new();
+	if (!self->aml)
+		goto aml_failure;
+
+	struct aml_handler* wake_handler = aml_handler_new(self->wake_fds[0],
+			capture_thread__on_wake, self, NULL);
+	if (!wake_handler)
+		goto handler_failure;
+
+	int rc = aml_start(self->aml, wake_handler);
+	aml_unref(wake_handler);
+	if (rc < 0)
+		goto handler_failure;
+
+	struct aml_handler* wl_handler = aml_handler_new(
+			wl_display_get_fd(display),
+			capture_thread__on_wayland_event, self, NULL);
+	if (!wl_handler)
+		goto handler_failure;
+
+	rc = aml_start(self->aml, wl_handler);
+	aml_unref(wl_handler);
+	if (rc < 0)
+		goto handler_failure;
+
+	self->notify_handler = aml_handler_new(self->notify_fds[0],
+			capture_thread__on_notify, self, NULL);
+	if (!self->notify_handler)
+		goto handler_failure;
+
+	if (aml_start(aml_get_default(), self->notify_handler) < 0)
+		goto notify_handler_failure;
+
+	self->queue = wl_display_create_queue(display);
+	if (!self->queue)
+		goto queue_failure;
+
+	/* Frames inherit the queue of the manager that created them */
+	self->manager = screencopy->manager;
+	screencopy->manager = wl_proxy_create_wrapper(self->manager);
+	if (!screencopy->manager)
+		goto wrapper_failure;
+
+	wl_proxy_set_queue((struct wl_proxy*)screencopy->manager, self->queue);
+
+	screencopy->aml = self->aml;
+	screencopy->userdata = self;
+	screencopy->on_done = capture_thread__on_done;
+
+	return 0;
+
+wrapper_failure:
+	screencopy->manager = self->manager;
+	wl_event_queue_destroy(self->queue);
+queue_failure:
+	aml_stop(aml_get_default(), self->notify_handler);
+notify_handler_failure:
+	aml_unref(self->notify_handler);
+handler_failure:
+	aml_unref(self->aml);
+aml_failure:
+	close(self->notify_fds[0]);
+	close(self->notify_fds[1]);
+notify_failure:
+	close(self->wake_fds[0]);
+	close(self->wake_fds[1]);
+wake_failure:
+	spsc_ring_destroy(&self->frames);
+frames_failure:
+	spsc_ring_destroy(&self->releases);
+releases_failure:
+	spsc_ring_destroy(&self->commands);
+commands_failure:
+	return -1;
+}
+
+int capture_thread_start(struct capture_thread* self)
+{
+	if (pthread_create(&self->thread, NULL, capture_thread__run, self) != 0)
+		return -1;
+
+	self->is_running = true;
+	return 0;
+}
+
+void capture_thread_stop(struct capture_thread* self)
+{
+	if (self->is_running) {
+		atomic_store(&self->do_exit, true);
+		poke(self->wake_fds[1]);
+		pthread_join(self->thread, NULL);
+		self->is_running = false;
+	}
+
+	/* With the thread gone, the pool belongs to this thread */
+	struct wv_buffer_pool* pool = self->screencopy->pool;
+
+	struct wv_buffer* buffer;
+	while (spsc_ring_pop(&self->releases, &buffer))
+		wv_buffer_pool_release(pool, buffer);
+
+	while (!TAILQ_EMPTY(&self->released)) {
+		buffer = TAILQ_FIRST(&self->released);
+		TAILQ_REMOVE(&self->released, buffer, link);
+		wv_buffer_pool_release(pool, buffer);
+	}
+
+	struct capture_frame frame;
+	while (spsc_ring_pop(&self->frames, &frame))
+		if (frame.buffer)
+			wv_buffer_pool_release(pool, frame.buffer);
+}
+
+void capture_thread_destroy(struct capture_thread* self)
+{
+	assert(!self->is_running);
+
+	struct screencopy* sc = self->screencopy;
+
+	wl_proxy_wrapper_destroy(sc->manager);
+	sc->manager = self->manager;
+	wl_event_queue_destroy(self->queue);
+
+	aml_stop(aml_get_default(), self->notify_handler);
+	aml_unref(self->notify_handler);
+	aml_unref(self->aml);
+
+	close(self->notify_fds[0]);
+	close(self->notify_fds[1]);
+	close(self->wake_fds[0]);
+	close(self->wake_fds[1]);
+
+	spsc_ring_destroy(&self->frames);
+	spsc_ring_destroy(&self->releases);
+	spsc_ring_destroy(&self->commands);
+}
+
+static void capture_thread__send(struct capture_thread* self,
+		const struct capture_message* msg)
+{
+	if (!spsc_ring_push(&self->commands, msg)) {
+		log_error("Capture command queue overflow\n");
+		return;
+	}
+
+	poke(self->wake_fds[1]);
+}
+
+void capture_thread_send(struct capture_thread* self,
+		enum capture_command command)
+{
+	assert(command != CAPTURE_RECONFIGURE);
+
+	struct capture_message msg = { .command = command };
+	capture_thread__send(self, &msg);
+}
+
+void capture_thread_reconfigure(struct capture_thread* self,
+		const struct screencopy_config* config)
+{
+	struct capture_message msg = {
+		.command = CAPTURE_RECONFIGURE,
+		.config = *config,
+	};
+	capture_thread__send(self, &msg);
+}
@@ -144,7 +144,7 @@ void cfg_destroy(struct cfg* self)
 {
 #define DESTROY_bool(...)
 #define DESTROY_uint(...)
-#define DESTROY_string(p) free(p)
+#define DESTROY_string(p) free(p); p = NULL
 
 #define X(type, name) DESTROY_ ## type(self->name);
 	X_CFG_LIST
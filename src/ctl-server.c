@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <aml.h>
+
+#include "ctl-server.h"
+#include "strlcpy.h"
+#include "unix-socket.h"
+#include "logging.h"
+
+#define CTL_MAX_LINE_SIZE 1024
+#define CTL_MAX_ARGS 16
+
+struct ctl_server {
+	int fd;
+	char path[108];
+	struct aml_handler* handler;
+
+	ctl_command_fn fn;
+	void* userdata;
+};
+
+struct ctl_connection {
+	struct ctl_server* server;
+	int fd;
+	size_t len;
+	char line[CTL_MAX_LINE_SIZE];
+	struct unix_socket_out out;
+};
+
+static void ctl_connection_destroy(void* userdata)
+{
+	struct ctl_connection* self = userdata;
+	unix_socket_out_destroy(&self->out);
+	close(self->fd);
+	free(self);
+}
+
+static int ctl_connection__run(struct ctl_connection* self, char* line)
+{
+	char* argv[CTL_MAX_ARGS + 1];
+	int argc = 0;
+
+	char* saveptr = NULL;
+	for (char* arg = strtok_r(line, " \t\r", &saveptr); arg;
+			arg = strtok_r(NULL, " \t\r", &saveptr)) {
+		if (argc == CTL_MAX_ARGS)
+			break;
+		argv[argc++] = arg;
+	}
+	argv[argc] = NULL;
+
+	if (argc == 0)
+		return 0;
+
+	char* reply = NULL;
+	size_t reply_len = 0;
+
+	FILE* out = open_memstream(&reply, &reply_len);
+	if (!out) {
+		log_error("open_memstream() failed: %m\n");
+		return -1;
+	}
+
+	self->server->fn(out, argc, argv, self->server->userdata);
+	fclose(out);
+
+	int rc = unix_socket_out_send(&self->out, self->fd, reply, reply_len);
+	if (rc < 0)
+		log_debug("Failed to send control reply: %m\n");
+
+	free(reply);
+	return rc < 0 ? -1 : 0;
+}
+
+static void ctl_connection__on_event(void* handler)
+{
+	struct ctl_connection* self = aml_get_userdata(handler);
+	enum aml_event revents = aml_get_revents(handler);
+
+	if (revents & AML_EVENT_WRITE) {
+		int rc = unix_socket_out_flush(&self->out, self->fd);
+		if (rc < 0) {
+			log_debug("Failed to send control reply: %m\n");
+			goto done;
+		}
+
+		if (rc == 0)
+			aml_set_event_mask(handler, AML_EVENT_READ);
+	}
+
+	if (!(revents & AML_EVENT_READ))
+		return;
+
+	ssize_t ret = read(self->fd, self->line + self->len,
+			sizeof(self->line) - self->len - 1);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	if (ret <= 0)
+		goto done;
+
+	self->len += ret;
+	self->line[self->len] = '\0';
+
+	char* start = self->line;
+	char* end;
+	while ((end = strchr(start, '\n'))) {
+		*end = '\0';
+
+		if (ctl_connection__run(self, start) < 0)
+			goto done;
+
+		start = end + 1;
+	}
+
+	self->len -= start - self->line;
+	memmove(self->line, start, self->len);
+
+	// No more commands are read until the replies have gone out
+	if (!unix_socket_out_is_empty(&self->out))
+		aml_set_event_mask(handler, AML_EVENT_WRITE);
+
+	if (self->len < sizeof(self->line) - 1)
+		return;
+
+	log_debug("Control command is too long. Closing connection...\n");
+done:
+	aml_stop(aml_get_default(), handler);
+}
+
+static void ctl_server__on_connection(void* handler)
+{
+	struct ctl_server* self = aml_get_userdata(handler);
+
+	int fd = accept4(self->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		log_debug("Failed to accept control connection: %m\n");
+		return;
+	}
+
+	struct ctl_connection* connection = calloc(1, sizeof(*connection));
+	if (!connection) {
+		close(fd);
+		return;
+	}
+
+	connection->server = self;
+	connection->fd = fd;
+
+	struct aml_handler* conn_handler = aml_handler_new(fd,
+			ctl_connection__on_event, connection,
+			ctl_connection_destroy);
+	if (!conn_handler) {
+		ctl_connection_destroy(connection);
+		return;
+	}
+
+	aml_start(aml_get_default(), conn_handler);
+	aml_unref(conn_handler);
+}
+
+struct ctl_server* ctl_server_new(const char* path, ctl_command_fn fn,
+		void* userdata)
+{
+	struct ctl_server* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->fn = fn;
+	self->userdata = userdata;
+
+	strlcpy(self->path, path, sizeof(self->path));
+
+	self->fd = unix_socket_listen(path, SOCK_STREAM);
+	if (self->fd < 0) {
+		log_error("Failed to set up control socket\n");
+		goto listen_failure;
+	}
+
+	self->handler = aml_handler_new(self->fd, ctl_server__on_connection,
+			self, NULL);
+	if (!self->handler)
+		goto handler_failure;
+
+	if (aml_start(aml_get_default(), self->handler) < 0)
+		goto start_failure;
+
+	return self;
+
+start_failure:
+	aml_unref(self->handler);
+handler_failure:
+	close(self->fd);
+	unlink(path);
+listen_failure:
+	free(self);
+	return NULL;
+}
+
+void ctl_server_destroy(struct ctl_server* self)
+{
+	aml_stop(aml_get_default(), self->handler);
+	aml_unref(self->handler);
+	close(self->fd);
+	unlink(self->path);
+	free(self);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+#include <neatvnc.h>
+#include <libdrm/drm_fourcc.h>
+
+#include "cursor.h"
+
+#define CURSOR_WIDTH 12
+#define CURSOR_HEIGHT 19
+
+/* 'X' is the outline, '.' is the fill and anything else is transparent */
+static const char* cursor_image[CURSOR_HEIGHT] = {
+	"X           ",
+	"XX          ",
+	"X.X         ",
+	"X..X        ",
+	"X...X       ",
+	"X....X      ",
+	"X.....X     ",
+	"X......X    ",
+	"X.......X   ",
+	"X........X  ",
+	"X.........X ",
+	"X......XXXXX",
+	"X...X..X    ",
+	"X..XX..X    ",
+	"X.X  X..X   ",
+	"XX   X..X   ",
+	"X     X..X  ",
+	"      X..X  ",
+	"       XX   ",
+};
+
+int cursor_set_default(struct nvnc* server)
+{
+	struct nvnc_fb* fb = nvnc_fb_new(CURSOR_WIDTH, CURSOR_HEIGHT,
+			DRM_FORMAT_ARGB8888, CURSOR_WIDTH);
+	if (!fb)
+		return -1;
+
+	uint32_t* pixels = nvnc_fb_get_addr(fb);
+
+	for (int y = 0; y < CURSOR_HEIGHT; ++y)
+		for (int x = 0; x < CURSOR_WIDTH; ++x) {
+			uint32_t* pixel = &pixels[x + y * CURSOR_WIDTH];
+
+			switch (cursor_image[y][x]) {
+			case 'X': *pixel = 0xff000000; break;
+			case '.': *pixel = 0xffffffff; break;
+			default: *pixel = 0; break;
+			}
+		}
+
+	nvnc_set_cursor(server, fb, CURSOR_WIDTH, CURSOR_HEIGHT, 0, 0, true);
+	nvnc_fb_unref(fb);
+	return 0;
+}
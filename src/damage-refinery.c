@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pixman.h>
+
+#include "damage-refinery.h"
+#include "buffer.h"
+#include "pixels.h"
+
+#define UDIV_UP(a, b) (((a) + (b) - 1) / (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define HASH_LANES 8
+#define HASH_BASIS UINT64_C(0xcbf29ce484222325)
+#define HASH_PRIME UINT64_C(0x100000001b3)
+
+int damage_refinery_init(struct damage_refinery* self, uint32_t width,
+		uint32_t height)
+{
+	uint32_t twidth = UDIV_UP(width, DAMAGE_REFINERY_TILE_SIZE);
+	uint32_t theight = UDIV_UP(height, DAMAGE_REFINERY_TILE_SIZE);
+
+	/* A hash of 0 means that the tile has never been hashed */
+	self->hashes = calloc(twidth * theight, sizeof(*self->hashes));
+	if (!self->hashes)
+		return -1;
+
+	self->width = width;
+	self->height = height;
+	return 0;
+}
+
+void damage_refinery_destroy(struct damage_refinery* self)
+{
+	free(self->hashes);
+	memset(self, 0, sizeof(*self));
+}
+
+static inline uint64_t mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= UINT64_C(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= UINT64_C(0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
+	return h;
+}
+
+/* The words of each row are spread over independent lanes, which lets the
+ * compiler vectorise the inner loop. Rows are hashed byte by byte, so that
+ * pixels of any size are covered exactly; with 24 bit formats, they don't
+ * even line up with words.
+ *
+ * A collision drops real damage and nothing repairs it later, so the hash is
+ * 64 bits wide. A 32 bit hash misses a change every few billion tiles, which a
+ * busy screen gets through in a day or two.
+ */
+static uint64_t damage_refinery__hash_tile(const struct wv_buffer* buffer,
+		int pixel_size, int x0, int y0, int width, int height)
+{
+	uint64_t lanes[HASH_LANES];
+	for (int i = 0; i < HASH_LANES; ++i)
+		lanes[i] = HASH_BASIS + i;
+
+	size_t row_size = (size_t)width * pixel_size;
+	size_t n_words = row_size / sizeof(uint32_t);
+
+	for (int y = y0; y < y0 + height; ++y) {
+		const uint8_t* row = (const uint8_t*)buffer->pixels +
+			(size_t)y * buffer->stride + (size_t)x0 * pixel_size;
+
+		size_t x = 0;
+		for (; x + HASH_LANES <= n_words; x += HASH_LANES)
+			for (int i = 0; i < HASH_LANES; ++i) {
+				uint32_t word;
+				memcpy(&word, row + (x + i) * sizeof(word),
+						sizeof(word));
+				lanes[i] = (lanes[i] ^ word) * HASH_PRIME;
+			}
+
+		for (x *= sizeof(uint32_t); x < row_size; ++x)
+			lanes[0] = (lanes[0] ^ row[x]) * HASH_PRIME;
+
+		lanes[0] = (lanes[0] ^ y) * HASH_PRIME;
+	}
+
+	uint64_t hash = 0;
+	for (int i = 0; i < HASH_LANES; ++i)
+		hash = mix64(hash ^ lanes[i]);
+
+	/* Never collide with the "not hashed yet" value */
+	return hash | 1;
+}
+
+void damage_refinery_refine(struct damage_refinery* self,
+		struct pixman_region16* refined, struct pixman_region16* hint,
+		const struct wv_buffer* buffer)
+{
+	pixman_region_clear(refined);
+
+	// Pixels of unknown size can't be compared
+	int pixel_size = fourcc_get_pixel_size(buffer->format);
+
+	if (buffer->width != (int)self->width ||
+	    buffer->height != (int)self->height || !buffer->pixels ||
+	    pixel_size == 0) {
+		pixman_region_copy(refined, hint);
+		return;
+	}
+
+	uint32_t twidth = UDIV_UP(self->width, DAMAGE_REFINERY_TILE_SIZE);
+
+	pixman_box16_t* ext = pixman_region_extents(hint);
+	if (ext->x1 >= ext->x2 || ext->y1 >= ext->y2)
+		return;
+
+	int tx0 = ext->x1 / DAMAGE_REFINERY_TILE_SIZE;
+	int ty0 = ext->y1 / DAMAGE_REFINERY_TILE_SIZE;
+	int tx1 = UDIV_UP(MIN(ext->x2, (int)self->width),
+			DAMAGE_REFINERY_TILE_SIZE);
+	int ty1 = UDIV_UP(MIN(ext->y2, (int)self->height),
+			DAMAGE_REFINERY_TILE_SIZE);
+
+	for (int ty = ty0; ty < ty1; ++ty)
+		for (int tx = tx0; tx < tx1; ++tx) {
+			pixman_box16_t box = {
+				.x1 = tx * DAMAGE_REFINERY_TILE_SIZE,
+				.y1 = ty * DAMAGE_REFINERY_TILE_SIZE,
+				.x2 = MIN((tx + 1) * DAMAGE_REFINERY_TILE_SIZE,
+						(int)self->width),
+				.y2 = MIN((ty + 1) * DAMAGE_REFINERY_TILE_SIZE,
+						(int)self->height),
+			};
+
+			if (pixman_region_contains_rectangle(hint, &box) ==
+					PIXMAN_REGION_OUT)
+				continue;
+
+			uint64_t hash = damage_refinery__hash_tile(buffer,
+					pixel_size, box.x1, box.y1, box.x2 - box.x1,
+					box.y2 - box.y1);
+
+			uint64_t* old = &self->hashes[tx + ty * twidth];
+			if (*old == hash)
+				continue;
+
+			*old = hash;
+			pixman_region_union_rect(refined, refined, box.x1,
+					box.y1, box.x2 - box.x1,
+					box.y2 - box.y1);
+		}
+
+	pixman_region_intersect(refined, refined, hint);
+}
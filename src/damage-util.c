@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pixman.h>
+
+#include "damage-util.h"
+
+uint32_t calculate_region_area(struct pixman_region16* region)
+{
+	uint32_t area = 0;
+
+	int n_rects = 0;
+	struct pixman_box16* rects = pixman_region_rectangles(region,
+		&n_rects);
+
+	for (int i = 0; i < n_rects; ++i) {
+		int width = rects[i].x2 - rects[i].x1;
+		int height = rects[i].y2 - rects[i].y1;
+		area += width * height;
+	}
+
+	return area;
+}
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/* Beyond this, the rects within each band are collapsed before merging. If
+ * that still leaves too many, the damage is replaced by its extents. This
+ * bounds the merge passes, which are cubic in the worst case, and lets them
+ * work on the stack.
+ */
+#define MAX_MERGE_INPUT 64
+
+static int64_t box_area(const struct pixman_box16* box)
+{
+	return (int64_t)(box->x2 - box->x1) * (box->y2 - box->y1);
+}
+
+static struct pixman_box16 box_union(const struct pixman_box16* a,
+		const struct pixman_box16* b)
+{
+	struct pixman_box16 box = {
+		.x1 = MIN(a->x1, b->x1),
+		.y1 = MIN(a->y1, b->y1),
+		.x2 = MAX(a->x2, b->x2),
+		.y2 = MAX(a->y2, b->y2),
+	};
+	return box;
+}
+
+static void damage__snap(struct pixman_region16* dst,
+		struct pixman_region16* src, int tile_size)
+{
+	int n_rects = 0;
+	struct pixman_box16* rects = pixman_region_rectangles(src, &n_rects);
+
+	pixman_region_clear(dst);
+
+	for (int i = 0; i < n_rects; ++i) {
+		int x1 = rects[i].x1 - rects[i].x1 % tile_size;
+		int y1 = rects[i].y1 - rects[i].y1 % tile_size;
+		int x2 = rects[i].x2 + (tile_size - rects[i].x2 % tile_size)
+			% tile_size;
+		int y2 = rects[i].y2 + (tile_size - rects[i].y2 % tile_size)
+			% tile_size;
+
+		pixman_region_union_rect(dst, dst, x1, y1, x2 - x1, y2 - y1);
+	}
+}
+
+/* Pixman regions are banded, so the rects of each band are adjacent. Returns
+ * -1 if there are more than MAX_MERGE_INPUT bands.
+ */
+static int damage__collapse_bands(struct pixman_box16* boxes,
+		int64_t* covered, const struct pixman_box16* rects, int n)
+{
+	int n_out = 0;
+
+	for (int i = 0; i < n; ++i) {
+		if (n_out > 0 && boxes[n_out - 1].y1 == rects[i].y1 &&
+		    boxes[n_out - 1].y2 == rects[i].y2) {
+			boxes[n_out - 1] = box_union(&boxes[n_out - 1],
+					&rects[i]);
+			covered[n_out - 1] += box_area(&rects[i]);
+			continue;
+		}
+
+		if (n_out == MAX_MERGE_INPUT)
+			return -1;
+
+		boxes[n_out] = rects[i];
+		covered[n_out] = box_area(&rects[i]);
+		n_out++;
+	}
+
+	return n_out;
+}
+
+static int64_t damage__merge_waste(const struct pixman_box16* boxes,
+		const int64_t* covered, int i, int j)
+{
+	struct pixman_box16 box = box_union(&boxes[i], &boxes[j]);
+	return box_area(&box) - covered[i] - covered[j];
+}
+
+static int damage__merge(struct pixman_box16* boxes, int64_t* covered,
+		int n, int i, int j)
+{
+	boxes[i] = box_union(&boxes[i], &boxes[j]);
+	covered[i] += covered[j];
+
+	boxes[j] = boxes[n - 1];
+	covered[j] = covered[n - 1];
+	return n - 1;
+}
+
+int damage_coalesce(struct pixman_region16* dst, struct pixman_region16* src,
+		int tile_size, int max_waste, int max_rects)
+{
+	struct pixman_region16 snapped;
+	pixman_region_init(&snapped);
+
+	if (tile_size > 1)
+		damage__snap(&snapped, src, tile_size);
+	else
+		pixman_region_copy(&snapped, src);
+
+	int n = 0;
+	struct pixman_box16* rects = pixman_region_rectangles(&snapped, &n);
+	if (n == 0) {
+		pixman_region_clear(dst);
+		pixman_region_fini(&snapped);
+		return 0;
+	}
+
+	struct pixman_box16 boxes[MAX_MERGE_INPUT];
+	int64_t covered[MAX_MERGE_INPUT];
+
+	if (n > MAX_MERGE_INPUT) {
+		n = damage__collapse_bands(boxes, covered, rects, n);
+	} else {
+		for (int i = 0; i < n; ++i) {
+			boxes[i] = rects[i];
+			covered[i] = box_area(&rects[i]);
+		}
+	}
+
+	if (n < 0) {
+		boxes[0] = *pixman_region_extents(&snapped);
+		n = 1;
+	}
+
+	bool is_merged = true;
+	while (is_merged) {
+		is_merged = false;
+
+		for (int i = 0; i < n; ++i)
+			for (int j = i + 1; j < n; ++j) {
+				struct pixman_box16 box =
+					box_union(&boxes[i], &boxes[j]);
+				int64_t waste = damage__merge_waste(boxes,
+						covered, i, j);
+
+				if (waste * 100 > max_waste * box_area(&box))
+					continue;
+
+				n = damage__merge(boxes, covered, n, i, j);
+				is_merged = true;
+				--j;
+			}
+	}
+
+	while (max_rects > 0 && n > max_rects) {
+		int best_i = 0, best_j = 1;
+		int64_t best_waste = INT64_MAX;
+
+		for (int i = 0; i < n; ++i)
+			for (int j = i + 1; j < n; ++j) {
+				int64_t waste = damage__merge_waste(boxes,
+						covered, i, j);
+				if (waste < best_waste) {
+					best_waste = waste;
+					best_i = i;
+					best_j = j;
+				}
+			}
+
+		n = damage__merge(boxes, covered, n, best_i, best_j);
+	}
+
+	pixman_region_fini(dst);
+	pixman_region_init_rects(dst, boxes, n);
+
+	pixman_region_fini(&snapped);
+	return 0;
+}
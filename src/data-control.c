@@ -20,19 +20,39 @@
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <assert.h>
 #include <aml.h>
 
 #include "logging.h"
 #include "data-control.h"
+#include "usdt.h"
+
+#define RECEIVE_INITIAL_SIZE 65536
+#define RECEIVE_MIN_READ 4096
+#define RECEIVE_PIPE_SIZE (1 << 20)
+
+struct clipboard_data {
+	int ref;
+	size_t len;
+	char text[];
+};
+
+struct send_context {
+	struct data_control* data_control;
+	struct clipboard_data* data;
+	size_t offset;
+	int fd;
+};
 
 struct receive_context {
 	struct data_control* data_control;
 	struct zwlr_data_control_offer_v1* offer;
 	int fd;
-	FILE* mem_fp;
-	size_t mem_size;
-	char* mem_data;
+	char* data;
+	size_t len;
+	size_t cap;
 };
 
 static void destroy_receive_context(void* raw_ctx)
@@ -40,36 +60,157 @@ static void destroy_receive_context(void* raw_ctx)
 	struct receive_context* ctx = raw_ctx;
 	int fd = ctx->fd;
 
-	if (ctx->mem_fp)
-		fclose(ctx->mem_fp);
-	free(ctx->mem_data);
+	free(ctx->data);
 	zwlr_data_control_offer_v1_destroy(ctx->offer);
 	close(fd);
 	free(ctx);
 }
 
+/* FNV-1a */
+static uint64_t hash_clipboard(const char* text, size_t len)
+{
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)text[i];
+		hash *= UINT64_C(0x100000001b3);
+	}
+
+	return hash;
+}
+
+/* Returns true if the text is what was last passed on in either direction, and
+ * otherwise remembers it as such.
+ */
+static bool is_duplicate(struct data_control* self, const char* text,
+		size_t len)
+{
+	uint64_t hash = hash_clipboard(text, len);
+
+	if (self->has_last_hash && self->last_len == len &&
+			self->last_hash == hash)
+		return true;
+
+	self->has_last_hash = true;
+	self->last_hash = hash;
+	self->last_len = len;
+	return false;
+}
+
+/* Called whenever the selection changes to something that wasn't passed on,
+ * so that passing the previous text on again isn't mistaken for an echo.
+ */
+static void forget_last(struct data_control* self)
+{
+	self->has_last_hash = false;
+}
+
+static struct clipboard_data* clipboard_data_new(const char* text, size_t len)
+{
+	struct clipboard_data* self = malloc(sizeof(*self) + len);
+	if (!self)
+		return NULL;
+
+	self->ref = 1;
+	self->len = len;
+	memcpy(self->text, text, len);
+	return self;
+}
+
+static void clipboard_data_ref(struct clipboard_data* self)
+{
+	self->ref++;
+}
+
+static void clipboard_data_unref(struct clipboard_data* self)
+{
+	if (self && --self->ref == 0)
+		free(self);
+}
+
+static int grow_receive_buffer(struct receive_context* ctx)
+{
+	if (ctx->cap - ctx->len >= RECEIVE_MIN_READ)
+		return 0;
+
+	size_t new_cap = ctx->cap ? ctx->cap * 2 : RECEIVE_INITIAL_SIZE;
+
+	/* Room for one byte past the limit is enough to tell that the
+	 * selection is too large.
+	 */
+	size_t limit = ctx->data_control->max_size + 1;
+	if (new_cap > limit)
+		new_cap = limit;
+
+	if (new_cap <= ctx->cap)
+		return 0;
+
+	char* data = realloc(ctx->data, new_cap);
+	if (!data)
+		return -1;
+
+	ctx->data = data;
+	ctx->cap = new_cap;
+	return 0;
+}
+
+static void stop_receiving(struct data_control* self, void* handler)
+{
+	if (self->receive_handler == handler)
+		self->receive_handler = NULL;
+
+	aml_stop(aml_get_default(), handler);
+}
+
+static void abort_receiving(struct data_control* self, void* handler)
+{
+	forget_last(self);
+	stop_receiving(self, handler);
+}
+
 static void on_receive(void* handler)
 {
 	struct receive_context* ctx = aml_get_userdata(handler);
+	struct data_control* self = ctx->data_control;
 	int fd = aml_get_fd(handler);
 	assert(ctx->fd == fd);
 
-	char buf[4096];
+	if (grow_receive_buffer(ctx) < 0) {
+		log_error("OOM\n");
+		abort_receiving(self, handler);
+		return;
+	}
 
-	ssize_t ret = read(fd, &buf, sizeof(buf));
+	ssize_t ret = read(fd, ctx->data + ctx->len, ctx->cap - ctx->len);
 	if (ret > 0) {
-		fwrite(&buf, 1, ret, ctx->mem_fp);
+		ctx->len += ret;
+		self->n_bytes_received += ret;
+
+		if (ctx->len > self->max_size) {
+			log_warning("Clipboard selection exceeds %zu bytes. Dropping it.\n",
+					self->max_size);
+			abort_receiving(self, handler);
+		}
 		return;
 	}
 
-	fclose(ctx->mem_fp);
-	ctx->mem_fp = NULL;
+	if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
 
-	if (ctx->mem_size)
-		nvnc_send_cut_text(ctx->data_control->server, ctx->mem_data,
-				ctx->mem_size);
+	if (ret < 0 || !ctx->len) {
+		abort_receiving(self, handler);
+		return;
+	}
 
-	aml_stop(aml_get_default(), handler);
+	if (is_duplicate(self, ctx->data, ctx->len)) {
+		log_debug("Clipboard unchanged. Not sending it to clients.\n");
+		self->n_duplicates++;
+	} else {
+		DTRACE_PROBE1(wayvnc, clipboard_to_client, ctx->len);
+		nvnc_send_cut_text(self->server, ctx->data, ctx->len);
+	}
+
+	stop_receiving(self, handler);
 }
 
 static void receive_data(void* data,
@@ -78,37 +219,46 @@ static void receive_data(void* data,
 	struct data_control* self = data;
 	int pipe_fd[2];
 
+	/* Only the latest selection is of interest */
+	if (self->receive_handler) {
+		log_debug("Cancelling superseded clipboard transfer\n");
+		stop_receiving(self, self->receive_handler);
+	}
+
 	if (pipe(pipe_fd) == -1) {
 		log_error("pipe() failed: %m\n");
+		forget_last(self);
 		return;
 	}
 
+#ifdef F_SETPIPE_SZ
+	/* Fewer wake-ups for large selections; failure is harmless */
+	fcntl(pipe_fd[0], F_SETPIPE_SZ, RECEIVE_PIPE_SIZE);
+#endif
+
 	struct receive_context* ctx = calloc(1, sizeof(*ctx));
 	if (!ctx) {
 		log_error("OOM\n");
+		forget_last(self);
 		close(pipe_fd[0]);
 		close(pipe_fd[1]);
 		return;
 	}
 
+	/* The request holds its own copy of the fd; it goes out with the next
+	 * flush of the main loop.
+	 */
 	zwlr_data_control_offer_v1_receive(offer, self->mime_type, pipe_fd[1]);
-	wl_display_flush(self->wl_display);
 	close(pipe_fd[1]);
 
 	ctx->fd = pipe_fd[0];
 	ctx->data_control = self;
 	ctx->offer = offer;
-	ctx->mem_fp = open_memstream(&ctx->mem_data, &ctx->mem_size);
-	if (!ctx->mem_fp) {
-		close(ctx->fd);
-		free(ctx);
-		log_error("open_memstream() failed: %m\n");
-		return;
-	}
 
 	struct aml_handler* handler = aml_handler_new(ctx->fd, on_receive,
 			ctx, destroy_receive_context);
 	if (!handler) {
+		forget_last(self);
 		close(ctx->fd);
 		free(ctx);
 		return;
@@ -116,6 +266,25 @@ static void receive_data(void* data,
 
 	aml_start(aml_get_default(), handler);
 	aml_unref(handler);
+
+	self->receive_handler = handler;
+}
+
+/* Our own source is cancelled as soon as something else takes over the
+ * selection, so if it is still set, the offer is just our own data coming back
+ * and need not be read at all.
+ */
+static void receive_selection(struct data_control* self,
+		struct zwlr_data_control_offer_v1* offer,
+		struct zwlr_data_control_source_v1* own_source)
+{
+	if (own_source) {
+		self->n_duplicates++;
+		zwlr_data_control_offer_v1_destroy(offer);
+		return;
+	}
+
+	receive_data(self, offer);
 }
 
 static void data_control_offer(void* data,
@@ -153,9 +322,13 @@ static void data_control_device_selection(void* data,
 {
 	struct data_control* self = data;
 	if (id && self->offer == id) {
-		receive_data(data, id);
+		receive_selection(self, id, self->selection);
 		self->offer = NULL;
+		return;
 	}
+
+	// The selection was cleared or it isn't text
+	forget_last(self);
 }
 
 static void data_control_device_finished(void* data,
@@ -170,10 +343,12 @@ static void data_control_device_primary_selection(void* data,
 {
 	struct data_control* self = data;
 	if (id && self->offer == id) {
-		receive_data(data, id);
+		receive_selection(self, id, self->primary_selection);
 		self->offer = NULL;
 		return;
 	}
+
+	forget_last(self);
 }
 
 static struct zwlr_data_control_device_v1_listener data_control_device_listener = {
@@ -183,6 +358,45 @@ static struct zwlr_data_control_device_v1_listener data_control_device_listener
 	.primary_selection = data_control_device_primary_selection
 };
 
+static void destroy_send_context(void* raw_ctx)
+{
+	struct send_context* ctx = raw_ctx;
+
+	ctx->data_control->n_sends_pending--;
+	clipboard_data_unref(ctx->data);
+	close(ctx->fd);
+	free(ctx);
+}
+
+static void on_send(void* handler)
+{
+	struct send_context* ctx = aml_get_userdata(handler);
+	struct clipboard_data* data = ctx->data;
+
+	ssize_t ret = write(ctx->fd, data->text + ctx->offset,
+			data->len - ctx->offset);
+	if (ret < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return;
+
+		log_error("Failed to write clipboard data: %m\n");
+		aml_stop(aml_get_default(), handler);
+		return;
+	}
+
+	ctx->offset += ret;
+	ctx->data_control->n_bytes_sent += ret;
+
+	if (ctx->offset < data->len)
+		return;
+
+	DTRACE_PROBE1(wayvnc, clipboard_to_compositor, data->len);
+	aml_stop(aml_get_default(), handler);
+}
+
+/* Each paste request gets its own context and progresses whenever its pipe is
+ * writable, so a slow reader only holds up itself.
+ */
 static void
 data_control_source_send(void* data,
 	struct zwlr_data_control_source_v1* zwlr_data_control_source_v1,
@@ -190,18 +404,42 @@ data_control_source_send(void* data,
 	int32_t fd)
 {
 	struct data_control* self = data;
-	char* d = self->cb_data;
-	size_t len = self->cb_len;
-	int ret;
 
-	assert(d);
+	assert(self->cb_data);
+
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		log_error("Failed to make clipboard pipe non-blocking: %m\n");
+		close(fd);
+		return;
+	}
+
+	struct send_context* ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		log_error("OOM\n");
+		close(fd);
+		return;
+	}
+
+	ctx->data_control = self;
+	ctx->data = self->cb_data;
+	ctx->fd = fd;
+	clipboard_data_ref(ctx->data);
+	self->n_sends_pending++;
+
+	struct aml_handler* handler = aml_handler_new(fd, on_send, ctx,
+			destroy_send_context);
+	if (!handler) {
+		destroy_send_context(ctx);
+		return;
+	}
 
-	ret = write(fd, d, len);
+	aml_set_event_mask(handler, AML_EVENT_WRITE);
 
-	if (ret < (int)len)
-		log_error("write from clipboard incomplete\n");
+	if (aml_start(aml_get_default(), handler) < 0)
+		log_error("Failed to start clipboard transfer\n");
 
-	close(fd);
+	aml_unref(handler);
 }
 
 static void data_control_source_cancelled(void* data,
@@ -209,11 +447,16 @@ static void data_control_source_cancelled(void* data,
 {
 	struct data_control* self = data;
 
+	/* Sources that we have replaced ourselves are not current anymore, so
+	 * this only forgets the text if something else took over.
+	 */
 	if (self->selection == zwlr_data_control_source_v1) {
 		self->selection = NULL;
+		forget_last(self);
 	}
 	if (self->primary_selection == zwlr_data_control_source_v1) {
 		self->primary_selection = NULL;
+		forget_last(self);
 	}
 	zwlr_data_control_source_v1_destroy(zwlr_data_control_source_v1);
 }
@@ -228,7 +471,7 @@ static struct zwlr_data_control_source_v1* set_selection(struct data_control* se
 	selection = zwlr_data_control_manager_v1_create_data_source(self->manager);
 	if (selection == NULL) {
 		log_error("zwlr_data_control_manager_v1_create_data_source() failed\n");
-		free(self->cb_data);
+		clipboard_data_unref(self->cb_data);
 		self->cb_data = NULL;
 		return NULL;
 	}
@@ -253,12 +496,17 @@ void data_control_init(struct data_control* self, struct wl_display* wl_display,
 	self->selection = NULL;
 	self->primary_selection = NULL;
 	self->cb_data = NULL;
-	self->cb_len = 0;
+	self->n_sends_pending = 0;
+	self->has_last_hash = false;
 	self->mime_type = "text/plain;charset=utf-8";
+	self->max_size = DEFAULT_CLIPBOARD_MAX_SIZE;
+	self->receive_handler = NULL;
 }
 
 void data_control_destroy(struct data_control* self)
 {
+	if (self->receive_handler)
+		stop_receiving(self, self->receive_handler);
 	if (self->selection) {
 		zwlr_data_control_source_v1_destroy(self->selection);
 		self->selection = NULL;
@@ -268,7 +516,7 @@ void data_control_destroy(struct data_control* self)
 		self->primary_selection = NULL;
 	}
 	zwlr_data_control_device_v1_destroy(self->device);
-	free(self->cb_data);
+	clipboard_data_unref(self->cb_data);
 }
 
 void data_control_to_clipboard(struct data_control* self, const char* text, size_t len)
@@ -277,16 +525,21 @@ void data_control_to_clipboard(struct data_control* self, const char* text, size
 		log_error("%s called with 0 length\n", __func__);
 		return;
 	}
-	free(self->cb_data);
 
-	self->cb_data = malloc(len);
+	if (is_duplicate(self, text, len)) {
+		log_debug("Clipboard unchanged. Not setting selection.\n");
+		self->n_duplicates++;
+		return;
+	}
+	/* Transfers that are still in progress keep their own reference */
+	clipboard_data_unref(self->cb_data);
+
+	self->cb_data = clipboard_data_new(text, len);
 	if (!self->cb_data) {
 		log_error("OOM: %m\n");
 		return;
 	}
 
-	memcpy(self->cb_data, text, len);
-	self->cb_len = len;
 	// Set copy/paste buffer
 	self->selection = set_selection(self, false);
 	// Set highlight/middle_click buffer
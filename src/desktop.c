@@ -0,0 +1,579 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <wayland-client.h>
+#include <pixman.h>
+#include <neatvnc.h>
+#include <libdrm/drm_fourcc.h>
+
+#include "desktop.h"
+#include "output.h"
+#include "buffer.h"
+#include "screencopy.h"
+#include "pixels.h"
+#include "transform-util.h"
+#include "logging.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+static void desktop__damage(struct desktop* self,
+		struct pixman_region16* damage)
+{
+	pixman_region_union(&self->damage, &self->damage, damage);
+
+	for (int i = 0; i < DESKTOP_N_BUFFERS; ++i)
+		pixman_region_union(&self->buffers[i].damage,
+				&self->buffers[i].damage, damage);
+}
+
+static void desktop__damage_whole(struct desktop* self)
+{
+	struct pixman_region16 damage;
+	pixman_region_init_rect(&damage, 0, 0, self->width, self->height);
+	desktop__damage(self, &damage);
+	pixman_region_fini(&damage);
+}
+
+static void desktop__destroy_buffers(struct desktop* self)
+{
+	for (int i = 0; i < DESKTOP_N_BUFFERS; ++i) {
+		struct desktop_buffer* buffer = &self->buffers[i];
+		if (!buffer->fb)
+			continue;
+
+		/* The display may still be holding on to the buffer, so it
+		 * must not call back into us once we've let go of it.
+		 */
+		nvnc_fb_set_release_fn(buffer->fb, NULL, NULL);
+		nvnc_fb_unref(buffer->fb);
+		buffer->fb = NULL;
+		buffer->is_held = false;
+	}
+}
+
+/* Pixels per logical unit. Without xdg-output, the two are assumed to be the
+ * same.
+ */
+static double desktop_output__get_density(const struct desktop_output* self)
+{
+	const struct output* output = self->output;
+
+	if (!output->logical_width)
+		return 1.0;
+
+	return (double)output_get_transformed_width(output) /
+		(double)output->logical_width;
+}
+
+/* The outputs are positioned in the compositor's logical coordinate space.
+ * The desktop is that space at the density of the densest output, so outputs
+ * with a lower density are scaled up to fill their place.
+ */
+static void desktop__update_layout(struct desktop* self)
+{
+	double density = 1.0;
+	int x0 = INT_MAX, y0 = INT_MAX;
+
+	struct desktop_output* dout;
+	wl_list_for_each(dout, &self->outputs, link) {
+		density = MAX(density, desktop_output__get_density(dout));
+		x0 = MIN(x0, (int)dout->output->x);
+		y0 = MIN(y0, (int)dout->output->y);
+	}
+
+	uint32_t width = 0;
+	uint32_t height = 0;
+
+	wl_list_for_each(dout, &self->outputs, link) {
+		struct output* output = dout->output;
+
+		uint32_t output_width = output_get_transformed_width(output);
+		uint32_t output_height = output_get_transformed_height(output);
+
+		dout->scale = density / desktop_output__get_density(dout);
+		dout->x = ((int)output->x - x0) * density + 0.5;
+		dout->y = ((int)output->y - y0) * density + 0.5;
+		dout->width = output_width * dout->scale + 0.5;
+		dout->height = output_height * dout->scale + 0.5;
+
+		width = MAX(width, dout->x + dout->width);
+		height = MAX(height, dout->y + dout->height);
+	}
+
+	if (width != self->width || height != self->height) {
+		log_debug("Desktop size changed to %"PRIu32"x%"PRIu32"\n",
+				width, height);
+
+		desktop__destroy_buffers(self);
+		self->width = width;
+		self->height = height;
+	}
+
+	desktop__damage_whole(self);
+}
+
+static void desktop__on_buffer_release(struct nvnc_fb* fb, void* context);
+
+static struct desktop_buffer* desktop__acquire_buffer(struct desktop* self)
+{
+	for (int i = 0; i < DESKTOP_N_BUFFERS; ++i) {
+		struct desktop_buffer* buffer = &self->buffers[i];
+		if (buffer->is_held)
+			continue;
+
+		if (buffer->fb)
+			return buffer;
+
+		buffer->fb = nvnc_fb_new(self->width, self->height,
+				self->format, self->width);
+		if (!buffer->fb)
+			return NULL;
+
+		/* Parts of the desktop might not be covered by any output */
+		memset(nvnc_fb_get_addr(buffer->fb), 0,
+				self->width * self->height * 4);
+
+		nvnc_fb_set_release_fn(buffer->fb, desktop__on_buffer_release,
+				buffer);
+
+		pixman_region_union_rect(&buffer->damage, &buffer->damage, 0, 0,
+				self->width, self->height);
+		return buffer;
+	}
+
+	return NULL;
+}
+
+static enum wl_output_transform desktop_output__get_buffer_transform(
+		const struct desktop_output* self, const struct wv_buffer* frame)
+{
+	enum wl_output_transform transform = self->output->transform;
+
+	if (frame->y_inverted)
+		transform = wv_output_transform_compose(transform,
+				WL_OUTPUT_TRANSFORM_FLIPPED_180);
+
+	return transform;
+}
+
+static void desktop_output__paint(struct desktop_output* self,
+		pixman_image_t* dst, struct pixman_region16* damage)
+{
+	struct wv_buffer* frame = self->frame;
+
+	struct pixman_region16 region;
+	pixman_region_init_rect(&region, self->x, self->y, self->width,
+			self->height);
+	pixman_region_intersect(&region, &region, damage);
+
+	if (!pixman_region_not_empty(&region))
+		goto done;
+
+	pixman_format_code_t format;
+	if (!fourcc_to_pixman_fmt(&format, frame->format)) {
+		log_error("Unsupported pixel format for output %s\n",
+				self->output->name);
+		goto done;
+	}
+
+	pixman_image_t* src = pixman_image_create_bits_no_clear(format,
+			frame->width, frame->height, frame->pixels,
+			frame->stride);
+	if (!src)
+		goto done;
+
+	pixman_transform_t pxform;
+	wv_pixman_transform_from_wl_output_transform(&pxform,
+			desktop_output__get_buffer_transform(self, frame),
+			frame->width, frame->height);
+
+	if (self->scale != 1.0) {
+		pixman_fixed_t inv = pixman_double_to_fixed(1.0 / self->scale);
+
+		pixman_transform_t scaling;
+		pixman_transform_init_scale(&scaling, inv, inv);
+		pixman_transform_multiply(&pxform, &pxform, &scaling);
+
+		pixman_image_set_filter(src, PIXMAN_FILTER_BILINEAR, NULL, 0);
+	}
+
+	pixman_image_set_transform(src, &pxform);
+
+	pixman_image_set_clip_region(dst, &region);
+	pixman_image_composite(PIXMAN_OP_SRC, src, NULL, dst, 0, 0, 0, 0,
+			self->x, self->y, self->width, self->height);
+	pixman_image_set_clip_region(dst, NULL);
+
+	pixman_image_unref(src);
+done:
+	pixman_region_fini(&region);
+}
+
+static void desktop__paint(struct desktop* self)
+{
+	if (self->width == 0 || self->height == 0)
+		return;
+
+	struct desktop_buffer* buffer = desktop__acquire_buffer(self);
+	if (!buffer) {
+		/* Every buffer is still held by the display or the encoder.
+		 * Damage keeps accumulating until one of them is released.
+		 */
+		self->is_paint_pending = true;
+		return;
+	}
+
+	self->is_paint_pending = false;
+
+	pixman_image_t* dst = pixman_image_create_bits_no_clear(
+			PIXMAN_x8r8g8b8, self->width, self->height,
+			nvnc_fb_get_addr(buffer->fb), self->width * 4);
+	if (!dst)
+		return;
+
+	struct desktop_output* dout;
+	wl_list_for_each(dout, &self->outputs, link)
+		if (dout->frame)
+			desktop_output__paint(dout, dst, &buffer->damage);
+
+	pixman_image_unref(dst);
+	pixman_region_clear(&buffer->damage);
+
+	buffer->is_held = true;
+	self->on_frame(self, buffer->fb, &self->damage);
+	pixman_region_clear(&self->damage);
+}
+
+static void desktop__on_buffer_release(struct nvnc_fb* fb, void* context)
+{
+	struct desktop_buffer* buffer = context;
+	struct desktop* desktop = buffer->desktop;
+
+	buffer->is_held = false;
+
+	if (desktop->is_paint_pending)
+		desktop__paint(desktop);
+}
+
+/* The damage is padded, because filtering spreads each source pixel out */
+static void desktop_output__scale_damage(const struct desktop_output* self,
+		struct pixman_region16* damage)
+{
+	if (self->scale == 1.0)
+		return;
+
+	int n_rects = 0;
+	struct pixman_box16* rects = pixman_region_rectangles(damage, &n_rects);
+
+	struct pixman_region16 scaled;
+	pixman_region_init(&scaled);
+
+	for (int i = 0; i < n_rects; ++i) {
+		int x1 = MAX(0, (int)(rects[i].x1 * self->scale) - 1);
+		int y1 = MAX(0, (int)(rects[i].y1 * self->scale) - 1);
+		int x2 = MIN((int)self->width,
+				(int)(rects[i].x2 * self->scale) + 2);
+		int y2 = MIN((int)self->height,
+				(int)(rects[i].y2 * self->scale) + 2);
+
+		if (x1 < x2 && y1 < y2)
+			pixman_region_union_rect(&scaled, &scaled, x1, y1,
+					x2 - x1, y2 - y1);
+	}
+
+	pixman_region_copy(damage, &scaled);
+	pixman_region_fini(&scaled);
+}
+
+static void desktop_output__map_damage(const struct desktop_output* self,
+		struct pixman_region16* dst, struct wv_buffer* frame)
+{
+	struct pixman_region16 damage;
+	pixman_region_init(&damage);
+
+	if (frame->y_inverted)
+		wv_region_transform(&damage, &frame->damage,
+				WL_OUTPUT_TRANSFORM_FLIPPED_180,
+				frame->width, frame->height);
+	else
+		pixman_region_copy(&damage, &frame->damage);
+
+	wv_region_transform(dst, &damage,
+			desktop_output__get_buffer_transform(self, frame),
+			frame->width, frame->height);
+	desktop_output__scale_damage(self, dst);
+	pixman_region_translate(dst, self->x, self->y);
+
+	pixman_region_fini(&damage);
+}
+
+static void desktop_output__process_frame(struct desktop_output* self)
+{
+	struct screencopy* sc = &self->screencopy;
+	struct wv_buffer* frame = sc->back;
+	sc->back = NULL;
+
+	struct pixman_region16 damage;
+	pixman_region_init(&damage);
+
+	if (self->frame) {
+		desktop_output__map_damage(self, &damage, frame);
+		wv_buffer_pool_release(sc->pool, self->frame);
+	} else {
+		pixman_region_union_rect(&damage, &damage, self->x, self->y,
+				self->width, self->height);
+	}
+
+	self->frame = frame;
+
+	desktop__damage(self->desktop, &damage);
+	pixman_region_fini(&damage);
+
+	desktop__paint(self->desktop);
+}
+
+static int desktop_output__start(struct desktop_output* self,
+		bool is_immediate)
+{
+	int rc = is_immediate ? screencopy_start_immediate(&self->screencopy)
+		: screencopy_start(&self->screencopy);
+	if (rc < 0) {
+		log_error("Failed to start capturing %s\n", self->output->name);
+		self->desktop->on_fatal(self->desktop);
+	}
+	return rc;
+}
+
+static void desktop_output__on_capture_done(struct screencopy* sc)
+{
+	struct desktop_output* self = sc->userdata;
+	struct desktop* desktop = self->desktop;
+
+	switch (sc->status) {
+	case SCREENCOPY_STOPPED:
+		break;
+	case SCREENCOPY_IN_PROGRESS:
+		break;
+	case SCREENCOPY_FATAL:
+		log_error("Fatal error while capturing %s\n",
+				self->output->name);
+		desktop->on_fatal(desktop);
+		break;
+	case SCREENCOPY_FAILED:
+		if (desktop->is_running)
+			desktop_output__start(self, true);
+		break;
+	case SCREENCOPY_DONE:
+		desktop_output__process_frame(self);
+		if (desktop->is_running)
+			desktop_output__start(self, false);
+		break;
+	}
+}
+
+static void desktop_output__on_dimension_change(struct output* output)
+{
+	struct desktop_output* self = output->userdata;
+	struct desktop* desktop = self->desktop;
+
+	desktop__update_layout(desktop);
+
+	if (!desktop->is_running)
+		return;
+
+	log_debug("Output %s dimensions changed. Reconfiguring frame capturer...\n",
+			output->name);
+
+	/* A capture that is in progress picks up the new geometry by itself */
+	screencopy_reconfigure(&self->screencopy);
+	if (self->screencopy.status != SCREENCOPY_IN_PROGRESS)
+		desktop_output__start(self, false);
+}
+
+static void desktop_output__on_transform_change(struct output* output)
+{
+	struct desktop_output* self = output->userdata;
+
+	/* The transform is applied while painting, so the frames that are
+	 * being captured remain valid.
+	 */
+	desktop__update_layout(self->desktop);
+	desktop__paint(self->desktop);
+}
+
+static struct desktop_output* desktop_output_new(struct desktop* desktop,
+		struct output* output, const struct screencopy* template)
+{
+	struct desktop_output* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->desktop = desktop;
+	self->output = output;
+
+	self->screencopy = *template;
+	self->screencopy.wl_output = output->wl_output;
+	self->screencopy.userdata = self;
+	self->screencopy.on_done = desktop_output__on_capture_done;
+
+	/* The frames are composited on the CPU */
+	self->screencopy.force_shm = true;
+
+	screencopy_init(&self->screencopy);
+
+	output->on_dimension_change = desktop_output__on_dimension_change;
+	output->on_transform_change = desktop_output__on_transform_change;
+	output->userdata = self;
+
+	return self;
+}
+
+static void desktop_output_destroy(struct desktop_output* self)
+{
+	screencopy_stop(&self->screencopy);
+
+	if (self->frame)
+		wv_buffer_pool_release(self->screencopy.pool, self->frame);
+
+	screencopy_destroy(&self->screencopy);
+
+	self->output->on_dimension_change = NULL;
+	self->output->on_transform_change = NULL;
+	self->output->userdata = NULL;
+
+	free(self);
+}
+
+struct desktop* desktop_new(struct wl_list* outputs,
+		const struct screencopy* template)
+{
+	struct desktop* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	wl_list_init(&self->outputs);
+	pixman_region_init(&self->damage);
+
+	self->template = *template;
+
+	self->format = DRM_FORMAT_XRGB8888;
+
+	for (int i = 0; i < DESKTOP_N_BUFFERS; ++i) {
+		self->buffers[i].desktop = self;
+		pixman_region_init(&self->buffers[i].damage);
+	}
+
+	struct output* output;
+	wl_list_for_each(output, outputs, link) {
+		struct desktop_output* dout =
+			desktop_output_new(self, output, template);
+		if (!dout)
+			goto failure;
+
+		wl_list_insert(self->outputs.prev, &dout->link);
+	}
+
+	desktop__update_layout(self);
+
+	return self;
+
+failure:
+	desktop_destroy(self);
+	return NULL;
+}
+
+void desktop_destroy(struct desktop* self)
+{
+	struct desktop_output* dout;
+	struct desktop_output* tmp;
+	wl_list_for_each_safe(dout, tmp, &self->outputs, link) {
+		wl_list_remove(&dout->link);
+		desktop_output_destroy(dout);
+	}
+
+	desktop__destroy_buffers(self);
+
+	for (int i = 0; i < DESKTOP_N_BUFFERS; ++i)
+		pixman_region_fini(&self->buffers[i].damage);
+
+	pixman_region_fini(&self->damage);
+	free(self);
+}
+
+int desktop_start(struct desktop* self)
+{
+	self->is_running = true;
+
+	struct desktop_output* dout;
+	wl_list_for_each(dout, &self->outputs, link)
+		if (desktop_output__start(dout, true) < 0)
+			return -1;
+
+	return 0;
+}
+
+void desktop_stop(struct desktop* self)
+{
+	self->is_running = false;
+
+	struct desktop_output* dout;
+	wl_list_for_each(dout, &self->outputs, link)
+		screencopy_stop(&dout->screencopy);
+}
+
+int desktop_add_output(struct desktop* self, struct output* output)
+{
+	struct desktop_output* dout =
+		desktop_output_new(self, output, &self->template);
+	if (!dout)
+		return -1;
+
+	wl_list_insert(self->outputs.prev, &dout->link);
+
+	if (self->on_output_added)
+		self->on_output_added(self, dout);
+
+	desktop__update_layout(self);
+	desktop__paint(self);
+
+	if (self->is_running)
+		return desktop_output__start(dout, true);
+
+	return 0;
+}
+
+void desktop_remove_output(struct desktop* self, struct output* output)
+{
+	struct desktop_output* dout;
+	wl_list_for_each(dout, &self->outputs, link)
+		if (dout->output == output)
+			break;
+
+	if (&dout->link == &self->outputs)
+		return;
+
+	wl_list_remove(&dout->link);
+	desktop_output_destroy(dout);
+
+	desktop__update_layout(self);
+	desktop__paint(self);
+}
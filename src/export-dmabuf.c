@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <assert.h>
+#include <wayland-client.h>
+#include <neatvnc.h>
+
+#include "wlr-export-dmabuf-unstable-v1.h"
+#include "linux-dmabuf-unstable-v1.h"
+#include "export-dmabuf.h"
+#include "buffer.h"
+#include "logging.h"
+#include "usdt.h"
+
+static void export_dmabuf__close_fds(struct export_dmabuf* self)
+{
+	for (uint32_t i = 0; i < self->n_planes &&
+			i < EXPORT_DMABUF_MAX_PLANES; ++i)
+		if (self->fds[i] >= 0)
+			close(self->fds[i]);
+
+	self->n_planes = 0;
+}
+
+void export_dmabuf_stop(struct export_dmabuf* self)
+{
+	export_dmabuf__close_fds(self);
+
+	if (self->frame) {
+		zwlr_export_dmabuf_frame_v1_destroy(self->frame);
+		self->frame = NULL;
+	}
+}
+
+void export_dmabuf_release(struct wv_buffer* buffer)
+{
+	/* The compositor may reuse the buffer once the frame is destroyed */
+	zwlr_export_dmabuf_frame_v1_destroy(buffer->export_frame);
+	wv_buffer_destroy(buffer);
+}
+
+static void export_dmabuf__on_release(struct nvnc_fb* fb, void* context)
+{
+	struct wv_buffer* buffer = nvnc_get_userdata(fb);
+	wv_buffer_end_hold(buffer);
+	export_dmabuf_release(buffer);
+}
+
+static void export_dmabuf_frame(void* data,
+		struct zwlr_export_dmabuf_frame_v1* frame, uint32_t width,
+		uint32_t height, uint32_t offset_x, uint32_t offset_y,
+		uint32_t buffer_flags, uint32_t flags, uint32_t format,
+		uint32_t mod_high, uint32_t mod_low, uint32_t num_objects)
+{
+	struct export_dmabuf* self = data;
+
+	export_dmabuf__close_fds(self);
+
+	self->width = width;
+	self->height = height;
+	self->format = format;
+	self->modifier = ((uint64_t)mod_high << 32) | mod_low;
+	self->y_inverted = !!(buffer_flags &
+			ZWP_LINUX_BUFFER_PARAMS_V1_FLAGS_Y_INVERT);
+
+	for (int i = 0; i < EXPORT_DMABUF_MAX_PLANES; ++i)
+		self->fds[i] = -1;
+
+	self->n_planes = num_objects;
+}
+
+static void export_dmabuf_object(void* data,
+		struct zwlr_export_dmabuf_frame_v1* frame, uint32_t index,
+		int32_t fd, uint32_t size, uint32_t offset, uint32_t stride,
+		uint32_t plane_index)
+{
+	struct export_dmabuf* self = data;
+
+	if (plane_index >= EXPORT_DMABUF_MAX_PLANES ||
+	    plane_index >= self->n_planes) {
+		close(fd);
+		return;
+	}
+
+	if (self->fds[plane_index] >= 0)
+		close(self->fds[plane_index]);
+
+	self->fds[plane_index] = fd;
+	self->offsets[plane_index] = offset;
+	self->strides[plane_index] = stride;
+}
+
+static void export_dmabuf_ready(void* data,
+		struct zwlr_export_dmabuf_frame_v1* frame, uint32_t tv_sec_hi,
+		uint32_t tv_sec_lo, uint32_t tv_nsec)
+{
+	struct export_dmabuf* self = data;
+
+	DTRACE_PROBE1(wayvnc, export_dmabuf_ready, self);
+
+	struct wv_buffer* buffer = NULL;
+	if (self->n_planes <= EXPORT_DMABUF_MAX_PLANES)
+		buffer = wv_buffer_import_dmabuf(self->width, self->height,
+				self->format, self->modifier, self->n_planes,
+				self->fds, self->offsets, self->strides);
+
+	/* GBM has its own reference to the buffer after import */
+	export_dmabuf__close_fds(self);
+
+	if (!buffer) {
+		log_error("Failed to import DMA-BUF from compositor\n");
+		export_dmabuf_stop(self);
+		self->on_import_failed(self);
+		return;
+	}
+
+	buffer->y_inverted = self->y_inverted;
+	buffer->export_frame = self->frame;
+	self->frame = NULL;
+
+	wv_buffer_set_release_fn(buffer, export_dmabuf__on_release, NULL);
+
+	wv_buffer_damage_whole(buffer);
+
+	uint64_t sec = (uint64_t)tv_sec_hi << 32 | tv_sec_lo;
+	self->present_time = sec * UINT64_C(1000000) + tv_nsec / 1000;
+
+	self->on_ready(self, buffer);
+}
+
+static void export_dmabuf_cancel(void* data,
+		struct zwlr_export_dmabuf_frame_v1* frame, uint32_t reason)
+{
+	struct export_dmabuf* self = data;
+
+	DTRACE_PROBE1(wayvnc, export_dmabuf_cancel, self);
+
+	export_dmabuf_stop(self);
+
+	self->on_failed(self, reason ==
+			ZWLR_EXPORT_DMABUF_FRAME_V1_CANCEL_REASON_PERMANENT);
+}
+
+int export_dmabuf_capture(struct export_dmabuf* self,
+		struct wl_output* output, bool overlay_cursor)
+{
+	static const struct zwlr_export_dmabuf_frame_v1_listener listener = {
+		.frame = export_dmabuf_frame,
+		.object = export_dmabuf_object,
+		.ready = export_dmabuf_ready,
+		.cancel = export_dmabuf_cancel,
+	};
+
+	assert(!self->frame);
+
+	self->frame = zwlr_export_dmabuf_manager_v1_capture_output(
+			self->manager, overlay_cursor, output);
+	if (!self->frame)
+		return -1;
+
+	zwlr_export_dmabuf_frame_v1_add_listener(self->frame, &listener, self);
+
+	return 0;
+}
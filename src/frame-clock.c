@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <assert.h>
+
+#include "frame-clock.h"
+
+/* A time stamp that lies this far in the past is likely on a different clock,
+ * because the ready event follows the presentation closely.
+ */
+#define MAX_PRESENT_AGE 1000000 // us
+
+/* The copy is requested this long after a presentation, so that slight
+ * variations in when the compositor's frame ends don't make it miss its turn.
+ */
+#define PHASE_MARGIN 1000 // us
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+void frame_clock_reset(struct frame_clock* self)
+{
+	self->last_present = 0;
+	self->due = 0;
+}
+
+bool frame_clock_present(struct frame_clock* self, uint64_t present,
+		uint64_t now)
+{
+	if (present == 0 || present > now || now - present > MAX_PRESENT_AGE) {
+		frame_clock_reset(self);
+		return false;
+	}
+
+	/* A frame that comes late, e.g. because nothing changed on the output
+	 * for a while, starts the schedule over.
+	 */
+	if (!self->last_present || present > self->due + self->interval / 2)
+		self->due = present;
+
+	self->last_present = present;
+	return true;
+}
+
+uint64_t frame_clock_schedule(struct frame_clock* self, uint64_t period)
+{
+	assert(frame_clock_is_locked(self));
+
+	uint64_t interval = self->interval;
+	uint64_t base = self->last_present + period;
+
+	/* The debt is limited to half a refresh either way, so that a pause,
+	 * or a change of rate, doesn't make up for itself in a burst.
+	 */
+	uint64_t due = self->due + period;
+	due = MAX(due, base - MIN(base, interval / 2));
+	due = MIN(due, base + interval / 2);
+	self->due = due;
+
+	uint64_t ahead = due > self->last_present ?
+		due - self->last_present : 0;
+	uint64_t n = MAX((ahead + interval / 2) / interval, 1);
+
+	return self->last_present + (n - 1) * interval +
+		MIN(PHASE_MARGIN, interval / 4);
+}
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <pixman.h>
+#include <neatvnc.h>
+#include <aml.h>
+
+#include "frame-tap.h"
+#include "buffer.h"
+#include "shm-slab.h"
+#include "shm.h"
+#include "sys/queue.h"
+#include "strlcpy.h"
+#include "unix-socket.h"
+#include "logging.h"
+#include "config.h"
+
+#ifdef ENABLE_SCREENCOPY_DMABUF
+#include <gbm.h>
+#endif
+
+struct frame_tap_held {
+	uint32_t id;
+	struct wv_buffer* buffer;
+};
+
+struct frame_tap_client {
+	LIST_ENTRY(frame_tap_client) link;
+	struct frame_tap* server;
+	int fd;
+	struct aml_handler* handler;
+
+	uint32_t next_id;
+	struct frame_tap_held held[FRAME_TAP_MAX_HELD];
+	int n_held;
+
+	/* Damage since the last frame that was sent, for the geometry that
+	 * was seen last.
+	 */
+	struct pixman_region16 damage;
+	int width, height;
+	uint32_t format;
+};
+
+LIST_HEAD(frame_tap_client_list, frame_tap_client);
+
+struct frame_tap {
+	int fd;
+	char path[108];
+	struct aml_handler* handler;
+
+	struct frame_tap_client_list clients;
+	int n_clients;
+};
+
+static void frame_tap_client_destroy(void* userdata)
+{
+	struct frame_tap_client* self = userdata;
+
+	// This hands the frames back to the buffer pool
+	for (int i = 0; i < self->n_held; ++i)
+		wv_buffer_release(self->held[i].buffer);
+
+	LIST_REMOVE(self, link);
+	self->server->n_clients--;
+
+	pixman_region_fini(&self->damage);
+	close(self->fd);
+	free(self);
+}
+
+static void frame_tap_client__release(struct frame_tap_client* self,
+		uint32_t id)
+{
+	for (int i = 0; i < self->n_held; ++i) {
+		if (self->held[i].id != id)
+			continue;
+
+		struct wv_buffer* buffer = self->held[i].buffer;
+		self->held[i] = self->held[--self->n_held];
+		wv_buffer_release(buffer);
+		return;
+	}
+
+	log_debug("Frame tap client released unknown frame %"PRIu32"\n", id);
+}
+
+static void frame_tap_client__on_event(void* handler)
+{
+	struct frame_tap_client* self = aml_get_userdata(handler);
+
+	struct frame_tap_release_msg msg;
+	ssize_t ret = recv(self->fd, &msg, sizeof(msg), 0);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	if (ret <= 0) {
+		aml_stop(aml_get_default(), handler);
+		return;
+	}
+
+	if (ret == sizeof(msg) && msg.type == FRAME_TAP_MSG_RELEASE)
+		frame_tap_client__release(self, msg.id);
+}
+
+static void frame_tap__on_connection(void* handler)
+{
+	struct frame_tap* self = aml_get_userdata(handler);
+
+	int fd = accept4(self->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		log_debug("Failed to accept frame tap connection: %m\n");
+		return;
+	}
+
+	struct frame_tap_client* client = calloc(1, sizeof(*client));
+	if (!client) {
+		close(fd);
+		return;
+	}
+
+	client->server = self;
+	client->fd = fd;
+	pixman_region_init(&client->damage);
+	LIST_INSERT_HEAD(&self->clients, client, link);
+	self->n_clients++;
+
+	client->handler = aml_handler_new(fd, frame_tap_client__on_event,
+			client, frame_tap_client_destroy);
+	if (!client->handler) {
+		frame_tap_client_destroy(client);
+		return;
+	}
+
+	aml_start(aml_get_default(), client->handler);
+	aml_unref(client->handler);
+
+	log_debug("Frame tap client connected\n");
+}
+
+/* Fills in where the frame's memory is. Returns the file descriptor, which
+ * must be closed afterwards if is_owned is set, or -1 if the buffer cannot be
+ * shared.
+ */
+static int frame_tap__describe(struct frame_tap_frame_msg* msg,
+		const struct wv_buffer* buffer, bool* is_owned)
+{
+	*is_owned = false;
+
+	msg->width = buffer->width;
+	msg->height = buffer->height;
+	msg->format = buffer->format;
+
+	switch (buffer->type) {
+	case WV_BUFFER_SHM:
+		msg->buffer_type = FRAME_TAP_BUFFER_SHM;
+		msg->stride = buffer->stride;
+
+		int shm_fd = buffer->shm_fd;
+		msg->offset = 0;
+		msg->size = buffer->size;
+
+		if (buffer->slab) {
+			shm_fd = buffer->slab->fd;
+			msg->offset = shm_slab_get_offset(buffer->slab,
+					buffer->slab_slot);
+			msg->size = msg->offset + buffer->size;
+		}
+
+		if (shm_fd < 0)
+			return -1;
+
+		/* A client that could truncate the memory would make us and
+		 * the compositor crash with SIGBUS.
+		 */
+		*is_owned = true;
+		return shm_reopen_readonly(shm_fd);
+#ifdef ENABLE_SCREENCOPY_DMABUF
+	case WV_BUFFER_DMABUF:;
+		int fd = gbm_bo_get_fd(buffer->bo);
+		if (fd < 0)
+			return -1;
+
+		*is_owned = true;
+		msg->buffer_type = FRAME_TAP_BUFFER_DMABUF;
+		msg->stride = gbm_bo_get_stride(buffer->bo);
+		msg->offset = gbm_bo_get_offset(buffer->bo, 0);
+		msg->modifier = gbm_bo_get_modifier(buffer->bo);
+		msg->size = msg->offset + (uint64_t)msg->stride * buffer->height;
+		return fd;
+#endif
+	case WV_BUFFER_UNSPEC:;
+	}
+
+	return -1;
+}
+
+static int frame_tap_client__send(struct frame_tap_client* self,
+		struct frame_tap_frame_msg* msg, int fd)
+{
+	struct frame_tap_rect rects[FRAME_TAP_MAX_RECTS];
+
+	int n_rects = 0;
+	const struct pixman_box16* boxes =
+		pixman_region_rectangles(&self->damage, &n_rects);
+
+	if (n_rects > FRAME_TAP_MAX_RECTS) {
+		boxes = pixman_region_extents(&self->damage);
+		n_rects = 1;
+	}
+
+	memcpy(rects, boxes, n_rects * sizeof(*rects));
+
+	msg->id = self->next_id;
+	msg->n_rects = n_rects;
+
+	struct iovec iov[2] = {
+		{ .iov_base = msg, .iov_len = sizeof(*msg) },
+		{ .iov_base = rects, .iov_len = n_rects * sizeof(*rects) },
+	};
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr hdr = {
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+	if (sendmsg(self->fd, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+	self->next_id++;
+	return 1;
+}
+
+void frame_tap_publish(struct frame_tap* self, struct wv_buffer* buffer,
+		enum wl_output_transform transform, uint64_t time)
+{
+	if (LIST_EMPTY(&self->clients))
+		return;
+
+	struct frame_tap_frame_msg msg = {
+		.type = FRAME_TAP_MSG_FRAME,
+		.flags = buffer->y_inverted ? FRAME_TAP_Y_INVERTED : 0,
+		.transform = transform,
+		.time = time,
+	};
+
+	bool is_owned;
+	int fd = frame_tap__describe(&msg, buffer, &is_owned);
+	if (fd < 0)
+		return;
+
+	struct frame_tap_client* client = LIST_FIRST(&self->clients);
+	while (client) {
+		struct frame_tap_client* next = LIST_NEXT(client, link);
+
+		if (client->width != buffer->width ||
+		    client->height != buffer->height ||
+		    client->format != buffer->format) {
+			client->width = buffer->width;
+			client->height = buffer->height;
+			client->format = buffer->format;
+			pixman_region_fini(&client->damage);
+			pixman_region_init_rect(&client->damage, 0, 0,
+					buffer->width, buffer->height);
+		} else {
+			pixman_region_union(&client->damage, &client->damage,
+					&buffer->damage);
+			pixman_region_intersect_rect(&client->damage,
+					&client->damage, 0, 0, buffer->width,
+					buffer->height);
+		}
+
+		/* A client that is behind misses this frame, but not its
+		 * damage.
+		 */
+		int rc = client->n_held < FRAME_TAP_MAX_HELD ?
+			frame_tap_client__send(client, &msg, fd) : 0;
+
+		if (rc > 0) {
+			wv_buffer_hold(buffer);
+			client->held[client->n_held++] = (struct frame_tap_held) {
+				.id = msg.id,
+				.buffer = buffer,
+			};
+			pixman_region_clear(&client->damage);
+		} else if (rc < 0) {
+			log_debug("Failed to send frame to frame tap client: %m\n");
+			aml_stop(aml_get_default(), client->handler);
+		}
+
+		client = next;
+	}
+
+	if (is_owned)
+		close(fd);
+}
+
+int frame_tap_get_n_clients(const struct frame_tap* self)
+{
+	return self->n_clients;
+}
+
+struct frame_tap* frame_tap_new(const char* path)
+{
+	struct frame_tap* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	LIST_INIT(&self->clients);
+
+	strlcpy(self->path, path, sizeof(self->path));
+
+	self->fd = unix_socket_listen(path, SOCK_SEQPACKET);
+	if (self->fd < 0) {
+		log_error("Failed to set up frame tap socket\n");
+		goto listen_failure;
+	}
+
+	self->handler = aml_handler_new(self->fd, frame_tap__on_connection,
+			self, NULL);
+	if (!self->handler)
+		goto handler_failure;
+
+	if (aml_start(aml_get_default(), self->handler) < 0)
+		goto start_failure;
+
+	return self;
+
+start_failure:
+	aml_unref(self->handler);
+handler_failure:
+	close(self->fd);
+	unlink(path);
+listen_failure:
+	free(self);
+	return NULL;
+}
+
+void frame_tap_destroy(struct frame_tap* self)
+{
+	// Stopping a client's handler destroys it
+	while (!LIST_EMPTY(&self->clients))
+		aml_stop(aml_get_default(), LIST_FIRST(&self->clients)->handler);
+
+	aml_stop(aml_get_default(), self->handler);
+	aml_unref(self->handler);
+	close(self->fd);
+	unlink(self->path);
+	free(self);
+}
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "frame-trace.h"
+
+static size_t frame_trace__record_size(const struct frame_trace_frame* frame)
+{
+	const struct frame_trace_rect* rects = frame_trace_frame_rects(frame);
+
+	size_t size = sizeof(*frame) + frame->n_rects * sizeof(*rects);
+	for (uint32_t i = 0; i < frame->n_rects; ++i)
+		size += (size_t)(rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1) * frame->pixel_size;
+
+	return frame_trace_align(size);
+}
+
+static const struct frame_trace_frame* frame_trace__get_at(
+		const struct frame_trace* self, uint64_t offset)
+{
+	if (offset % 8 != 0 || offset > self->size ||
+	    self->size - offset < sizeof(struct frame_trace_frame))
+		return NULL;
+
+	const struct frame_trace_frame* frame =
+		(const struct frame_trace_frame*)(self->data + offset);
+
+	if (frame->magic != FRAME_TRACE_FRAME_MAGIC ||
+	    frame->pixel_size == 0 || frame->pixel_size > 16 ||
+	    frame->size > self->size - offset ||
+	    frame->n_rects > (frame->size - sizeof(*frame)) /
+			sizeof(struct frame_trace_rect))
+		return NULL;
+
+	const struct frame_trace_rect* rects = frame_trace_frame_rects(frame);
+	for (uint32_t i = 0; i < frame->n_rects; ++i)
+		if (rects[i].x1 < 0 || rects[i].y1 < 0 ||
+		    rects[i].x2 < rects[i].x1 || rects[i].y2 < rects[i].y1 ||
+		    (uint32_t)rects[i].x2 > frame->width ||
+		    (uint32_t)rects[i].y2 > frame->height)
+			return NULL;
+
+	return frame_trace__record_size(frame) == frame->size ? frame : NULL;
+}
+
+static bool frame_trace__load_index(struct frame_trace* self)
+{
+	const struct frame_trace_footer* footer;
+
+	if (self->size < sizeof(struct frame_trace_header) + sizeof(*footer))
+		return false;
+
+	footer = (const struct frame_trace_footer*)(self->data + self->size -
+			sizeof(*footer));
+	if (memcmp(footer->magic, FRAME_TRACE_INDEX_MAGIC,
+				sizeof(footer->magic)) != 0)
+		return false;
+
+	size_t index_size = self->size - sizeof(*footer) -
+		footer->index_offset;
+	if (footer->index_offset > self->size - sizeof(*footer) ||
+	    footer->index_offset % 8 != 0 ||
+	    footer->n_frames != index_size /
+			sizeof(struct frame_trace_index_entry))
+		return false;
+
+	self->index = (const struct frame_trace_index_entry*)(self->data +
+			footer->index_offset);
+	self->n_frames = footer->n_frames;
+	return true;
+}
+
+static int frame_trace__scan(struct frame_trace* self)
+{
+	const struct frame_trace_header* header =
+		(const struct frame_trace_header*)self->data;
+
+	size_t capacity = 0;
+	uint64_t offset = header->header_size;
+
+	for (;;) {
+		const struct frame_trace_frame* frame =
+			frame_trace__get_at(self, offset);
+		if (!frame)
+			break;
+
+		if (self->n_frames == capacity) {
+			capacity = capacity ? capacity * 2 : 256;
+			struct frame_trace_index_entry* index = realloc(
+					self->scanned_index,
+					capacity * sizeof(*index));
+			if (!index)
+				return -1;
+			self->scanned_index = index;
+		}
+
+		self->scanned_index[self->n_frames++] =
+			(struct frame_trace_index_entry) {
+				.offset = offset,
+				.time = frame->time,
+				.flags = frame->flags,
+				.damage_area = frame->damage_area,
+			};
+
+		offset += frame->size;
+	}
+
+	self->index = self->scanned_index;
+	return 0;
+}
+
+int frame_trace_open(struct frame_trace* self, const char* path)
+{
+	memset(self, 0, sizeof(*self));
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 ||
+	    (size_t)st.st_size < sizeof(struct frame_trace_header))
+		goto failure;
+
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		goto failure;
+
+	close(fd);
+
+	self->data = data;
+	self->size = st.st_size;
+
+	const struct frame_trace_header* header = data;
+	if (memcmp(header->magic, FRAME_TRACE_MAGIC, sizeof(header->magic)) != 0
+	    || header->version != FRAME_TRACE_VERSION
+	    || header->header_size < sizeof(*header)
+	    || header->header_size % 8 != 0)
+		goto format_failure;
+
+	if (!frame_trace__load_index(self) && frame_trace__scan(self) < 0)
+		goto format_failure;
+
+	return 0;
+
+format_failure:
+	frame_trace_close(self);
+	return -1;
+failure:
+	close(fd);
+	return -1;
+}
+
+void frame_trace_close(struct frame_trace* self)
+{
+	free(self->scanned_index);
+	if (self->data)
+		munmap((void*)self->data, self->size);
+	memset(self, 0, sizeof(*self));
+}
+
+const struct frame_trace_frame* frame_trace_get(const struct frame_trace* self,
+		uint64_t i)
+{
+	if (i >= self->n_frames)
+		return NULL;
+
+	return frame_trace__get_at(self, self->index[i].offset);
+}
+
+uint64_t frame_trace_find_keyframe(const struct frame_trace* self,
+		uint64_t time)
+{
+	// The first frame that was captured at or after the given time
+	uint64_t lo = 0, hi = self->n_frames;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (self->index[mid].time < time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == self->n_frames && lo > 0)
+		lo--;
+
+	while (lo > 0 && !(self->index[lo].flags & FRAME_TRACE_KEYFRAME))
+		lo--;
+
+	return lo;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "geometry.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static bool parse_dimension(uint32_t* dst, const char** str)
+{
+	char* end = NULL;
+
+	errno = 0;
+	unsigned long value = strtoul(*str, &end, 10);
+	if (end == *str || errno != 0 || value == 0 || value > INT32_MAX)
+		return false;
+
+	*dst = value;
+	*str = end;
+	return true;
+}
+
+static bool parse_offset(int32_t* dst, bool* from_end, const char** str)
+{
+	char sign = **str;
+	if (sign != '+' && sign != '-')
+		return false;
+
+	const char* digits = *str + 1;
+	if (*digits < '0' || *digits > '9')
+		return false;
+
+	char* end = NULL;
+
+	errno = 0;
+	unsigned long value = strtoul(digits, &end, 10);
+	if (errno != 0 || value > INT32_MAX)
+		return false;
+
+	*dst = value;
+	*from_end = sign == '-';
+	*str = end;
+	return true;
+}
+
+bool geometry_parse(struct geometry* dst, const char* str)
+{
+	struct geometry result = { 0 };
+
+	if (!parse_dimension(&result.width, &str) || *str++ != 'x' ||
+			!parse_dimension(&result.height, &str))
+		return false;
+
+	if (*str != '\0' &&
+			(!parse_offset(&result.x, &result.x_from_end, &str) ||
+			 !parse_offset(&result.y, &result.y_from_end, &str)))
+		return false;
+
+	if (*str != '\0')
+		return false;
+
+	*dst = result;
+	return true;
+}
+
+static void resolve_axis(int32_t offset, bool from_end, uint32_t size,
+		uint32_t outer_size, int32_t* pos, uint32_t* len)
+{
+	int64_t start = from_end
+		? (int64_t)outer_size - size - offset
+		: offset;
+
+	if (start < 0)
+		start = 0;
+
+	if (start >= outer_size) {
+		*pos = 0;
+		*len = 0;
+		return;
+	}
+
+	*pos = start;
+	*len = MIN(size, outer_size - start);
+}
+
+void geometry_resolve(const struct geometry* self, uint32_t outer_width,
+		uint32_t outer_height, int32_t* x, int32_t* y, uint32_t* width,
+		uint32_t* height)
+{
+	resolve_axis(self->x, self->x_from_end, self->width, outer_width,
+			x, width);
+	resolve_axis(self->y, self->y_from_end, self->height, outer_height,
+			y, height);
+}
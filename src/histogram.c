@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <string.h>
+#include <stdint.h>
+
+#include "histogram.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+void histogram_reset(struct histogram* self)
+{
+	memset(self, 0, sizeof(*self));
+}
+
+void histogram_diff(struct histogram* dst, const struct histogram* a,
+		const struct histogram* b)
+{
+	dst->count = a->count - b->count;
+	dst->sum = a->sum - b->sum;
+	dst->max = a->max;
+
+	for (int i = 0; i < HISTOGRAM_N_BUCKETS; ++i)
+		dst->buckets[i] = a->buckets[i] - b->buckets[i];
+}
+
+static uint64_t histogram__upper_bound(int bucket)
+{
+	if (bucket < HISTOGRAM_SUB_BUCKETS)
+		return bucket;
+
+	int exponent = bucket / HISTOGRAM_SUB_BUCKETS + 2;
+	int sub = bucket % HISTOGRAM_SUB_BUCKETS;
+	uint64_t width = UINT64_C(1) << (exponent - 3);
+
+	return (HISTOGRAM_SUB_BUCKETS + sub) * width + width - 1;
+}
+
+uint64_t histogram_percentile(const struct histogram* self, double fraction)
+{
+	if (self->count == 0)
+		return 0;
+
+	uint64_t rank = fraction * self->count;
+	if (rank < 1)
+		rank = 1;
+
+	uint64_t n = 0;
+	for (int i = 0; i < HISTOGRAM_N_BUCKETS; ++i) {
+		n += self->buckets[i];
+		if (n >= rank)
+			return MIN(histogram__upper_bound(i), self->max);
+	}
+
+	return self->max;
+}
+
+uint32_t histogram_count_le(const struct histogram* self, uint64_t value)
+{
+	uint32_t n = 0;
+
+	for (int i = 0; i < HISTOGRAM_N_BUCKETS; ++i) {
+		if (histogram__upper_bound(i) > value)
+			break;
+		n += self->buckets[i];
+	}
+
+	return n;
+}
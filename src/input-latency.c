@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pixman.h>
+
+#include "input-latency.h"
+#include "histogram.h"
+
+static void input_latency__drop(struct input_latency* self, int n)
+{
+	self->n_pending -= n;
+	memmove(self->pending, self->pending + n,
+			self->n_pending * sizeof(*self->pending));
+}
+
+static void input_latency__expire(struct input_latency* self, uint64_t now)
+{
+	int n = 0;
+	while (n < self->n_pending &&
+			self->pending[n].time + INPUT_LATENCY_TIMEOUT < now)
+		++n;
+
+	self->n_expired += n;
+	input_latency__drop(self, n);
+}
+
+void input_latency_add(struct input_latency* self, uint64_t time,
+		bool has_position, int32_t x, int32_t y)
+{
+	input_latency__expire(self, time);
+
+	if (self->n_pending == INPUT_LATENCY_MAX_EVENTS) {
+		self->n_expired++;
+		input_latency__drop(self, 1);
+	}
+
+	self->pending[self->n_pending++] = (struct input_latency_event) {
+		.time = time,
+		.has_position = has_position,
+		.x = x,
+		.y = y,
+	};
+}
+
+static bool input_latency__is_shown(const struct input_latency_event* event,
+		struct pixman_region16* damage)
+{
+	if (!event->has_position)
+		return pixman_region_not_empty(damage);
+
+	int32_t half = INPUT_LATENCY_POINTER_AREA / 2;
+	struct pixman_box16 box = {
+		.x1 = event->x - half,
+		.y1 = event->y - half,
+		.x2 = event->x + half,
+		.y2 = event->y + half,
+	};
+
+	return pixman_region_contains_rectangle(damage, &box) !=
+		PIXMAN_REGION_OUT;
+}
+
+void input_latency_capture(struct input_latency* self,
+		struct pixman_region16* damage, uint64_t capture_time)
+{
+	input_latency__expire(self, capture_time);
+
+	// Find the latest event that happened before the frame and shows in it
+	int n = 0;
+	for (int i = 0; i < self->n_pending; ++i) {
+		const struct input_latency_event* event = &self->pending[i];
+		if (event->time > capture_time)
+			break;
+
+		if (input_latency__is_shown(event, damage))
+			n = i + 1;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		uint64_t time = self->pending[i].time;
+
+		if (self->capture_histogram)
+			histogram_add(self->capture_histogram,
+					capture_time - time);
+
+		if (self->n_captured < INPUT_LATENCY_MAX_EVENTS)
+			self->captured[self->n_captured++] = time;
+	}
+
+	input_latency__drop(self, n);
+}
+
+void input_latency_feed(struct input_latency* self, uint64_t feed_time)
+{
+	if (self->feed_histogram)
+		for (int i = 0; i < self->n_captured; ++i)
+			histogram_add(self->feed_histogram,
+					feed_time - self->captured[i]);
+
+	self->n_captured = 0;
+}
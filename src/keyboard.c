@@ -32,16 +32,9 @@
 #include "keyboard.h"
 #include "shm.h"
 #include "logging.h"
-#include "intset.h"
 
 #define MAYBE_UNUSED __attribute__((unused))
 
-struct table_entry {
-	xkb_keysym_t symbol;
-	xkb_keycode_t code;
-	int level;
-};
-
 struct kb_mods {
 	xkb_mod_mask_t depressed, latched, locked;
 };
@@ -96,12 +89,44 @@ static int compare_symbols(const void* a, const void* b)
 	return x->symbol < y->symbol ? -1 : x->symbol > y->symbol;
 }
 
-static int compare_symbols2(const void* a, const void* b)
+static uint32_t hash_symbol(xkb_keysym_t symbol)
 {
-	const struct table_entry* x = a;
-	const struct table_entry* y = b;
+	/* Fibonacci hashing; keysyms are mostly small and dense */
+	return symbol * UINT32_C(2654435761);
+}
 
-	return x->symbol < y->symbol ? -1 : x->symbol > y->symbol;
+static int create_symbol_index(struct keyboard* self)
+{
+	size_t n_symbols = 0;
+	for (size_t i = 0; i < self->lookup_table_length; i++)
+		if (i == 0 || self->lookup_table[i - 1].symbol !=
+				self->lookup_table[i].symbol)
+			n_symbols++;
+
+	/* Keep the load factor at or below one half */
+	size_t size = 16;
+	while (size < n_symbols * 2)
+		size *= 2;
+
+	self->symbol_index = calloc(size, sizeof(*self->symbol_index));
+	if (!self->symbol_index)
+		return -1;
+
+	self->symbol_index_mask = size - 1;
+
+	for (size_t i = 0; i < self->lookup_table_length; i++) {
+		xkb_keysym_t symbol = self->lookup_table[i].symbol;
+		if (i != 0 && self->lookup_table[i - 1].symbol == symbol)
+			continue;
+
+		uint32_t slot = hash_symbol(symbol) & self->symbol_index_mask;
+		while (self->symbol_index[slot])
+			slot = (slot + 1) & self->symbol_index_mask;
+
+		self->symbol_index[slot] = i + 1;
+	}
+
+	return 0;
 }
 
 static int create_lookup_table(struct keyboard* self)
@@ -116,9 +141,17 @@ static int create_lookup_table(struct keyboard* self)
 
 	xkb_keymap_key_for_each(self->keymap, key_iter, self);
 
+	/* Entries for the same symbol end up next to each other, ordered by
+	 * level.
+	 */
 	qsort(self->lookup_table, self->lookup_table_length,
 	      sizeof(*self->lookup_table), compare_symbols);
 
+	if (create_symbol_index(self) < 0) {
+		free(self->lookup_table);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -140,8 +173,7 @@ static void keyboard__dump_entry(const struct keyboard* self,
 	const char* code_name MAYBE_UNUSED =
 		xkb_keymap_key_get_name(self->keymap, entry->code);
 
-	bool is_pressed MAYBE_UNUSED =
-		intset_is_set(&self->key_state, entry->code);
+	bool is_pressed MAYBE_UNUSED = keyboard_is_pressed(self, entry->code);
 
 	log_debug("symbol=%s level=%d code=%s %s\n", sym_name, entry->level,
 	          code_name, is_pressed ? "pressed" : "released");
@@ -159,8 +191,7 @@ int keyboard_init(struct keyboard* self, const struct xkb_rule_names* rule_names
 	if (!self->context)
 		return -1;
 
-	if (intset_init(&self->key_state, 0) < 0)
-		goto key_state_failure;
+	memset(self->key_state, 0, sizeof(self->key_state));
 
 	self->keymap = xkb_keymap_new_from_names(self->context, rule_names, 0);
 	if (!self->keymap)
@@ -215,43 +246,49 @@ write_failure:
 fd_failure:
 	free(keymap_string);
 keymap_string_failure:
+	free(self->symbol_index);
 	free(self->lookup_table);
 table_failure:
 	xkb_state_unref(self->state);
 state_failure:
 	xkb_keymap_unref(self->keymap);
 keymap_failure:
-	intset_destroy(&self->key_state);
-key_state_failure:
 	xkb_context_unref(self->context);
 	return -1;
 }
 
 void keyboard_destroy(struct keyboard* self)
 {
+	free(self->symbol_index);
 	free(self->lookup_table);
 	xkb_state_unref(self->state);
 	xkb_keymap_unref(self->keymap);
-	intset_destroy(&self->key_state);
 	xkb_context_unref(self->context);
 }
 
 struct table_entry* keyboard_find_symbol(const struct keyboard* self,
                                          xkb_keysym_t symbol)
 {
-	struct table_entry cmp = { .symbol = symbol };
+	uint32_t slot = hash_symbol(symbol) & self->symbol_index_mask;
 
-	struct table_entry* entry =
-		bsearch(&cmp, self->lookup_table, self->lookup_table_length,
-		        sizeof(*self->lookup_table), compare_symbols2);
+	while (self->symbol_index[slot]) {
+		struct table_entry* entry =
+			&self->lookup_table[self->symbol_index[slot] - 1];
+		if (entry->symbol == symbol)
+			return entry;
+
+		slot = (slot + 1) & self->symbol_index_mask;
+	}
 
-	if (!entry)
-		return NULL;
+	return NULL;
+}
 
-	while (entry != self->lookup_table && (entry - 1)->symbol == symbol)
-		--entry;
+bool keyboard_is_pressed(const struct keyboard* self, xkb_keycode_t code)
+{
+	if (code >= KEYBOARD_MAX_KEYCODE)
+		return false;
 
-	return entry;
+	return !!(self->key_state[code / 64] & (UINT64_C(1) << (code % 64)));
 }
 
 static void keyboard_send_mods(struct keyboard* self)
@@ -380,14 +417,20 @@ static void send_key_with_level(struct keyboard* self, xkb_keycode_t code,
 static bool update_key_state(struct keyboard* self, xkb_keycode_t code,
 		bool is_pressed)
 {
-	bool was_pressed = intset_is_set(&self->key_state, code);
+	if (code >= KEYBOARD_MAX_KEYCODE) {
+		log_error("Key code out of range: %u\n", code);
+		return false;
+	}
+
+	uint64_t bit = UINT64_C(1) << (code % 64);
+	bool was_pressed = !!(self->key_state[code / 64] & bit);
 	if (was_pressed == is_pressed)
 		return false;
 
 	if (is_pressed)
-		intset_set(&self->key_state, code);
+		self->key_state[code / 64] |= bit;
 	else
-		intset_clear(&self->key_state, code);
+		self->key_state[code / 64] &= ~bit;
 
 	return true;
 }
@@ -436,3 +479,10 @@ void keyboard_feed_code(struct keyboard* self, xkb_keycode_t code,
 		send_key(self, code, is_pressed);
 	}
 }
+
+void keyboard_release_all(struct keyboard* self)
+{
+	for (xkb_keycode_t code = 0; code < KEYBOARD_MAX_KEYCODE; ++code)
+		if (keyboard_is_pressed(self, code))
+			keyboard_feed_code(self, code, false);
+}
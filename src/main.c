@@ -24,6 +24,7 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <math.h>
 #include <neatvnc.h>
 #include <aml.h>
 #include <signal.h>
@@ -34,8 +35,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include "wlr-screencopy-unstable-v1.h"
+#include "wlr-export-dmabuf-unstable-v1.h"
 #include "wlr-virtual-pointer-unstable-v1.h"
 #include "virtual-keyboard-unstable-v1.h"
 #include "xdg-output-unstable-v1.h"
@@ -50,6 +54,22 @@
 #include "seat.h"
 #include "cfg.h"
 #include "transform-util.h"
+#include "damage-util.h"
+#include "desktop.h"
+#include "capture-thread.h"
+#include "prerotate.h"
+#include "cursor.h"
+#include "geometry.h"
+#include "pixels.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "ctl-server.h"
+#include "systemd.h"
+#include "thread-sched.h"
+#include "recorder.h"
+#include "input-latency.h"
+#include "frame-tap.h"
+#include "time-util.h"
 #include "usdt.h"
 
 #ifdef ENABLE_PAM
@@ -63,9 +83,35 @@
 
 #define DEFAULT_ADDRESS "127.0.0.1"
 #define DEFAULT_PORT 5900
+#define DEFAULT_FPS_RISE_TIME 100 // ms
+#define DEFAULT_FPS_FALL_TIME 2000 // ms
+#define DEFAULT_DAMAGE_MAX_WASTE 25 // %
+#define DEFAULT_DAMAGE_MAX_RECTS 32
+#define DEFAULT_POOL_IDLE_TIMEOUT 30 // s
+#define DEFAULT_PAM_MAX_ATTEMPTS 4
+#define DEFAULT_PAM_TIMEOUT 5 // s
 
 #define MAYBE_UNUSED __attribute__((unused))
 
+struct wayvnc_latency {
+	struct histogram wait;
+	struct histogram capture;
+	struct histogram present;
+	struct histogram process;
+	struct histogram hold;
+	struct histogram input_capture;
+	struct histogram input_feed;
+	struct histogram dispatch;
+};
+
+/* Cumulative counters for the traffic to and from the compositor */
+struct wayvnc_wayland_stats {
+	uint64_t n_events;
+	uint64_t n_flushes;
+	uint64_t n_flushed_bytes;
+	uint64_t n_flush_stalls;
+};
+
 struct wayvnc {
 	bool do_exit;
 
@@ -79,10 +125,38 @@ struct wayvnc {
 	struct zwp_virtual_keyboard_manager_v1* keyboard_manager;
 	struct zwlr_virtual_pointer_manager_v1* pointer_manager;
 
-	const struct output* selected_output;
+	struct output* selected_output;
 	const struct seat* selected_seat;
 
 	struct screencopy screencopy;
+	struct desktop* desktop;
+
+	/* Only used if capturing runs on its own thread */
+	bool use_capture_thread;
+	struct capture_thread capture_thread;
+
+	/* Only this part of the selected output is captured, if set */
+	bool has_region;
+	struct geometry region;
+
+	/* Where the region currently is, in the output's transformed buffer
+	 * pixels. Captured frames and pointer events from clients are in
+	 * these. Only valid if use_region is set.
+	 */
+	bool use_region;
+	int32_t region_x, region_y;
+	uint32_t region_width, region_height;
+
+	/* Set if transformed frames are copied into upright buffers */
+	bool use_prerotate;
+	struct prerotate prerotate;
+
+	/* Every captured frame is written to a trace file, if set */
+	struct recorder* recorder;
+
+	/* Captured frames are shared with local processes, if set */
+	struct frame_tap* frame_tap;
+
 	struct pointer pointer_backend;
 	struct keyboard keyboard_backend;
 	struct data_control data_control;
@@ -90,6 +164,13 @@ struct wayvnc {
 	struct aml_handler* wayland_handler;
 	struct aml_signal* signal_handler;
 
+	/* Requests are flushed once per main loop iteration. If the socket is
+	 * full, the rest goes out once it becomes writable again.
+	 */
+	bool is_flush_blocked;
+	struct wayvnc_wayland_stats wayland_stats;
+	struct wayvnc_wayland_stats wayland_stats_snapshot;
+
 	struct nvnc* nvnc;
 	struct nvnc_display* nvnc_display;
 
@@ -98,10 +179,57 @@ struct wayvnc {
 
 	uint32_t damage_area_sum;
 	uint32_t n_frames_captured;
+	uint32_t n_rects_reported_sum;
+	uint32_t n_rects_fed_sum;
+
+	/* Per-stage latencies, which are only collected when performance
+	 * counters are shown or metrics are exported. They are cumulative;
+	 * the performance counters show the difference to the snapshot that
+	 * was taken at the previous tick.
+	 */
+	bool show_performance;
+	bool use_json_performance;
+	bool collect_latency;
+	struct wayvnc_latency latency;
+	struct wayvnc_latency latency_snapshot;
+
+	/* Input events are matched with the frames that show them, while
+	 * latencies are being collected.
+	 */
+	struct input_latency input_latency;
+
+	struct aml_ticker* performance_ticker;
+
+	/* Settings can be changed at runtime through the control socket */
+	struct ctl_server* ctl_server;
+	const char* cfg_path;
+
+	// Cumulative counters for the metrics endpoint
+	struct metrics_server* metrics_server;
+
+	struct thread_sched main_sched;
+	struct thread_sched worker_sched;
+	struct thread_sched capture_sched;
+	uint64_t damage_area_total;
+	uint64_t n_pointer_events;
+	uint64_t n_key_events;
+
+	/* Time to first frame. The first is measured from startup and the
+	 * second from the moment that the first client of a session connects.
+	 * Both are in microseconds and 0 until they have been measured.
+	 */
+	uint64_t start_time;
+	uint64_t first_frame_latency;
+	uint64_t connect_time;
+	uint64_t connect_frame_latency;
+
+	int nr_clients;
 };
 
 void wayvnc_exit(struct wayvnc* self);
 void on_capture_done(struct screencopy* sc);
+int wayvnc_start_capture_immediate(struct wayvnc* self);
+void wayvnc_stop_capture(struct wayvnc* self);
 
 #if defined(GIT_VERSION)
 static const char wayvnc_version[] = GIT_VERSION;
@@ -132,6 +260,20 @@ static void registry_add(void* data, struct wl_registry* registry,
 			return;
 
 		wl_list_insert(&self->outputs, &output->link);
+
+		// Outputs that appear during startup are set up later
+		if (!self->desktop)
+			return;
+
+		if (self->xdg_output_manager)
+			output_set_xdg_output(output,
+					zxdg_output_manager_v1_get_xdg_output(
+						self->xdg_output_manager,
+						wl_output));
+
+		log_debug("New output. Adding it to the desktop...\n");
+		if (desktop_add_output(self->desktop, output) < 0)
+			log_error("Failed to add new output to the desktop\n");
 		return;
 	}
 
@@ -155,6 +297,14 @@ static void registry_add(void* data, struct wl_registry* registry,
 		return;
 	}
 
+	if (strcmp(interface, zwlr_export_dmabuf_manager_v1_interface.name) == 0) {
+		self->screencopy.export_dmabuf.manager =
+			wl_registry_bind(registry, id,
+					 &zwlr_export_dmabuf_manager_v1_interface,
+					 1);
+		return;
+	}
+
 	if (strcmp(interface, zwlr_virtual_pointer_manager_v1_interface.name) == 0) {
 		self->pointer_manager =
 			wl_registry_bind(registry, id,
@@ -207,6 +357,9 @@ static void registry_remove(void* data, struct wl_registry* registry,
 
 	struct output* out = output_find_by_id(&self->outputs, id);
 	if (out) {
+		if (self->desktop)
+			desktop_remove_output(self->desktop, out);
+
 		wl_list_remove(&out->link);
 		output_destroy(out);
 
@@ -274,6 +427,9 @@ static int init_render_node(int* fd)
 
 void wayvnc_destroy(struct wayvnc* self)
 {
+	if (self->recorder)
+		recorder_destroy(self->recorder);
+
 	cfg_destroy(&self->cfg);
 
 	output_list_destroy(&self->outputs);
@@ -292,6 +448,9 @@ void wayvnc_destroy(struct wayvnc* self)
 
 	if (self->screencopy.manager)
 		zwlr_screencopy_manager_v1_destroy(self->screencopy.manager);
+	if (self->screencopy.export_dmabuf.manager)
+		zwlr_export_dmabuf_manager_v1_destroy(
+				self->screencopy.export_dmabuf.manager);
 	if (self->data_control.manager)
 		zwlr_data_control_manager_v1_destroy(self->data_control.manager);
 
@@ -364,14 +523,79 @@ failure:
 	return -1;
 }
 
+static void wayvnc_flush_display(struct wayvnc* self)
+{
+	int rc = wl_display_flush(self->display);
+	if (rc > 0) {
+		self->wayland_stats.n_flushes++;
+		self->wayland_stats.n_flushed_bytes += rc;
+	}
+
+	bool is_blocked = rc < 0 && errno == EAGAIN;
+	if (is_blocked == self->is_flush_blocked)
+		return;
+
+	/* Errors other than a full socket show up when reading */
+	self->is_flush_blocked = is_blocked;
+	if (is_blocked)
+		self->wayland_stats.n_flush_stalls++;
+
+	aml_set_event_mask(self->wayland_handler, is_blocked ?
+			AML_EVENT_READ | AML_EVENT_WRITE : AML_EVENT_READ);
+}
+
+/* Sends out everything that was queued up during this iteration of the main
+ * loop at once.
+ */
+static void wayvnc_flush(struct wayvnc* self)
+{
+	pointer_flush(&self->pointer_backend);
+	if (self->use_capture_thread)
+		capture_thread_flush(&self->capture_thread);
+
+	if (!self->is_flush_blocked)
+		wayvnc_flush_display(self);
+}
+
+static void wayvnc_dispatch_pending(struct wayvnc* self)
+{
+	int n = wl_display_dispatch_pending(self->display);
+	if (n < 0)
+		log_error("Failed to dispatch pending\n");
+	else
+		self->wayland_stats.n_events += n;
+}
+
 void on_wayland_event(void* obj)
 {
 	struct wayvnc* self = aml_get_userdata(obj);
+	enum aml_event revents = aml_get_revents(obj);
+
+	if (revents & AML_EVENT_WRITE)
+		wayvnc_flush_display(self);
+
+	if (!(revents & AML_EVENT_READ))
+		return;
 
-	int rc MAYBE_UNUSED = wl_display_prepare_read(self->display);
-	assert(rc == 0);
+	uint64_t start_time = self->collect_latency ? gettime_us() : 0;
 
-	if (wl_display_read_events(self->display) < 0) {
+	/* The capture thread may have read events for this queue already */
+	while (wl_display_prepare_read(self->display) != 0)
+		wayvnc_dispatch_pending(self);
+
+	/* wl_display_read_events() waits for every prepared reader. If the
+	 * capture thread got to the data first, it has prepared again and
+	 * won't read until the compositor sends more. Only data that is
+	 * readable right now is sure to wake it up as well.
+	 */
+	struct pollfd pfd = {
+		.fd = wl_display_get_fd(self->display),
+		.events = POLLIN,
+	};
+	if (poll(&pfd, 1, 0) != 1) {
+		wl_display_cancel_read(self->display);
+	} else if (wl_display_read_events(self->display) < 0 &&
+			errno != EAGAIN) {
 		if (errno == EPIPE || errno == ECONNRESET) {
 			log_error("Compositor has gone away. Exiting...\n");
 			wayvnc_exit(self);
@@ -380,8 +604,11 @@ void on_wayland_event(void* obj)
 		}
 	}
 
-	if (wl_display_dispatch_pending(self->display) < 0)
-		log_error("Failed to dispatch pending\n");
+	wayvnc_dispatch_pending(self);
+
+	if (self->collect_latency)
+		histogram_add(&self->latency.dispatch,
+				gettime_us() - start_time);
 }
 
 void wayvnc_exit(struct wayvnc* self)
@@ -410,6 +637,14 @@ int init_main_loop(struct wayvnc* self)
 	if (rc < 0)
 		return -1;
 
+	// The main loop holds on to it from here on
+	self->wayland_handler = wl_handler;
+
+	/* Clipboard readers may go away mid-transfer. The write errors are
+	 * handled where they happen.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+
 	struct aml_signal* sig;
 	sig = aml_signal_new(SIGINT, on_signal, self, NULL);
 	if (!sig)
@@ -423,6 +658,30 @@ int init_main_loop(struct wayvnc* self)
 	return 0;
 }
 
+/* Pointer positions are in output buffer coordinates. If only a region is
+ * captured, they are made relative to it, which is where the damage of the
+ * captured frames is.
+ */
+static void wayvnc_add_input_event(struct wayvnc* self, bool has_position,
+		uint32_t x, uint32_t y)
+{
+	int32_t px = x, py = y;
+
+	if (has_position && self->use_region && self->selected_output) {
+		uint32_t x0, y0, x1, y1;
+		output_transform_box_coord(self->selected_output,
+				self->region_x, self->region_y,
+				self->region_x + self->region_width,
+				self->region_y + self->region_height,
+				&x0, &y0, &x1, &y1);
+		px -= x0;
+		py -= y0;
+	}
+
+	input_latency_add(&self->input_latency, gettime_us(), has_position,
+			px, py);
+}
+
 static void on_pointer_event(struct nvnc_client* client, uint16_t x, uint16_t y,
 			     enum nvnc_button_mask button_mask)
 {
@@ -431,8 +690,26 @@ static void on_pointer_event(struct nvnc_client* client, uint16_t x, uint16_t y,
 	struct nvnc* nvnc = nvnc_client_get_server(client);
 	struct wayvnc* wayvnc = nvnc_get_userdata(nvnc);
 
-	uint32_t xfx = 0, xfy = 0;
-	output_transform_coord(wayvnc->selected_output, x, y, &xfx, &xfy);
+	DTRACE_PROBE3(wayvnc, pointer_event, x, y, button_mask);
+
+	wayvnc->n_pointer_events++;
+
+	uint32_t ux = x, uy = y;
+	if (wayvnc->use_prerotate)
+		prerotate_unscale_coord(&wayvnc->prerotate, x, y, &ux, &uy);
+
+	if (wayvnc->use_region) {
+		ux += wayvnc->region_x;
+		uy += wayvnc->region_y;
+	}
+
+	uint32_t xfx = ux, xfy = uy;
+	if (wayvnc->selected_output)
+		output_transform_coord(wayvnc->selected_output, ux, uy,
+				&xfx, &xfy);
+
+	if (wayvnc->collect_latency && !wayvnc->desktop)
+		wayvnc_add_input_event(wayvnc, true, xfx, xfy);
 
 	pointer_set(&wayvnc->pointer_backend, xfx, xfy, button_mask);
 }
@@ -443,6 +720,12 @@ static void on_key_event(struct nvnc_client* client, uint32_t symbol,
 	struct nvnc* nvnc = nvnc_client_get_server(client);
 	struct wayvnc* wayvnc = nvnc_get_userdata(nvnc);
 
+	DTRACE_PROBE2(wayvnc, key_event, symbol, is_pressed);
+
+	wayvnc->n_key_events++;
+	if (wayvnc->collect_latency && !wayvnc->desktop && is_pressed)
+		wayvnc_add_input_event(wayvnc, false, 0, 0);
+
 	keyboard_feed(&wayvnc->keyboard_backend, symbol, is_pressed);
 }
 
@@ -452,13 +735,49 @@ static void on_key_code_event(struct nvnc_client* client, uint32_t code,
 	struct nvnc* nvnc = nvnc_client_get_server(client);
 	struct wayvnc* wayvnc = nvnc_get_userdata(nvnc);
 
+	DTRACE_PROBE2(wayvnc, key_code_event, code, is_pressed);
+
+	wayvnc->n_key_events++;
+	if (wayvnc->collect_latency && !wayvnc->desktop && is_pressed)
+		wayvnc_add_input_event(wayvnc, false, 0, 0);
+
 	keyboard_feed_code(&wayvnc->keyboard_backend, code + 8, is_pressed);
 }
 
+static void on_client_cleanup(struct nvnc_client* client)
+{
+	struct nvnc* nvnc = nvnc_client_get_server(client);
+	struct wayvnc* self = nvnc_get_userdata(nvnc);
+
+	assert(self->nr_clients > 0);
+
+	if (--self->nr_clients > 0)
+		return;
+
+	log_debug("Last client disconnected. Stopping frame capturer...\n");
+	wayvnc_stop_capture(self);
+}
+
+static void on_new_client(struct nvnc_client* client)
+{
+	struct nvnc* nvnc = nvnc_client_get_server(client);
+	struct wayvnc* self = nvnc_get_userdata(nvnc);
+
+	nvnc_set_client_cleanup_fn(client, on_client_cleanup);
+
+	if (self->nr_clients++ > 0)
+		return;
+
+	log_debug("First client connected. Starting frame capturer...\n");
+	self->connect_time = gettime_us();
+	wayvnc_start_capture_immediate(self);
+}
+
 static void on_client_cut_text(struct nvnc* server, const char* text, uint32_t len)
 {
 	struct wayvnc* wayvnc = nvnc_get_userdata(server);
 
+	DTRACE_PROBE1(wayvnc, clipboard_from_client, len);
 	data_control_to_clipboard(&wayvnc->data_control, text, len);
 }
 
@@ -479,9 +798,28 @@ bool on_auth(const char* username, const char* password, void* ud)
 	return true;
 }
 
-int init_nvnc(struct wayvnc* self, const char* addr, uint16_t port, bool is_unix)
+static struct nvnc* wayvnc_open_server(const char* addr, uint16_t port,
+		bool is_unix, int listen_fd)
+{
+#ifdef HAVE_NVNC_OPEN_FROM_FD
+	if (listen_fd >= 0) {
+		log_debug("Using socket from the service manager\n");
+		return nvnc_open_from_fd(listen_fd);
+	}
+#else
+	if (listen_fd >= 0) {
+		log_warning("Socket activation is not supported by this build. Ignoring the socket from the service manager.\n");
+		close(listen_fd);
+	}
+#endif
+
+	return is_unix ? nvnc_open_unix(addr) : nvnc_open(addr, port);
+}
+
+int init_nvnc(struct wayvnc* self, const char* addr, uint16_t port, bool is_unix,
+		int listen_fd)
 {
-	self->nvnc = is_unix ? nvnc_open_unix(addr) : nvnc_open(addr, port);
+	self->nvnc = wayvnc_open_server(addr, port, is_unix, listen_fd);
 	if (!self->nvnc) {
 		log_error("Failed to bind to address\n");
 		return -1;
@@ -497,6 +835,19 @@ int init_nvnc(struct wayvnc* self, const char* addr, uint16_t port, bool is_unix
 
 	nvnc_set_name(self->nvnc, "WayVNC");
 
+#ifdef ENABLE_PAM
+	/* neatvnc needs the answer before on_auth() returns, so the main loop
+	 * still waits for PAM, but only for so long.
+	 */
+	if (self->cfg.enable_pam)
+		pam_auth_set_limits(self->cfg.pam_max_attempts ?
+				self->cfg.pam_max_attempts :
+				DEFAULT_PAM_MAX_ATTEMPTS,
+				1000 * (self->cfg.pam_timeout ?
+					self->cfg.pam_timeout :
+					DEFAULT_PAM_TIMEOUT));
+#endif
+
 	if (self->cfg.enable_auth &&
 	    nvnc_enable_auth(self->nvnc, self->cfg.private_key_file,
 	                     self->cfg.certificate_file, on_auth, self) < 0) {
@@ -513,6 +864,7 @@ int init_nvnc(struct wayvnc* self, const char* addr, uint16_t port, bool is_unix
 	}
 
 	nvnc_set_cut_text_receive_fn(self->nvnc, on_client_cut_text);
+	nvnc_set_new_client_fn(self->nvnc, on_new_client);
 
 	return 0;
 
@@ -523,6 +875,11 @@ failure:
 
 int wayvnc_start_capture(struct wayvnc* self)
 {
+	if (self->use_capture_thread) {
+		capture_thread_send(&self->capture_thread, CAPTURE_START);
+		return 0;
+	}
+
 	int rc = screencopy_start(&self->screencopy);
 	if (rc < 0) {
 		log_error("Failed to start capture. Exiting...\n");
@@ -533,7 +890,18 @@ int wayvnc_start_capture(struct wayvnc* self)
 
 int wayvnc_start_capture_immediate(struct wayvnc* self)
 {
-	int rc = screencopy_start_immediate(&self->screencopy);
+	if (self->use_capture_thread) {
+		capture_thread_send(&self->capture_thread,
+				CAPTURE_START_IMMEDIATE);
+		return 0;
+	}
+
+	/* The frame that is requested at startup may still be underway */
+	if (!self->desktop && self->screencopy.status == SCREENCOPY_IN_PROGRESS)
+		return 0;
+
+	int rc = self->desktop ? desktop_start(self->desktop) :
+		screencopy_start_immediate(&self->screencopy);
 	if (rc < 0) {
 		log_error("Failed to start capture. Exiting...\n");
 		wayvnc_exit(self);
@@ -541,43 +909,173 @@ int wayvnc_start_capture_immediate(struct wayvnc* self)
 	return rc;
 }
 
-// TODO: Handle transform change too
+void wayvnc_stop_capture(struct wayvnc* self)
+{
+	if (self->use_capture_thread)
+		capture_thread_send(&self->capture_thread, CAPTURE_STOP);
+	else if (self->desktop)
+		desktop_stop(self->desktop);
+	else
+		screencopy_stop(&self->screencopy);
+}
+
+/* Works out the capture settings for the selected output. The screencopy
+ * itself may be running on the capture thread, so it is left for the caller to
+ * apply them.
+ */
+static void wayvnc_get_capture_config(struct wayvnc* self,
+		struct screencopy_config* config)
+{
+	const struct output* output = self->selected_output;
+
+	*config = (struct screencopy_config){ 0 };
+	self->use_region = false;
+
+	if (!output)
+		return;
+
+	config->frame_interval = output_get_refresh_interval(output);
+
+	if (!self->has_region)
+		return;
+
+	uint32_t pixel_width = output_get_transformed_width(output);
+	uint32_t pixel_height = output_get_transformed_height(output);
+
+	/* Without xdg-output, the scale is assumed to be 1 */
+	uint32_t logical_width = output->logical_width ?
+		output->logical_width : pixel_width;
+	uint32_t logical_height = output->logical_height ?
+		output->logical_height : pixel_height;
+
+	int32_t x, y;
+	uint32_t width, height;
+	geometry_resolve(&self->region, logical_width, logical_height, &x, &y,
+			&width, &height);
+
+	if (width == 0 || height == 0 || logical_width == 0 ||
+			logical_height == 0) {
+		log_warning("Capture region is outside of the output. Capturing the whole output instead.\n");
+		return;
+	}
+
+	config->use_region = true;
+	config->region_x = x;
+	config->region_y = y;
+	config->region_width = width;
+	config->region_height = height;
+
+	/* The compositor scales the region by the same factor when it copies
+	 * it out.
+	 */
+	double sx = (double)pixel_width / logical_width;
+	double sy = (double)pixel_height / logical_height;
+
+	self->use_region = true;
+	self->region_x = round(x * sx);
+	self->region_y = round(y * sy);
+	self->region_width = round(width * sx);
+	self->region_height = round(height * sy);
+}
+
+static void wayvnc_reconfigure_capture(struct wayvnc* self)
+{
+	/* An anchored region may have moved along with the output's edges */
+	struct screencopy_config config;
+	wayvnc_get_capture_config(self, &config);
+
+	/* The capture thread restarts capturing by itself, if needed */
+	if (self->use_capture_thread) {
+		capture_thread_reconfigure(&self->capture_thread, &config);
+		return;
+	}
+
+	screencopy_configure(&self->screencopy, &config);
+	screencopy_reconfigure(&self->screencopy);
+
+	/* A capture that is in progress picks up the new geometry by itself */
+	if (self->nr_clients > 0 &&
+	    self->screencopy.status != SCREENCOPY_IN_PROGRESS)
+		wayvnc_start_capture(self);
+}
+
 void on_output_dimension_change(struct output* output)
 {
 	struct wayvnc* self = output->userdata;
-	assert(self->selected_output == output);
+	if (self->selected_output != output)
+		return;
 
-	log_debug("Output dimensions changed. Restarting frame capturer...\n");
+	log_debug("Output dimensions changed. Reconfiguring frame capturer...\n");
+	wayvnc_reconfigure_capture(self);
+}
 
-	screencopy_stop(&self->screencopy);
-	wayvnc_start_capture_immediate(self);
+void on_output_transform_change(struct output* output)
+{
+	struct wayvnc* self = output->userdata;
+	if (self->selected_output != output)
+		return;
+
+	/* The transform is applied to each frame as it is fed to neatvnc */
+	log_debug("Output transform changed. Reconfiguring frame capturer...\n");
+	wayvnc_reconfigure_capture(self);
 }
 
-static uint32_t calculate_region_area(struct pixman_region16* region)
+/* Called whenever a frame is fed to the display */
+static void wayvnc_record_frame_time(struct wayvnc* self)
 {
-	uint32_t area = 0;
+	uint64_t now = gettime_us();
+
+	if (!self->first_frame_latency)
+		self->first_frame_latency = now - self->start_time;
+
+	if (self->connect_time) {
+		self->connect_frame_latency = now - self->connect_time;
+		self->connect_time = 0;
+	}
+}
+
+static void wayvnc_coalesce_damage(struct wayvnc* self,
+		struct pixman_region16* damage, int width, int height)
+{
+	self->n_rects_reported_sum += pixman_region_n_rects(damage);
+
+	if (self->cfg.damage_tile_size > 0) {
+		int max_waste = self->cfg.damage_max_waste ?
+			self->cfg.damage_max_waste : DEFAULT_DAMAGE_MAX_WASTE;
+		int max_rects = self->cfg.damage_max_rects ?
+			self->cfg.damage_max_rects : DEFAULT_DAMAGE_MAX_RECTS;
 
-	int n_rects = 0;
-	struct pixman_box16* rects = pixman_region_rectangles(region,
-		&n_rects);
+		damage_coalesce(damage, damage, self->cfg.damage_tile_size,
+				max_waste, max_rects);
 
-	for (int i = 0; i < n_rects; ++i) {
-		int width = rects[i].x2 - rects[i].x1;
-		int height = rects[i].y2 - rects[i].y1;
-		area += width * height;
+		// The tile grid may reach past the edges of the buffer
+		pixman_region_intersect_rect(damage, damage, 0, 0, width,
+				height);
 	}
 
-	return area;
+	self->n_rects_fed_sum += pixman_region_n_rects(damage);
 }
 
-void wayvnc_process_frame(struct wayvnc* self)
+void wayvnc_process_frame(struct wayvnc* self, struct wv_buffer* buffer,
+		uint64_t capture_time)
 {
-	struct wv_buffer* buffer = self->screencopy.back;
-	self->screencopy.back = NULL;
+	DTRACE_PROBE1(wayvnc, process_frame_start, self);
 
+	if (self->recorder)
+		recorder_add_frame(self->recorder, buffer,
+				self->selected_output->transform, capture_time);
+
+	/* This goes before feeding, so that the buffer is held before the
+	 * encoder gets a chance to release it.
+	 */
+	if (self->frame_tap)
+		frame_tap_publish(self->frame_tap, buffer,
+				self->selected_output->transform, capture_time);
+
+	uint32_t area = calculate_region_area(&buffer->damage);
 	self->n_frames_captured++;
-	self->damage_area_sum +=
-		calculate_region_area(&buffer->damage);
+	self->damage_area_sum += area;
+	self->damage_area_total += area;
 
 	struct pixman_region16 damage;
 	pixman_region_init(&damage);
@@ -597,22 +1095,52 @@ void wayvnc_process_frame(struct wayvnc* self)
 		pixman_region_copy(&damage, &buffer->damage);
 	}
 
-	nvnc_fb_set_transform(buffer->nvnc_fb,
-			(enum nvnc_transform)buffer_transform);
+	if (self->collect_latency)
+		input_latency_capture(&self->input_latency, &damage,
+				capture_time);
+
+	if (self->use_prerotate &&
+			prerotate_is_enabled(&self->prerotate, buffer_transform) &&
+			prerotate_is_supported(buffer)) {
+		prerotate_feed(&self->prerotate, buffer, buffer_transform,
+				&damage);
+	} else {
+		wayvnc_coalesce_damage(self, &damage, buffer->width,
+				buffer->height);
+
+		nvnc_fb_set_transform(buffer->nvnc_fb,
+				(enum nvnc_transform)buffer_transform);
+
+		if (self->collect_latency)
+			wv_buffer_begin_hold(buffer, &self->latency.hold);
+
+		wv_buffer_hold(buffer);
+		DTRACE_PROBE2(wayvnc, feed_buffer, self, buffer->nvnc_fb);
+		nvnc_display_feed_buffer(self->nvnc_display, buffer->nvnc_fb,
+				&damage);
+		wayvnc_record_frame_time(self);
 
-	nvnc_display_feed_buffer(self->nvnc_display, buffer->nvnc_fb,
-			&damage);
+		if (self->collect_latency)
+			input_latency_feed(&self->input_latency, gettime_us());
+	}
+
+	if (self->collect_latency)
+		histogram_add(&self->latency.process,
+				gettime_us() - capture_time);
 
 	pixman_region_fini(&damage);
 
-	wayvnc_start_capture(self);
+	DTRACE_PROBE1(wayvnc, process_frame_end, self);
+
+	if (self->nr_clients > 0)
+		wayvnc_start_capture(self);
 }
 
-void on_capture_done(struct screencopy* sc)
+static void wayvnc_handle_capture(struct wayvnc* self,
+		enum screencopy_status status, struct wv_buffer* buffer,
+		uint64_t capture_time)
 {
-	struct wayvnc* self = sc->userdata;
-
-	switch (sc->status) {
+	switch (status) {
 	case SCREENCOPY_STOPPED:
 		break;
 	case SCREENCOPY_IN_PROGRESS:
@@ -622,14 +1150,145 @@ void on_capture_done(struct screencopy* sc)
 		wayvnc_exit(self);
 		break;
 	case SCREENCOPY_FAILED:
-		wayvnc_start_capture_immediate(self);
+		if (self->nr_clients > 0)
+			wayvnc_start_capture_immediate(self);
 		break;
 	case SCREENCOPY_DONE:
-		wayvnc_process_frame(self);
+		wayvnc_process_frame(self, buffer, capture_time);
 		break;
 	}
 }
 
+void on_capture_done(struct screencopy* sc)
+{
+	struct wayvnc* self = sc->userdata;
+	struct wv_buffer* buffer = NULL;
+
+	if (sc->status == SCREENCOPY_DONE) {
+		buffer = sc->back;
+		sc->back = NULL;
+	}
+
+	wayvnc_handle_capture(self, sc->status, buffer, sc->last_time);
+}
+
+static void on_capture_thread_frame(struct capture_thread* thread,
+		const struct capture_frame* frame)
+{
+	struct wayvnc* self = thread->userdata;
+
+	if (self->collect_latency && frame->status == SCREENCOPY_DONE) {
+		histogram_add(&self->latency.wait, frame->wait_us);
+		histogram_add(&self->latency.capture, frame->capture_us);
+		if (frame->present_us)
+			histogram_add(&self->latency.present,
+					frame->present_us);
+	}
+
+	wayvnc_handle_capture(self, frame->status, frame->buffer, frame->time);
+}
+
+static void on_prerotate_frame(struct prerotate* prerotate,
+		struct nvnc_fb* fb, struct pixman_region16* damage)
+{
+	struct wayvnc* self = prerotate->userdata;
+
+	wayvnc_coalesce_damage(self, damage, prerotate->width,
+			prerotate->height);
+
+	DTRACE_PROBE2(wayvnc, feed_buffer, self, fb);
+	nvnc_display_feed_buffer(self->nvnc_display, fb, damage);
+	wayvnc_record_frame_time(self);
+
+	if (self->collect_latency)
+		input_latency_feed(&self->input_latency, gettime_us());
+}
+
+static void on_desktop_frame(struct desktop* desktop, struct nvnc_fb* fb,
+		struct pixman_region16* damage)
+{
+	struct wayvnc* self = desktop->userdata;
+
+	uint32_t area = calculate_region_area(damage);
+	self->n_frames_captured++;
+	self->damage_area_sum += area;
+	self->damage_area_total += area;
+
+	self->pointer_backend.width = desktop->width;
+	self->pointer_backend.height = desktop->height;
+
+	wayvnc_coalesce_damage(self, damage, desktop->width, desktop->height);
+
+	DTRACE_PROBE2(wayvnc, feed_buffer, self, fb);
+	nvnc_display_feed_buffer(self->nvnc_display, fb, damage);
+	wayvnc_record_frame_time(self);
+}
+
+static void on_desktop_fatal(struct desktop* desktop)
+{
+	struct wayvnc* self = desktop->userdata;
+
+	log_error("Fatal error while capturing. Exiting...\n");
+	wayvnc_exit(self);
+}
+
+static void wayvnc_init_pool(struct wayvnc* self, struct screencopy* sc)
+{
+	enum wv_buffer_alloc_flags flags = 0;
+	if (self->cfg.prefault_buffers)
+		flags |= WV_BUFFER_ALLOC_POPULATE;
+	if (self->cfg.hugepage_buffers)
+		flags |= WV_BUFFER_ALLOC_HUGEPAGES;
+	if (self->cfg.slab_buffers)
+		flags |= WV_BUFFER_ALLOC_SLAB;
+	// The frame tap passes the memory of the buffers on
+	if (self->cfg.frame_tap_socket)
+		flags |= WV_BUFFER_ALLOC_KEEP_FD;
+
+	wv_buffer_pool_set_depth(sc->pool, self->cfg.pool_depth);
+	wv_buffer_pool_set_max_bytes(sc->pool,
+			(size_t)self->cfg.pool_max_memory << 20);
+	wv_buffer_pool_set_idle_timeout(sc->pool, 1000 *
+			(self->cfg.pool_idle_timeout ? self->cfg.pool_idle_timeout :
+			 DEFAULT_POOL_IDLE_TIMEOUT));
+	wv_buffer_pool_set_alloc_flags(sc->pool, flags);
+
+	if (self->use_capture_thread)
+		capture_thread_send(&self->capture_thread, CAPTURE_PREWARM);
+	else
+		screencopy_prewarm(sc);
+}
+
+static void on_desktop_output_added(struct desktop* desktop,
+		struct desktop_output* dout)
+{
+	struct wayvnc* self = desktop->userdata;
+	wayvnc_init_pool(self, &dout->screencopy);
+}
+
+static int init_desktop(struct wayvnc* self)
+{
+	self->desktop = desktop_new(&self->outputs, &self->screencopy);
+	if (!self->desktop)
+		return -1;
+
+	self->desktop->userdata = self;
+	self->desktop->on_frame = on_desktop_frame;
+	self->desktop->on_fatal = on_desktop_fatal;
+	self->desktop->on_output_added = on_desktop_output_added;
+
+	self->pointer_backend.width = self->desktop->width;
+	self->pointer_backend.height = self->desktop->height;
+
+	struct desktop_output* dout;
+	wl_list_for_each(dout, &self->desktop->outputs, link)
+		wayvnc_init_pool(self, &dout->screencopy);
+
+	log_debug("Capturing all outputs into a %"PRIu32"x%"PRIu32" desktop\n",
+			self->desktop->width, self->desktop->height);
+	return 0;
+}
+
 int wayvnc_usage(FILE* stream, int rc)
 {
 	static const char* usage =
@@ -637,12 +1296,22 @@ int wayvnc_usage(FILE* stream, int rc)
 "\n"
 "    -C,--config=<path>                        Select a config file.\n"
 "    -o,--output=<name>                        Select output to capture.\n"
+"    -a,--all-outputs                          Capture all outputs into a\n"
+"                                              single desktop.\n"
 "    -k,--keyboard=<layout>[-<variant>]        Select keyboard layout with an\n"
 "                                              optional variant.\n"
 "    -s,--seat=<name>                          Select seat by name.\n"
 "    -r,--render-cursor                        Enable overlay cursor rendering.\n"
 "    -f,--max-fps=<fps>                        Set the rate limit (default 30).\n"
+"    -S,--scale=<factor>                       Downscale frames by a factor\n"
+"                                              between 0 and 1.\n"
+"    -w,--workers=<n>                          Start at least this many\n"
+"                                              encoder worker threads.\n"
+"    -R,--record=<path>                        Record captured frames to a\n"
+"                                              trace file.\n"
 "    -p,--show-performance                     Show performance counters.\n"
+"    -J,--json-performance                     Show performance counters as\n"
+"                                              JSON lines.\n"
 "    -u,--unix-socket                          Create a UNIX domain socket\n"
 "                                              instead of TCP.\n"
 "    -V,--version                              Show version info.\n"
@@ -654,8 +1323,70 @@ int wayvnc_usage(FILE* stream, int rc)
 	return rc;
 }
 
+static int wayvnc_init_sched(struct wayvnc* self)
+{
+	const struct cfg* cfg = &self->cfg;
+
+	if (cfg->cpu_affinity && !thread_sched_parse_cpus(&self->main_sched,
+				cfg->cpu_affinity)) {
+		log_error("Invalid cpu_affinity: %s\n", cfg->cpu_affinity);
+		return -1;
+	}
+
+	if (cfg->worker_cpu_affinity && !thread_sched_parse_cpus(
+				&self->worker_sched, cfg->worker_cpu_affinity)) {
+		log_error("Invalid worker_cpu_affinity: %s\n",
+				cfg->worker_cpu_affinity);
+		return -1;
+	}
+
+	if (cfg->capture_cpu_affinity && !thread_sched_parse_cpus(
+				&self->capture_sched, cfg->capture_cpu_affinity)) {
+		log_error("Invalid capture_cpu_affinity: %s\n",
+				cfg->capture_cpu_affinity);
+		return -1;
+	}
+
+	if (cfg->capture_priority && !thread_sched_parse_priority(
+				&self->capture_sched, cfg->capture_priority)) {
+		log_error("Invalid capture_priority: %s\n",
+				cfg->capture_priority);
+		return -1;
+	}
+
+	if ((cfg->capture_cpu_affinity || cfg->capture_priority) &&
+	    !cfg->capture_thread)
+		log_warning("capture_cpu_affinity and capture_priority only apply with capture_thread\n");
+
+	/* The main thread is moved off the worker CPUs again once the
+	 * workers have been started, even if it has no CPUs of its own.
+	 */
+	if (self->worker_sched.has_cpus && !self->main_sched.has_cpus) {
+		if (pthread_getaffinity_np(pthread_self(),
+					sizeof(self->main_sched.cpus),
+					&self->main_sched.cpus) != 0) {
+			log_error("Failed to get CPU affinity\n");
+			return -1;
+		}
+		self->main_sched.has_cpus = true;
+	}
+
+	// The capture thread is started from the main thread
+	if (!self->capture_sched.has_cpus && self->main_sched.has_cpus) {
+		self->capture_sched.cpus = self->main_sched.cpus;
+		self->capture_sched.has_cpus = true;
+	}
+
+	return 0;
+}
+
 int check_cfg_sanity(struct cfg* cfg)
 {
+	if (cfg->pool_depth == 1) {
+		log_error("pool_depth must be at least 2, because the last frame is always held by the server\n");
+		return -1;
+	}
+
 	if (cfg->enable_auth) {
 		int rc = 0;
 
@@ -688,30 +1419,383 @@ int check_cfg_sanity(struct cfg* cfg)
 	return 0;
 }
 
+static void print_histogram_text(const char* name,
+		const struct histogram* histogram)
+{
+	if (histogram->count == 0)
+		return;
+
+	printf("Latency of %s: p50 %.1f ms, p95 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+			name, 1.0e-3 * histogram_percentile(histogram, 0.50),
+			1.0e-3 * histogram_percentile(histogram, 0.95),
+			1.0e-3 * histogram_percentile(histogram, 0.99),
+			1.0e-3 * histogram->max);
+}
+
+// All latencies are in microseconds
+static void print_histogram_json(const char* name,
+		const struct histogram* histogram, bool is_first)
+{
+	printf("%s\"%s\":{\"count\":%"PRIu32",\"p50\":%"PRIu64
+			",\"p95\":%"PRIu64",\"p99\":%"PRIu64
+			",\"max\":%"PRIu64"}",
+			is_first ? "" : ",", name, histogram->count,
+			histogram_percentile(histogram, 0.50),
+			histogram_percentile(histogram, 0.95),
+			histogram_percentile(histogram, 0.99),
+			histogram->max);
+}
+
+static void print_perf_text(struct wayvnc* self, double relative_area_avg,
+		const struct wayvnc_latency* latency,
+		const struct wayvnc_wayland_stats* stats)
+{
+	printf("Frames captured: %"PRIu32", average reported frame damage: %.1f %%\n",
+			self->n_frames_captured, relative_area_avg);
+
+	if (self->n_frames_captured > 0)
+		printf("Damage rects per frame: %.1f reported, %.1f after coalescing\n",
+				(double)self->n_rects_reported_sum /
+				(double)self->n_frames_captured,
+				(double)self->n_rects_fed_sum /
+				(double)self->n_frames_captured);
+
+	if (self->screencopy.min_rate > 0.0 && !self->desktop)
+		printf("Adaptive capture rate: %.1f FPS\n",
+				screencopy_get_rate(&self->screencopy));
+
+	if (self->first_frame_latency)
+		printf("Time to first frame: %.1f ms after startup, %.1f ms after connecting\n",
+				self->first_frame_latency * 1.0e-3,
+				self->connect_frame_latency * 1.0e-3);
+
+	print_histogram_text("capture wait", &latency->wait);
+	print_histogram_text("capture", &latency->capture);
+	print_histogram_text("capture to present", &latency->present);
+	print_histogram_text("processing", &latency->process);
+	print_histogram_text("buffer hold", &latency->hold);
+	print_histogram_text("input to capture", &latency->input_capture);
+	print_histogram_text("input to feed", &latency->input_feed);
+	print_histogram_text("wayland dispatch", &latency->dispatch);
+
+	if (stats->n_flushes > 0)
+		printf("Wayland: %"PRIu64" events, %"PRIu64" flushes, %.0f bytes per flush, %"PRIu64" stalls\n",
+				stats->n_events, stats->n_flushes,
+				(double)stats->n_flushed_bytes /
+				(double)stats->n_flushes,
+				stats->n_flush_stalls);
+}
+
+static void print_perf_json(struct wayvnc* self, double relative_area_avg,
+		const struct wayvnc_latency* latency,
+		const struct wayvnc_wayland_stats* stats)
+{
+	printf("{\"time\":%"PRIu64",\"frames\":%"PRIu32",\"damage\":%.1f",
+			gettime_ms(), self->n_frames_captured,
+			relative_area_avg);
+
+	if (self->n_frames_captured > 0)
+		printf(",\"rects_reported\":%.1f,\"rects_fed\":%.1f",
+				(double)self->n_rects_reported_sum /
+				(double)self->n_frames_captured,
+				(double)self->n_rects_fed_sum /
+				(double)self->n_frames_captured);
+
+	if (self->screencopy.min_rate > 0.0 && !self->desktop)
+		printf(",\"rate\":%.1f", screencopy_get_rate(&self->screencopy));
+
+	if (self->first_frame_latency)
+		printf(",\"ttff\":{\"startup\":%"PRIu64",\"connect\":%"PRIu64"}",
+				self->first_frame_latency,
+				self->connect_frame_latency);
+
+	printf(",\"latency\":{");
+	print_histogram_json("wait", &latency->wait, true);
+	print_histogram_json("capture", &latency->capture, false);
+	print_histogram_json("present", &latency->present, false);
+	print_histogram_json("process", &latency->process, false);
+	print_histogram_json("hold", &latency->hold, false);
+	print_histogram_json("input_capture", &latency->input_capture, false);
+	print_histogram_json("input_feed", &latency->input_feed, false);
+	print_histogram_json("dispatch", &latency->dispatch, false);
+	printf("}");
+
+	printf(",\"wayland\":{\"events\":%"PRIu64",\"flushes\":%"PRIu64
+			",\"flushed_bytes\":%"PRIu64",\"stalls\":%"PRIu64"}}\n",
+			stats->n_events, stats->n_flushes,
+			stats->n_flushed_bytes, stats->n_flush_stalls);
+
+	// Make sure that each line goes out as a whole when piped
+	fflush(stdout);
+}
+
+static void take_interval(struct histogram* interval,
+		struct histogram* histogram, struct histogram* snapshot)
+{
+	histogram_diff(interval, histogram, snapshot);
+	*snapshot = *histogram;
+	histogram->max = 0;
+}
+
 static void on_perf_tick(void* obj)
 {
 	struct wayvnc* self = aml_get_userdata(obj);
 
-	double total_area = self->selected_output->width * self->selected_output->height;
-	double area_avg = (double)self->damage_area_sum / (double)self->n_frames_captured;
+	double total_area = self->desktop ?
+		self->desktop->width * self->desktop->height :
+		self->selected_output->width * self->selected_output->height;
+	double area_avg = self->n_frames_captured > 0 ?
+		(double)self->damage_area_sum / (double)self->n_frames_captured : 0.0;
 	double relative_area_avg = 100.0 * area_avg / total_area;
 
-	printf("Frames captured: %"PRIu32", average reported frame damage: %.1f %%\n",
-			self->n_frames_captured, relative_area_avg);
+	struct wayvnc_latency interval;
+	take_interval(&interval.wait, &self->latency.wait,
+			&self->latency_snapshot.wait);
+	take_interval(&interval.capture, &self->latency.capture,
+			&self->latency_snapshot.capture);
+	take_interval(&interval.present, &self->latency.present,
+			&self->latency_snapshot.present);
+	take_interval(&interval.process, &self->latency.process,
+			&self->latency_snapshot.process);
+	take_interval(&interval.hold, &self->latency.hold,
+			&self->latency_snapshot.hold);
+	take_interval(&interval.input_capture, &self->latency.input_capture,
+			&self->latency_snapshot.input_capture);
+	take_interval(&interval.input_feed, &self->latency.input_feed,
+			&self->latency_snapshot.input_feed);
+	take_interval(&interval.dispatch, &self->latency.dispatch,
+			&self->latency_snapshot.dispatch);
+
+	const struct wayvnc_wayland_stats* total = &self->wayland_stats;
+	struct wayvnc_wayland_stats* prev = &self->wayland_stats_snapshot;
+	struct wayvnc_wayland_stats stats = {
+		.n_events = total->n_events - prev->n_events,
+		.n_flushes = total->n_flushes - prev->n_flushes,
+		.n_flushed_bytes = total->n_flushed_bytes - prev->n_flushed_bytes,
+		.n_flush_stalls = total->n_flush_stalls - prev->n_flush_stalls,
+	};
+	*prev = *total;
+
+	if (self->use_json_performance)
+		print_perf_json(self, relative_area_avg, &interval, &stats);
+	else
+		print_perf_text(self, relative_area_avg, &interval, &stats);
 
 	self->n_frames_captured = 0;
 	self->damage_area_sum = 0;
+	self->n_rects_reported_sum = 0;
+	self->n_rects_fed_sum = 0;
+}
+
+static void wayvnc_collect_metrics(FILE* out, void* userdata)
+{
+	struct wayvnc* self = userdata;
+
+	uint64_t n_captured = 0, n_failed = 0;
+	int n_buffers = 0, n_free = 0, n_held = 0;
+	size_t n_bytes = 0;
+
+	if (self->desktop) {
+		struct desktop_output* dout;
+		wl_list_for_each(dout, &self->desktop->outputs, link) {
+			struct screencopy* sc = &dout->screencopy;
+			n_captured += sc->n_frames_captured;
+			n_failed += sc->n_frames_failed;
+			n_buffers += sc->pool->n_buffers;
+			n_free += sc->pool->n_free;
+			n_held += wv_buffer_pool_get_n_held(sc->pool);
+			n_bytes += sc->pool->n_bytes;
+		}
+	} else {
+		struct screencopy* sc = &self->screencopy;
+		n_captured = self->use_capture_thread ?
+			self->capture_thread.n_frames_captured :
+			sc->n_frames_captured;
+		n_failed = self->use_capture_thread ?
+			self->capture_thread.n_frames_failed :
+			sc->n_frames_failed;
+		n_buffers = sc->pool->n_buffers;
+		n_free = sc->pool->n_free;
+		n_held = wv_buffer_pool_get_n_held(sc->pool);
+		n_bytes = sc->pool->n_bytes;
+	}
+
+	metrics_write_header(out, "wayvnc_frames_captured_total", "counter",
+			"Frames captured from the compositor");
+	metrics_write_value(out, "wayvnc_frames_captured_total", NULL,
+			n_captured);
+
+	metrics_write_header(out, "wayvnc_frames_failed_total", "counter",
+			"Frame captures that failed");
+	metrics_write_value(out, "wayvnc_frames_failed_total", NULL,
+			n_failed);
+
+	metrics_write_header(out, "wayvnc_damage_pixels_total", "counter",
+			"Area of the damage reported by the compositor");
+	metrics_write_value(out, "wayvnc_damage_pixels_total", NULL,
+			self->damage_area_total);
+
+	metrics_write_histogram(out, "wayvnc_capture_wait_seconds",
+			"Time from starting a capture until the copy is requested",
+			&self->latency.wait);
+	metrics_write_histogram(out, "wayvnc_capture_seconds",
+			"Time from requesting a copy until the frame is ready",
+			&self->latency.capture);
+	metrics_write_histogram(out, "wayvnc_capture_to_present_seconds",
+			"Time from requesting a copy until the frame was presented",
+			&self->latency.present);
+	metrics_write_histogram(out, "wayvnc_process_seconds",
+			"Time from a frame being ready until it is fed to the encoder",
+			&self->latency.process);
+	metrics_write_histogram(out, "wayvnc_buffer_hold_seconds",
+			"Time that the encoder holds on to each frame",
+			&self->latency.hold);
+	metrics_write_histogram(out, "wayvnc_input_to_capture_seconds",
+			"Time from an input event until a captured frame showed it",
+			&self->latency.input_capture);
+	metrics_write_histogram(out, "wayvnc_input_to_feed_seconds",
+			"Time from an input event until a frame that showed it was fed to the encoder",
+			&self->latency.input_feed);
+	metrics_write_histogram(out, "wayvnc_wayland_dispatch_seconds",
+			"Time spent reading and dispatching Wayland events",
+			&self->latency.dispatch);
+
+	metrics_write_header(out, "wayvnc_wayland_events_total", "counter",
+			"Wayland events dispatched on the main thread");
+	metrics_write_value(out, "wayvnc_wayland_events_total", NULL,
+			self->wayland_stats.n_events);
+
+	metrics_write_header(out, "wayvnc_wayland_flushes_total", "counter",
+			"Flushes that sent data to the compositor");
+	metrics_write_value(out, "wayvnc_wayland_flushes_total", NULL,
+			self->wayland_stats.n_flushes);
+
+	metrics_write_header(out, "wayvnc_wayland_flushed_bytes_total",
+			"counter", "Bytes sent to the compositor");
+	metrics_write_value(out, "wayvnc_wayland_flushed_bytes_total", NULL,
+			self->wayland_stats.n_flushed_bytes);
+
+	metrics_write_header(out, "wayvnc_wayland_flush_stalls_total",
+			"counter", "Flushes that found the socket full");
+	metrics_write_value(out, "wayvnc_wayland_flush_stalls_total", NULL,
+			self->wayland_stats.n_flush_stalls);
+
+	metrics_write_header(out, "wayvnc_first_frame_seconds", "gauge",
+			"Time from startup until the first frame was fed to the encoder");
+	metrics_write_value(out, "wayvnc_first_frame_seconds", NULL,
+			self->first_frame_latency * 1.0e-6);
+
+	metrics_write_header(out, "wayvnc_connect_frame_seconds", "gauge",
+			"Time from the first client connecting until a frame was fed to the encoder");
+	metrics_write_value(out, "wayvnc_connect_frame_seconds", NULL,
+			self->connect_frame_latency * 1.0e-6);
+
+	metrics_write_header(out, "wayvnc_buffers_allocated", "gauge",
+			"Capture buffers that are currently allocated");
+	metrics_write_value(out, "wayvnc_buffers_allocated", NULL, n_buffers);
+
+	metrics_write_header(out, "wayvnc_buffers_in_flight", "gauge",
+			"Capture buffers that are held by the encoder");
+	metrics_write_value(out, "wayvnc_buffers_in_flight", NULL, n_held);
+
+	metrics_write_header(out, "wayvnc_buffers_free", "gauge",
+			"Capture buffers that are ready to be captured into");
+	metrics_write_value(out, "wayvnc_buffers_free", NULL, n_free);
+
+	metrics_write_header(out, "wayvnc_buffer_bytes", "gauge",
+			"Memory taken by capture buffers, including those being allocated");
+	metrics_write_value(out, "wayvnc_buffer_bytes", NULL, n_bytes);
+
+	metrics_write_header(out, "wayvnc_clients", "gauge",
+			"Connected clients");
+	metrics_write_value(out, "wayvnc_clients", NULL, self->nr_clients);
+
+	metrics_write_header(out, "wayvnc_input_events_total", "counter",
+			"Input events received from clients");
+	metrics_write_value(out, "wayvnc_input_events_total",
+			"type=\"pointer\"", self->n_pointer_events);
+	metrics_write_value(out, "wayvnc_input_events_total",
+			"type=\"key\"", self->n_key_events);
+
+	metrics_write_header(out, "wayvnc_pointer_frames_total", "counter",
+			"Pointer frames sent to the compositor");
+	metrics_write_value(out, "wayvnc_pointer_frames_total", NULL,
+			self->pointer_backend.n_frames);
+
+	metrics_write_header(out, "wayvnc_clipboard_bytes_total", "counter",
+			"Clipboard data passed between the compositor and clients");
+	metrics_write_value(out, "wayvnc_clipboard_bytes_total",
+			"direction=\"to_client\"",
+			self->data_control.n_bytes_received);
+	metrics_write_value(out, "wayvnc_clipboard_bytes_total",
+			"direction=\"to_compositor\"",
+			self->data_control.n_bytes_sent);
+
+	metrics_write_header(out, "wayvnc_clipboard_duplicates_total",
+			"counter",
+			"Clipboard updates dropped because they were unchanged");
+	metrics_write_value(out, "wayvnc_clipboard_duplicates_total", NULL,
+			self->data_control.n_duplicates);
+
+	metrics_write_header(out, "wayvnc_clipboard_sends_pending", "gauge",
+			"Paste requests from the compositor still being written");
+	metrics_write_value(out, "wayvnc_clipboard_sends_pending", NULL,
+			self->data_control.n_sends_pending);
 }
 
 static void start_performance_ticker(struct wayvnc* self)
 {
-	struct aml_ticker* ticker = aml_ticker_new(1000, on_perf_tick, self,
+	if (self->performance_ticker)
+		return;
+
+	self->performance_ticker = aml_ticker_new(1000, on_perf_tick, self,
 		NULL);
-	if (!ticker)
+	if (!self->performance_ticker)
+		return;
+
+	aml_start(aml_get_default(), self->performance_ticker);
+}
+
+static void stop_performance_ticker(struct wayvnc* self)
+{
+	if (!self->performance_ticker)
 		return;
 
-	aml_start(aml_get_default(), ticker);
-	aml_unref(ticker);
+	aml_stop(aml_get_default(), self->performance_ticker);
+	aml_unref(self->performance_ticker);
+	self->performance_ticker = NULL;
+}
+
+static int wayvnc_init_keyboard(struct wayvnc* self,
+		struct keyboard* keyboard, const char* layout,
+		const char* variant)
+{
+	struct xkb_rule_names rule_names = {
+		.rules = self->cfg.xkb_rules,
+		.layout = layout ? layout : self->cfg.xkb_layout,
+		.model = self->cfg.xkb_model ? self->cfg.xkb_model : "pc105",
+		.variant = variant ? variant : self->cfg.xkb_variant,
+		.options = self->cfg.xkb_options,
+	};
+
+	return keyboard_init(keyboard, &rule_names);
+}
+
+static struct zwlr_virtual_pointer_v1* wayvnc_create_virtual_pointer(
+		struct wayvnc* self)
+{
+	int version = zwlr_virtual_pointer_manager_v1_get_version(
+			self->pointer_manager);
+
+	/* Without an output, the pointer is mapped onto the whole layout,
+	 * which is what the desktop consists of.
+	 */
+	return version >= 2 && self->selected_output
+		? zwlr_virtual_pointer_manager_v1_create_virtual_pointer_with_output(
+			self->pointer_manager, self->selected_seat->wl_seat,
+			self->selected_output->wl_output)
+		: zwlr_virtual_pointer_manager_v1_create_virtual_pointer(
+			self->pointer_manager, self->selected_seat->wl_seat);
 }
 
 void parse_keyboard_option(struct wayvnc* self, char* arg)
@@ -726,6 +1810,301 @@ void parse_keyboard_option(struct wayvnc* self, char* arg)
 	self->kb_layout = arg;
 }
 
+/* Capture settings live in the screencopy state, which belongs to another
+ * thread with capture_thread and is duplicated per output on a desktop.
+ */
+static const char* ctl_check_capture(struct wayvnc* self)
+{
+	if (self->use_capture_thread)
+		return "not available with capture_thread";
+	if (self->desktop)
+		return "not available when capturing all outputs";
+	return NULL;
+}
+
+static bool ctl_parse_uint(uint32_t* dst, const char* str)
+{
+	char* end = NULL;
+
+	errno = 0;
+	unsigned long value = strtoul(str, &end, 10);
+	if (end == str || *end != '\0' || errno != 0 || value > UINT32_MAX)
+		return false;
+
+	*dst = value;
+	return true;
+}
+
+static const char* ctl_max_fps(struct wayvnc* self, FILE* out, char* argv[])
+{
+	const char* err = ctl_check_capture(self);
+	if (err)
+		return err;
+
+	uint32_t rate;
+	if (!ctl_parse_uint(&rate, argv[1]) || rate == 0)
+		return "invalid rate";
+
+	self->screencopy.rate_limit = rate;
+	return NULL;
+}
+
+static const char* ctl_cursor(struct wayvnc* self, FILE* out, char* argv[])
+{
+	const char* err = ctl_check_capture(self);
+	if (err)
+		return err;
+
+	if (strcmp(argv[1], "overlay") == 0)
+		self->screencopy.overlay_cursor = true;
+	else if (strcmp(argv[1], "none") == 0)
+		self->screencopy.overlay_cursor = false;
+	else
+		return "expected overlay or none";
+
+	/* The cursor has to be added to or removed from the whole frame */
+	wayvnc_reconfigure_capture(self);
+	return NULL;
+}
+
+static const char* ctl_output(struct wayvnc* self, FILE* out, char* argv[])
+{
+	const char* err = ctl_check_capture(self);
+	if (err)
+		return err;
+
+	struct output* output = output_find_by_name(&self->outputs, argv[1]);
+	if (!output)
+		return "no such output";
+
+	if (output == self->selected_output)
+		return NULL;
+
+	log_debug("Switching to output %s\n", output->name);
+
+	wayvnc_stop_capture(self);
+
+	self->selected_output->on_dimension_change = NULL;
+	self->selected_output->on_transform_change = NULL;
+
+	self->selected_output = output;
+	output->on_dimension_change = on_output_dimension_change;
+	output->on_transform_change = on_output_transform_change;
+	output->userdata = self;
+
+	self->screencopy.wl_output = output->wl_output;
+
+	/* The virtual pointer is bound to the output that it moves on. The
+	 * position and buttons of the old one don't carry over.
+	 */
+	pointer_release_all(&self->pointer_backend);
+	pointer_destroy(&self->pointer_backend);
+	self->pointer_backend.output = output;
+	self->pointer_backend.pointer = wayvnc_create_virtual_pointer(self);
+	pointer_init(&self->pointer_backend);
+
+	struct screencopy_config config;
+	wayvnc_get_capture_config(self, &config);
+	screencopy_configure(&self->screencopy, &config);
+	screencopy_reconfigure(&self->screencopy);
+
+	if (self->nr_clients > 0)
+		wayvnc_start_capture_immediate(self);
+	return NULL;
+}
+
+static const char* ctl_pool_depth(struct wayvnc* self, FILE* out,
+		char* argv[])
+{
+	const char* err = ctl_check_capture(self);
+	if (err)
+		return err;
+
+	uint32_t depth;
+	if (!ctl_parse_uint(&depth, argv[1]) || depth < 2)
+		return "pool depth must be at least 2";
+
+	wv_buffer_pool_set_depth(self->screencopy.pool, depth);
+	return NULL;
+}
+
+static const char* ctl_performance(struct wayvnc* self, FILE* out,
+		char* argv[])
+{
+	if (strcmp(argv[1], "on") == 0) {
+		/* The capture thread hands its latencies over with each
+		 * frame instead, so its screencopy is left alone.
+		 */
+		if (!self->collect_latency && !self->desktop) {
+			if (!self->use_capture_thread) {
+				self->screencopy.wait_histogram =
+					&self->latency.wait;
+				self->screencopy.capture_histogram =
+					&self->latency.capture;
+				self->screencopy.present_histogram =
+					&self->latency.present;
+			}
+			self->collect_latency = true;
+		}
+
+		self->show_performance = true;
+		start_performance_ticker(self);
+	} else if (strcmp(argv[1], "off") == 0) {
+		self->show_performance = false;
+		stop_performance_ticker(self);
+	} else {
+		return "expected on or off";
+	}
+
+	return NULL;
+}
+
+static const char* ctl_keyboard(struct wayvnc* self, FILE* out, char* argv[])
+{
+	if (!self->keyboard_backend.virtual_keyboard)
+		return "no virtual keyboard";
+
+	char* layout = argv[1];
+	char* variant = strchr(layout, '-');
+	if (variant)
+		*variant++ = '\0';
+
+	struct keyboard keyboard = {
+		.virtual_keyboard = self->keyboard_backend.virtual_keyboard,
+	};
+
+	/* The new keyboard starts out with nothing pressed, so keys that are
+	 * held now would otherwise stay down in the compositor.
+	 */
+	keyboard_release_all(&self->keyboard_backend);
+
+	if (wayvnc_init_keyboard(self, &keyboard, layout, variant) < 0)
+		return "failed to load keymap";
+
+	keyboard_destroy(&self->keyboard_backend);
+	self->keyboard_backend = keyboard;
+	return NULL;
+}
+
+static const char* ctl_reload(struct wayvnc* self, FILE* out, char* argv[])
+{
+	struct cfg cfg = { 0 };
+
+	errno = 0;
+	int rc = cfg_load(&cfg, self->cfg_path);
+	if (rc > 0) {
+		cfg_destroy(&cfg);
+		fprintf(out, "error on line %d\n", rc);
+		return "failed to load config";
+	}
+	if (rc < 0 && (self->cfg_path || errno != ENOENT))
+		return "failed to open config";
+
+	if (check_cfg_sanity(&cfg) < 0) {
+		cfg_destroy(&cfg);
+		return "invalid config";
+	}
+
+	/* Keys that are read as they are used take effect right away. The
+	 * ones below are copied elsewhere at startup. The rest need a
+	 * restart.
+	 */
+	if (!ctl_check_capture(self)) {
+		self->screencopy.min_rate = cfg.min_fps;
+		self->screencopy.rate_rise_time = 1.0e-3 * (cfg.fps_rise_time ?
+				cfg.fps_rise_time : DEFAULT_FPS_RISE_TIME);
+		self->screencopy.rate_fall_time = 1.0e-3 * (cfg.fps_fall_time ?
+				cfg.fps_fall_time : DEFAULT_FPS_FALL_TIME);
+		if (cfg.pool_depth)
+			wv_buffer_pool_set_depth(self->screencopy.pool,
+					cfg.pool_depth);
+		wv_buffer_pool_set_max_bytes(self->screencopy.pool,
+				(size_t)cfg.pool_max_memory << 20);
+	}
+
+	if (self->data_control.manager)
+		self->data_control.max_size = cfg.clipboard_max_size ?
+			cfg.clipboard_max_size : DEFAULT_CLIPBOARD_MAX_SIZE;
+
+	cfg_destroy(&self->cfg);
+	self->cfg = cfg;
+	return NULL;
+}
+
+static const char* ctl_status(struct wayvnc* self, FILE* out, char* argv[])
+{
+	if (self->selected_output)
+		fprintf(out, "output %s\n", self->selected_output->name);
+	if (!self->desktop) {
+		fprintf(out, "max-fps %g\n", self->screencopy.rate_limit);
+		fprintf(out, "cursor %s\n", self->screencopy.overlay_cursor ?
+				"overlay" : "none");
+
+		const struct wv_buffer_pool* pool = self->screencopy.pool;
+		fprintf(out, "buffers %d allocated, %d free, %d held, %.1f MiB\n",
+				pool->n_buffers, pool->n_free,
+				wv_buffer_pool_get_n_held(pool),
+				pool->n_bytes / 1048576.0);
+	}
+	fprintf(out, "performance %s\n", self->show_performance ? "on" : "off");
+	fprintf(out, "clients %d\n", self->nr_clients);
+	return NULL;
+}
+
+static const char* ctl_help(struct wayvnc* self, FILE* out, char* argv[]);
+
+struct ctl_command {
+	const char* name;
+	const char* args;
+	int n_args;
+	const char* (*fn)(struct wayvnc*, FILE* out, char* argv[]);
+};
+
+static const struct ctl_command ctl_commands[] = {
+	{ "help", "", 0, ctl_help },
+	{ "status", "", 0, ctl_status },
+	{ "max-fps", " <fps>", 1, ctl_max_fps },
+	{ "cursor", " overlay|none", 1, ctl_cursor },
+	{ "output", " <name>", 1, ctl_output },
+	{ "pool-depth", " <depth>", 1, ctl_pool_depth },
+	{ "performance", " on|off", 1, ctl_performance },
+	{ "keyboard", " <layout>[-<variant>]", 1, ctl_keyboard },
+	{ "reload", "", 0, ctl_reload },
+};
+
+#define N_CTL_COMMANDS (sizeof(ctl_commands) / sizeof(ctl_commands[0]))
+
+static const char* ctl_help(struct wayvnc* self, FILE* out, char* argv[])
+{
+	for (size_t i = 0; i < N_CTL_COMMANDS; ++i)
+		fprintf(out, "%s%s\n", ctl_commands[i].name,
+				ctl_commands[i].args);
+	return NULL;
+}
+
+static void on_ctl_command(FILE* out, int argc, char* argv[], void* userdata)
+{
+	struct wayvnc* self = userdata;
+
+	const struct ctl_command* command = NULL;
+	for (size_t i = 0; i < N_CTL_COMMANDS; ++i)
+		if (strcmp(ctl_commands[i].name, argv[0]) == 0)
+			command = &ctl_commands[i];
+
+	const char* err = NULL;
+	if (!command)
+		err = "unknown command";
+	else if (argc - 1 != command->n_args)
+		err = "wrong number of arguments";
+	else
+		err = command->fn(self, out, argv);
+
+	if (err)
+		fprintf(out, "error: %s\n", err);
+	else
+		fprintf(out, "ok\n");
+}
+
 int show_version(void)
 {
 	printf("wayvnc: %s\n", wayvnc_version);
@@ -737,6 +2116,7 @@ int show_version(void)
 int main(int argc, char* argv[])
 {
 	struct wayvnc self = { 0 };
+	self.start_time = gettime_us();
 
 	const char* cfg_file = NULL;
 
@@ -748,21 +2128,29 @@ int main(int argc, char* argv[])
 	const char* seat_name = NULL;
 
 	bool overlay_cursor = false;
-	bool show_performance = false;
+	bool use_all_outputs = false;
 	int max_rate = 30;
+	double scale = 1.0;
+	int n_workers = 0;
+	const char* record_path = NULL;
 
-	static const char* shortopts = "C:o:k:s:rf:hpuV";
+	static const char* shortopts = "C:o:ak:s:rf:S:w:R:hpJuV";
 	int drm_fd MAYBE_UNUSED = -1;
 
 	static const struct option longopts[] = {
 		{ "config", required_argument, NULL, 'C' },
 		{ "output", required_argument, NULL, 'o' },
+		{ "all-outputs", no_argument, NULL, 'a' },
 		{ "keyboard", required_argument, NULL, 'k' },
 		{ "seat", required_argument, NULL, 's' },
 		{ "render-cursor", no_argument, NULL, 'r' },
 		{ "max-fps", required_argument, NULL, 'f' },
+		{ "scale", required_argument, NULL, 'S' },
+		{ "workers", required_argument, NULL, 'w' },
+		{ "record", required_argument, NULL, 'R' },
 		{ "help", no_argument, NULL, 'h' },
 		{ "show-performance", no_argument, NULL, 'p' },
+		{ "json-performance", no_argument, NULL, 'J' },
 		{ "unix-socket", no_argument, NULL, 'u' },
 		{ "version", no_argument, NULL, 'V' },
 		{ NULL, 0, NULL, 0 }
@@ -780,6 +2168,9 @@ int main(int argc, char* argv[])
 		case 'o':
 			output_name = optarg;
 			break;
+		case 'a':
+			use_all_outputs = true;
+			break;
 		case 'k':
 			parse_keyboard_option(&self, optarg);
 			break;
@@ -792,8 +2183,21 @@ int main(int argc, char* argv[])
 		case 'f':
 			max_rate = atoi(optarg);
 			break;
+		case 'S':
+			scale = atof(optarg);
+			break;
+		case 'w':
+			n_workers = atoi(optarg);
+			break;
+		case 'R':
+			record_path = optarg;
+			break;
 		case 'p':
-			show_performance = true;
+			self.show_performance = true;
+			break;
+		case 'J':
+			self.show_performance = true;
+			self.use_json_performance = true;
 			break;
 		case 'u':
 			use_unix_socket = true;
@@ -816,6 +2220,7 @@ int main(int argc, char* argv[])
 		port = atoi(argv[optind + 1]);
 
 	errno = 0;
+	self.cfg_path = cfg_file;
 	int cfg_rc = cfg_load(&self.cfg, cfg_file);
 	if (cfg_rc != 0 && (cfg_file || errno != ENOENT)) {
 		if (cfg_rc > 0) {
@@ -839,13 +2244,65 @@ int main(int argc, char* argv[])
 	if (!address) address = DEFAULT_ADDRESS;
 	if (!port) port = DEFAULT_PORT;
 
+	if (!n_workers)
+		n_workers = self.cfg.worker_threads;
+
+	if (wayvnc_init_sched(&self) < 0)
+		return 1;
+
 	if (init_wayland(&self) < 0) {
 		log_error("Failed to initialise wayland\n");
 		return 1;
 	}
 
-	struct output* out;
-	if (output_name) {
+	if (output_name && use_all_outputs) {
+		log_error("--output and --all-outputs are mutually exclusive\n");
+		goto failure;
+	}
+
+	if (scale <= 0.0 || scale > 1.0) {
+		log_error("--scale must be greater than 0 and at most 1\n");
+		goto failure;
+	}
+
+	if (scale != 1.0 && use_all_outputs) {
+		log_error("--scale and --all-outputs are mutually exclusive\n");
+		goto failure;
+	}
+
+	if (record_path && use_all_outputs) {
+		log_error("--record and --all-outputs are mutually exclusive\n");
+		goto failure;
+	}
+
+	if (record_path) {
+		self.recorder = recorder_new(record_path);
+		if (!self.recorder)
+			goto failure;
+	}
+
+	if (self.cfg.capture_region) {
+		if (!geometry_parse(&self.region, self.cfg.capture_region)) {
+			log_error("Invalid capture region: %s\n",
+					self.cfg.capture_region);
+			goto failure;
+		}
+
+		if (use_all_outputs) {
+			log_error("capture_region cannot be used with --all-outputs\n");
+			goto failure;
+		}
+
+		self.has_region = true;
+	}
+
+	struct output* out = NULL;
+	if (use_all_outputs) {
+		if (wl_list_empty(&self.outputs)) {
+			log_error("No output found\n");
+			goto failure;
+		}
+	} else if (output_name) {
 		out = output_find_by_name(&self.outputs, output_name);
 		if (!out) {
 			log_error("No such output\n");
@@ -876,23 +2333,51 @@ int main(int argc, char* argv[])
 
 	self.selected_output = out;
 	self.selected_seat = seat;
-	self.screencopy.wl_output = out->wl_output;
+	self.screencopy.wl_output = out ? out->wl_output : NULL;
+	/* The cursor is drawn by the clients instead, so pointer motion
+	 * doesn't damage the frames.
+	 */
+	if (self.cfg.cursor_channel)
+		overlay_cursor = false;
+
+	self.screencopy.overlay_cursor = overlay_cursor;
+	// The capture thread hasn't been started yet
+	struct screencopy_config capture_config;
+	wayvnc_get_capture_config(&self, &capture_config);
+	screencopy_configure(&self.screencopy, &capture_config);
+	self.screencopy.enable_damage_refinery =
+		self.cfg.enable_damage_refinery;
 	self.screencopy.rate_limit = max_rate;
 
+	self.collect_latency = self.show_performance ||
+		self.cfg.metrics_socket;
+	if (self.collect_latency) {
+		self.screencopy.wait_histogram = &self.latency.wait;
+		self.screencopy.capture_histogram = &self.latency.capture;
+		self.screencopy.present_histogram = &self.latency.present;
+	}
+	self.input_latency.capture_histogram = &self.latency.input_capture;
+	self.input_latency.feed_histogram = &self.latency.input_feed;
+	self.screencopy.min_rate = self.cfg.min_fps;
+	self.screencopy.rate_rise_time = 1.0e-3 * (self.cfg.fps_rise_time ?
+			self.cfg.fps_rise_time : DEFAULT_FPS_RISE_TIME);
+	self.screencopy.rate_fall_time = 1.0e-3 * (self.cfg.fps_fall_time ?
+			self.cfg.fps_fall_time : DEFAULT_FPS_FALL_TIME);
+
+	if (self.cfg.capture_format && !fourcc_from_string(
+				&self.screencopy.preferred_fourcc,
+				self.cfg.capture_format)) {
+		log_error("Unknown capture format: %s\n",
+				self.cfg.capture_format);
+		goto failure;
+	}
+
 	self.keyboard_backend.virtual_keyboard =
 		zwp_virtual_keyboard_manager_v1_create_virtual_keyboard(
 			self.keyboard_manager, self.selected_seat->wl_seat);
 
-	struct xkb_rule_names rule_names = {
-		.rules = self.cfg.xkb_rules,
-		.layout = self.kb_layout ? self.kb_layout : self.cfg.xkb_layout,
-		.model = self.cfg.xkb_model ? self.cfg.xkb_model : "pc105",
-		.variant = self.kb_variant ? self.kb_variant :
-			self.cfg.xkb_variant,
-		.options = self.cfg.xkb_options,
-	};
-
-	if (keyboard_init(&self.keyboard_backend, &rule_names) < 0) {
+	if (wayvnc_init_keyboard(&self, &self.keyboard_backend,
+				self.kb_layout, self.kb_variant) < 0) {
 		log_error("Failed to initialise keyboard\n");
 		goto failure;
 	}
@@ -900,20 +2385,15 @@ int main(int argc, char* argv[])
 	self.pointer_backend.vnc = self.nvnc;
 	self.pointer_backend.output = self.selected_output;
 
-	int pointer_manager_version =
-		zwlr_virtual_pointer_manager_v1_get_version(self.pointer_manager);
-
-	self.pointer_backend.pointer = pointer_manager_version >= 2
-		? zwlr_virtual_pointer_manager_v1_create_virtual_pointer_with_output(
-			self.pointer_manager, self.selected_seat->wl_seat,
-			out->wl_output)
-		: zwlr_virtual_pointer_manager_v1_create_virtual_pointer(
-			self.pointer_manager, self.selected_seat->wl_seat);
+	self.pointer_backend.pointer = wayvnc_create_virtual_pointer(&self);
 
 	pointer_init(&self.pointer_backend);
 
-	out->on_dimension_change = on_output_dimension_change;
-	out->userdata = &self;
+	if (out) {
+		out->on_dimension_change = on_output_dimension_change;
+		out->on_transform_change = on_output_transform_change;
+		out->userdata = &self;
+	}
 
 #ifdef ENABLE_SCREENCOPY_DMABUF
 	if (init_render_node(&drm_fd) < 0) {
@@ -927,48 +2407,179 @@ int main(int argc, char* argv[])
 
 	aml_set_default(aml);
 
+	/* Worker threads inherit the CPU affinity of the thread that starts
+	 * them. This includes the ones that neatvnc asks for when the server
+	 * is opened, so the main thread only gets its own CPUs after that.
+	 */
+	thread_sched_apply(&self.worker_sched);
+
+	if (n_workers > 0 && aml_require_workers(aml, n_workers) < 0) {
+		log_error("Failed to start worker threads\n");
+		goto main_loop_failure;
+	}
+
 	if (init_main_loop(&self) < 0)
 		goto main_loop_failure;
 
-	if (init_nvnc(&self, address, port, use_unix_socket) < 0)
-		goto nvnc_failure;
+	/* Capturing is set up before the VNC server is opened, so that the
+	 * buffer pool is warmed up in the meantime.
+	 */
+	if (self.screencopy.manager && use_all_outputs) {
+		if (self.cfg.capture_thread)
+			log_warning("capture_thread is not supported when capturing all outputs\n");
 
-	if (self.screencopy.manager)
+		if (init_desktop(&self) < 0) {
+			log_error("Failed to initialise desktop\n");
+			goto capture_init_failure;
+		}
+	} else if (self.screencopy.manager) {
+		if (self.cfg.capture_thread) {
+			if (capture_thread_init(&self.capture_thread,
+						&self.screencopy,
+						self.display) < 0) {
+				log_error("Failed to initialise capture thread\n");
+				goto capture_init_failure;
+			}
+
+			self.capture_thread.userdata = &self;
+			self.capture_thread.on_frame = on_capture_thread_frame;
+			self.capture_thread.sched = &self.capture_sched;
+			self.use_capture_thread = true;
+
+			/* The histograms belong to the main thread, which
+			 * fills them from the frames that arrive instead.
+			 */
+			self.screencopy.wait_histogram = NULL;
+			self.screencopy.capture_histogram = NULL;
+			self.screencopy.present_histogram = NULL;
+		}
+
+		/* Frames have to be read back for scaling and recording, and
+		 * export-dmabuf can only capture whole outputs.
+		 */
+		if (scale != 1.0 || self.recorder || self.has_region)
+			self.screencopy.force_shm = true;
+
+		self.screencopy.enable_export_dmabuf =
+			self.cfg.enable_export_dmabuf;
 		screencopy_init(&self.screencopy);
 
+		/* Imported frames are released through the export-dmabuf
+		 * state, which stays on the main thread.
+		 */
+		if (self.use_capture_thread)
+			self.screencopy.use_export_dmabuf = false;
+
+		wayvnc_init_pool(&self, &self.screencopy);
+
+		if (self.use_capture_thread &&
+		    capture_thread_start(&self.capture_thread) < 0) {
+			log_error("Failed to start capture thread\n");
+			goto screencopy_failure;
+		}
+
+		if (self.use_capture_thread)
+			log_debug("Capturing frames on a separate thread\n");
+		if (self.screencopy.use_export_dmabuf)
+			log_debug("Using export-dmabuf for capturing frames\n");
+	}
+
 	if (!self.screencopy.manager) {
 		log_error("screencopy is not supported by compositor\n");
-		goto capture_failure;
+		goto capture_init_failure;
 	}
 
-	if (self.data_control.manager)
+	if ((self.cfg.prerotate_buffers || scale != 1.0) && !self.desktop) {
+		prerotate_init(&self.prerotate);
+		self.prerotate.scale = scale;
+		self.prerotate.userdata = &self;
+		self.prerotate.on_frame = on_prerotate_frame;
+		self.use_prerotate = true;
+	}
+
+	/* The first frame is captured right away, so that it's ready by the
+	 * time that the first client connects. The compositor works on it
+	 * while the rest of the server is being set up.
+	 */
+	if (!self.desktop)
+		wayvnc_start_capture_immediate(&self);
+
+	int listen_fd = systemd_get_listen_fd();
+	if (init_nvnc(&self, address, port, use_unix_socket, listen_fd) < 0)
+		goto nvnc_failure;
+
+	thread_sched_apply(&self.main_sched);
+
+	if (self.cfg.cursor_channel && cursor_set_default(self.nvnc) < 0)
+		log_warning("Failed to set up the cursor channel\n");
+
+	if (self.cfg.metrics_socket) {
+		self.metrics_server = metrics_server_new(self.cfg.metrics_socket,
+				wayvnc_collect_metrics, &self);
+		if (!self.metrics_server)
+			goto capture_failure;
+	}
+
+	if (self.data_control.manager) {
 		data_control_init(&self.data_control, self.display, self.nvnc,
 				self.selected_seat->wl_seat);
+		if (self.cfg.clipboard_max_size)
+			self.data_control.max_size =
+				self.cfg.clipboard_max_size;
+	}
 
-	self.screencopy.overlay_cursor = overlay_cursor;
+	if (self.show_performance)
+		start_performance_ticker(&self);
 
-	if (wayvnc_start_capture(&self) < 0)
-		goto capture_failure;
+	if (self.cfg.control_socket) {
+		self.ctl_server = ctl_server_new(self.cfg.control_socket,
+				on_ctl_command, &self);
+		if (!self.ctl_server)
+			log_warning("Failed to create control socket\n");
+	}
 
-	if (show_performance)
-		start_performance_ticker(&self);
+	if (self.cfg.frame_tap_socket && self.desktop) {
+		log_warning("frame_tap_socket is not supported when capturing all outputs\n");
+	} else if (self.cfg.frame_tap_socket) {
+		self.frame_tap = frame_tap_new(self.cfg.frame_tap_socket);
+		if (!self.frame_tap)
+			log_warning("Failed to create frame tap socket\n");
+	}
+
+	systemd_notify_ready();
 
 	wl_display_dispatch(self.display);
 
 	while (!self.do_exit) {
-		wl_display_flush(self.display);
+		wayvnc_flush(&self);
 		aml_poll(aml, -1);
 		aml_dispatch(aml);
 	}
 
-	screencopy_stop(&self.screencopy);
+	wayvnc_stop_capture(&self);
 
+	if (self.ctl_server)
+		ctl_server_destroy(self.ctl_server);
+	if (self.frame_tap)
+		frame_tap_destroy(self.frame_tap);
+	stop_performance_ticker(&self);
+	if (self.metrics_server)
+		metrics_server_destroy(self.metrics_server);
 	nvnc_display_unref(self.nvnc_display);
 	nvnc_close(self.nvnc);
+	if (self.use_prerotate)
+		prerotate_destroy(&self.prerotate);
 	if (zwp_linux_dmabuf)
 		zwp_linux_dmabuf_v1_destroy(zwp_linux_dmabuf);
-	if (self.screencopy.manager)
+	/* neatvnc has released all buffers by now */
+	if (self.use_capture_thread)
+		capture_thread_stop(&self.capture_thread);
+	if (self.desktop)
+		desktop_destroy(self.desktop);
+	else if (self.screencopy.manager)
 		screencopy_destroy(&self.screencopy);
+	if (self.use_capture_thread)
+		capture_thread_destroy(&self.capture_thread);
 	if (self.data_control.manager)
 		data_control_destroy(&self.data_control);
 #ifdef ENABLE_SCREENCOPY_DMABUF
@@ -983,9 +2594,27 @@ int main(int argc, char* argv[])
 	return 0;
 
 capture_failure:
+	if (self.metrics_server)
+		metrics_server_destroy(self.metrics_server);
 	nvnc_display_unref(self.nvnc_display);
 	nvnc_close(self.nvnc);
 nvnc_failure:
+	wayvnc_stop_capture(&self);
+	if (self.use_prerotate)
+		prerotate_destroy(&self.prerotate);
+screencopy_failure:
+	/* The capture thread must be gone before the display is disconnected
+	 * by wayvnc_destroy().
+	 */
+	if (self.use_capture_thread)
+		capture_thread_stop(&self.capture_thread);
+	if (self.desktop)
+		desktop_destroy(self.desktop);
+	else
+		screencopy_destroy(&self.screencopy);
+	if (self.use_capture_thread)
+		capture_thread_destroy(&self.capture_thread);
+capture_init_failure:
 	aml_unref(aml);
 main_loop_failure:
 failure:
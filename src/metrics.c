@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <aml.h>
+
+#include "metrics.h"
+#include "histogram.h"
+#include "strlcpy.h"
+#include "unix-socket.h"
+#include "logging.h"
+
+#define METRICS_MAX_REQUEST_SIZE 4096
+
+struct metrics_server {
+	int fd;
+	char path[108];
+	struct aml_handler* handler;
+
+	metrics_collect_fn collect;
+	void* userdata;
+};
+
+struct metrics_connection {
+	struct metrics_server* server;
+	int fd;
+	size_t len;
+	char request[METRICS_MAX_REQUEST_SIZE];
+	struct unix_socket_out out;
+};
+
+/* Bucket boundaries in microseconds */
+static const uint64_t metrics_histogram_buckets[] = {
+	500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000,
+};
+
+#define N_HISTOGRAM_BUCKETS (sizeof(metrics_histogram_buckets) / \
+		sizeof(metrics_histogram_buckets[0]))
+
+void metrics_write_header(FILE* out, const char* name, const char* type,
+		const char* help)
+{
+	fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_write_value(FILE* out, const char* name, const char* labels,
+		double value)
+{
+	if (labels)
+		fprintf(out, "%s{%s} %.17g\n", name, labels, value);
+	else
+		fprintf(out, "%s %.17g\n", name, value);
+}
+
+void metrics_write_histogram(FILE* out, const char* name, const char* help,
+		const struct histogram* histogram)
+{
+	metrics_write_header(out, name, "histogram", help);
+
+	for (size_t i = 0; i < N_HISTOGRAM_BUCKETS; ++i) {
+		uint64_t bound = metrics_histogram_buckets[i];
+		fprintf(out, "%s_bucket{le=\"%g\"} %"PRIu32"\n", name,
+				bound * 1.0e-6,
+				histogram_count_le(histogram, bound));
+	}
+
+	fprintf(out, "%s_bucket{le=\"+Inf\"} %"PRIu32"\n", name,
+			histogram->count);
+	fprintf(out, "%s_sum %.6f\n", name, histogram->sum * 1.0e-6);
+	fprintf(out, "%s_count %"PRIu32"\n", name, histogram->count);
+}
+
+static void metrics_connection_destroy(void* userdata)
+{
+	struct metrics_connection* self = userdata;
+	unix_socket_out_destroy(&self->out);
+	close(self->fd);
+	free(self);
+}
+
+/* Returns 1 if some of the response still has to be sent */
+static int metrics_connection__respond(struct metrics_connection* self)
+{
+	char* body = NULL;
+	size_t body_len = 0;
+
+	FILE* out = open_memstream(&body, &body_len);
+	if (!out) {
+		log_error("open_memstream() failed: %m\n");
+		return -1;
+	}
+
+	self->server->collect(out, self->server->userdata);
+	fclose(out);
+
+	char header[256];
+	int header_len = snprintf(header, sizeof(header),
+			"HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n"
+			"\r\n", body_len);
+
+	int rc = unix_socket_out_send(&self->out, self->fd, header, header_len);
+	if (rc >= 0)
+		rc = unix_socket_out_send(&self->out, self->fd, body, body_len);
+	if (rc < 0)
+		log_debug("Failed to send metrics: %m\n");
+
+	free(body);
+	return rc;
+}
+
+static void metrics_connection__on_event(void* handler)
+{
+	struct metrics_connection* self = aml_get_userdata(handler);
+
+	// The connection is closed once the response has gone out
+	if (aml_get_revents(handler) & AML_EVENT_WRITE) {
+		int rc = unix_socket_out_flush(&self->out, self->fd);
+		if (rc < 0)
+			log_debug("Failed to send metrics: %m\n");
+		if (rc != 1)
+			aml_stop(aml_get_default(), handler);
+		return;
+	}
+
+	ssize_t ret = read(self->fd, self->request + self->len,
+			sizeof(self->request) - self->len - 1);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	if (ret > 0) {
+		self->len += ret;
+		self->request[self->len] = '\0';
+
+		/* Wait for the request to end, unless it's too large */
+		if (!strstr(self->request, "\r\n\r\n") &&
+		    !strstr(self->request, "\n\n") &&
+		    self->len < sizeof(self->request) - 1)
+			return;
+
+		if (metrics_connection__respond(self) == 1) {
+			aml_set_event_mask(handler, AML_EVENT_WRITE);
+			return;
+		}
+	}
+
+	aml_stop(aml_get_default(), handler);
+}
+
+static void metrics_server__on_connection(void* handler)
+{
+	struct metrics_server* self = aml_get_userdata(handler);
+
+	int fd = accept4(self->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		log_debug("Failed to accept metrics connection: %m\n");
+		return;
+	}
+
+	struct metrics_connection* connection = calloc(1, sizeof(*connection));
+	if (!connection) {
+		close(fd);
+		return;
+	}
+
+	connection->server = self;
+	connection->fd = fd;
+
+	struct aml_handler* conn_handler = aml_handler_new(fd,
+			metrics_connection__on_event, connection,
+			metrics_connection_destroy);
+	if (!conn_handler) {
+		metrics_connection_destroy(connection);
+		return;
+	}
+
+	aml_start(aml_get_default(), conn_handler);
+	aml_unref(conn_handler);
+}
+
+struct metrics_server* metrics_server_new(const char* path,
+		metrics_collect_fn collect, void* userdata)
+{
+	struct metrics_server* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->collect = collect;
+	self->userdata = userdata;
+
+	strlcpy(self->path, path, sizeof(self->path));
+
+	self->fd = unix_socket_listen(path, SOCK_STREAM);
+	if (self->fd < 0) {
+		log_error("Failed to set up metrics socket\n");
+		goto listen_failure;
+	}
+
+	self->handler = aml_handler_new(self->fd,
+			metrics_server__on_connection, self, NULL);
+	if (!self->handler)
+		goto handler_failure;
+
+	if (aml_start(aml_get_default(), self->handler) < 0)
+		goto start_failure;
+
+	return self;
+
+start_failure:
+	aml_unref(self->handler);
+handler_failure:
+	close(self->fd);
+	unlink(path);
+listen_failure:
+	free(self);
+	return NULL;
+}
+
+void metrics_server_destroy(struct metrics_server* self)
+{
+	aml_stop(aml_get_default(), self->handler);
+	aml_unref(self->handler);
+	close(self->fd);
+	unlink(self->path);
+	free(self);
+}
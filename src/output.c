@@ -115,6 +115,14 @@ uint32_t output_get_transformed_height(const struct output* self)
 	      ? self->width : self->height;
 }
 
+uint64_t output_get_refresh_interval(const struct output* self)
+{
+	if (self->refresh == 0)
+		return 0;
+
+	return UINT64_C(1000000000) / self->refresh;
+}
+
 static void output_handle_geometry(void* data, struct wl_output* wl_output,
 				   int32_t x, int32_t y, int32_t phys_width,
 				   int32_t phys_height, int32_t subpixel,
@@ -143,11 +151,19 @@ static void output_handle_mode(void* data, struct wl_output* wl_output,
 	if (!(flags & WL_OUTPUT_MODE_CURRENT))
 		return;
 
-	if (width != (int32_t)output->width || height != (int32_t)output->height)
+	uint32_t new_refresh = refresh > 0 ? refresh : 0;
+
+	/* A new refresh rate is handled like new dimensions, so that the
+	 * capture is reconfigured for it.
+	 */
+	if (width != (int32_t)output->width ||
+	    height != (int32_t)output->height ||
+	    new_refresh != output->refresh)
 		output->is_dimension_changed = true;
 
 	output->width = width;
 	output->height = height;
+	output->refresh = new_refresh;
 }
 
 static void output_handle_done(void* data, struct wl_output* wl_output)
@@ -219,6 +235,20 @@ void output_logical_position(void* data, struct zxdg_output_v1* xdg_output,
 void output_logical_size(void* data, struct zxdg_output_v1* xdg_output,
                          int32_t width, int32_t height)
 {
+	struct output* self = data;
+
+	uint32_t new_width = width > 0 ? width : 0;
+	uint32_t new_height = height > 0 ? height : 0;
+
+	/* A capture region is placed in logical coordinates, so it has to be
+	 * placed again when the scale changes.
+	 */
+	if (new_width != self->logical_width ||
+	    new_height != self->logical_height)
+		self->is_dimension_changed = true;
+
+	self->logical_width = new_width;
+	self->logical_height = new_height;
 }
 
 void output_name(void* data, struct zxdg_output_v1* xdg_output,
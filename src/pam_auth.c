@@ -18,6 +18,10 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <security/pam_appl.h>
 
 #include "logging.h"
@@ -25,8 +29,29 @@
 struct credentials {
 	const char* user;
 	const char* password;
+
+	// Requested by modules such as pam_faildelay, in microseconds
+	unsigned int fail_delay;
+};
+
+/* Shared between the thread that asked and the thread that talks to PAM. The
+ * last one to let go of it frees it.
+ */
+struct pam_auth_request {
+	int ref;
+	bool is_done;
+	bool result;
+	pthread_cond_t cond;
+
+	char* username;
+	char* password;
 };
 
+static pthread_mutex_t pam_auth_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int pam_auth_max_attempts;
+static uint32_t pam_auth_timeout;
+static unsigned int pam_auth_n_attempts;
+
 static int pam_return_pwd(int num_msg, const struct pam_message** msgm,
                           struct pam_response** response, void* appdata_ptr)
 {
@@ -54,18 +79,30 @@ error:
 	return PAM_CONV_ERR;
 }
 
-bool pam_auth(const char* username, const char* password)
+/* PAM calls this with the conversation's data instead of sleeping inside
+ * pam_authenticate(), so that the result can be handed over first.
+ */
+static void pam_on_fail_delay(int retval, unsigned usec_delay,
+		void* appdata_ptr)
 {
-	struct credentials cred = { username, password };
-	struct pam_conv conv = { &pam_return_pwd, &cred };
+	struct credentials* cred = appdata_ptr;
+	(void)retval;
+	cred->fail_delay = usec_delay;
+}
+
+static bool pam_auth__run(struct credentials* cred)
+{
+	struct pam_conv conv = { &pam_return_pwd, cred };
 	const char* service = "wayvnc";
 	pam_handle_t* pamh;
-	int result = pam_start(service, username, &conv, &pamh);
+	int result = pam_start(service, cred->user, &conv, &pamh);
 	if (result != PAM_SUCCESS) {
 		log_error("ERROR: PAM start failed: %s\n", pam_strerror(pamh, result));
 		return false;
 	}
 
+	pam_set_item(pamh, PAM_FAIL_DELAY, (const void*)pam_on_fail_delay);
+
 	result = pam_authenticate(pamh, PAM_SILENT|PAM_DISALLOW_NULL_AUTHTOK);
 	if (result != PAM_SUCCESS) {
 		log_error("PAM authenticate failed: %s\n", pam_strerror(pamh, result));
@@ -82,3 +119,167 @@ error:
 	pam_end(pamh, result);
 	return result == PAM_SUCCESS;
 }
+
+static void pam_auth__free_string(char* str)
+{
+	if (!str)
+		return;
+
+	explicit_bzero(str, strlen(str));
+	free(str);
+}
+
+// Must be called with pam_auth_mutex held
+static void pam_auth__unref(struct pam_auth_request* request)
+{
+	if (--request->ref > 0)
+		return;
+
+	pthread_cond_destroy(&request->cond);
+	pam_auth__free_string(request->username);
+	pam_auth__free_string(request->password);
+	free(request);
+}
+
+static void* pam_auth__thread(void* userdata)
+{
+	struct pam_auth_request* request = userdata;
+
+	struct credentials cred = {
+		.user = request->username,
+		.password = request->password,
+	};
+	bool result = pam_auth__run(&cred);
+
+	pthread_mutex_lock(&pam_auth_mutex);
+	request->result = result;
+	request->is_done = true;
+	pthread_cond_signal(&request->cond);
+	pthread_mutex_unlock(&pam_auth_mutex);
+
+	/* Serving the delay here keeps the attempt counted against the limit
+	 * without holding up whoever is waiting for the result.
+	 */
+	if (cred.fail_delay)
+		usleep(cred.fail_delay);
+
+	pthread_mutex_lock(&pam_auth_mutex);
+	pam_auth_n_attempts--;
+	pam_auth__unref(request);
+	pthread_mutex_unlock(&pam_auth_mutex);
+
+	return NULL;
+}
+
+static struct pam_auth_request* pam_auth__request_new(const char* username,
+		const char* password)
+{
+	struct pam_auth_request* request = calloc(1, sizeof(*request));
+	if (!request)
+		return NULL;
+
+	request->username = strdup(username);
+	request->password = strdup(password);
+	if (!request->username || !request->password)
+		goto failure;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	int rc = pthread_cond_init(&request->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (rc != 0)
+		goto failure;
+
+	// One for the caller and one for the thread
+	request->ref = 2;
+	return request;
+
+failure:
+	pam_auth__free_string(request->username);
+	pam_auth__free_string(request->password);
+	free(request);
+	return NULL;
+}
+
+static int pam_auth__wait(struct pam_auth_request* request)
+{
+	if (!pam_auth_timeout) {
+		while (!request->is_done)
+			pthread_cond_wait(&request->cond, &pam_auth_mutex);
+		return 0;
+	}
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += pam_auth_timeout / 1000;
+	deadline.tv_nsec += (pam_auth_timeout % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	while (!request->is_done)
+		if (pthread_cond_timedwait(&request->cond, &pam_auth_mutex,
+					&deadline) == ETIMEDOUT)
+			return request->is_done ? 0 : -1;
+
+	return 0;
+}
+
+void pam_auth_set_limits(unsigned int max_attempts, uint32_t timeout_ms)
+{
+	pthread_mutex_lock(&pam_auth_mutex);
+	pam_auth_max_attempts = max_attempts;
+	pam_auth_timeout = timeout_ms;
+	pthread_mutex_unlock(&pam_auth_mutex);
+}
+
+bool pam_auth(const char* username, const char* password)
+{
+	pthread_mutex_lock(&pam_auth_mutex);
+
+	if (pam_auth_max_attempts &&
+			pam_auth_n_attempts >= pam_auth_max_attempts) {
+		pthread_mutex_unlock(&pam_auth_mutex);
+		log_error("Too many PAM authentication attempts in progress. Denying access for %s\n",
+				username);
+		return false;
+	}
+
+	struct pam_auth_request* request = pam_auth__request_new(username,
+			password);
+	if (!request) {
+		pthread_mutex_unlock(&pam_auth_mutex);
+		return false;
+	}
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_t thread;
+	int rc = pthread_create(&thread, &attr, pam_auth__thread, request);
+	pthread_attr_destroy(&attr);
+	if (rc != 0) {
+		log_error("Failed to start PAM authentication thread: %s\n",
+				strerror(rc));
+		request->ref = 1;
+		pam_auth__unref(request);
+		pthread_mutex_unlock(&pam_auth_mutex);
+		return false;
+	}
+
+	pam_auth_n_attempts++;
+
+	bool result = false;
+	if (pam_auth__wait(request) == 0)
+		result = request->result;
+	else
+		log_error("PAM authentication for %s timed out\n", username);
+
+	pam_auth__unref(request);
+	pthread_mutex_unlock(&pam_auth_mutex);
+
+	return result;
+}
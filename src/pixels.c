@@ -21,6 +21,7 @@
 #include <assert.h>
 #include <libdrm/drm_fourcc.h>
 #include <stdbool.h>
+#include <strings.h>
 
 enum wl_shm_format fourcc_to_wl_shm(uint32_t in)
 {
@@ -114,3 +115,41 @@ bool fourcc_to_pixman_fmt(pixman_format_code_t* dst, uint32_t src)
 	return true;
 }
 
+
+int fourcc_get_pixel_size(uint32_t fourcc)
+{
+	pixman_format_code_t format;
+	if (!fourcc_to_pixman_fmt(&format, fourcc))
+		return 0;
+
+	return PIXMAN_FORMAT_BPP(format) / 8;
+}
+
+struct fourcc_name {
+	const char* name;
+	uint32_t fourcc;
+};
+
+static const struct fourcc_name fourcc_names[] = {
+	{ "argb8888", DRM_FORMAT_ARGB8888 },
+	{ "xrgb8888", DRM_FORMAT_XRGB8888 },
+	{ "abgr8888", DRM_FORMAT_ABGR8888 },
+	{ "xbgr8888", DRM_FORMAT_XBGR8888 },
+	{ "rgb888", DRM_FORMAT_RGB888 },
+	{ "bgr888", DRM_FORMAT_BGR888 },
+	{ "rgb565", DRM_FORMAT_RGB565 },
+	{ "bgr565", DRM_FORMAT_BGR565 },
+};
+
+bool fourcc_from_string(uint32_t* dst, const char* str)
+{
+	size_t len = sizeof(fourcc_names) / sizeof(fourcc_names[0]);
+
+	for (size_t i = 0; i < len; ++i)
+		if (strcasecmp(fourcc_names[i].name, str) == 0) {
+			*dst = fourcc_names[i].fourcc;
+			return true;
+		}
+
+	return false;
+}
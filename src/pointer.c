@@ -25,6 +25,14 @@
 
 int pointer_init(struct pointer* self)
 {
+	/* Nothing has been sent through this virtual pointer yet, so the
+	 * first position must go out even if it matches the last one.
+	 */
+	self->current_mask = 0;
+	self->current_x = UINT32_MAX;
+	self->current_y = UINT32_MAX;
+	self->has_pending_motion = false;
+
 	zwlr_virtual_pointer_v1_axis_source(self->pointer,
 					    WL_POINTER_AXIS_SOURCE_WHEEL);
 	return 0;
@@ -69,22 +77,72 @@ static void pointer_set_button_mask(struct pointer* self, uint32_t t,
 	self->current_mask = mask;
 }
 
-void pointer_set(struct pointer* self, uint32_t x, uint32_t y,
-		 enum nvnc_button_mask button_mask)
+static void pointer_send_motion(struct pointer* self, uint32_t t,
+				uint32_t x, uint32_t y)
 {
-	uint32_t t = gettime_ms();
+	uint32_t width = self->output ? self->output->width : self->width;
+	uint32_t height = self->output ? self->output->height : self->height;
 
 	if (x != self->current_x || y != self->current_y)
 		zwlr_virtual_pointer_v1_motion_absolute(self->pointer, t,
-		                                        x, y,
-		                                        self->output->width,
-		                                        self->output->height);
+		                                        x, y, width, height);
 
 	self->current_x = x;
 	self->current_y = y;
+}
+
+void pointer_set(struct pointer* self, uint32_t x, uint32_t y,
+		 enum nvnc_button_mask button_mask)
+{
+	uint32_t t = gettime_ms();
+
+	/* Only the last position matters for motion that isn't accompanied
+	 * by a button or scroll transition, so it is held back until
+	 * pointer_flush() is called.
+	 */
+	if (button_mask == self->current_mask) {
+		self->pending_x = x;
+		self->pending_y = y;
+		self->pending_time = t;
+		self->has_pending_motion = true;
+		return;
+	}
+
+	self->has_pending_motion = false;
+
+	pointer_send_motion(self, t, x, y);
+	pointer_set_button_mask(self, t, button_mask);
+	zwlr_virtual_pointer_v1_frame(self->pointer);
+	self->n_frames++;
+}
+
+void pointer_flush(struct pointer* self)
+{
+	if (!self->has_pending_motion)
+		return;
+
+	self->has_pending_motion = false;
+
+	if (self->pending_x == self->current_x &&
+	    self->pending_y == self->current_y)
+		return;
+
+	pointer_send_motion(self, self->pending_time, self->pending_x,
+			self->pending_y);
+	zwlr_virtual_pointer_v1_frame(self->pointer);
+	self->n_frames++;
+}
+
+void pointer_release_all(struct pointer* self)
+{
+	pointer_flush(self);
 
-	if (button_mask != self->current_mask)
-		pointer_set_button_mask(self, t, button_mask);
+	// Scrolling happens on release, which would scroll once more
+	self->current_mask &= ~(NVNC_SCROLL_UP | NVNC_SCROLL_DOWN);
+	if (!self->current_mask)
+		return;
 
+	pointer_set_button_mask(self, gettime_ms(), 0);
 	zwlr_virtual_pointer_v1_frame(self->pointer);
+	self->n_frames++;
 }
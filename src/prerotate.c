@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <wayland-client.h>
+#include <pixman.h>
+#include <neatvnc.h>
+
+#include "prerotate.h"
+#include "buffer.h"
+#include "pixels.h"
+#include "transform-util.h"
+#include "logging.h"
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static void prerotate__paint(struct prerotate* self);
+
+static bool is_transform_90(enum wl_output_transform transform)
+{
+	return transform & WL_OUTPUT_TRANSFORM_90;
+}
+
+static double prerotate__get_scale(const struct prerotate* self)
+{
+	return self->scale > 0.0 ? self->scale : 1.0;
+}
+
+/* pixman wants every row to start on a 32 bit boundary */
+static uint32_t prerotate__get_stride(const struct prerotate* self)
+{
+	return (self->width + 3) & ~3u;
+}
+
+static void prerotate__release_frame(struct wv_buffer* frame)
+{
+	/* This hands the frame back to whoever it belongs to, unless the
+	 * frame tap still holds on to it.
+	 */
+	wv_buffer_release(frame);
+}
+
+static void prerotate__damage(struct prerotate* self,
+		struct pixman_region16* damage)
+{
+	pixman_region_union(&self->damage, &self->damage, damage);
+
+	for (int i = 0; i < PREROTATE_N_BUFFERS; ++i)
+		pixman_region_union(&self->buffers[i].damage,
+				&self->buffers[i].damage, damage);
+}
+
+static void prerotate__destroy_buffers(struct prerotate* self)
+{
+	for (int i = 0; i < PREROTATE_N_BUFFERS; ++i) {
+		struct prerotate_buffer* buffer = &self->buffers[i];
+		if (!buffer->fb)
+			continue;
+
+		/* The display may still be holding on to the buffer, so it
+		 * must not call back into us once we've let go of it.
+		 */
+		nvnc_fb_set_release_fn(buffer->fb, NULL, NULL);
+		nvnc_fb_unref(buffer->fb);
+		buffer->fb = NULL;
+		buffer->is_held = false;
+		pixman_region_clear(&buffer->damage);
+	}
+}
+
+static void prerotate__on_buffer_release(struct nvnc_fb* fb, void* context)
+{
+	struct prerotate_buffer* buffer = context;
+	struct prerotate* self = buffer->parent;
+
+	buffer->is_held = false;
+
+	if (self->frame)
+		prerotate__paint(self);
+}
+
+static void prerotate__configure(struct prerotate* self,
+		const struct wv_buffer* frame,
+		enum wl_output_transform transform)
+{
+	if (self->src_width == frame->width &&
+			self->src_height == frame->height &&
+			self->format == frame->format &&
+			self->transform == transform)
+		return;
+
+	prerotate__destroy_buffers(self);
+
+	self->src_width = frame->width;
+	self->src_height = frame->height;
+	self->format = frame->format;
+	self->transform = transform;
+
+	int width = frame->width;
+	int height = frame->height;
+	if (is_transform_90(transform)) {
+		width = frame->height;
+		height = frame->width;
+	}
+
+	double scale = prerotate__get_scale(self);
+	self->width = MAX(1, (int)(width * scale + 0.5));
+	self->height = MAX(1, (int)(height * scale + 0.5));
+
+	free(self->filter_params);
+	self->filter_params = NULL;
+	self->n_filter_params = 0;
+
+	/* A box filter makes every upright pixel the average of the output
+	 * pixels that it covers.
+	 */
+	if (scale != 1.0) {
+		pixman_fixed_t inv = pixman_double_to_fixed(1.0 / scale);
+		self->filter_params = pixman_filter_create_separable_convolution(
+				&self->n_filter_params, inv, inv,
+				PIXMAN_KERNEL_BOX, PIXMAN_KERNEL_BOX,
+				PIXMAN_KERNEL_BOX, PIXMAN_KERNEL_BOX, 1, 1);
+	}
+
+	pixman_region_union_rect(&self->damage, &self->damage, 0, 0,
+			self->width, self->height);
+
+	log_debug("Pre-rotating %dx%d frames into %"PRIu32"x%"PRIu32" buffers\n",
+			frame->width, frame->height, self->width, self->height);
+}
+
+/* Maps damage in the output onto the scaled buffers. The region is padded
+ * so that it also covers the pixels that the filter pulls in.
+ */
+static void prerotate__scale_damage(struct prerotate* self,
+		struct pixman_region16* damage)
+{
+	double scale = prerotate__get_scale(self);
+	if (scale == 1.0)
+		return;
+
+	int n_rects = 0;
+	pixman_box16_t* rects = pixman_region_rectangles(damage, &n_rects);
+
+	struct pixman_region16 scaled;
+	pixman_region_init(&scaled);
+
+	for (int i = 0; i < n_rects; ++i) {
+		int x1 = MAX(0, (int)(rects[i].x1 * scale) - 1);
+		int y1 = MAX(0, (int)(rects[i].y1 * scale) - 1);
+		int x2 = MIN((int)self->width, (int)(rects[i].x2 * scale) + 2);
+		int y2 = MIN((int)self->height, (int)(rects[i].y2 * scale) + 2);
+
+		if (x2 > x1 && y2 > y1)
+			pixman_region_union_rect(&scaled, &scaled, x1, y1,
+					x2 - x1, y2 - y1);
+	}
+
+	pixman_region_copy(damage, &scaled);
+	pixman_region_fini(&scaled);
+}
+
+static struct prerotate_buffer* prerotate__acquire_buffer(
+		struct prerotate* self)
+{
+	for (int i = 0; i < PREROTATE_N_BUFFERS; ++i) {
+		struct prerotate_buffer* buffer = &self->buffers[i];
+		if (buffer->is_held)
+			continue;
+
+		if (buffer->fb)
+			return buffer;
+
+		buffer->fb = nvnc_fb_new(self->width, self->height,
+				self->format, prerotate__get_stride(self));
+		if (!buffer->fb)
+			return NULL;
+
+		nvnc_fb_set_release_fn(buffer->fb, prerotate__on_buffer_release,
+				buffer);
+
+		pixman_region_union_rect(&buffer->damage, &buffer->damage, 0, 0,
+				self->width, self->height);
+		return buffer;
+	}
+
+	return NULL;
+}
+
+static bool prerotate__paint_buffer(struct prerotate* self,
+		struct prerotate_buffer* buffer, struct wv_buffer* frame)
+{
+	pixman_format_code_t format;
+	if (!fourcc_to_pixman_fmt(&format, frame->format))
+		return false;
+
+	int pixel_size = PIXMAN_FORMAT_BPP(format) / 8;
+
+	pixman_image_t* src = pixman_image_create_bits_no_clear(format,
+			frame->width, frame->height, frame->pixels,
+			frame->stride);
+	if (!src)
+		return false;
+
+	pixman_image_t* dst = pixman_image_create_bits_no_clear(format,
+			self->width, self->height, nvnc_fb_get_addr(buffer->fb),
+			prerotate__get_stride(self) * pixel_size);
+	if (!dst) {
+		pixman_image_unref(src);
+		return false;
+	}
+
+	pixman_transform_t pxform;
+	wv_pixman_transform_from_wl_output_transform(&pxform, self->transform,
+			frame->width, frame->height);
+
+	double scale = prerotate__get_scale(self);
+	if (scale != 1.0) {
+		pixman_fixed_t inv = pixman_double_to_fixed(1.0 / scale);
+
+		pixman_transform_t scaling;
+		pixman_transform_init_scale(&scaling, inv, inv);
+		pixman_transform_multiply(&pxform, &pxform, &scaling);
+	}
+
+	pixman_image_set_transform(src, &pxform);
+
+	if (self->filter_params)
+		pixman_image_set_filter(src,
+				PIXMAN_FILTER_SEPARABLE_CONVOLUTION,
+				self->filter_params, self->n_filter_params);
+
+	/* Only the damaged parts are copied; pixman picks a dedicated
+	 * rotation path for the plain 90 degree steps.
+	 */
+	pixman_image_set_clip_region(dst, &buffer->damage);
+	pixman_image_composite(PIXMAN_OP_SRC, src, NULL, dst, 0, 0, 0, 0,
+			0, 0, self->width, self->height);
+
+	pixman_image_unref(dst);
+	pixman_image_unref(src);
+	return true;
+}
+
+static void prerotate__paint(struct prerotate* self)
+{
+	struct prerotate_buffer* buffer = prerotate__acquire_buffer(self);
+	if (!buffer) {
+		/* Every buffer is still held by the display or the encoder.
+		 * The frame is painted once one of them is released.
+		 */
+		self->n_deferred++;
+		return;
+	}
+
+	struct wv_buffer* frame = self->frame;
+	self->frame = NULL;
+
+	bool ok = prerotate__paint_buffer(self, buffer, frame);
+	prerotate__release_frame(frame);
+
+	if (!ok) {
+		log_error("Failed to copy frame into upright buffer\n");
+		return;
+	}
+
+	pixman_region_clear(&buffer->damage);
+
+	buffer->is_held = true;
+	self->n_frames++;
+	self->on_frame(self, buffer->fb, &self->damage);
+	pixman_region_clear(&self->damage);
+}
+
+bool prerotate_is_enabled(const struct prerotate* self,
+		enum wl_output_transform transform)
+{
+	return transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+		prerotate__get_scale(self) != 1.0;
+}
+
+bool prerotate_is_supported(const struct wv_buffer* frame)
+{
+	/* DMA-BUFs are not mapped, so there is nothing to copy from */
+	if (!frame->pixels)
+		return false;
+
+	pixman_format_code_t format;
+	return fourcc_to_pixman_fmt(&format, frame->format);
+}
+
+void prerotate_feed(struct prerotate* self, struct wv_buffer* frame,
+		enum wl_output_transform transform,
+		struct pixman_region16* damage)
+{
+	prerotate__configure(self, frame, transform);
+
+	struct pixman_region16 mapped;
+	pixman_region_init(&mapped);
+	wv_region_transform(&mapped, damage, transform, frame->width,
+			frame->height);
+	prerotate__scale_damage(self, &mapped);
+	pixman_region_intersect_rect(&mapped, &mapped, 0, 0, self->width,
+			self->height);
+	prerotate__damage(self, &mapped);
+	pixman_region_fini(&mapped);
+
+	/* A frame that is still waiting is superseded by this one */
+	if (self->frame)
+		prerotate__release_frame(self->frame);
+
+	wv_buffer_hold(frame);
+	self->frame = frame;
+	prerotate__paint(self);
+}
+
+void prerotate_unscale_coord(const struct prerotate* self, uint32_t x,
+		uint32_t y, uint32_t* dst_x, uint32_t* dst_y)
+{
+	double scale = prerotate__get_scale(self);
+
+	*dst_x = x / scale;
+	*dst_y = y / scale;
+}
+
+void prerotate_init(struct prerotate* self)
+{
+	memset(self, 0, sizeof(*self));
+
+	pixman_region_init(&self->damage);
+
+	for (int i = 0; i < PREROTATE_N_BUFFERS; ++i) {
+		self->buffers[i].parent = self;
+		pixman_region_init(&self->buffers[i].damage);
+	}
+}
+
+void prerotate_destroy(struct prerotate* self)
+{
+	if (self->frame)
+		prerotate__release_frame(self->frame);
+	self->frame = NULL;
+
+	prerotate__destroy_buffers(self);
+
+	for (int i = 0; i < PREROTATE_N_BUFFERS; ++i)
+		pixman_region_fini(&self->buffers[i].damage);
+
+	pixman_region_fini(&self->damage);
+	free(self->filter_params);
+}
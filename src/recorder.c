@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <pixman.h>
+
+#include "sys/queue.h"
+#include "recorder.h"
+#include "frame-trace.h"
+#include "buffer.h"
+#include "pixels.h"
+#include "damage-util.h"
+#include "logging.h"
+
+/* Frames are dropped once this much is waiting to be written */
+#define MAX_QUEUED_BYTES (256 << 20)
+
+struct recorder_frame {
+	TAILQ_ENTRY(recorder_frame) link;
+	size_t size;
+	// Holds the record as it goes into the file
+	uint64_t data[];
+};
+
+TAILQ_HEAD(recorder_frame_queue, recorder_frame);
+
+struct recorder {
+	FILE* file;
+	pthread_t thread;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct recorder_frame_queue queue;
+	size_t n_queued_bytes;
+	bool do_exit;
+
+	// Only accessed by the writer thread
+	uint64_t offset;
+	struct frame_trace_index_entry* index;
+	size_t index_capacity;
+	uint64_t n_written;
+	bool has_failed;
+
+	// Only accessed by the recording thread
+	bool need_keyframe;
+	int width, height;
+	uint32_t format;
+	uint64_t n_frames;
+	uint64_t n_dropped;
+};
+
+static int recorder__write(struct recorder* self, const void* data,
+		size_t size)
+{
+	if (fwrite(data, 1, size, self->file) != size)
+		return -1;
+
+	self->offset += size;
+	return 0;
+}
+
+static int recorder__add_to_index(struct recorder* self,
+		const struct frame_trace_frame* frame, uint64_t offset)
+{
+	if (self->n_written == self->index_capacity) {
+		size_t capacity = self->index_capacity ?
+			self->index_capacity * 2 : 1024;
+		struct frame_trace_index_entry* index = realloc(self->index,
+				capacity * sizeof(*index));
+		if (!index)
+			return -1;
+
+		self->index = index;
+		self->index_capacity = capacity;
+	}
+
+	self->index[self->n_written++] = (struct frame_trace_index_entry) {
+		.offset = offset,
+		.time = frame->time,
+		.flags = frame->flags,
+		.damage_area = frame->damage_area,
+	};
+	return 0;
+}
+
+static void recorder__write_frame(struct recorder* self,
+		struct recorder_frame* rframe)
+{
+	const struct frame_trace_frame* frame = (const void*)rframe->data;
+	uint64_t offset = self->offset;
+
+	if (self->has_failed)
+		return;
+
+	if (recorder__write(self, rframe->data, rframe->size) < 0 ||
+	    recorder__add_to_index(self, frame, offset) < 0) {
+		log_error("Failed to write recorded frame: %m\n");
+		self->has_failed = true;
+	}
+}
+
+static void* recorder__run(void* userdata)
+{
+	struct recorder* self = userdata;
+
+	pthread_mutex_lock(&self->mutex);
+	for (;;) {
+		while (TAILQ_EMPTY(&self->queue) && !self->do_exit)
+			pthread_cond_wait(&self->cond, &self->mutex);
+
+		struct recorder_frame* rframe = TAILQ_FIRST(&self->queue);
+		if (!rframe)
+			break;
+
+		TAILQ_REMOVE(&self->queue, rframe, link);
+		pthread_mutex_unlock(&self->mutex);
+
+		recorder__write_frame(self, rframe);
+
+		pthread_mutex_lock(&self->mutex);
+		self->n_queued_bytes -= rframe->size;
+		free(rframe);
+	}
+	pthread_mutex_unlock(&self->mutex);
+
+	return NULL;
+}
+
+struct recorder* recorder_new(const char* path)
+{
+	struct recorder* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	TAILQ_INIT(&self->queue);
+	self->need_keyframe = true;
+
+	self->file = fopen(path, "wbe");
+	if (!self->file) {
+		log_error("Failed to open %s for recording: %m\n", path);
+		goto file_failure;
+	}
+
+	struct frame_trace_header header = {
+		.magic = FRAME_TRACE_MAGIC,
+		.version = FRAME_TRACE_VERSION,
+		.header_size = sizeof(header),
+	};
+	if (recorder__write(self, &header, sizeof(header)) < 0) {
+		log_error("Failed to write to %s: %m\n", path);
+		goto write_failure;
+	}
+
+	pthread_mutex_init(&self->mutex, NULL);
+	pthread_cond_init(&self->cond, NULL);
+
+	if (pthread_create(&self->thread, NULL, recorder__run, self) != 0)
+		goto thread_failure;
+
+	return self;
+
+thread_failure:
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->mutex);
+write_failure:
+	fclose(self->file);
+file_failure:
+	free(self);
+	return NULL;
+}
+
+static void recorder__finish(struct recorder* self)
+{
+	if (self->has_failed)
+		return;
+
+	struct frame_trace_footer footer = {
+		.index_offset = self->offset,
+		.n_frames = self->n_written,
+		.magic = FRAME_TRACE_INDEX_MAGIC,
+	};
+
+	if (recorder__write(self, self->index,
+				self->n_written * sizeof(*self->index)) < 0 ||
+	    recorder__write(self, &footer, sizeof(footer)) < 0 ||
+	    fflush(self->file) != 0)
+		log_error("Failed to write recording index: %m\n");
+}
+
+void recorder_destroy(struct recorder* self)
+{
+	pthread_mutex_lock(&self->mutex);
+	self->do_exit = true;
+	pthread_cond_signal(&self->cond);
+	pthread_mutex_unlock(&self->mutex);
+
+	pthread_join(self->thread, NULL);
+
+	recorder__finish(self);
+
+	log_debug("Recorded %"PRIu64" frames, %"PRIu64" dropped\n",
+			self->n_frames, self->n_dropped);
+
+	fclose(self->file);
+	free(self->index);
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->mutex);
+	free(self);
+}
+
+static struct recorder_frame* recorder__encode(const struct wv_buffer* buffer,
+		struct pixman_region16* damage, uint32_t flags,
+		enum wl_output_transform transform, uint64_t time)
+{
+	int pixel_size = fourcc_get_pixel_size(buffer->format);
+	if (pixel_size <= 0)
+		return NULL;
+
+	int n_rects = 0;
+	const struct pixman_box16* boxes =
+		pixman_region_rectangles(damage, &n_rects);
+
+	uint32_t area = calculate_region_area(damage);
+	size_t size = frame_trace_align(sizeof(struct frame_trace_frame) +
+			n_rects * sizeof(struct frame_trace_rect) +
+			(size_t)area * pixel_size);
+
+	struct recorder_frame* rframe = calloc(1, sizeof(*rframe) + size);
+	if (!rframe)
+		return NULL;
+
+	rframe->size = size;
+
+	struct frame_trace_frame* frame = (void*)rframe->data;
+	*frame = (struct frame_trace_frame) {
+		.magic = FRAME_TRACE_FRAME_MAGIC,
+		.flags = flags,
+		.size = size,
+		.time = time,
+		.width = buffer->width,
+		.height = buffer->height,
+		.format = buffer->format,
+		.transform = transform,
+		.n_rects = n_rects,
+		.pixel_size = pixel_size,
+		.damage_area = area,
+	};
+
+	struct frame_trace_rect* rects = (void*)(frame + 1);
+	memcpy(rects, boxes, n_rects * sizeof(*rects));
+
+	uint8_t* dst = (uint8_t*)(rects + n_rects);
+	for (int i = 0; i < n_rects; ++i) {
+		size_t row_size = (size_t)(boxes[i].x2 - boxes[i].x1) *
+			pixel_size;
+		for (int y = boxes[i].y1; y < boxes[i].y2; ++y) {
+			const uint8_t* src = (const uint8_t*)buffer->pixels +
+				(size_t)y * buffer->stride +
+				(size_t)boxes[i].x1 * pixel_size;
+			memcpy(dst, src, row_size);
+			dst += row_size;
+		}
+	}
+
+	return rframe;
+}
+
+void recorder_add_frame(struct recorder* self, const struct wv_buffer* buffer,
+		enum wl_output_transform transform, uint64_t time)
+{
+	if (!buffer->pixels)
+		return;
+
+	if (buffer->width != self->width || buffer->height != self->height ||
+	    buffer->format != self->format) {
+		self->width = buffer->width;
+		self->height = buffer->height;
+		self->format = buffer->format;
+		self->need_keyframe = true;
+	}
+
+	uint32_t flags = buffer->y_inverted ? FRAME_TRACE_Y_INVERTED : 0;
+
+	struct pixman_region16 damage;
+	pixman_region_init(&damage);
+
+	if (self->need_keyframe) {
+		flags |= FRAME_TRACE_KEYFRAME;
+		pixman_region_init_rect(&damage, 0, 0, buffer->width,
+				buffer->height);
+	} else {
+		pixman_region_intersect_rect(&damage,
+				(struct pixman_region16*)&buffer->damage, 0, 0,
+				buffer->width, buffer->height);
+	}
+
+	self->n_frames++;
+
+	pthread_mutex_lock(&self->mutex);
+	bool is_behind = self->n_queued_bytes >= MAX_QUEUED_BYTES;
+	pthread_mutex_unlock(&self->mutex);
+
+	struct recorder_frame* rframe = is_behind ? NULL :
+		recorder__encode(buffer, &damage, flags, transform, time);
+	pixman_region_fini(&damage);
+
+	if (!rframe) {
+		self->n_dropped++;
+		self->need_keyframe = true;
+		return;
+	}
+
+	self->need_keyframe = false;
+
+	pthread_mutex_lock(&self->mutex);
+	TAILQ_INSERT_TAIL(&self->queue, rframe, link);
+	self->n_queued_bytes += rframe->size;
+	pthread_cond_signal(&self->cond);
+	pthread_mutex_unlock(&self->mutex);
+}
+
+uint64_t recorder_get_n_frames(const struct recorder* self)
+{
+	return self->n_frames;
+}
+
+uint64_t recorder_get_n_dropped(const struct recorder* self)
+{
+	return self->n_dropped;
+}
@@ -32,15 +32,57 @@
 #include "time-util.h"
 #include "usdt.h"
 #include "pixels.h"
+#include "damage-util.h"
+#include "histogram.h"
+#include "export-dmabuf.h"
+#include "damage-refinery.h"
+#include "transform-util.h"
+#include "frame-clock.h"
+#include "logging.h"
 #include "config.h"
 
 #define DELAY_SMOOTHER_TIME_CONSTANT 0.5 // s
 
+/* The fraction of the output that needs to be damaged, on average, for the
+ * adaptive rate control to go all the way up to the rate limit.
+ */
+#define FULL_RATE_DAMAGE 0.1
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+static struct aml* screencopy__aml(struct screencopy* self)
+{
+	return self->aml ? self->aml : aml_get_default();
+}
+
+static void screencopy__release(struct screencopy* self,
+		struct wv_buffer* buffer)
+{
+#ifdef ENABLE_SCREENCOPY_DMABUF
+	if (buffer->export_frame) {
+		export_dmabuf_release(buffer);
+		return;
+	}
+#endif
+
+	wv_buffer_pool_release(self->pool, buffer);
+}
+
 static void screencopy__stop(struct screencopy* self)
 {
-	aml_stop(aml_get_default(), self->timer);
+	aml_stop(screencopy__aml(self), self->timer);
+
+#ifdef ENABLE_SCREENCOPY_DMABUF
+	if (self->use_export_dmabuf)
+		export_dmabuf_stop(&self->export_dmabuf);
+#endif
 
 	self->status = SCREENCOPY_STOPPED;
+	self->is_prewarming = false;
+	self->is_frame_negotiated = false;
+	self->is_copy_pending = false;
+	self->is_waiting_for_buffer = false;
 
 	if (self->frame) {
 		zwlr_screencopy_frame_v1_destroy(self->frame);
@@ -51,12 +93,32 @@ static void screencopy__stop(struct screencopy* self)
 void screencopy_stop(struct screencopy* self)
 {
 	if (self->front)
-		wv_buffer_pool_release(self->pool, self->front);
+		screencopy__release(self, self->front);
 	self->front = NULL;
 
 	return screencopy__stop(self);
 }
 
+/* With version 3 of the protocol, the compositor may offer several formats
+ * for the same frame. The higher the rank, the less work it takes to get a
+ * frame in that format to the clients.
+ */
+static int screencopy__rank_format(const struct screencopy* self,
+		uint32_t fourcc)
+{
+	if (self->preferred_fourcc && fourcc == self->preferred_fourcc)
+		return 3;
+
+	/* This is what neatvnc works with internally */
+	switch (fourcc) {
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_ARGB8888:
+		return 2;
+	}
+
+	return fourcc_get_pixel_size(fourcc) > 0 ? 1 : 0;
+}
+
 static void screencopy_linux_dmabuf(void* data,
 			      struct zwlr_screencopy_frame_v1* frame,
 			      uint32_t format, uint32_t width, uint32_t height)
@@ -64,16 +126,99 @@ static void screencopy_linux_dmabuf(void* data,
 #ifdef ENABLE_SCREENCOPY_DMABUF
 	struct screencopy* self = data;
 
-	if (!(wv_buffer_get_available_types() & WV_BUFFER_DMABUF))
+	if (self->force_shm ||
+	    !(wv_buffer_get_available_types() & WV_BUFFER_DMABUF))
+		return;
+
+	int rank = screencopy__rank_format(self, format);
+	if (rank <= self->dmabuf_rank)
 		return;
 
 	self->have_linux_dmabuf = true;
+	self->dmabuf_rank = rank;
 	self->dmabuf_width = width;
 	self->dmabuf_height = height;
 	self->fourcc = format;
 #endif
 }
 
+static void screencopy__begin_copy(struct screencopy* self)
+{
+	DTRACE_PROBE1(wayvnc, screencopy_start, self);
+
+	self->start_time = gettime_us();
+	self->wait_us = self->start_time - self->wait_start_time;
+	self->present_us = 0;
+
+	if (self->wait_histogram)
+		histogram_add(self->wait_histogram, self->wait_us);
+}
+
+static void screencopy__copy(struct screencopy* self)
+{
+	assert(self->frame && self->is_frame_negotiated);
+
+	self->is_copy_pending = false;
+
+	if (wv_buffer_pool_is_exhausted(self->pool)) {
+		/* All buffers are still held by the encoder. The compositor
+		 * keeps accumulating damage for us until we copy, so nothing is
+		 * lost by waiting for one of them to be released.
+		 */
+		self->is_waiting_for_buffer = true;
+		return;
+	}
+
+	struct wv_buffer* buffer = wv_buffer_pool_acquire(self->pool);
+	if (!buffer) {
+		screencopy__stop(self);
+		self->status = SCREENCOPY_FATAL;
+		self->on_done(self);
+		return;
+	}
+
+	assert(!self->front);
+	self->front = buffer;
+
+	screencopy__begin_copy(self);
+
+	if (self->is_immediate_copy)
+		zwlr_screencopy_frame_v1_copy(self->frame, buffer->wl_buffer);
+	else
+		zwlr_screencopy_frame_v1_copy_with_damage(self->frame,
+				buffer->wl_buffer);
+}
+
+static int screencopy__request_copy(struct screencopy* self)
+{
+#ifdef ENABLE_SCREENCOPY_DMABUF
+	if (self->use_export_dmabuf) {
+		screencopy__begin_copy(self);
+
+		return export_dmabuf_capture(&self->export_dmabuf,
+				self->wl_output, self->overlay_cursor);
+	}
+#endif
+
+	if (self->is_frame_negotiated)
+		screencopy__copy(self);
+	else
+		self->is_copy_pending = true;
+
+	return 0;
+}
+
+static void screencopy__on_pool_release(struct wv_buffer_pool* pool)
+{
+	struct screencopy* self = pool->userdata;
+
+	if (!self->is_waiting_for_buffer)
+		return;
+
+	self->is_waiting_for_buffer = false;
+	screencopy__copy(self);
+}
+
 static void screencopy_buffer_done(void* data,
 			      struct zwlr_screencopy_frame_v1* frame)
 {
@@ -82,7 +227,13 @@ static void screencopy_buffer_done(void* data,
 	enum wv_buffer_type type = WV_BUFFER_UNSPEC;
 
 #ifdef ENABLE_SCREENCOPY_DMABUF
-	if (self->have_linux_dmabuf) {
+	/* DMA-BUFs are preferred, unless only shared memory comes in the
+	 * format that was asked for.
+	 */
+	bool use_dmabuf = self->have_linux_dmabuf &&
+		(self->dmabuf_rank == 3 || self->wl_shm_rank < 3);
+
+	if (use_dmabuf) {
 		width = self->dmabuf_width;
 		height = self->dmabuf_height;
 		stride = 0;
@@ -100,22 +251,23 @@ static void screencopy_buffer_done(void* data,
 
 	wv_buffer_pool_resize(self->pool, type, width, height, stride, fourcc);
 
-	struct wv_buffer* buffer = wv_buffer_pool_acquire(self->pool);
-	if (!buffer) {
-		screencopy__stop(self);
-		self->status = SCREENCOPY_FATAL;
-		self->on_done(self);
-		return;
-	}
+	self->is_frame_negotiated = true;
 
-	assert(!self->front);
-	self->front = buffer;
+	if (self->is_copy_pending)
+		screencopy__copy(self);
 
-	if (self->is_immediate_copy)
-		zwlr_screencopy_frame_v1_copy(self->frame, buffer->wl_buffer);
-	else
-		zwlr_screencopy_frame_v1_copy_with_damage(self->frame,
-				buffer->wl_buffer);
+	/* The rest of the pool is filled in the background, so that the
+	 * allocations don't land on the capture path later on.
+	 */
+	wv_buffer_pool_prewarm(self->pool);
+
+	if (self->is_prewarming && self->status == SCREENCOPY_STOPPED) {
+		zwlr_screencopy_frame_v1_destroy(self->frame);
+		self->frame = NULL;
+		self->is_frame_negotiated = false;
+	}
+
+	self->is_prewarming = false;
 }
 
 static void screencopy_buffer(void* data,
@@ -125,12 +277,18 @@ static void screencopy_buffer(void* data,
 {
 	struct screencopy* self = data;
 
+	int version = zwlr_screencopy_manager_v1_get_version(self->manager);
+
+	int rank = screencopy__rank_format(self, fourcc_from_wl_shm(format));
+	if (version >= 3 && rank <= self->wl_shm_rank)
+		return;
+
+	self->wl_shm_rank = rank;
 	self->wl_shm_format = format;
 	self->wl_shm_width = width;
 	self->wl_shm_height = height;
 	self->wl_shm_stride = stride;
 
-	int version = zwlr_screencopy_manager_v1_get_version(self->manager);
 	if (version < 3) {
 		self->have_linux_dmabuf = false;
 		screencopy_buffer_done(data, frame);
@@ -150,30 +308,109 @@ static void screencopy_flags(void* data,
 		!!(flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT);
 }
 
-static void screencopy_ready(void* data,
-			     struct zwlr_screencopy_frame_v1* frame,
-			     uint32_t sec_hi, uint32_t sec_lo, uint32_t nsec)
+static void screencopy__update_damage(struct screencopy* self,
+		struct wv_buffer* buffer)
 {
-	(void)sec_hi;
-	(void)sec_lo;
-	(void)nsec;
+	double area = calculate_region_area(&buffer->damage);
+	double fraction = area / (double)(buffer->width * buffer->height);
+
+	/* The rate should go up quickly when things start moving, but it
+	 * should take a while to come back down.
+	 */
+	self->damage_smoother.time_constant = fraction > self->damage
+		? self->rate_rise_time : self->rate_fall_time;
+	self->damage = smooth(&self->damage_smoother, fraction);
+}
 
-	struct screencopy* self = data;
+static void screencopy__refine_damage(struct screencopy* self,
+		struct wv_buffer* buffer)
+{
+	struct damage_refinery* refinery = &self->damage_refinery;
 
-	DTRACE_PROBE1(wayvnc, screencopy_ready, self);
+	if (!buffer->pixels)
+		return;
+
+	if (refinery->width != (uint32_t)buffer->width ||
+	    refinery->height != (uint32_t)buffer->height) {
+		damage_refinery_destroy(refinery);
+		if (damage_refinery_init(refinery, buffer->width,
+					buffer->height) < 0)
+			return;
+	}
+
+	DTRACE_PROBE1(wayvnc, refine_damage_start, self);
+
+	struct pixman_region16 hint, refined;
+	pixman_region_init(&hint);
+	pixman_region_init(&refined);
+
+	/* The tiles are laid out in memory order */
+	if (buffer->y_inverted)
+		wv_region_transform(&hint, &buffer->damage,
+				WL_OUTPUT_TRANSFORM_FLIPPED_180,
+				buffer->width, buffer->height);
+	else
+		pixman_region_copy(&hint, &buffer->damage);
+
+	damage_refinery_refine(refinery, &refined, &hint, buffer);
+
+	if (buffer->y_inverted)
+		wv_region_transform(&buffer->damage, &refined,
+				WL_OUTPUT_TRANSFORM_FLIPPED_180,
+				buffer->width, buffer->height);
+	else
+		pixman_region_copy(&buffer->damage, &refined);
 
+	pixman_region_fini(&refined);
+	pixman_region_fini(&hint);
+
+	DTRACE_PROBE1(wayvnc, refine_damage_end, self);
+}
+
+/* The time stamp is when the frame that was copied got presented */
+static void screencopy__present(struct screencopy* self, uint64_t present)
+{
+	if (!frame_clock_present(&self->frame_clock, present, gettime_us()))
+		return;
+
+	if (present < self->start_time)
+		return;
+
+	self->present_us = present - self->start_time;
+
+	if (self->present_histogram)
+		histogram_add(self->present_histogram, self->present_us);
+}
+
+static void screencopy__finish(struct screencopy* self)
+{
 	screencopy__stop(self);
 
 	self->last_time = gettime_us();
 
-	double delay = (self->last_time - self->start_time) * 1.0e-6;
-	self->delay = smooth(&self->delay_smoother, delay);
+	self->capture_us = self->last_time - self->start_time;
+	self->delay = smooth(&self->delay_smoother,
+			self->capture_us * 1.0e-6);
 
-	if (self->is_immediate_copy)
+	if (self->capture_histogram)
+		histogram_add(self->capture_histogram, self->capture_us);
+
+	self->n_frames_captured++;
+
+	if (self->is_immediate_copy || self->n_damage_whole > 0)
 		wv_buffer_damage_whole(self->front);
 
+	if (self->n_damage_whole > 0)
+		self->n_damage_whole--;
+
+	if (self->enable_damage_refinery)
+		screencopy__refine_damage(self, self->front);
+
+	if (!self->is_immediate_copy && self->min_rate > 0.0)
+		screencopy__update_damage(self, self->front);
+
 	if (self->back)
-		wv_buffer_pool_release(self->pool, self->back);
+		screencopy__release(self, self->back);
 	self->back = self->front;
 	self->front = NULL;
 
@@ -181,6 +418,20 @@ static void screencopy_ready(void* data,
 	self->on_done(self);
 }
 
+static void screencopy_ready(void* data,
+			     struct zwlr_screencopy_frame_v1* frame,
+			     uint32_t sec_hi, uint32_t sec_lo, uint32_t nsec)
+{
+	struct screencopy* self = data;
+
+	DTRACE_PROBE1(wayvnc, screencopy_ready, self);
+
+	uint64_t sec = (uint64_t)sec_hi << 32 | sec_lo;
+	screencopy__present(self, sec * UINT64_C(1000000) + nsec / 1000);
+
+	screencopy__finish(self);
+}
+
 static void screencopy_failed(void* data,
 			      struct zwlr_screencopy_frame_v1* frame)
 {
@@ -188,16 +439,63 @@ static void screencopy_failed(void* data,
 
 	DTRACE_PROBE1(wayvnc, screencopy_failed, self);
 
+	self->n_frames_failed++;
 	screencopy__stop(self);
 
 	if (self->front)
-		wv_buffer_pool_release(self->pool, self->front);
+		screencopy__release(self, self->front);
 	self->front = NULL;
 
 	self->status = SCREENCOPY_FAILED;
 	self->on_done(self);
 }
 
+#ifdef ENABLE_SCREENCOPY_DMABUF
+static void screencopy__on_export_ready(struct export_dmabuf* export_dmabuf,
+		struct wv_buffer* buffer)
+{
+	struct screencopy* self = export_dmabuf->userdata;
+
+	DTRACE_PROBE1(wayvnc, screencopy_ready, self);
+
+	assert(!self->front);
+	self->front = buffer;
+
+	screencopy__present(self, export_dmabuf->present_time);
+	screencopy__finish(self);
+}
+
+static void screencopy__on_export_failed(struct export_dmabuf* export_dmabuf,
+		bool is_fatal)
+{
+	struct screencopy* self = export_dmabuf->userdata;
+
+	DTRACE_PROBE1(wayvnc, screencopy_failed, self);
+
+	self->n_frames_failed++;
+	screencopy__stop(self);
+
+	self->status = is_fatal ? SCREENCOPY_FATAL : SCREENCOPY_FAILED;
+	self->on_done(self);
+}
+
+static void screencopy__on_export_import_failed(
+		struct export_dmabuf* export_dmabuf)
+{
+	struct screencopy* self = export_dmabuf->userdata;
+
+	log_warning("Falling back to screencopy\n");
+
+	// Captures from here on go through screencopy
+	self->n_frames_failed++;
+	screencopy__stop(self);
+	self->use_export_dmabuf = false;
+
+	self->status = SCREENCOPY_FAILED;
+	self->on_done(self);
+}
+#endif
+
 static void screencopy_damage(void* data,
 			      struct zwlr_screencopy_frame_v1* frame,
 			      uint32_t x, uint32_t y,
@@ -210,10 +508,8 @@ static void screencopy_damage(void* data,
 	wv_buffer_damage_rect(self->front, x, y, width, height);
 }
 
-static int screencopy__start_capture(struct screencopy* self)
+static int screencopy__request_frame(struct screencopy* self)
 {
-	DTRACE_PROBE1(wayvnc, screencopy_start, self);
-
 	static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
 		.buffer = screencopy_buffer,
 		.linux_dmabuf = screencopy_linux_dmabuf,
@@ -224,10 +520,22 @@ static int screencopy__start_capture(struct screencopy* self)
 		.damage = screencopy_damage,
 	};
 
-	self->start_time = gettime_us();
+	assert(!self->frame);
 
-	self->frame = zwlr_screencopy_manager_v1_capture_output(self->manager,
-			self->overlay_cursor, self->wl_output);
+	/* Every frame comes with its own set of buffer events */
+	self->have_linux_dmabuf = false;
+	self->wl_shm_rank = -1;
+	self->dmabuf_rank = -1;
+
+	if (self->use_region)
+		self->frame = zwlr_screencopy_manager_v1_capture_output_region(
+				self->manager, self->overlay_cursor,
+				self->wl_output, self->region_x, self->region_y,
+				self->region_width, self->region_height);
+	else
+		self->frame = zwlr_screencopy_manager_v1_capture_output(
+				self->manager, self->overlay_cursor,
+				self->wl_output);
 	if (!self->frame)
 		return -1;
 
@@ -241,7 +549,27 @@ static void screencopy__poll(void* obj)
 {
 	struct screencopy* self = aml_get_userdata(obj);
 
-	screencopy__start_capture(self);
+	screencopy__request_copy(self);
+}
+
+double screencopy_get_rate(struct screencopy* self)
+{
+	if (self->min_rate <= 0.0 || self->min_rate >= self->rate_limit)
+		return self->rate_limit;
+
+	double activity = MIN(1.0, self->damage / FULL_RATE_DAMAGE);
+	double rate = self->min_rate +
+		(self->rate_limit - self->min_rate) * activity;
+
+	/* The display always holds on to the last buffer that was fed to it.
+	 * Any buffer held beyond that is still being encoded for some client,
+	 * so we back off to give the encoder a chance to catch up.
+	 */
+	int n_held = wv_buffer_pool_get_n_held(self->pool);
+	if (n_held > 1)
+		rate /= n_held;
+
+	return MAX(rate, self->min_rate);
 }
 
 static int screencopy__start(struct screencopy* self, bool is_immediate_copy)
@@ -253,16 +581,104 @@ static int screencopy__start(struct screencopy* self, bool is_immediate_copy)
 
 	uint64_t now = gettime_us();
 	double dt = (now - self->last_time) * 1.0e-6;
-	int32_t time_left = (1.0 / self->rate_limit - dt - self->delay) * 1.0e3;
+	double rate = screencopy_get_rate(self);
+	int32_t time_left = (1.0 / rate - dt - self->delay) * 1.0e3;
+
+	/* When the refresh cycle is known, the copy is requested just after a
+	 * presentation instead, so that it always makes it into the next one.
+	 */
+	if (frame_clock_is_locked(&self->frame_clock)) {
+		uint64_t t = frame_clock_schedule(&self->frame_clock,
+				1.0e6 / rate);
+		time_left = t > now ? (t - now + 999) / 1000 : 0;
+	}
 
 	self->status = SCREENCOPY_IN_PROGRESS;
+	self->wait_start_time = now;
+
+	/* The frame is requested right away, so that the buffer parameters
+	 * have been negotiated by the time the rate limiter allows the copy
+	 * to be started. This takes a round-trip off the capture path.
+	 *
+	 * This does not apply to export-dmabuf, which sends the next frame
+	 * that the compositor renders as soon as it is requested.
+	 */
+	if (!self->use_export_dmabuf && !self->frame &&
+	    screencopy__request_frame(self) < 0)
+		return -1;
 
 	if (time_left > 0) {
 		aml_set_duration(self->timer, time_left);
-		return aml_start(aml_get_default(), self->timer);
+		return aml_start(screencopy__aml(self), self->timer);
 	}
 
-	return screencopy__start_capture(self);
+	return screencopy__request_copy(self);
+}
+
+int screencopy_prewarm(struct screencopy* self)
+{
+	if (self->use_export_dmabuf || self->frame ||
+	    self->status != SCREENCOPY_STOPPED)
+		return 0;
+
+	/* A frame is requested only to learn the buffer parameters. It is
+	 * not copied, unless capturing starts before it has been negotiated.
+	 */
+	self->is_prewarming = true;
+	return screencopy__request_frame(self);
+}
+
+void screencopy_configure(struct screencopy* self,
+		const struct screencopy_config* config)
+{
+	self->use_region = config->use_region;
+	self->region_x = config->region_x;
+	self->region_y = config->region_y;
+	self->region_width = config->region_width;
+	self->region_height = config->region_height;
+	self->frame_clock.interval = config->frame_interval;
+}
+
+/* Called when the mode or the transform of the output changes. Buffers that
+ * are still held by neatvnc are left alone and the capture keeps going, so
+ * the switch only takes a single frame.
+ */
+void screencopy_reconfigure(struct screencopy* self)
+{
+	/* A copy that is already underway may still deliver a frame from
+	 * before the change, so the one after it must be damaged too.
+	 */
+	self->n_damage_whole = self->status == SCREENCOPY_IN_PROGRESS ? 2 : 1;
+
+	// The refresh rate or the output itself may have changed
+	frame_clock_reset(&self->frame_clock);
+
+	/* Export-dmabuf describes every frame as it arrives and a frame that
+	 * is being copied into is left to finish.
+	 */
+	if (self->use_export_dmabuf || !self->frame || self->front)
+		return;
+
+	/* The frame that has been requested, but not yet copied, was
+	 * negotiated for the old geometry.
+	 */
+	bool is_copy_pending = self->is_copy_pending ||
+		self->is_waiting_for_buffer;
+	bool is_needed = self->status == SCREENCOPY_IN_PROGRESS ||
+		self->is_prewarming;
+
+	zwlr_screencopy_frame_v1_destroy(self->frame);
+	self->frame = NULL;
+	self->is_frame_negotiated = false;
+	self->is_waiting_for_buffer = false;
+	self->is_copy_pending = is_copy_pending;
+
+	if (!is_needed || screencopy__request_frame(self) == 0)
+		return;
+
+	screencopy__stop(self);
+	self->status = SCREENCOPY_FATAL;
+	self->on_done(self);
 }
 
 int screencopy_start(struct screencopy* self)
@@ -280,21 +696,40 @@ void screencopy_init(struct screencopy* self)
 	self->pool = wv_buffer_pool_create(0, 0, 0, 0, 0);
 	assert(self->pool);
 
+	self->pool->userdata = self;
+	self->pool->on_release = screencopy__on_pool_release;
+	self->pool->aml = self->aml;
+
 	self->timer = aml_timer_new(0, screencopy__poll, self, NULL);
 	assert(self->timer);
 
 	self->delay_smoother.time_constant = DELAY_SMOOTHER_TIME_CONSTANT;
+
+#ifdef ENABLE_SCREENCOPY_DMABUF
+	self->export_dmabuf.userdata = self;
+	self->export_dmabuf.on_ready = screencopy__on_export_ready;
+	self->export_dmabuf.on_failed = screencopy__on_export_failed;
+	self->export_dmabuf.on_import_failed =
+		screencopy__on_export_import_failed;
+
+	self->use_export_dmabuf = self->enable_export_dmabuf &&
+		!self->force_shm &&
+		self->export_dmabuf.manager &&
+		(wv_buffer_get_available_types() & WV_BUFFER_DMABUF);
+#endif
 }
 
 void screencopy_destroy(struct screencopy* self)
 {
-	aml_stop(aml_get_default(), self->timer);
+	aml_stop(screencopy__aml(self), self->timer);
 	aml_unref(self->timer);
 
+	damage_refinery_destroy(&self->damage_refinery);
+
 	if (self->back)
-		wv_buffer_pool_release(self->pool, self->back);
+		screencopy__release(self, self->back);
 	if (self->front)
-		wv_buffer_pool_release(self->pool, self->front);
+		screencopy__release(self, self->front);
 
 	wv_buffer_pool_destroy(self->pool);
 }
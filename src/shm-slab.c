@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <wayland-client.h>
+
+#include "shm-slab.h"
+#include "shm.h"
+#include "logging.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+extern struct wl_shm* wl_shm;
+
+static int shm_slab_grow(struct shm_slab* self);
+
+static int shm_slab__init(struct shm_slab* self, size_t size,
+		bool use_hugepages)
+{
+	size_t alignment = use_hugepages ? SHM_HUGEPAGE_SIZE :
+		(size_t)sysconf(_SC_PAGESIZE);
+
+	self->slot_size = ALIGN_UP(size, alignment);
+	self->max_slots = MIN(SHM_SLAB_MAX_SLOTS,
+			(size_t)INT32_MAX / self->slot_size);
+
+	/* Buffers this large get their own memory. This fails before any
+	 * resources are taken, because the pool keeps trying.
+	 */
+	if (self->max_slots < 2)
+		return -1;
+
+	self->fd = use_hugepages ? shm_alloc_hugetlb_fd(0) : shm_alloc_fd(0);
+	if (self->fd < 0)
+		return -1;
+
+	/* Huge pages must be mapped at aligned addresses, so a little extra
+	 * is reserved to make room for aligning the base.
+	 */
+	self->reservation_size = self->slot_size * self->max_slots +
+		alignment;
+	self->reservation = mmap(NULL, self->reservation_size, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (self->reservation == MAP_FAILED)
+		goto reserve_failure;
+
+	self->base = (uint8_t*)ALIGN_UP((uintptr_t)self->reservation,
+			alignment);
+
+	/* Huge pages may be unavailable even after the file has been
+	 * created, which only shows once they are mapped.
+	 */
+	if (shm_slab_grow(self) < 0)
+		goto grow_failure;
+
+	return 0;
+
+grow_failure:
+	munmap(self->reservation, self->reservation_size);
+reserve_failure:
+	close(self->fd);
+	return -1;
+}
+
+struct shm_slab* shm_slab_new(size_t size, bool use_hugepages,
+		bool is_populated)
+{
+	struct shm_slab* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->ref = 1;
+	self->is_populated = is_populated;
+
+	if (use_hugepages && shm_slab__init(self, size, true) == 0)
+		return self;
+
+	if (shm_slab__init(self, size, false) == 0)
+		return self;
+
+	free(self);
+	return NULL;
+}
+
+static void shm_slab_destroy(struct shm_slab* self)
+{
+	assert(!self->used);
+
+	if (self->wl_pool)
+		wl_shm_pool_destroy(self->wl_pool);
+
+	munmap(self->reservation, self->reservation_size);
+	close(self->fd);
+	free(self);
+}
+
+void shm_slab_ref(struct shm_slab* self)
+{
+	self->ref++;
+}
+
+void shm_slab_unref(struct shm_slab* self)
+{
+	if (--self->ref == 0)
+		shm_slab_destroy(self);
+}
+
+static int shm_slab_grow(struct shm_slab* self)
+{
+	if (self->n_slots >= self->max_slots)
+		return -1;
+
+	int n_slots = MIN(MAX(self->n_slots * 2, 2), self->max_slots);
+	size_t old_size = self->n_slots * self->slot_size;
+	size_t new_size = n_slots * self->slot_size;
+
+	if (shm_truncate(self->fd, new_size) < 0)
+		return -1;
+
+	int flags = MAP_SHARED | MAP_FIXED;
+#ifdef MAP_POPULATE
+	if (self->is_populated)
+		flags |= MAP_POPULATE;
+#endif
+
+	/* The new part is mapped over the reserved address space that follows
+	 * the existing mapping, so existing buffers stay where they are.
+	 */
+	void* addr = mmap(self->base + old_size, new_size - old_size,
+			PROT_READ | PROT_WRITE, flags, self->fd, old_size);
+	if (addr == MAP_FAILED)
+		return -1;
+
+	if (self->wl_pool)
+		wl_shm_pool_resize(self->wl_pool, new_size);
+	else
+		self->wl_pool = wl_shm_create_pool(wl_shm, self->fd, new_size);
+
+	if (!self->wl_pool)
+		return -1;
+
+	log_debug("Grew shm slab to %d slots of %zu bytes\n", n_slots,
+			self->slot_size);
+
+	self->n_slots = n_slots;
+	return 0;
+}
+
+static void shm_slab__populate(struct shm_slab* self, int slot)
+{
+#ifdef MADV_POPULATE_WRITE
+	/* Freed slots have had their memory punched out */
+	if (self->is_populated)
+		madvise(shm_slab_get_addr(self, slot), self->slot_size,
+				MADV_POPULATE_WRITE);
+#else
+	(void)self;
+	(void)slot;
+#endif
+}
+
+int shm_slab_alloc(struct shm_slab* self)
+{
+	for (;;) {
+		for (int i = 0; i < self->n_slots; ++i)
+			if (!(self->used & (1ULL << i))) {
+				self->used |= 1ULL << i;
+				shm_slab__populate(self, i);
+				shm_slab_ref(self);
+				return i;
+			}
+
+		if (shm_slab_grow(self) < 0)
+			return -1;
+	}
+}
+
+void shm_slab_free(struct shm_slab* self, int slot)
+{
+	assert(self->used & (1ULL << slot));
+	self->used &= ~(1ULL << slot);
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	/* The mapping stays in place, so the slot reads back as zeroes and
+	 * is faulted in again when it is handed out next time.
+	 */
+	if (self->ref > 1 && fallocate(self->fd,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				shm_slab_get_offset(self, slot),
+				self->slot_size) < 0)
+		log_debug("Failed to give back memory of shm slab slot: %m\n");
+#endif
+
+	shm_slab_unref(self);
+}
@@ -14,6 +14,7 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -71,21 +72,57 @@ static int create_shm_file(void)
 #endif
 }
 
-int shm_alloc_fd(size_t size)
+int shm_truncate(int fd, size_t size)
 {
-	int fd = create_shm_file();
-	if (fd < 0)
-		return -1;
-
 	int ret;
 	do {
 		ret = ftruncate(fd, size);
 	} while (ret < 0 && errno == EINTR);
 
-	if (ret < 0) {
+	return ret;
+}
+
+static int shm_resize(int fd, size_t size)
+{
+	if (shm_truncate(fd, size) < 0) {
 		close(fd);
 		return -1;
 	}
 
 	return fd;
 }
+
+int shm_alloc_fd(size_t size)
+{
+	int fd = create_shm_file();
+	if (fd < 0)
+		return -1;
+
+	return shm_resize(fd, size);
+}
+
+int shm_alloc_hugetlb_fd(size_t size)
+{
+#if defined(HAVE_MEMFD) && defined(MFD_HUGETLB)
+	int fd = memfd_create("wayvnc-shm", MFD_HUGETLB);
+	if (fd < 0)
+		return -1;
+
+	return shm_resize(fd, size);
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+int shm_reopen_readonly(int fd)
+{
+#ifdef __linux__
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	return open(path, O_RDONLY | O_CLOEXEC);
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "spsc-ring.h"
+
+int spsc_ring_init(struct spsc_ring* self, size_t elem_size, size_t capacity)
+{
+	size_t size = 1;
+	while (size < capacity)
+		size *= 2;
+
+	self->data = malloc(size * elem_size);
+	if (!self->data)
+		return -1;
+
+	self->elem_size = elem_size;
+	self->mask = size - 1;
+	atomic_init(&self->head, 0);
+	atomic_init(&self->tail, 0);
+	return 0;
+}
+
+void spsc_ring_destroy(struct spsc_ring* self)
+{
+	free(self->data);
+	self->data = NULL;
+}
+
+bool spsc_ring_push(struct spsc_ring* self, const void* elem)
+{
+	size_t tail = atomic_load_explicit(&self->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&self->head, memory_order_acquire);
+
+	if (tail - head > self->mask)
+		return false;
+
+	memcpy(self->data + (tail & self->mask) * self->elem_size, elem,
+			self->elem_size);
+
+	/* Publishes the element to the consumer */
+	atomic_store_explicit(&self->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+bool spsc_ring_pop(struct spsc_ring* self, void* elem)
+{
+	size_t head = atomic_load_explicit(&self->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&self->tail, memory_order_acquire);
+
+	if (head == tail)
+		return false;
+
+	memcpy(elem, self->data + (head & self->mask) * self->elem_size,
+			self->elem_size);
+
+	/* Hands the slot back to the producer */
+	atomic_store_explicit(&self->head, head + 1, memory_order_release);
+	return true;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "systemd.h"
+#include "logging.h"
+
+/* See sd_listen_fds(3) and sd_notify(3). The protocols are simple enough
+ * that they don't warrant a dependency on libsystemd.
+ */
+#define SD_LISTEN_FDS_START 3
+
+int systemd_get_listen_fd(void)
+{
+	const char* pid_str = getenv("LISTEN_PID");
+	const char* fds_str = getenv("LISTEN_FDS");
+	if (!pid_str || !fds_str)
+		return -1;
+
+	pid_t pid = strtol(pid_str, NULL, 10);
+	int n_fds = atoi(fds_str);
+
+	/* The sockets must not be passed on to children */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	if (pid != getpid() || n_fds < 1)
+		return -1;
+
+	if (n_fds > 1)
+		log_warning("Got %d sockets from the service manager. Only the first one is used.\n",
+				n_fds);
+
+	int fd = SD_LISTEN_FDS_START;
+
+	int is_listening = 0;
+	socklen_t len = sizeof(is_listening);
+	if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &is_listening,
+				&len) < 0 || !is_listening) {
+		log_error("The socket from the service manager is not listening\n");
+		return -1;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+void systemd_notify_ready(void)
+{
+	const char* path = getenv("NOTIFY_SOCKET");
+	if (!path || !*path)
+		return;
+
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+
+	size_t path_len = strlen(path);
+	if (path_len >= sizeof(addr.sun_path)) {
+		log_error("Notification socket path is too long: %s\n", path);
+		return;
+	}
+
+	memcpy(addr.sun_path, path, path_len);
+
+	/* A leading '@' stands for the abstract namespace */
+	if (addr.sun_path[0] == '@')
+		addr.sun_path[0] = '\0';
+
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+
+	static const char message[] = "READY=1";
+	socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + path_len;
+
+	if (sendto(fd, message, sizeof(message) - 1, MSG_NOSIGNAL,
+				(struct sockaddr*)&addr, addr_len) < 0)
+		log_debug("Failed to notify service manager: %m\n");
+
+	close(fd);
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "thread-sched.h"
+#include "logging.h"
+
+#define DEFAULT_FIFO_PRIORITY 1
+
+static bool parse_uint(const char** str, unsigned long* value)
+{
+	char* end;
+
+	if (**str < '0' || **str > '9')
+		return false;
+
+	errno = 0;
+	*value = strtoul(*str, &end, 10);
+	if (errno)
+		return false;
+
+	*str = end;
+	return true;
+}
+
+bool thread_sched_parse_cpus(struct thread_sched* self, const char* str)
+{
+	CPU_ZERO(&self->cpus);
+
+	for (;;) {
+		unsigned long first, last;
+		if (!parse_uint(&str, &first))
+			return false;
+
+		last = first;
+		if (*str == '-') {
+			str++;
+			if (!parse_uint(&str, &last) || last < first)
+				return false;
+		}
+
+		if (last >= CPU_SETSIZE)
+			return false;
+
+		for (unsigned long i = first; i <= last; ++i)
+			CPU_SET(i, &self->cpus);
+
+		if (*str == '\0')
+			break;
+
+		if (*str++ != ',')
+			return false;
+	}
+
+	self->has_cpus = true;
+	return true;
+}
+
+bool thread_sched_parse_priority(struct thread_sched* self, const char* str)
+{
+	char* end;
+
+	if (strncmp(str, "fifo", 4) == 0) {
+		str += 4;
+
+		unsigned long priority = DEFAULT_FIFO_PRIORITY;
+		if (*str == ':') {
+			str++;
+			if (!parse_uint(&str, &priority))
+				return false;
+		}
+
+		if (*str != '\0' ||
+		    (int)priority < sched_get_priority_min(SCHED_FIFO) ||
+		    (int)priority > sched_get_priority_max(SCHED_FIFO))
+			return false;
+
+		self->policy = SCHED_FIFO;
+		self->priority = priority;
+		self->has_priority = true;
+		return true;
+	}
+
+	errno = 0;
+	long nice = strtol(str, &end, 10);
+	if (errno || end == str || *end != '\0' || nice < -20 || nice > 19)
+		return false;
+
+	self->policy = SCHED_OTHER;
+	self->nice = nice;
+	self->has_priority = true;
+	return true;
+}
+
+int thread_sched_apply(const struct thread_sched* self)
+{
+	int rc = 0;
+
+	if (self->has_cpus && pthread_setaffinity_np(pthread_self(),
+				sizeof(self->cpus), &self->cpus) != 0) {
+		log_warning("Failed to set CPU affinity\n");
+		rc = -1;
+	}
+
+	if (!self->has_priority)
+		return rc;
+
+	if (self->policy == SCHED_FIFO) {
+		struct sched_param param = { .sched_priority = self->priority };
+		int err = pthread_setschedparam(pthread_self(), SCHED_FIFO,
+				&param);
+		if (err != 0) {
+			log_warning("Failed to set real-time priority: %s\n",
+					strerror(err));
+			rc = -1;
+		}
+		return rc;
+	}
+
+#ifdef SYS_gettid
+	/* The nice value belongs to the thread rather than to the whole
+	 * process on Linux.
+	 */
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), self->nice) < 0) {
+		log_warning("Failed to set nice value: %m\n");
+		rc = -1;
+	}
+#else
+	log_warning("Setting the nice value of a thread is not supported on this system\n");
+	rc = -1;
+#endif
+
+	return rc;
+}
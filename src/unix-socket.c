@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "unix-socket.h"
+#include "strlcpy.h"
+#include "logging.h"
+
+static int unix_socket_remove_stale(const char* path)
+{
+	struct stat st;
+	if (lstat(path, &st) < 0) {
+		if (errno == ENOENT)
+			return 0;
+
+		log_error("Failed to stat %s: %m\n", path);
+		return -1;
+	}
+
+	if (!S_ISSOCK(st.st_mode)) {
+		log_error("Refusing to replace %s: not a socket\n", path);
+		return -1;
+	}
+
+	if (unlink(path) < 0) {
+		log_error("Failed to remove stale socket %s: %m\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int unix_socket_listen(const char* path, int type)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_error("Socket path is too long: %s\n", path);
+		return -1;
+	}
+
+	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+	int fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		log_error("Failed to create socket for %s: %m\n", path);
+		return -1;
+	}
+
+	if (unix_socket_remove_stale(path) < 0)
+		goto failure;
+
+	/* Narrowing the umask around bind() means that there is no window in
+	 * which others may connect before the permissions are set.
+	 */
+	mode_t old_mask = umask(S_IRWXG | S_IRWXO | S_IXUSR);
+	int rc = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+	umask(old_mask);
+
+	if (rc < 0) {
+		log_error("Failed to bind socket to %s: %m\n", path);
+		goto failure;
+	}
+
+	if (listen(fd, 16) < 0) {
+		log_error("Failed to listen on %s: %m\n", path);
+		goto listen_failure;
+	}
+
+	return fd;
+
+listen_failure:
+	unlink(path);
+failure:
+	close(fd);
+	return -1;
+}
+
+int unix_socket_out_flush(struct unix_socket_out* self, int fd)
+{
+	while (self->pos < self->len) {
+		ssize_t rc = send(fd, self->data + self->pos,
+				self->len - self->pos, MSG_NOSIGNAL);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 1;
+		if (rc < 0)
+			return -1;
+
+		self->pos += rc;
+	}
+
+	self->pos = self->len = 0;
+	return 0;
+}
+
+int unix_socket_out_send(struct unix_socket_out* self, int fd,
+		const void* data, size_t len)
+{
+	if (len == 0)
+		return unix_socket_out_flush(self, fd);
+
+	size_t queued = self->len - self->pos;
+	if (queued + len > UNIX_SOCKET_MAX_QUEUED) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	// Whatever has been sent already makes room at the front
+	if (self->pos > 0) {
+		memmove(self->data, self->data + self->pos, queued);
+		self->len = queued;
+		self->pos = 0;
+	}
+
+	char* new_data = realloc(self->data, queued + len);
+	if (!new_data)
+		return -1;
+
+	memcpy(new_data + queued, data, len);
+	self->data = new_data;
+	self->len += len;
+
+	return unix_socket_out_flush(self, fd);
+}
+
+void unix_socket_out_destroy(struct unix_socket_out* self)
+{
+	free(self->data);
+	self->data = NULL;
+	self->pos = self->len = 0;
+}
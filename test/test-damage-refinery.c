@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <pixman.h>
+#include <libdrm/drm_fourcc.h>
+
+#include "tst.h"
+#include "buffer.h"
+#include "damage-refinery.h"
+#include "damage-util.h"
+
+#define WIDTH 70
+#define HEIGHT 10
+#define PIXEL_SIZE 3
+
+/* The rows are packed, so that reading past the end of a row of 24 bit
+ * pixels lands in the next one, or past the end of the buffer.
+ */
+static void init_buffer(struct wv_buffer* buffer)
+{
+	memset(buffer, 0, sizeof(*buffer));
+	buffer->width = WIDTH;
+	buffer->height = HEIGHT;
+	buffer->stride = WIDTH * PIXEL_SIZE;
+	buffer->format = DRM_FORMAT_RGB888;
+	buffer->pixels = calloc(1, buffer->stride * HEIGHT);
+}
+
+static void refine_whole(struct damage_refinery* refinery,
+		struct pixman_region16* refined, struct wv_buffer* buffer)
+{
+	struct pixman_region16 hint;
+	pixman_region_init_rect(&hint, 0, 0, WIDTH, HEIGHT);
+	damage_refinery_refine(refinery, refined, &hint, buffer);
+	pixman_region_fini(&hint);
+}
+
+static int test_24_bit_tiles(void)
+{
+	struct wv_buffer buffer;
+	init_buffer(&buffer);
+	ASSERT_TRUE(buffer.pixels);
+
+	struct damage_refinery refinery;
+	ASSERT_INT_EQ(0, damage_refinery_init(&refinery, WIDTH, HEIGHT));
+
+	struct pixman_region16 refined;
+	pixman_region_init(&refined);
+
+	// Nothing has been hashed yet
+	refine_whole(&refinery, &refined, &buffer);
+	ASSERT_INT_EQ(WIDTH * HEIGHT, calculate_region_area(&refined));
+
+	refine_whole(&refinery, &refined, &buffer);
+	ASSERT_FALSE(pixman_region_not_empty(&refined));
+
+	// The last byte of the last pixel in the first tile
+	uint8_t* pixels = buffer.pixels;
+	pixels[(DAMAGE_REFINERY_TILE_SIZE - 1) * PIXEL_SIZE + 2] = 0xff;
+	refine_whole(&refinery, &refined, &buffer);
+	pixman_box16_t* ext = pixman_region_extents(&refined);
+	ASSERT_INT_EQ(0, ext->x1);
+	ASSERT_INT_EQ(DAMAGE_REFINERY_TILE_SIZE, ext->x2);
+
+	// The last byte of the buffer
+	pixels[buffer.stride * HEIGHT - 1] = 0xff;
+	refine_whole(&refinery, &refined, &buffer);
+	ext = pixman_region_extents(&refined);
+	ASSERT_INT_EQ(DAMAGE_REFINERY_TILE_SIZE, ext->x1);
+	ASSERT_INT_EQ(WIDTH, ext->x2);
+
+	pixman_region_fini(&refined);
+	damage_refinery_destroy(&refinery);
+	free(buffer.pixels);
+	return 0;
+}
+
+/* Each word of a row goes into one of eight lanes. A change in any of them,
+ * and in the tail that doesn't fill a whole round of lanes, must show up.
+ */
+static int test_32_bit_lanes(void)
+{
+	struct wv_buffer buffer;
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.width = WIDTH;
+	buffer.height = HEIGHT;
+	buffer.stride = WIDTH * 4;
+	buffer.format = DRM_FORMAT_XRGB8888;
+	buffer.pixels = calloc(1, buffer.stride * HEIGHT);
+	ASSERT_TRUE(buffer.pixels);
+
+	struct damage_refinery refinery;
+	ASSERT_INT_EQ(0, damage_refinery_init(&refinery, WIDTH, HEIGHT));
+
+	struct pixman_region16 refined;
+	pixman_region_init(&refined);
+
+	refine_whole(&refinery, &refined, &buffer);
+
+	uint32_t* pixels = buffer.pixels;
+	for (int x = 0; x < WIDTH; ++x) {
+		int tile_x = x - x % DAMAGE_REFINERY_TILE_SIZE;
+
+		pixels[WIDTH * (HEIGHT - 1) + x] = 0x00ffffff;
+		refine_whole(&refinery, &refined, &buffer);
+		ASSERT_INT_EQ(1, pixman_region_n_rects(&refined));
+		ASSERT_INT_EQ(tile_x, pixman_region_extents(&refined)->x1);
+
+		// Putting it back is a change as well
+		pixels[WIDTH * (HEIGHT - 1) + x] = 0;
+		refine_whole(&refinery, &refined, &buffer);
+		ASSERT_INT_EQ(1, pixman_region_n_rects(&refined));
+	}
+
+	refine_whole(&refinery, &refined, &buffer);
+	ASSERT_FALSE(pixman_region_not_empty(&refined));
+
+	pixman_region_fini(&refined);
+	damage_refinery_destroy(&refinery);
+	free(buffer.pixels);
+	return 0;
+}
+
+static int test_tiles_outside_hint_are_left_alone(void)
+{
+	struct wv_buffer buffer;
+	init_buffer(&buffer);
+	ASSERT_TRUE(buffer.pixels);
+
+	struct damage_refinery refinery;
+	ASSERT_INT_EQ(0, damage_refinery_init(&refinery, WIDTH, HEIGHT));
+
+	struct pixman_region16 refined;
+	pixman_region_init(&refined);
+
+	refine_whole(&refinery, &refined, &buffer);
+
+	// A change in the second tile, with only the first one hinted
+	uint8_t* pixels = buffer.pixels;
+	pixels[(WIDTH - 1) * PIXEL_SIZE] = 0xff;
+
+	struct pixman_region16 hint;
+	pixman_region_init_rect(&hint, 0, 0, DAMAGE_REFINERY_TILE_SIZE, HEIGHT);
+	damage_refinery_refine(&refinery, &refined, &hint, &buffer);
+	pixman_region_fini(&hint);
+	ASSERT_FALSE(pixman_region_not_empty(&refined));
+
+	// The change is still found once the tile is hinted
+	refine_whole(&refinery, &refined, &buffer);
+	pixman_box16_t* ext = pixman_region_extents(&refined);
+	ASSERT_INT_EQ(DAMAGE_REFINERY_TILE_SIZE, ext->x1);
+	ASSERT_INT_EQ(WIDTH, ext->x2);
+
+	pixman_region_fini(&refined);
+	damage_refinery_destroy(&refinery);
+	free(buffer.pixels);
+	return 0;
+}
+
+static int test_unknown_format_passes_hint(void)
+{
+	struct wv_buffer buffer;
+	init_buffer(&buffer);
+	ASSERT_TRUE(buffer.pixels);
+	buffer.format = 0;
+
+	struct damage_refinery refinery;
+	ASSERT_INT_EQ(0, damage_refinery_init(&refinery, WIDTH, HEIGHT));
+
+	struct pixman_region16 refined;
+	pixman_region_init(&refined);
+
+	refine_whole(&refinery, &refined, &buffer);
+	refine_whole(&refinery, &refined, &buffer);
+	ASSERT_INT_EQ(WIDTH * HEIGHT, calculate_region_area(&refined));
+
+	pixman_region_fini(&refined);
+	damage_refinery_destroy(&refinery);
+	free(buffer.pixels);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	r |= test_24_bit_tiles();
+	r |= test_32_bit_lanes();
+	r |= test_tiles_outside_hint_are_left_alone();
+	r |= test_unknown_format_passes_hint();
+	return r;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <pixman.h>
+
+#include "tst.h"
+#include "damage-util.h"
+
+static int test_far_apart_rects_stay_apart(void)
+{
+	struct pixman_region16 damage;
+	pixman_region_init_rect(&damage, 0, 0, 16, 16);
+	pixman_region_union_rect(&damage, &damage, 512, 512, 16, 16);
+
+	ASSERT_INT_EQ(0, damage_coalesce(&damage, &damage, 1, 0, 0));
+	ASSERT_INT_EQ(2, pixman_region_n_rects(&damage));
+
+	ASSERT_INT_EQ(0, damage_coalesce(&damage, &damage, 1, 0, 1));
+	ASSERT_INT_EQ(1, pixman_region_n_rects(&damage));
+	ASSERT_UINT32_EQ(528 * 528, calculate_region_area(&damage));
+
+	pixman_region_fini(&damage);
+	return 0;
+}
+
+static int test_fragmented_damage_falls_back_to_extents(void)
+{
+	struct pixman_region16 damage;
+	pixman_region_init(&damage);
+
+	// Every other row differs, so there are 128 bands
+	for (int y = 0; y < 128; ++y)
+		for (int x = y % 2; x < 128; x += 2)
+			pixman_region_union_rect(&damage, &damage, x, y, 1, 1);
+
+	ASSERT_INT_EQ(0, damage_coalesce(&damage, &damage, 1, 0, 0));
+	ASSERT_INT_EQ(1, pixman_region_n_rects(&damage));
+
+	pixman_box16_t* ext = pixman_region_extents(&damage);
+	ASSERT_INT_EQ(0, ext->x1);
+	ASSERT_INT_EQ(0, ext->y1);
+	ASSERT_INT_EQ(128, ext->x2);
+	ASSERT_INT_EQ(128, ext->y2);
+
+	pixman_region_fini(&damage);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	r |= test_far_apart_rects_stay_apart();
+	r |= test_fragmented_damage_falls_back_to_extents();
+	return r;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "tst.h"
+#include "frame-clock.h"
+
+#define INTERVAL 16667 // us, 60 Hz
+#define START 10000000 // us
+
+/* Presents a frame on the first refresh after the copy was requested and
+ * returns the time at which the next copy is requested.
+ */
+static uint64_t present_next(struct frame_clock* clock, uint64_t request_time,
+		uint64_t period)
+{
+	uint64_t n = (request_time - START) / INTERVAL + 1;
+	uint64_t present = START + n * INTERVAL;
+
+	frame_clock_present(clock, present, present + 2000);
+	return frame_clock_schedule(clock, period);
+}
+
+static int test_implausible_time_stamp(void)
+{
+	struct frame_clock clock = { .interval = INTERVAL };
+
+	ASSERT_FALSE(frame_clock_present(&clock, START, START + 2000000));
+	ASSERT_FALSE(frame_clock_is_locked(&clock));
+
+	ASSERT_FALSE(frame_clock_present(&clock, START + 1, START));
+	ASSERT_FALSE(frame_clock_is_locked(&clock));
+
+	ASSERT_TRUE(frame_clock_present(&clock, START, START + 2000));
+	ASSERT_TRUE(frame_clock_is_locked(&clock));
+	return 0;
+}
+
+static int test_unknown_interval(void)
+{
+	struct frame_clock clock = { 0 };
+
+	ASSERT_TRUE(frame_clock_present(&clock, START, START + 2000));
+	ASSERT_FALSE(frame_clock_is_locked(&clock));
+	return 0;
+}
+
+static int test_full_rate(void)
+{
+	struct frame_clock clock = { .interval = INTERVAL };
+
+	frame_clock_present(&clock, START, START + 2000);
+
+	// The next copy can be requested right away
+	uint64_t t = frame_clock_schedule(&clock, 1000000 / 60);
+	ASSERT_UINT32_EQ(1000, t - START);
+	return 0;
+}
+
+static int test_half_rate(void)
+{
+	struct frame_clock clock = { .interval = INTERVAL };
+
+	frame_clock_present(&clock, START, START + 2000);
+
+	// The copy is requested just after the refresh in between
+	uint64_t t = frame_clock_schedule(&clock, 1000000 / 30);
+	ASSERT_UINT32_EQ(INTERVAL + 1000, t - START);
+
+	t = present_next(&clock, t, 1000000 / 30);
+	ASSERT_UINT32_EQ(3 * INTERVAL + 1000, t - START);
+	return 0;
+}
+
+static int test_uneven_rate_is_met_on_average(void)
+{
+	struct frame_clock clock = { .interval = INTERVAL };
+
+	frame_clock_present(&clock, START, START + 2000);
+
+	uint64_t t = frame_clock_schedule(&clock, 1000000 / 40);
+	for (int i = 0; i < 39; ++i)
+		t = present_next(&clock, t, 1000000 / 40);
+
+	// 40 frames at 40 FPS are 39 periods apart
+	uint64_t duration = clock.last_present - START;
+	ASSERT_UINT32_GE(975000 - INTERVAL / 2, duration);
+	ASSERT_UINT32_LE(975000 + INTERVAL / 2, duration);
+	return 0;
+}
+
+static int test_pause_is_not_made_up_for(void)
+{
+	struct frame_clock clock = { .interval = INTERVAL };
+
+	frame_clock_present(&clock, START, START + 2000);
+	frame_clock_schedule(&clock, 1000000 / 30);
+
+	// Nothing changed on the output for a while
+	uint64_t present = START + 60 * INTERVAL;
+	frame_clock_present(&clock, present, present + 2000);
+
+	uint64_t t = frame_clock_schedule(&clock, 1000000 / 30);
+	ASSERT_UINT32_EQ(INTERVAL + 1000, t - present);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	r |= test_implausible_time_stamp();
+	r |= test_unknown_interval();
+	r |= test_full_rate();
+	r |= test_half_rate();
+	r |= test_uneven_rate_is_met_on_average();
+	r |= test_pause_is_not_made_up_for();
+	return r;
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tst.h"
+#include "frame-trace.h"
+
+#define WIDTH 8
+#define HEIGHT 4
+
+struct trace_writer {
+	FILE* file;
+	uint64_t offset;
+	struct frame_trace_index_entry index[8];
+	int n_frames;
+};
+
+static void write_data(struct trace_writer* self, const void* data,
+		size_t size)
+{
+	fwrite(data, 1, size, self->file);
+	self->offset += size;
+}
+
+/* Writes a frame with a single damaged rectangle, filled with the value */
+static void write_frame(struct trace_writer* self, uint64_t time,
+		uint32_t flags, int x, int y, int width, int height,
+		uint8_t value)
+{
+	size_t n_pixel_bytes = width * height * 4;
+	size_t size = frame_trace_align(sizeof(struct frame_trace_frame) +
+			sizeof(struct frame_trace_rect) + n_pixel_bytes);
+
+	struct frame_trace_frame frame = {
+		.magic = FRAME_TRACE_FRAME_MAGIC,
+		.flags = flags,
+		.size = size,
+		.time = time,
+		.width = WIDTH,
+		.height = HEIGHT,
+		.transform = 0,
+		.n_rects = 1,
+		.pixel_size = 4,
+		.damage_area = width * height,
+	};
+	struct frame_trace_rect rect = { x, y, x + width, y + height };
+
+	self->index[self->n_frames++] = (struct frame_trace_index_entry) {
+		.offset = self->offset,
+		.time = time,
+		.flags = flags,
+		.damage_area = frame.damage_area,
+	};
+
+	uint8_t pixels[WIDTH * HEIGHT * 4 + 8] = { 0 };
+	memset(pixels, value, n_pixel_bytes);
+
+	write_data(self, &frame, sizeof(frame));
+	write_data(self, &rect, sizeof(rect));
+	write_data(self, pixels, size - sizeof(frame) - sizeof(rect));
+}
+
+/* Returns the size of the file without the index */
+static size_t write_trace(const char* path)
+{
+	struct trace_writer writer = { .file = fopen(path, "wb") };
+
+	struct frame_trace_header header = {
+		.magic = FRAME_TRACE_MAGIC,
+		.version = FRAME_TRACE_VERSION,
+		.header_size = sizeof(header),
+	};
+	write_data(&writer, &header, sizeof(header));
+
+	write_frame(&writer, 1000, FRAME_TRACE_KEYFRAME, 0, 0, WIDTH, HEIGHT,
+			1);
+	write_frame(&writer, 2000, 0, 1, 1, 2, 1, 2);
+	write_frame(&writer, 3000, FRAME_TRACE_KEYFRAME, 0, 0, WIDTH, HEIGHT,
+			3);
+	write_frame(&writer, 4000, 0, 3, 2, 1, 2, 4);
+
+	size_t records_size = writer.offset;
+
+	struct frame_trace_footer footer = {
+		.index_offset = writer.offset,
+		.n_frames = writer.n_frames,
+		.magic = FRAME_TRACE_INDEX_MAGIC,
+	};
+	write_data(&writer, writer.index,
+			writer.n_frames * sizeof(*writer.index));
+	write_data(&writer, &footer, sizeof(footer));
+
+	fclose(writer.file);
+	return records_size;
+}
+
+static int check_trace(const struct frame_trace* trace)
+{
+	ASSERT_UINT32_EQ(4, trace->n_frames);
+
+	const struct frame_trace_frame* frame = frame_trace_get(trace, 1);
+	ASSERT_TRUE(frame);
+	ASSERT_UINT32_EQ(2000, frame->time);
+	ASSERT_UINT32_EQ(1, frame->n_rects);
+	ASSERT_UINT32_EQ(2, frame->damage_area);
+
+	const struct frame_trace_rect* rect = frame_trace_frame_rects(frame);
+	ASSERT_INT_EQ(1, rect->x1);
+	ASSERT_INT_EQ(3, rect->x2);
+
+	const uint8_t* pixels = frame_trace_frame_pixels(frame);
+	ASSERT_INT_EQ(2, pixels[0]);
+	ASSERT_INT_EQ(2, pixels[7]);
+
+	ASSERT_FALSE(frame_trace_get(trace, 4));
+
+	ASSERT_UINT32_EQ(0, frame_trace_find_keyframe(trace, 0));
+	ASSERT_UINT32_EQ(0, frame_trace_find_keyframe(trace, 2000));
+	ASSERT_UINT32_EQ(2, frame_trace_find_keyframe(trace, 2500));
+	ASSERT_UINT32_EQ(2, frame_trace_find_keyframe(trace, 4000));
+	ASSERT_UINT32_EQ(2, frame_trace_find_keyframe(trace, 9000));
+	return 0;
+}
+
+static int test_indexed(const char* path)
+{
+	write_trace(path);
+
+	struct frame_trace trace;
+	ASSERT_INT_EQ(0, frame_trace_open(&trace, path));
+	ASSERT_FALSE(trace.scanned_index);
+
+	int rc = check_trace(&trace);
+	frame_trace_close(&trace);
+	return rc;
+}
+
+static int test_without_index(const char* path)
+{
+	size_t records_size = write_trace(path);
+	ASSERT_INT_EQ(0, truncate(path, records_size));
+
+	struct frame_trace trace;
+	ASSERT_INT_EQ(0, frame_trace_open(&trace, path));
+	ASSERT_TRUE(trace.scanned_index);
+
+	int rc = check_trace(&trace);
+	frame_trace_close(&trace);
+	return rc;
+}
+
+static int test_cut_short(const char* path)
+{
+	// The last record is incomplete
+	size_t records_size = write_trace(path);
+	ASSERT_INT_EQ(0, truncate(path, records_size - 8));
+
+	struct frame_trace trace;
+	ASSERT_INT_EQ(0, frame_trace_open(&trace, path));
+	ASSERT_UINT32_EQ(3, trace.n_frames);
+	frame_trace_close(&trace);
+	return 0;
+}
+
+static int test_not_a_trace(const char* path)
+{
+	FILE* file = fopen(path, "wb");
+	fputs("This is not a frame trace at all", file);
+	fclose(file);
+
+	struct frame_trace trace;
+	ASSERT_INT_EQ(-1, frame_trace_open(&trace, path));
+	return 0;
+}
+
+int main()
+{
+	char path[] = "/tmp/wayvnc-test-trace-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return 1;
+	close(fd);
+
+	int r = 0;
+	r |= test_indexed(path);
+	r |= test_without_index(path);
+	r |= test_cut_short(path);
+	r |= test_not_a_trace(path);
+
+	unlink(path);
+	return r;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "tst.h"
+#include "geometry.h"
+
+static int test_parse_size_only(void)
+{
+	struct geometry geometry;
+	ASSERT_TRUE(geometry_parse(&geometry, "1280x720"));
+	ASSERT_UINT_EQ(1280, geometry.width);
+	ASSERT_UINT_EQ(720, geometry.height);
+	ASSERT_INT_EQ(0, geometry.x);
+	ASSERT_INT_EQ(0, geometry.y);
+	ASSERT_FALSE(geometry.x_from_end);
+	ASSERT_FALSE(geometry.y_from_end);
+	return 0;
+}
+
+static int test_parse_offsets(void)
+{
+	struct geometry geometry;
+	ASSERT_TRUE(geometry_parse(&geometry, "640x480+10-20"));
+	ASSERT_UINT_EQ(640, geometry.width);
+	ASSERT_UINT_EQ(480, geometry.height);
+	ASSERT_INT_EQ(10, geometry.x);
+	ASSERT_INT_EQ(20, geometry.y);
+	ASSERT_FALSE(geometry.x_from_end);
+	ASSERT_TRUE(geometry.y_from_end);
+	return 0;
+}
+
+static int test_parse_invalid(void)
+{
+	struct geometry geometry;
+	ASSERT_FALSE(geometry_parse(&geometry, ""));
+	ASSERT_FALSE(geometry_parse(&geometry, "640"));
+	ASSERT_FALSE(geometry_parse(&geometry, "0x480"));
+	ASSERT_FALSE(geometry_parse(&geometry, "640x480+10"));
+	ASSERT_FALSE(geometry_parse(&geometry, "640x480+10+"));
+	ASSERT_FALSE(geometry_parse(&geometry, "640x480+10+20 "));
+	ASSERT_FALSE(geometry_parse(&geometry, "-640x480"));
+	return 0;
+}
+
+static int test_resolve_from_end(void)
+{
+	struct geometry geometry;
+	ASSERT_TRUE(geometry_parse(&geometry, "200x100-0-10"));
+
+	int32_t x, y;
+	uint32_t width, height;
+	geometry_resolve(&geometry, 1920, 1080, &x, &y, &width, &height);
+	ASSERT_INT_EQ(1720, x);
+	ASSERT_INT_EQ(970, y);
+	ASSERT_UINT_EQ(200, width);
+	ASSERT_UINT_EQ(100, height);
+
+	// The rectangle follows the edges when the outer size changes
+	geometry_resolve(&geometry, 1280, 720, &x, &y, &width, &height);
+	ASSERT_INT_EQ(1080, x);
+	ASSERT_INT_EQ(610, y);
+	return 0;
+}
+
+static int test_resolve_clips(void)
+{
+	struct geometry geometry;
+	ASSERT_TRUE(geometry_parse(&geometry, "800x600+1500+700"));
+
+	int32_t x, y;
+	uint32_t width, height;
+	geometry_resolve(&geometry, 1920, 1080, &x, &y, &width, &height);
+	ASSERT_INT_EQ(1500, x);
+	ASSERT_INT_EQ(700, y);
+	ASSERT_UINT_EQ(420, width);
+	ASSERT_UINT_EQ(380, height);
+
+	// Entirely outside
+	geometry_resolve(&geometry, 1024, 768, &x, &y, &width, &height);
+	ASSERT_UINT_EQ(0, width);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	r |= test_parse_size_only();
+	r |= test_parse_offsets();
+	r |= test_parse_invalid();
+	r |= test_resolve_from_end();
+	r |= test_resolve_clips();
+	return r;
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "tst.h"
+#include "input-latency.h"
+#include "histogram.h"
+
+#include <pixman.h>
+
+#define START 10000000 // us
+
+static void capture_rect(struct input_latency* tracker, int x, int y,
+		int width, int height, uint64_t time)
+{
+	struct pixman_region16 damage;
+	pixman_region_init_rect(&damage, x, y, width, height);
+	input_latency_capture(tracker, &damage, time);
+	pixman_region_fini(&damage);
+}
+
+static int test_key_matches_any_damage(void)
+{
+	struct histogram capture = { 0 }, feed = { 0 };
+	struct input_latency tracker = {
+		.capture_histogram = &capture,
+		.feed_histogram = &feed,
+	};
+
+	input_latency_add(&tracker, START, false, 0, 0);
+
+	// Nothing changed on screen
+	capture_rect(&tracker, 0, 0, 0, 0, START + 10000);
+	ASSERT_UINT32_EQ(0, capture.count);
+
+	capture_rect(&tracker, 500, 500, 10, 10, START + 20000);
+	ASSERT_UINT32_EQ(1, capture.count);
+	ASSERT_UINT32_EQ(20000, capture.max);
+	ASSERT_INT_EQ(0, tracker.n_pending);
+
+	input_latency_feed(&tracker, START + 25000);
+	ASSERT_UINT32_EQ(1, feed.count);
+	ASSERT_UINT32_EQ(25000, feed.max);
+
+	// Only once
+	input_latency_feed(&tracker, START + 30000);
+	ASSERT_UINT32_EQ(1, feed.count);
+	return 0;
+}
+
+static int test_pointer_needs_nearby_damage(void)
+{
+	struct histogram capture = { 0 };
+	struct input_latency tracker = { .capture_histogram = &capture };
+
+	input_latency_add(&tracker, START, true, 100, 100);
+
+	capture_rect(&tracker, 500, 500, 10, 10, START + 10000);
+	ASSERT_UINT32_EQ(0, capture.count);
+	ASSERT_INT_EQ(1, tracker.n_pending);
+
+	capture_rect(&tracker, 110, 90, 10, 10, START + 20000);
+	ASSERT_UINT32_EQ(1, capture.count);
+	ASSERT_UINT32_EQ(20000, capture.max);
+	return 0;
+}
+
+static int test_later_match_resolves_earlier_events(void)
+{
+	struct histogram capture = { 0 };
+	struct input_latency tracker = { .capture_histogram = &capture };
+
+	input_latency_add(&tracker, START, true, 100, 100);
+	input_latency_add(&tracker, START + 1000, true, 300, 300);
+	input_latency_add(&tracker, START + 2000, true, 600, 600);
+
+	capture_rect(&tracker, 290, 290, 20, 20, START + 10000);
+	ASSERT_UINT32_EQ(2, capture.count);
+	ASSERT_UINT32_EQ(10000, capture.max);
+	ASSERT_INT_EQ(1, tracker.n_pending);
+	return 0;
+}
+
+static int test_events_after_capture_are_kept(void)
+{
+	struct histogram capture = { 0 };
+	struct input_latency tracker = { .capture_histogram = &capture };
+
+	input_latency_add(&tracker, START + 20000, false, 0, 0);
+
+	capture_rect(&tracker, 0, 0, 10, 10, START + 10000);
+	ASSERT_UINT32_EQ(0, capture.count);
+	ASSERT_INT_EQ(1, tracker.n_pending);
+	return 0;
+}
+
+static int test_expiry(void)
+{
+	struct histogram capture = { 0 };
+	struct input_latency tracker = { .capture_histogram = &capture };
+
+	input_latency_add(&tracker, START, true, 100, 100);
+
+	capture_rect(&tracker, 100, 100, 10, 10,
+			START + INPUT_LATENCY_TIMEOUT + 1);
+	ASSERT_UINT32_EQ(0, capture.count);
+	ASSERT_INT_EQ(0, tracker.n_pending);
+	ASSERT_UINT32_EQ(1, tracker.n_expired);
+	return 0;
+}
+
+static int test_overflow_drops_oldest(void)
+{
+	struct input_latency tracker = { 0 };
+
+	for (int i = 0; i < INPUT_LATENCY_MAX_EVENTS + 1; ++i)
+		input_latency_add(&tracker, START + i, true, i, 0);
+
+	ASSERT_INT_EQ(INPUT_LATENCY_MAX_EVENTS, tracker.n_pending);
+	ASSERT_UINT32_EQ(1, tracker.n_expired);
+	ASSERT_INT_EQ(1, tracker.pending[0].x);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	r |= test_key_matches_any_damage();
+	r |= test_pointer_needs_nearby_damage();
+	r |= test_later_match_resolves_earlier_events();
+	r |= test_events_after_capture_are_kept();
+	r |= test_expiry();
+	r |= test_overflow_drops_oldest();
+	return r;
+}
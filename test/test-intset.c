@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "tst.h"
+#include "intset.h"
+
+static int test_set_and_clear(void)
+{
+	struct intset set;
+	ASSERT_INT_EQ(0, intset_init(&set, 0));
+
+	ASSERT_FALSE(intset_is_set(&set, 42));
+	ASSERT_INT_EQ(0, intset_set(&set, 42));
+	ASSERT_TRUE(intset_is_set(&set, 42));
+	ASSERT_FALSE(intset_is_set(&set, 43));
+
+	intset_clear(&set, 42);
+	ASSERT_FALSE(intset_is_set(&set, 42));
+
+	// Clearing what isn't there does nothing
+	intset_clear(&set, 42);
+	ASSERT_UINT_EQ(0, set.len);
+
+	intset_destroy(&set);
+	return 0;
+}
+
+static int test_set_twice(void)
+{
+	struct intset set;
+	ASSERT_INT_EQ(0, intset_init(&set, 0));
+
+	ASSERT_INT_EQ(0, intset_set(&set, -1));
+	ASSERT_INT_EQ(0, intset_set(&set, -1));
+	ASSERT_UINT_EQ(1, set.len);
+
+	intset_clear(&set, -1);
+	ASSERT_FALSE(intset_is_set(&set, -1));
+
+	intset_destroy(&set);
+	return 0;
+}
+
+static int test_grow(void)
+{
+	struct intset set;
+	ASSERT_INT_EQ(0, intset_init(&set, 4));
+
+	for (int i = 0; i < 1000; ++i)
+		ASSERT_INT_EQ(0, intset_set(&set, i * 7));
+
+	ASSERT_UINT_EQ(1000, set.len);
+	ASSERT_UINT_GE(1000, set.cap);
+
+	for (int i = 0; i < 1000; ++i)
+		ASSERT_TRUE(intset_is_set(&set, i * 7));
+
+	for (int i = 0; i < 1000; i += 2)
+		intset_clear(&set, i * 7);
+
+	for (int i = 0; i < 1000; ++i)
+		ASSERT_TRUE(intset_is_set(&set, i * 7) == (i & 1));
+
+	intset_destroy(&set);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	r |= test_set_and_clear();
+	r |= test_set_twice();
+	r |= test_grow();
+	return r;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "tst.h"
+#include "keyboard.h"
+
+#include <stdlib.h>
+#include <xkbcommon/xkbcommon-keysyms.h>
+
+#define SKIP 77
+
+static struct keyboard keyboard;
+
+static int test_find_lowercase(void)
+{
+	struct table_entry* entry = keyboard_find_symbol(&keyboard, XKB_KEY_a);
+	ASSERT_TRUE(entry);
+	ASSERT_UINT32_EQ(XKB_KEY_a, entry->symbol);
+	ASSERT_UINT32_EQ(38, entry->code);
+	ASSERT_INT_EQ(0, entry->level);
+	return 0;
+}
+
+static int test_find_uppercase(void)
+{
+	struct table_entry* entry = keyboard_find_symbol(&keyboard, XKB_KEY_A);
+	ASSERT_TRUE(entry);
+	ASSERT_UINT32_EQ(38, entry->code);
+	ASSERT_INT_EQ(1, entry->level);
+	return 0;
+}
+
+static int test_find_returns_lowest_level(void)
+{
+	/* Return is reachable both on the main key and on the keypad */
+	struct table_entry* entry = keyboard_find_symbol(&keyboard,
+			XKB_KEY_Return);
+	ASSERT_TRUE(entry);
+	ASSERT_INT_EQ(0, entry->level);
+	if (entry != keyboard.lookup_table)
+		ASSERT_TRUE((entry - 1)->symbol != XKB_KEY_Return);
+	return 0;
+}
+
+static int test_find_all_symbols(void)
+{
+	for (size_t i = 0; i < keyboard.lookup_table_length; ++i) {
+		const struct table_entry* expected = &keyboard.lookup_table[i];
+		struct table_entry* entry = keyboard_find_symbol(&keyboard,
+				expected->symbol);
+		ASSERT_TRUE(entry);
+		ASSERT_UINT32_EQ(expected->symbol, entry->symbol);
+		ASSERT_TRUE(entry <= expected);
+	}
+	return 0;
+}
+
+static int test_find_missing(void)
+{
+	ASSERT_FALSE(keyboard_find_symbol(&keyboard, XKB_KEY_Hangul));
+	return 0;
+}
+
+static int test_key_state(void)
+{
+	ASSERT_FALSE(keyboard_is_pressed(&keyboard, 38));
+
+	keyboard_feed_code(&keyboard, 38, true);
+	ASSERT_TRUE(keyboard_is_pressed(&keyboard, 38));
+	ASSERT_FALSE(keyboard_is_pressed(&keyboard, 39));
+
+	keyboard_feed_code(&keyboard, 38, false);
+	ASSERT_FALSE(keyboard_is_pressed(&keyboard, 38));
+	return 0;
+}
+
+static int test_release_all(void)
+{
+	keyboard_feed_code(&keyboard, 38, true);
+	keyboard_feed_code(&keyboard, 50, true);
+	keyboard_feed_code(&keyboard, KEYBOARD_MAX_KEYCODE - 1, true);
+
+	keyboard_release_all(&keyboard);
+	ASSERT_FALSE(keyboard_is_pressed(&keyboard, 38));
+	ASSERT_FALSE(keyboard_is_pressed(&keyboard, 50));
+	ASSERT_FALSE(keyboard_is_pressed(&keyboard, KEYBOARD_MAX_KEYCODE - 1));
+	return 0;
+}
+
+static int test_key_state_out_of_range(void)
+{
+	keyboard_feed_code(&keyboard, KEYBOARD_MAX_KEYCODE, true);
+	ASSERT_FALSE(keyboard_is_pressed(&keyboard, KEYBOARD_MAX_KEYCODE));
+	return 0;
+}
+
+int main()
+{
+	struct xkb_rule_names rule_names = {
+		.rules = "evdev",
+		.model = "pc105",
+		.layout = "us",
+	};
+
+	/* The virtual keyboard calls go to the stub in wayland-stub.c */
+	if (keyboard_init(&keyboard, &rule_names) < 0) {
+		fprintf(stderr, "No XKB data available, skipping\n");
+		return SKIP;
+	}
+
+	int r = 0;
+	r |= test_find_lowercase();
+	r |= test_find_uppercase();
+	r |= test_find_returns_lowest_level();
+	r |= test_find_all_symbols();
+	r |= test_find_missing();
+	r |= test_key_state();
+	r |= test_release_all();
+	r |= test_key_state_out_of_range();
+
+	keyboard_destroy(&keyboard);
+	return r;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "tst.h"
+#include "pixels.h"
+
+#include <pixman.h>
+#include <wayland-client.h>
+#include <libdrm/drm_fourcc.h>
+
+static int test_fourcc_to_wl_shm(void)
+{
+	// These two are the only ones where the codes differ
+	ASSERT_UINT32_EQ(WL_SHM_FORMAT_ARGB8888,
+			fourcc_to_wl_shm(DRM_FORMAT_ARGB8888));
+	ASSERT_UINT32_EQ(WL_SHM_FORMAT_XRGB8888,
+			fourcc_to_wl_shm(DRM_FORMAT_XRGB8888));
+	ASSERT_UINT32_EQ(WL_SHM_FORMAT_ABGR8888,
+			fourcc_to_wl_shm(DRM_FORMAT_ABGR8888));
+	ASSERT_UINT32_EQ(WL_SHM_FORMAT_RGB565,
+			fourcc_to_wl_shm(DRM_FORMAT_RGB565));
+	return 0;
+}
+
+static int test_fourcc_from_wl_shm(void)
+{
+	static const uint32_t formats[] = {
+		DRM_FORMAT_ARGB8888,
+		DRM_FORMAT_XRGB8888,
+		DRM_FORMAT_ABGR8888,
+		DRM_FORMAT_XBGR8888,
+		DRM_FORMAT_RGB565,
+	};
+
+	for (size_t i = 0; i < sizeof(formats) / sizeof(*formats); ++i)
+		ASSERT_UINT32_EQ(formats[i],
+				fourcc_from_wl_shm(fourcc_to_wl_shm(formats[i])));
+	return 0;
+}
+
+static int test_fourcc_to_pixman_fmt(void)
+{
+	pixman_format_code_t fmt = 0;
+
+	ASSERT_TRUE(fourcc_to_pixman_fmt(&fmt, DRM_FORMAT_XRGB8888));
+	ASSERT_UINT32_EQ(PIXMAN_x8r8g8b8, fmt);
+
+	ASSERT_TRUE(fourcc_to_pixman_fmt(&fmt, DRM_FORMAT_ARGB8888));
+	ASSERT_UINT32_EQ(PIXMAN_a8r8g8b8, fmt);
+
+	ASSERT_TRUE(fourcc_to_pixman_fmt(&fmt, DRM_FORMAT_ABGR8888));
+	ASSERT_UINT32_EQ(PIXMAN_a8b8g8r8, fmt);
+
+	ASSERT_TRUE(fourcc_to_pixman_fmt(&fmt, DRM_FORMAT_RGBX8888));
+	ASSERT_UINT32_EQ(PIXMAN_r8g8b8x8, fmt);
+
+	ASSERT_TRUE(fourcc_to_pixman_fmt(&fmt, DRM_FORMAT_RGB888));
+	ASSERT_UINT32_EQ(PIXMAN_r8g8b8, fmt);
+
+	ASSERT_TRUE(fourcc_to_pixman_fmt(&fmt, DRM_FORMAT_RGB565));
+	ASSERT_UINT32_EQ(PIXMAN_r5g6b5, fmt);
+
+	ASSERT_FALSE(fourcc_to_pixman_fmt(&fmt, DRM_FORMAT_NV12));
+	return 0;
+}
+
+static int test_fourcc_get_pixel_size(void)
+{
+	ASSERT_INT_EQ(4, fourcc_get_pixel_size(DRM_FORMAT_XRGB8888));
+	ASSERT_INT_EQ(3, fourcc_get_pixel_size(DRM_FORMAT_BGR888));
+	ASSERT_INT_EQ(2, fourcc_get_pixel_size(DRM_FORMAT_RGB565));
+	ASSERT_INT_EQ(0, fourcc_get_pixel_size(DRM_FORMAT_NV12));
+	return 0;
+}
+
+static int test_fourcc_from_string(void)
+{
+	uint32_t fourcc = 0;
+
+	ASSERT_TRUE(fourcc_from_string(&fourcc, "xrgb8888"));
+	ASSERT_UINT32_EQ(DRM_FORMAT_XRGB8888, fourcc);
+
+	ASSERT_TRUE(fourcc_from_string(&fourcc, "RGB565"));
+	ASSERT_UINT32_EQ(DRM_FORMAT_RGB565, fourcc);
+
+	ASSERT_FALSE(fourcc_from_string(&fourcc, "nv12"));
+	ASSERT_FALSE(fourcc_from_string(&fourcc, ""));
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	r |= test_fourcc_to_wl_shm();
+	r |= test_fourcc_from_wl_shm();
+	r |= test_fourcc_to_pixman_fmt();
+	r |= test_fourcc_get_pixel_size();
+	r |= test_fourcc_from_string();
+	return r;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "tst.h"
+#include "smooth.h"
+#include "time-util.h"
+
+static int test_first_sample(void)
+{
+	struct smooth smoother = { .time_constant = 0.01 };
+
+	// The last sample was taken a very long time ago
+	ASSERT_DOUBLE_EQ(10.0, smooth(&smoother, 10.0));
+	return 0;
+}
+
+static int test_no_time_passed(void)
+{
+	struct smooth smoother = {
+		.time_constant = 1000.0,
+		.last_time = gettime_us(),
+		.last_result = 10.0,
+	};
+
+	double result = smooth(&smoother, 0.0);
+	ASSERT_DOUBLE_GT(9.99, result);
+	ASSERT_DOUBLE_LT(10.0 + 1e-9, result);
+	return 0;
+}
+
+static int test_one_time_constant(void)
+{
+	struct smooth smoother = {
+		.time_constant = 1.0,
+		.last_time = gettime_us() - 1000000,
+		.last_result = 10.0,
+	};
+
+	// After one time constant, 1/e of the old value remains
+	double result = smooth(&smoother, 0.0);
+	ASSERT_DOUBLE_GT(3.6, result);
+	ASSERT_DOUBLE_LT(3.7, result);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	r |= test_first_sample();
+	r |= test_no_time_passed();
+	r |= test_one_time_constant();
+	return r;
+}
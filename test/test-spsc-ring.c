@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "tst.h"
+#include "spsc-ring.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#define N_TRANSFERS 100000
+
+static int test_push_pop(void)
+{
+	struct spsc_ring ring;
+	ASSERT_INT_EQ(0, spsc_ring_init(&ring, sizeof(int), 3));
+
+	int value = 0;
+	ASSERT_FALSE(spsc_ring_pop(&ring, &value));
+
+	for (int i = 0; i < 4; ++i)
+		ASSERT_TRUE(spsc_ring_push(&ring, &i));
+
+	/* The capacity is rounded up to 4 */
+	ASSERT_FALSE(spsc_ring_push(&ring, &value));
+
+	for (int i = 0; i < 4; ++i) {
+		ASSERT_TRUE(spsc_ring_pop(&ring, &value));
+		ASSERT_INT_EQ(i, value);
+	}
+
+	ASSERT_FALSE(spsc_ring_pop(&ring, &value));
+
+	spsc_ring_destroy(&ring);
+	return 0;
+}
+
+static int test_wrap_around(void)
+{
+	struct spsc_ring ring;
+	ASSERT_INT_EQ(0, spsc_ring_init(&ring, sizeof(int), 4));
+
+	for (int i = 0; i < 100; ++i) {
+		int value;
+		ASSERT_TRUE(spsc_ring_push(&ring, &i));
+		ASSERT_TRUE(spsc_ring_pop(&ring, &value));
+		ASSERT_INT_EQ(i, value);
+	}
+
+	spsc_ring_destroy(&ring);
+	return 0;
+}
+
+static void* produce(void* arg)
+{
+	struct spsc_ring* ring = arg;
+
+	for (uint32_t i = 0; i < N_TRANSFERS; ) {
+		if (spsc_ring_push(ring, &i))
+			++i;
+		else
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+static int test_threads(void)
+{
+	struct spsc_ring ring;
+	ASSERT_INT_EQ(0, spsc_ring_init(&ring, sizeof(uint32_t), 64));
+
+	pthread_t thread;
+	ASSERT_INT_EQ(0, pthread_create(&thread, NULL, produce, &ring));
+
+	for (uint32_t i = 0; i < N_TRANSFERS; ) {
+		uint32_t value;
+		if (!spsc_ring_pop(&ring, &value)) {
+			sched_yield();
+			continue;
+		}
+
+		ASSERT_UINT32_EQ(i, value);
+		++i;
+	}
+
+	pthread_join(thread, NULL);
+
+	spsc_ring_destroy(&ring);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	r |= test_push_pop();
+	r |= test_wrap_around();
+	r |= test_threads();
+	return r;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "tst.h"
+#include "thread-sched.h"
+
+static bool has_cpu(const struct thread_sched* sched, int cpu)
+{
+	return CPU_ISSET(cpu, &sched->cpus);
+}
+
+static int test_parse_cpus(void)
+{
+	struct thread_sched sched = { 0 };
+
+	ASSERT_TRUE(thread_sched_parse_cpus(&sched, "0-2,5"));
+	ASSERT_TRUE(sched.has_cpus);
+	ASSERT_INT_EQ(4, CPU_COUNT(&sched.cpus));
+	ASSERT_TRUE(has_cpu(&sched, 0));
+	ASSERT_TRUE(has_cpu(&sched, 2));
+	ASSERT_FALSE(has_cpu(&sched, 3));
+	ASSERT_TRUE(has_cpu(&sched, 5));
+	return 0;
+}
+
+static int test_parse_bad_cpus(void)
+{
+	struct thread_sched sched = { 0 };
+
+	ASSERT_FALSE(thread_sched_parse_cpus(&sched, ""));
+	ASSERT_FALSE(thread_sched_parse_cpus(&sched, "1,"));
+	ASSERT_FALSE(thread_sched_parse_cpus(&sched, "3-1"));
+	ASSERT_FALSE(thread_sched_parse_cpus(&sched, "-1"));
+	ASSERT_FALSE(thread_sched_parse_cpus(&sched, "1 2"));
+	ASSERT_FALSE(thread_sched_parse_cpus(&sched, "100000"));
+	ASSERT_FALSE(sched.has_cpus);
+	return 0;
+}
+
+static int test_parse_nice(void)
+{
+	struct thread_sched sched = { 0 };
+
+	ASSERT_TRUE(thread_sched_parse_priority(&sched, "-5"));
+	ASSERT_TRUE(sched.has_priority);
+	ASSERT_INT_EQ(SCHED_OTHER, sched.policy);
+	ASSERT_INT_EQ(-5, sched.nice);
+
+	ASSERT_FALSE(thread_sched_parse_priority(&sched, "20"));
+	ASSERT_FALSE(thread_sched_parse_priority(&sched, "5x"));
+	ASSERT_FALSE(thread_sched_parse_priority(&sched, ""));
+	return 0;
+}
+
+static int test_parse_fifo(void)
+{
+	struct thread_sched sched = { 0 };
+
+	ASSERT_TRUE(thread_sched_parse_priority(&sched, "fifo"));
+	ASSERT_INT_EQ(SCHED_FIFO, sched.policy);
+	ASSERT_INT_EQ(1, sched.priority);
+
+	ASSERT_TRUE(thread_sched_parse_priority(&sched, "fifo:10"));
+	ASSERT_INT_EQ(10, sched.priority);
+
+	ASSERT_FALSE(thread_sched_parse_priority(&sched, "fifo:"));
+	ASSERT_FALSE(thread_sched_parse_priority(&sched, "fifo:1000"));
+	ASSERT_FALSE(thread_sched_parse_priority(&sched, "fifox"));
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	r |= test_parse_cpus();
+	r |= test_parse_bad_cpus();
+	r |= test_parse_nice();
+	r |= test_parse_fifo();
+	return r;
+}
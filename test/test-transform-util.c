@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "tst.h"
+#include "transform-util.h"
+
+#include <stdbool.h>
+#include <pixman.h>
+#include <wayland-client.h>
+
+#define WIDTH 8
+#define HEIGHT 5
+
+#define N_TRANSFORMS 8
+
+// The rect 1,2 - 3,4 within an 8x5 buffer, after each of the transforms
+static const struct pixman_box16 transformed_rects[N_TRANSFORMS] = {
+	[WL_OUTPUT_TRANSFORM_NORMAL] = { 1, 2, 3, 4 },
+	[WL_OUTPUT_TRANSFORM_90] = { 1, 1, 3, 3 },
+	[WL_OUTPUT_TRANSFORM_180] = { 5, 1, 7, 3 },
+	[WL_OUTPUT_TRANSFORM_270] = { 2, 5, 4, 7 },
+	[WL_OUTPUT_TRANSFORM_FLIPPED] = { 5, 2, 7, 4 },
+	[WL_OUTPUT_TRANSFORM_FLIPPED_90] = { 2, 1, 4, 3 },
+	[WL_OUTPUT_TRANSFORM_FLIPPED_180] = { 1, 1, 3, 3 },
+	[WL_OUTPUT_TRANSFORM_FLIPPED_270] = { 1, 5, 3, 7 },
+};
+
+static bool box_eq(const struct pixman_box16* a, const struct pixman_box16* b)
+{
+	return a->x1 == b->x1 && a->y1 == b->y1 && a->x2 == b->x2 &&
+		a->y2 == b->y2;
+}
+
+static int test_region_transform(void)
+{
+	for (int i = 0; i < N_TRANSFORMS; ++i) {
+		struct pixman_region16 src, dst;
+		pixman_region_init_rect(&src, 1, 2, 2, 2);
+		pixman_region_init(&dst);
+
+		wv_region_transform(&dst, &src, i, WIDTH, HEIGHT);
+
+		ASSERT_INT_EQ(1, pixman_region_n_rects(&dst));
+		ASSERT_TRUE(box_eq(&transformed_rects[i],
+					pixman_region_extents(&dst)));
+
+		pixman_region_fini(&dst);
+		pixman_region_fini(&src);
+	}
+	return 0;
+}
+
+static int test_region_transform_round_trip(void)
+{
+	for (int i = 0; i < N_TRANSFORMS; ++i) {
+		struct pixman_region16 src, dst, back;
+		pixman_region_init_rect(&src, 0, 0, 2, 1);
+		pixman_region_union_rect(&src, &src, 4, 3, 3, 2);
+		pixman_region_init(&dst);
+		pixman_region_init(&back);
+
+		bool is_rotated = i & WL_OUTPUT_TRANSFORM_90;
+		wv_region_transform(&dst, &src, i, WIDTH, HEIGHT);
+		wv_region_transform(&back, &dst, wv_output_transform_invert(i),
+				is_rotated ? HEIGHT : WIDTH,
+				is_rotated ? WIDTH : HEIGHT);
+
+		ASSERT_INT_EQ(2, pixman_region_n_rects(&dst));
+		ASSERT_TRUE(pixman_region_equal(&src, &back));
+
+		pixman_region_fini(&back);
+		pixman_region_fini(&dst);
+		pixman_region_fini(&src);
+	}
+	return 0;
+}
+
+/* The pixman transform maps from the transformed image back to the buffer,
+ * so the centre of each transformed rect must land in the original one.
+ */
+static int test_pixman_transform_matches_region(void)
+{
+	for (int i = 0; i < N_TRANSFORMS; ++i) {
+		pixman_transform_t transform;
+		wv_pixman_transform_from_wl_output_transform(&transform, i,
+				WIDTH, HEIGHT);
+
+		const struct pixman_box16* box = &transformed_rects[i];
+		struct pixman_vector point = {{
+			(box->x1 + box->x2) * pixman_fixed_1 / 2,
+			(box->y1 + box->y2) * pixman_fixed_1 / 2,
+			pixman_fixed_1,
+		}};
+
+		ASSERT_TRUE(pixman_transform_point_3d(&transform, &point));
+		ASSERT_INT_EQ(2, pixman_fixed_to_int(point.vector[0]));
+		ASSERT_INT_EQ(3, pixman_fixed_to_int(point.vector[1]));
+	}
+	return 0;
+}
+
+static int test_transform_invert_compose(void)
+{
+	for (int i = 0; i < N_TRANSFORMS; ++i) {
+		ASSERT_INT_EQ(WL_OUTPUT_TRANSFORM_NORMAL,
+				wv_output_transform_compose(i,
+					wv_output_transform_invert(i)));
+		ASSERT_INT_EQ(i, wv_output_transform_compose(i,
+					WL_OUTPUT_TRANSFORM_NORMAL));
+		ASSERT_INT_EQ(i, wv_output_transform_compose(
+					WL_OUTPUT_TRANSFORM_NORMAL, i));
+	}
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	r |= test_region_transform();
+	r |= test_region_transform_round_trip();
+	r |= test_pixman_transform_matches_region();
+	r |= test_transform_invert_compose();
+	return r;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2022 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Stands in for libwayland-client's request marshalling, so that buffers and
+ * virtual input devices can be used without a compositor. This takes
+ * precedence over the library, which is still linked for the interface
+ * definitions. Every request succeeds and every new object is the same dummy
+ * proxy.
+ */
+
+#include <stdint.h>
+#include <wayland-client.h>
+
+static char dummy_proxy;
+
+struct wl_shm* wl_shm = (struct wl_shm*)&dummy_proxy;
+struct zwp_linux_dmabuf_v1* zwp_linux_dmabuf = NULL;
+struct gbm_device* gbm_device = NULL;
+
+struct wl_proxy* wl_proxy_marshal_flags(struct wl_proxy* proxy,
+		uint32_t opcode, const struct wl_interface* interface,
+		uint32_t version, uint32_t flags, ...)
+{
+	return interface ? (struct wl_proxy*)&dummy_proxy : NULL;
+}
+
+struct wl_proxy* wl_proxy_marshal_constructor(struct wl_proxy* proxy,
+		uint32_t opcode, const struct wl_interface* interface, ...)
+{
+	return (struct wl_proxy*)&dummy_proxy;
+}
+
+struct wl_proxy* wl_proxy_marshal_constructor_versioned(
+		struct wl_proxy* proxy, uint32_t opcode,
+		const struct wl_interface* interface, uint32_t version, ...)
+{
+	return (struct wl_proxy*)&dummy_proxy;
+}
+
+void wl_proxy_marshal(struct wl_proxy* proxy, uint32_t opcode, ...)
+{
+}
+
+void wl_proxy_destroy(struct wl_proxy* proxy)
+{
+}
+
+uint32_t wl_proxy_get_version(struct wl_proxy* proxy)
+{
+	return 1;
+}
+
+int wl_proxy_add_listener(struct wl_proxy* proxy,
+		void (**implementation)(void), void* data)
+{
+	return 0;
+}
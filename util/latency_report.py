@@ -1,11 +1,23 @@
 #!/usr/bin/python
+#
+# Usage: util/latency_report.py [--timeline] [perf.data]
+#
+# Reads a recording made with util/trace.sh and reports how long each stage
+# of the pipeline takes. With --timeline, the events of every frame are also
+# listed relative to the start of the capture.
 
 import os
+import sys
 import math
+import argparse
 
-stream = os.popen('perf script -F time,event')
+parser = argparse.ArgumentParser()
+parser.add_argument('--timeline', action='store_true',
+                    help='list the events of every frame')
+parser.add_argument('input', nargs='?', default='perf.data')
+args = parser.parse_args()
 
-is_in_update_fb = False
+stream = os.popen('perf script -i {} -F time,event'.format(args.input))
 
 class StateTracker:
     def __init__(self, name, src, enter, leave):
@@ -28,12 +40,16 @@ class StateTracker:
         self.dt_min = min(self.dt_min, dt)
 
     def apply(self, src, event, t):
+        # A stage may begin in one component and end in another
+        if self.src is not None and src != self.src:
+            return
+
         if self.is_active:
-            if (src, event) == (self.src, self.leave):
+            if event == self.leave:
                 self.is_active = False
                 self.add_dt(t - self.t0)
         else:
-            if (src, event) == (self.src, self.enter):
+            if event == self.enter:
                 self.is_active = True
                 self.t0 = t
 
@@ -44,24 +60,92 @@ class StateTracker:
         return self.dt_square_sum / self.n - self.avg() ** 2
 
     def stddev(self):
-        return math.sqrt(self.var())
+        return math.sqrt(max(0.0, self.var()))
 
     def report(self):
         if self.n == 0:
             return
 
         print('{}:'.format(self.name))
+        print('\tCount: {}'.format(self.n))
         print('\tMin, max: {:.1f} ms, {:.1f} ms'.format(self.dt_min * 1e3, self.dt_max * 1e3))
         print('\tAverage, std.dev.: {:.1f} ms, {:.1f} ms'.format(self.avg() * 1e3, self.stddev() * 1e3))
+        print()
+
+class EventCounter:
+    def __init__(self, name, src, events):
+        self.name = name
+        self.src = src
+        self.events = events
+        self.n = 0
+        self.t_first = None
+        self.t_last = None
+
+    def apply(self, src, event, t):
+        if src != self.src or event not in self.events:
+            return
+
+        self.n += 1
+        if self.t_first is None:
+            self.t_first = t
+        self.t_last = t
+
+    def report(self):
+        if self.n == 0:
+            return
+
+        dt = self.t_last - self.t_first
+        rate = ', {:.1f} per second'.format(self.n / dt) if dt > 0 else ''
+        print('{}: {}{}'.format(self.name, self.n, rate))
+
+# A frame starts when the capture starts and ends when the capture of the
+# next one starts. Anything that happens in between is attributed to it.
+class FrameTimeline:
+    def __init__(self):
+        self.frames = []
+        self.current = None
+
+    def apply(self, src, event, t):
+        if (src, event) == ('sdt_wayvnc', 'screencopy_start'):
+            self.current = [(t, src, event)]
+            self.frames.append(self.current)
+        elif self.current is not None:
+            self.current.append((t, src, event))
+
+    def report(self):
+        for i, frame in enumerate(self.frames):
+            t0 = frame[0][0]
+            print('Frame {} at {:.6f}:'.format(i, t0))
+            for (t, src, event) in frame:
+                print('\t{:+8.3f} ms  {}:{}'.format((t - t0) * 1e3, src, event))
+            print()
 
 trackers = [
-    StateTracker('Framebuffer update', 'sdt_neatvnc', 'update_fb_start', 'update_fb_done'),
-    StateTracker('Framebuffer update (only sending)', 'sdt_neatvnc', 'send_fb_start', 'send_fb_done'),
     StateTracker('Screencopy', 'sdt_wayvnc', 'screencopy_start', 'screencopy_ready'),
+    StateTracker('Export-dmabuf', 'sdt_wayvnc', 'screencopy_start', 'export_dmabuf_ready'),
     StateTracker('Refine damage', 'sdt_wayvnc', 'refine_damage_start', 'refine_damage_end'),
+    StateTracker('Ready to processing', 'sdt_wayvnc', 'screencopy_ready', 'process_frame_start'),
+    StateTracker('Processing', 'sdt_wayvnc', 'process_frame_start', 'process_frame_end'),
+    StateTracker('Processing to feed', 'sdt_wayvnc', 'process_frame_start', 'feed_buffer'),
+    StateTracker('Feed to framebuffer update', None, 'feed_buffer', 'update_fb_start'),
+    StateTracker('Framebuffer update', 'sdt_neatvnc', 'update_fb_start', 'update_fb_done'),
+    StateTracker('Framebuffer update (only sending)', 'sdt_neatvnc', 'send_fb_start', 'send_fb_done'),
     StateTracker('Render', 'sdt_wayvnc', 'render_start', 'render_end'),
 ]
 
+counters = [
+    EventCounter('Buffers created', 'sdt_wayvnc', ['buffer_pool_create']),
+    EventCounter('Buffers destroyed', 'sdt_wayvnc', ['buffer_pool_destroy']),
+    EventCounter('Buffers acquired', 'sdt_wayvnc', ['buffer_pool_acquire']),
+    EventCounter('Capture failures', 'sdt_wayvnc', ['screencopy_failed']),
+    EventCounter('Pointer events', 'sdt_wayvnc', ['pointer_event']),
+    EventCounter('Key events', 'sdt_wayvnc', ['key_event', 'key_code_event']),
+    EventCounter('Clipboard transfers to clients', 'sdt_wayvnc', ['clipboard_to_client']),
+    EventCounter('Clipboard transfers from clients', 'sdt_wayvnc', ['clipboard_from_client']),
+]
+
+timeline = FrameTimeline()
+
 for line in stream:
     [t, src, event, _] = line.replace(' ', '').split(':')
     t = float(t)
@@ -69,6 +153,17 @@ for line in stream:
     for tracker in trackers:
         tracker.apply(src, event, t)
 
+    for counter in counters:
+        counter.apply(src, event, t)
+
+    if args.timeline:
+        timeline.apply(src, event, t)
+
+if args.timeline:
+    timeline.report()
+
 for tracker in trackers:
     tracker.report()
-    print()
+
+for counter in counters:
+    counter.report()
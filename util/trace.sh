@@ -1,7 +1,15 @@
 #!/bin/bash
+#
+# Usage: util/trace.sh [seconds]
+#
+# Records all wayvnc and neatvnc probes system-wide into perf.data, either
+# until interrupted or for the given number of seconds. Use
+# util/latency_report.py to analyse the result. The build directory can be
+# selected with BUILD_DIR.
 
 set -e
 
+BUILD_DIR=${BUILD_DIR:-build}
 EVENTS="sdt_wayvnc:* sdt_neatvnc:*"
 
 delete_all_events()
@@ -18,13 +26,16 @@ add_all_events()
 	done
 }
 
-sudo perf buildid-cache -a build/wayvnc
-sudo perf buildid-cache -a build/subprojects/neatvnc/libneatvnc.so
+sudo perf buildid-cache -a $BUILD_DIR/wayvnc
+sudo perf buildid-cache -a $BUILD_DIR/subprojects/neatvnc/libneatvnc.so
 
 delete_all_events
 add_all_events
 
 trap "sudo chown $USER.$USER perf.data*" EXIT
 
-sudo perf record -aR -e ${EVENTS/ /,}
-
+if [ -n "$1" ]; then
+	sudo perf record -aR -e ${EVENTS/ /,} -- sleep "$1"
+else
+	sudo perf record -aR -e ${EVENTS/ /,}
+fi